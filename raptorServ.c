@@ -37,16 +37,24 @@
  * $Log$
  *
  *********************************************************************!*/
+#define _GNU_SOURCE
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
 #include <unistd.h>
 #include <ctype.h>
 #include <math.h>
 #include <assert.h>
 #include <netdb.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
 
 #include "cli/cli.h"
 #include "fh/fh.h"
@@ -61,6 +69,18 @@
 #include "clsim_lib.h"
 
 #include "mpfit/mpfit.h"
+#include "fitsio.h"
+
+#include "raptorShm.h"
+#include "raptorTelemetry.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif // __SSE2__
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_AVX2_KERNELS
+#endif // __x86_64__
 
 // Comment this statement is you have no ISU
 #define HAVE_ISU
@@ -84,6 +104,7 @@
  * Serial channel interface parameters
  */
 #define SERIALTIMEOUT 6
+#define SERIAL_REPLY_TIMEOUT 200     /* ms, for a reply of known length */
 #define SERBUFSIZE 512
 #define UNIT       0
 #define BAUD       115200
@@ -117,8 +138,25 @@
 #define SAVE_CMD "SAVE"
 #define GUIDE_CMD "GUIDE"
 #define ISU_CMD "ISU"
+#define PREDICT_CMD "PREDICT"
+#define PSF_CMD "PSF"
+#define NOISE_CMD "NOISE"
+#define COADD_CMD "COADD"
+#define FITSQ_CMD "FITSQ"
+#define SHM_CMD "SHM"
+#define VIDEORATE_CMD "VIDEORATE"
+#define CUBE_CMD "CUBE"
+#define COMPRESS_CMD "COMPRESS"
+#define RECORD_CMD "RECORD"
+#define TELEMETRY_CMD "TELEMETRY"
+#define SERIAL_CMD "SERIAL"
+#define CAMERA_CMD "CAMERA"
+#define BENCH_CMD "BENCH"
 #define STARTEXP_CMD "STARTEXP"
 #define ENDEXP_CMD "ENDEXP"
+#define FRESH_ARG "FRESH"
+#define MAX_ARG "MAX"
+#define SNR_ARG "SNR"
 #define PASS_CHAR '.'
 #define FAIL_CHAR '!'
 #define OOB_CHAR '*'
@@ -129,6 +167,29 @@
 #define CONFIG_GUIDE_RASTER_Y0 "guideRasterY0"
 #define CONFIG_GUIDE_NULL_X "holeNullX"
 #define CONFIG_GUIDE_NULL_Y "holeNullY"
+#define CONFIG_PREDICT_X "predictX"
+#define CONFIG_PREDICT_Y "predictY"
+#define CONFIG_PSF_MODEL "psfModel"
+#define CONFIG_DET_GAIN "detGain"
+#define CONFIG_DET_READ_NOISE "detReadNoise"
+#define CONFIG_DARK_FRAME "darkFrame"
+#define CONFIG_FIT_LOSS "fitLoss"
+#define CONFIG_COADD_FRAMES "coaddFrames"
+#define CONFIG_FITS_VMSPLICE "fitsVmsplice"
+#define CONFIG_FITS_QUEUE "fitsQueue"
+#define CONFIG_SHM_RING "shmRing"
+#define CONFIG_VIDEO_RATE "videoRate"
+#define CONFIG_SAVE_CUBE "saveCube"
+#define CONFIG_FITS_COMPRESS "fitsCompress"
+#define CONFIG_RECORD_DIR "recordDir"
+#define CONFIG_TELEMETRY_PORT "telemetryPort"
+#define CONFIG_TELEMETRY_HOST "telemetryHost"
+#define CONFIG_TELEMETRY_SOCKET "telemetrySocket"
+#define CONFIG_CALIB_FILE "calibrationFile"
+#define CONFIG_CAMERA_POLL "cameraPoll"
+#define CONFIG_SIM_CAMERA "simCamera"
+#define CONFIG_CAMERA_INIT "cameraInit"
+#define CONFIG_CAMERA_READOUT "cameraReadout"
 
 #define SIZE_X 640
 #define SIZE_Y 512
@@ -158,6 +219,14 @@
  */
 //#define SIM_STAR
 
+/*
+ * BEWARE THAT
+ * if SIM_CAMERA is defined, the serial commands go to an emulator of the
+ * camera instead of the camera.  The frames still come from the frame
+ * grabber.  This definition should be COMMENTED FOR NORMAL OPERATIONS !
+ */
+//#define SIM_CAMERA
+
 /* This definition flag is to select SLOPES */
 #define SLOPES
 
@@ -176,6 +245,524 @@ typedef struct
 } client_info_t;
 
 
+/*
+ * State estimator applied to one axis of the guide star offset.  The
+ * ISU correction computed from a frame is only applied one to two frame
+ * periods after the star light was collected, so the estimator predicts
+ * where the star will be at actuation time instead of using the raw
+ * measurement.  The estimator runs on the pseudo open loop position of
+ * the star (measured offset plus the corrections already sent to the
+ * ISU) so that the corrections themselves are not mistaken for motion.
+ */
+typedef enum {
+   PREDICT_OFF = 0,
+   PREDICT_ALPHABETA,
+   PREDICT_KALMAN
+} predict_mode_t;
+
+typedef struct {
+   predict_mode_t mode;
+   double alpha;        /* alpha-beta position gain */
+   double beta;         /* alpha-beta velocity gain */
+   double q;            /* Kalman process noise (arcsec^2/s^3) */
+   double r;            /* Kalman measurement noise (arcsec^2) */
+   BOOLEAN primed;      /* TRUE once the first measurement was absorbed */
+   double x;            /* estimated position (arcsec) */
+   double v;            /* estimated velocity (arcsec/s) */
+   double p[2][2];      /* Kalman state covariance */
+   double applied;      /* corrections sent to the ISU so far (arcsec) */
+   long n;              /* innovation statistics */
+   double innov_sum;
+   double innov_sum2;
+   double nis_sum;      /* normalized innovation squared (Kalman only) */
+} predict_axis_t;
+
+#define PREDICT_X 0
+#define PREDICT_Y 1
+
+/* Weight of a new sample in the smoothed loop latency estimate */
+#define LATENCY_SMOOTHING 0.05
+
+/*
+ * Analytic model of the guide star fitted by mpfit.  All the models share
+ * the same parameter vector so that the fit setup, the seeding and the
+ * results are handled the same way whatever the model:
+ *   GAUSSIAN:   axis aligned Gaussian, W1/W2 are the FWHM along x and y
+ *   MOFFAT:     circular Moffat, W1 is alpha and W2 is beta
+ *   ELLIPTICAL: rotated Gaussian, W1/W2 are the FWHM along the major and
+ *               minor axes and THETA is the angle of the major axis
+ */
+typedef enum {
+   PSF_GAUSSIAN = 0,
+   PSF_MOFFAT,
+   PSF_ELLIPTICAL
+} psf_model_t;
+
+#define PSF_XC 0
+#define PSF_YC 1
+#define PSF_W1 2
+#define PSF_W2 3
+#define PSF_AMP 4
+#define PSF_BKG 5
+#define PSF_THETA 6
+#define PSF_NPARAMS 7
+
+/* FWHM^2 to sigma^2 conversion, 1/(8 ln 2) */
+#define FWHM_TO_SIGMA2 0.180337
+
+/*
+ * Loss applied to the residuals normalized by the detector noise.  HUBER
+ * turns quadratic into linear beyond the tuning constant, TUKEY (biweight)
+ * ignores the residuals beyond it, which rejects cosmic ray hits.
+ */
+typedef enum {
+   FIT_LOSS_NONE = 0,
+   FIT_LOSS_HUBER,
+   FIT_LOSS_TUKEY
+} fit_loss_t;
+
+#define DEFAULT_HUBER_SCALE 1.345
+#define DEFAULT_TUKEY_SCALE 4.685
+
+/* Detector noise model, electrons per ADU and read noise in electrons */
+#define DEFAULT_DET_GAIN 1.0
+#define DEFAULT_DET_READ_NOISE 0.0
+
+/* Bound on the solver iterations so a bad frame cannot stall the loop */
+#define PSF_MAX_ITER 50
+
+/* Shape used to seed the fits until a FWHM measurement is available */
+#define DEFAULT_PSF_FWHM 2.5
+#define DEFAULT_MOFFAT_BETA 2.5
+
+/*
+ * Running shift-and-add co-add of the last guide frames.  Each frame is
+ * registered on the null position by the whole pixel part of its measured
+ * offset and kept in a ring so that the oldest one can be subtracted from
+ * the accumulator when a new one is added.  The FWHM and the slow offset of
+ * faint stars are measured on the co-add while the ISU loop keeps running
+ * on the individual frames.
+ */
+#define COADD_MAX_FRAMES 64
+
+typedef struct {
+   int depth;           /* frames in the co-add, 0 when disabled */
+   int count;           /* frames currently accumulated */
+   int next;            /* ring slot of the next frame (the oldest one) */
+   long added;          /* frames added since the last reset */
+   long measured;       /* value of added when last measured */
+   long shift_sum_x;    /* sum of the shifts removed by the registration */
+   long shift_sum_y;
+   int shift_x[COADD_MAX_FRAMES];
+   int shift_y[COADD_MAX_FRAMES];
+   uint32_t sum[GUIDE_SIZE_X*GUIDE_SIZE_Y] __attribute__((aligned(16)));
+   uint16_t ring[COADD_MAX_FRAMES][GUIDE_SIZE_X*GUIDE_SIZE_Y]
+      __attribute__((aligned(16)));
+} coadd_t;
+
+
+/*
+ * Snapshot of everything the FITS header of a frame needs, taken by the
+ * main loop when the frame is acquired so that the frame can be serialized
+ * later, by another thread, while the server state keeps changing.
+ */
+typedef struct {
+   struct timeval capture;
+   int image_width;
+   int image_height;
+   float exposure_time;
+   float frame_rate;
+   float tec_setpoint;
+   float det_temp;              /* sensor, fh_fits_real_null if unknown */
+   int cam_settings;            /* exposure and rate changes applied */
+   int frame_sequence;
+   BOOLEAN etype_guide;
+   BOOLEAN save;                /* frame of a SAVE sequence */
+   BOOLEAN save_last;           /* last frame of the SAVE sequence */
+   int cube_frames;             /* frames per cube of SAVE sequences */
+   double cube_flush;           /* flush time of a partial cube (s) */
+   char fits_comment[50];
+   int win_x0;
+   int win_y0;
+   int guide_x0;
+   int guide_y0;
+   float null_x;
+   float null_y;
+   BOOLEAN guide_on;
+   float guide_xoff;
+   float guide_yoff;
+   int coadd_count;
+   float coadd_xoff;
+   float coadd_yoff;
+   BOOLEAN isu_on;
+   double isu_mrad_x_delta_setup;
+   double isu_mrad_y_delta_setup;
+   double isu_mrad_x_status;
+   double isu_mrad_y_status;
+   BOOLEAN exp_on;
+   char filename[50];
+   char ra[20];
+   char dec[20];
+   float equinox;
+   float objmag;
+} frame_info_t;
+
+/*
+ * FITS header of the output frames.  The cards whose values only change
+ * with the configuration are formatted once into a template; each frame
+ * then only patches the value fields of the per frame cards, found at
+ * fixed offsets in the template.
+ */
+#define FITS_CARD_SIZE 80
+#define FITS_BLOCK_SIZE 2880
+#define FITS_HEADER_BLOCKS 2
+#define FITS_VALUE_OFFSET 10    /* value field follows "KEYWORD = " */
+#define FITS_VALUE_WIDTH 20     /* right justified numeric values */
+#define FITS_DATE_WIDTH 19      /* fixed width of the date strings */
+#define FITS_HSTTIME_WIDTH 30
+
+/* Per frame cards patched in the template */
+typedef enum {
+   FC_DATE = 0,
+   FC_HSTTIME,
+   FC_UNIXTIME,
+   FC_SEQNUM,
+   FC_WIN_X0,
+   FC_WIN_Y0,
+   FC_WIN_X1,
+   FC_WIN_Y1,
+   FC_GD_XOFF,
+   FC_GD_YOFF,
+   FC_GD_NCOAD,
+   FC_GD_CXOFF,
+   FC_GD_CYOFF,
+   FC_SMRAD_X,
+   FC_SMRAD_Y,
+   FC_RMRAD_X,
+   FC_RMRAD_Y,
+   FC_NAXIS3,                   /* frames of a cube */
+   FC_COUNT
+} fits_card_t;
+
+/* Values of the cards formatted in the template */
+typedef struct {
+   int image_width;
+   int image_height;
+   float exposure_time;
+   float frame_rate;
+   float tec_setpoint;
+   float det_temp;
+   int cam_settings;
+   BOOLEAN etype_guide;
+   char fits_comment[50];
+   int guide_x0;
+   int guide_y0;
+   float null_x;
+   float null_y;
+   BOOLEAN exp_on;
+   char filename[50];
+   char ra[20];
+   char dec[20];
+   float equinox;
+   float objmag;
+} fits_static_t;
+
+typedef struct {
+   BOOLEAN valid;
+   fits_static_t key;           /* values the template was built with */
+   char header[FITS_HEADER_BLOCKS * FITS_BLOCK_SIZE];
+   size_t size;                 /* bytes used, whole FITS blocks */
+   size_t offset[FC_COUNT];     /* value field of the per frame cards */
+   time_t date_sec;             /* second of the formatted DATE/HSTTIME */
+} fits_template_t;
+
+/*
+ * Cube of the frames of a SAVE sequence.  The frames are stacked along
+ * NAXIS3 of a single image, whose header holds the values of the first
+ * frame, followed by a binary table of the per frame values.  A cube is
+ * written when it is full, when its flush time elapsed, at the end of the
+ * SAVE sequence or of the video, or when the frames no longer fit in it.
+ * The FITS writer checks the flush time and the end while it is idle, so
+ * that a cube is written even when no frame follows.
+ */
+#define CUBE_MAX_FRAMES 1000
+#define CUBE_MAX_BYTES (64 * 1024 * 1024)
+#define CUBE_TFIELDS 10
+#define CUBE_ROW_BYTES 60       /* 1D 1J 1J 1J 1E 1E 1D 1D 1D 1D */
+
+typedef struct {
+   int count;                   /* frames in the pending cube */
+   fits_template_t t;           /* header of the pending cube */
+   double start;                /* capture time of its first frame (s) */
+   double flush;                /* flush time of the pending cube (s) */
+   size_t frame_bytes;
+   char *pixels;                /* converted pixels of the pending frames */
+   unsigned char rows[CUBE_MAX_FRAMES][CUBE_ROW_BYTES];
+   long written;                /* cubes written */
+} fits_cube_t;
+
+/*
+ * Recorder of the SAVE sequences to local files, independent of the
+ * downstream process reading stdout.  The main loop copies the frames in
+ * a ring and never waits: a frame is lost when the ring is full.  The
+ * recorder thread writes each sequence as a multi extension FITS file,
+ * one image extension per frame, through an aligned staging buffer with
+ * O_DIRECT writes into space preallocated with fallocate.  When the SAVE
+ * stream is compressed, each extension is the Rice compressed image made
+ * in memory by cfitsio before it is staged.  A text index next to the
+ * file gives the offset of each frame.
+ */
+#define RECORD_RING_SLOTS 16
+#define RECORD_ALIGN 4096
+#define RECORD_CHUNK (4 * 1024 * 1024)      /* staging buffer */
+#define RECORD_PREALLOC (256 * 1024 * 1024) /* fallocate increment */
+
+typedef struct {
+   frame_info_t info;
+   unsigned short *pixels;
+   BOOLEAN close_only;          /* no frame, end the sequence */
+   BOOLEAN compress;            /* Rice compressed extension */
+} record_job_t;
+
+typedef struct {
+   pthread_t thread;
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+   char dir[256];               /* empty when disabled */
+   record_job_t ring[RECORD_RING_SLOTS];
+   int head;
+   int count;
+   BOOLEAN active;              /* main loop: sequence being recorded */
+   BOOLEAN close_pending;       /* main loop: end marker not queued yet */
+   long frames;                 /* frames written */
+   long lost;                   /* frames lost because the ring was full */
+   long files;
+   char path[320];              /* file of the last sequence */
+
+   /* Only used by the recorder thread */
+   int fd;
+   FILE *idx;
+   BOOLEAN direct;              /* fd opened with O_DIRECT */
+   char *stage;
+   size_t staged;               /* bytes in the staging buffer */
+   off_t stage_offset;          /* file offset of the staging buffer */
+   off_t allocated;
+   unsigned short *scratch;     /* converted pixels */
+   void *comp_data;             /* compressed FITS file, grown by cfitsio */
+   size_t comp_alloc;
+   fits_template_t t;
+} recorder_t;
+
+/*
+ * Binary telemetry stream, see raptorTelemetry.h.  The main loop puts one
+ * record per frame in a ring and wakes the telemetry thread up through a
+ * pipe; the thread sends the records to each subscriber on non blocking
+ * sockets, skipping the ones a subscriber is too slow to take.
+ */
+#define TELEMETRY_RING 256
+#define TELEMETRY_MAX_CLIENTS 16
+
+typedef struct {
+   int fd;
+   int decimate;                /* only frames multiple of decimate */
+   uint64_t next;               /* next record of the ring to send */
+   raptor_telemetry_t out;      /* record being sent */
+   size_t out_sent;             /* bytes of out already sent */
+   BOOLEAN out_pending;
+   char in[64];                 /* partial request line */
+   size_t in_len;
+   long skipped;
+} telemetry_client_t;
+
+typedef struct {
+   pthread_t thread;
+   pthread_mutex_t lock;
+   int wake[2];                 /* pipe waking the thread up */
+   int listen_tcp;
+   int listen_unix;
+   char port[16];               /* "OFF" when no TCP port */
+   char host[64];               /* address of the port, ALL for any */
+   char socket_path[108];       /* empty when no Unix socket */
+   raptor_telemetry_t ring[TELEMETRY_RING];
+   uint64_t published;          /* records put in the ring */
+   uint64_t frame;              /* frames seen by the main loop */
+   telemetry_client_t clients[TELEMETRY_MAX_CLIENTS];
+   int nclients;
+} telemetry_t;
+
+/*
+ * Output of the FITS frames on STDOUT.  Each frame is sent with a single
+ * writev of the header, the converted pixels and the padding.  When STDOUT
+ * is a pipe and vmsplice is enabled, the pages of the conversion buffers
+ * are spliced into the pipe instead of being copied.  A spliced buffer is
+ * still referenced by the pipe until the reader consumed it, which is only
+ * guaranteed once a pipe capacity of data was written after it, so the
+ * vmsplice path uses a ring of buffers and falls back to writev when the
+ * next one may still be in the pipe.
+ */
+#define FITS_OUTPUT_MAX_SLOTS 64
+
+typedef struct {
+   char *data;                  /* page aligned header copy and pixels */
+   long long spliced_at;        /* output count after it was spliced */
+} fits_slot_t;
+
+typedef struct {
+   BOOLEAN vmsplice;            /* requested by the configuration */
+   BOOLEAN checked;             /* STDOUT was inspected */
+   BOOLEAN fifo;                /* STDOUT is a pipe */
+   long pipe_size;
+   size_t frame_bytes;          /* size of the buffers, a full frame */
+   int nslots;
+   int next;
+   fits_slot_t slots[FITS_OUTPUT_MAX_SLOTS];
+   char *copy;                  /* conversion buffer of the writev path */
+   long long out_bytes;         /* bytes written to STDOUT */
+   long spliced;                /* frames sent with vmsplice */
+   long copied;                 /* frames sent with writev */
+} fits_output_t;
+
+
+/*
+ * A pipeline stage is a worker thread running one job at a time on behalf
+ * of the main loop.  The main loop starts the job for frame k and only
+ * waits for it when it needs the result, or before handing frame k+1 over
+ * to the same stage.  Independent stages thus run concurrently while the
+ * per frame order is preserved.
+ */
+typedef struct {
+   pthread_t thread;
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+   BOOLEAN pending;             /* job started and not finished yet */
+   void (*job)(void *arg);
+   void *arg;
+} pipeline_stage_t;
+
+/*
+ * Rice tile compression of the output frames, selected per stream: the
+ * video frames and the frames of SAVE sequences.  Queued frames are
+ * compressed by a pool of worker threads, each one in a cfitsio memory
+ * file, and the FITS writer still emits them in order.  cfitsio must be
+ * built reentrant for the workers to run concurrently: otherwise only the
+ * FITS writer compresses, and the recorder writes uncompressed files.
+ */
+typedef enum {
+   FITS_COMPRESS_OFF = 0,
+   FITS_COMPRESS_VIDEO = 1,
+   FITS_COMPRESS_SAVE = 2,
+   FITS_COMPRESS_BOTH = 3
+} fits_compress_t;
+
+typedef enum {
+   COMP_NONE = 0,               /* written uncompressed */
+   COMP_PENDING,                /* waiting for a worker */
+   COMP_BUSY,                   /* being compressed */
+   COMP_DONE
+} comp_state_t;
+
+#define COMPRESS_MAX_WORKERS 8
+#define DEFAULT_COMPRESS_WORKERS 2
+
+/*
+ * Job of the FITS stage: a frame and its header values
+ */
+typedef struct {
+   frame_info_t info;
+   unsigned short *pixels;      /* copy of the DMA buffer */
+   BOOLEAN fwhm_request;        /* also measure the FWHM on this frame */
+   BOOLEAN coadd_request;       /* measure the co-add */
+   unsigned short *coadd_pixels; /* mean of the co-added frames */
+   double coadd_shift_x;        /* mean registration shift (pixels) */
+   double coadd_shift_y;
+   comp_state_t comp_state;
+   BOOLEAN comp_dropped;        /* dropped while a worker compressed it */
+   PASSFAIL comp_status;
+   void *comp_data;             /* compressed FITS file, grown by cfitsio */
+   size_t comp_alloc;
+   size_t comp_size;
+} fits_job_t;
+
+/*
+ * Job of the ISU readback stage
+ */
+typedef struct {
+   BOOLEAN check;               /* check the error status of the axes */
+   BOOLEAN readback;            /* read back the current angles */
+   PASSFAIL check_status;
+   BOOLEAN x_fault;
+   BOOLEAN y_fault;
+   PASSFAIL readback_status;
+   double x_angle;
+   double y_angle;
+} isu_job_t;
+
+/*
+ * Bounded queue of frames waiting for the FITS writer thread.  The main
+ * loop never waits for the writer: when the queue is full a frame is
+ * dropped according to the policy, except with BLOCKSAVE while a SAVE
+ * sequence is in progress, where the archive must get every frame.
+ * Jobs are taken from a pool so that dropping the oldest queued frame
+ * does not move any pixels.
+ */
+typedef enum {
+   FITS_DROP_OLDEST = 0,
+   FITS_DROP_NEWEST,
+   FITS_BLOCK_SAVE
+} fits_policy_t;
+
+#define FITS_QUEUE_MAX 16
+#define DEFAULT_FITS_QUEUE 4
+
+/* A frame written this long after its capture is counted late (s) */
+#define FITS_LATE_TIME 0.5
+
+/* Queued, writing, filling and dropped while compressed */
+#define FITS_POOL_SIZE (FITS_QUEUE_MAX + 2 + COMPRESS_MAX_WORKERS)
+
+typedef struct {
+   pthread_t thread;
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+   fits_job_t pool[FITS_POOL_SIZE];
+   int free_list[FITS_POOL_SIZE];
+   int nfree;
+   int fifo[FITS_QUEUE_MAX];    /* pool indexes, oldest first */
+   int head;
+   int count;
+   int depth;                   /* configured capacity */
+   fits_policy_t policy;
+   long queued;                 /* frames handed to the writer */
+   long written;
+   long dropped;
+   long late;
+   fits_compress_t compress;    /* streams to compress */
+   int nworkers;
+   BOOLEAN reentrant;           /* cfitsio usable from several threads */
+   pthread_t workers[COMPRESS_MAX_WORKERS];
+   long compressed;             /* frames compressed and their sizes */
+   double comp_in;
+   double comp_out;
+   BOOLEAN cube_end;            /* write the pending cube once idle */
+} fits_queue_t;
+
+/*
+ * Decimation of the FITS video stream.  The guide loop runs on every frame
+ * but only one frame out of decimate, and at most max_rate per second, is
+ * serialized to stdout.  SAVE sequences get every frame.
+ */
+#define VIDEO_DECIMATE_MAX 1000
+
+typedef struct {
+   int decimate;        /* emit one frame out of decimate */
+   double max_rate;     /* Hz, 0 for no limit */
+   int skipped_run;     /* frames skipped since the last emitted one */
+   double next_due;     /* earliest capture time of the next frame (s) */
+   long emitted;
+   long skipped;
+} video_rate_t;
+
+
 /*
  * Structure used to specify server specific information.
  */
@@ -217,8 +804,42 @@ typedef struct {
    int first_done_flag;
    float fwhm_x;
    float fwhm_y;
+   psf_model_t psf_model;
+   double psf_shape[PSF_NPARAMS]; /* last fitted model, seeds the centroid */
+   int psf_niter;                 /* iterations of the last centroid fit */
+   BOOLEAN psf_refit;             /* measure the shape on the next frame */
+   double psf_xerr;               /* 1 sigma errors of the last centroid */
+   double psf_yerr;
+   double psf_chi2;               /* reduced chi2 of the last centroid fit */
+   double psf_flux;               /* flux of the last centroid fit (ADU) */
+   double psf_bkg;                /* its background (ADU) */
+   double det_gain;               /* e-/ADU */
+   double det_read_noise;         /* e- */
+   fit_loss_t fit_loss;
+   double fit_loss_scale;
+   char dark_file[256];           /* empty when no dark is subtracted */
+   int coadd_count;               /* frames in the last measured co-add */
+   float coadd_xoff;              /* star offset measured on the co-add */
+   float coadd_yoff;
    int frame_sequence;
    int frame_save_count;
+   predict_axis_t predict[2];
+   double loop_latency; /* capture to actuation latency (s) */
+   int fits_queue_depth;          /* FITS writer queue from the config */
+   fits_policy_t fits_queue_policy;
+   int cube_frames;               /* frames per cube, 0 for single frames */
+   double cube_flush;             /* flush time of a partial cube (s) */
+   fits_compress_t fits_compress; /* compression from the config */
+   int compress_workers;
+   double poll_temp;              /* s between camera temperature reads */
+   double poll_settings;          /* s between camera settings reads */
+   int cam_init_mode;             /* CAM_INIT_FAST or CAM_INIT_FULL */
+   double pclock_mhz;             /* camera link pixel clock */
+   int readout_width;             /* window read out by the camera */
+   int readout_height;
+   double readout_line_clocks;    /* pixel clocks between two lines */
+   double readout_frame_us;       /* fixed overhead of each frame */
+   double proc_time;              /* s the main loop spends per frame */
 } server_info_t;
 
 
@@ -227,13 +848,105 @@ typedef struct {
  */
 static server_info_t *serv_info;
 
+/*
+ * Frame processing pipeline stages and their jobs
+ */
+static fits_queue_t fits_queue;
+#ifdef HAVE_ISU
+static pipeline_stage_t isu_stage;
+static isu_job_t isu_job;
+#endif // HAVE_ISU
+
+/*
+ * Protects the PSF model, the shape seeding the centroid and the measured
+ * FWHM, which are updated by the FITS stage and by client commands
+ */
+static pthread_mutex_t psf_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Last FWHM measured by the FITS stage (pixels)
+ */
+static void
+psfFwhm(float *fwhm_x, float *fwhm_y)
+{
+   pthread_mutex_lock(&psf_lock);
+   *fwhm_x = serv_info->fwhm_x;
+   *fwhm_y = serv_info->fwhm_y;
+   pthread_mutex_unlock(&psf_lock);
+}
+
+/*
+ * Dark frame subtracted before the PSF fit, protected by psf_lock
+ */
+static float dark_frame[SIZE_X*SIZE_Y];
+static BOOLEAN dark_loaded = FALSE;
+
+/*
+ * Load of a dark frame requested by a client, on its own thread so that
+ * the file is not read while serving the clients.  The main loop takes
+ * the result in darkLoadPoll.  Protected by psf_lock.
+ */
+typedef struct {
+   BOOLEAN busy;                /* thread running */
+   BOOLEAN done;                /* result not taken by the main loop */
+   PASSFAIL status;
+   char path[256];
+} dark_load_t;
+
+static dark_load_t dark_load;
+
+/*
+ * Co-add of the guide frames, only used by the main loop
+ */
+static coadd_t coadd;
+
+/*
+ * Buffers and statistics of the FITS output, only used by the FITS stage
+ */
+static fits_output_t fits_output;
+
+/*
+ * Pending cube of a SAVE sequence, only used by the FITS stage
+ */
+static fits_cube_t fits_cube;
+
+/*
+ * Recorder of the SAVE sequences
+ */
+static recorder_t recorder;
+
+/*
+ * Telemetry stream of the guide results
+ */
+static telemetry_t telemetry = {
+   .lock = PTHREAD_MUTEX_INITIALIZER,
+   .wake = { -1, -1 }, .listen_tcp = -1, .listen_unix = -1,
+   .port = "OFF", .host = "127.0.0.1"
+};
+
+/*
+ * Decimation of the FITS video stream, only used by the main thread
+ */
+static video_rate_t video_rate = { 1, 0.0, 0, 0.0, 0, 0 };
+
+/*
+ * Shared memory frame ring for local readers, only written by the main
+ * loop.  NULL when it is disabled or could not be created.
+ */
+static raptor_shm_t *shm_ring = NULL;
+static BOOLEAN shm_ring_enabled = TRUE;
+
 /*MPFIT STRUCTURE - DEFINE THE PRIVATE STRUCTURE FOR THE DATA, ERRORS,
   COORDINATES ETC. ANY 2D BEHAVIOUR IS HERE.  REMOVED X AND Y BECAUSE WE
-  CAN GET THESE, ASSUMING IMAGE IS SQUARE */
+  CAN GET THESE FROM THE DIMENSIONS OF THE SUBREGION */
 
 struct vars_struct {
    double *flux;     //DATA
    double *ferr;     //ESTIMATE OF ERROR
+   int nx;           //COLUMNS OF THE SUBREGION
+   int ny;           //ROWS OF THE SUBREGION
+   fit_loss_t loss;  //LOSS APPLIED TO THE NORMALIZED RESIDUALS
+   double loss_scale; //TUNING CONSTANT OF THE LOSS, IN SIGMAS
 };
 //--------------------------------------------------//
 
@@ -318,82 +1031,696 @@ static void *set_analog_slope_thread(void* p_args)
 #endif // SLOPES
 
 /*
- * Returns whether a string is a floating point number
+ * Body of a pipeline stage thread: run the job each time it is started
  */
-   static int
-isFloat(const char *ch)
+static void *
+stageThread(void *p_args)
 {
-   uint8_t i;
-   int debut, fin;
-   int flagPt = 0;
-   int flagE = 0;
-   int iE = 0;
+   pipeline_stage_t *stage = (pipeline_stage_t *)p_args;
 
-   fin = strlen(ch);
+   pthread_mutex_lock(&stage->lock);
+   for (;;) {
+      while (stage->pending == FALSE) {
+	 pthread_cond_wait(&stage->cond, &stage->lock);
+      }
+      pthread_mutex_unlock(&stage->lock);
 
-   if (strncmp(ch, "+", 1) == 0 || strncmp(ch, "-", 1) == 0) {
-      debut = 1; /* beginning with either a + or a - */
-   }
-   else if (isdigit(ch[0]) != 0) {
-      debut = 0; /* beginning with any digit */
-   }
-   else {
-      return 0;
-   }
+      stage->job(stage->arg);
 
-   if (debut == fin) {
-      return 0;
+      pthread_mutex_lock(&stage->lock);
+      stage->pending = FALSE;
+      pthread_cond_broadcast(&stage->cond);
    }
+   return NULL;
+}
 
-   for (i = debut; i < fin; i++) {
-      if (isdigit(ch[i]) == 0) {
-	 if (flagPt == 0 && flagE == 0 && ch[i] == '.') {
-	    flagPt = 1;
-	 }
-	 else if (flagE == 0 && (ch[i] == 'E' || ch[i] == 'e')) {
-	    flagE = 1;
-	    iE = i;
-	 }
-	 else if (flagE == 1 && ch[i] == '-') {
-	    if (i != iE + 1) {
-	       return 0;
-	    }
-	 }
-	 else {
-	    return 0;
-	 }
-      }
+/*
+ * Create the worker thread of a pipeline stage
+ */
+static PASSFAIL
+stageCreate(pipeline_stage_t *stage, void (*job)(void *), void *arg)
+{
+   memset(stage, 0, sizeof(*stage));
+   stage->job = job;
+   stage->arg = arg;
+   pthread_mutex_init(&stage->lock, NULL);
+   pthread_cond_init(&stage->cond, NULL);
+
+   if (pthread_create(&stage->thread, NULL, stageThread, stage)) {
+      cfht_logv(CFHT_MAIN, CFHT_ERROR,
+	    "(%s:%d) %s: failed creating pipeline stage thread",
+	    __FILE__, __LINE__, __FUNCTION__);
+      return FAIL;
    }
+   pthread_detach(stage->thread);
 
-   return 1;
+   return PASS;
 }
 
 /*
- * Returns whether a string is an Integer
+ * Start the job of a stage.  The caller must have waited for the
+ * previous job and filled in the job arguments.
  */
-   static int
-isInt(const char *ch)
+static void
+stageStart(pipeline_stage_t *stage)
 {
-   uint8_t i;
-   int debut, fin;
-
-   fin = strlen(ch);
+   pthread_mutex_lock(&stage->lock);
+   stage->pending = TRUE;
+   pthread_cond_broadcast(&stage->cond);
+   pthread_mutex_unlock(&stage->lock);
+}
 
-   if (strncmp(ch, "+", 1) == 0 || strncmp(ch, "-", 1) == 0) {
-      debut = 1;
-   }
-   else if (isdigit(ch[0]) != 0) {
-      debut = 0;
-   }
-   else {
-      return 0;
+/*
+ * Wait until the job last started on a stage is finished
+ */
+static void
+stageWait(pipeline_stage_t *stage)
+{
+   pthread_mutex_lock(&stage->lock);
+   while (stage->pending == TRUE) {
+      pthread_cond_wait(&stage->cond, &stage->lock);
    }
+   pthread_mutex_unlock(&stage->lock);
+}
 
-   if (debut == fin) {
-      return 0;
+static void fitsStageJob(void *p_args);
+static void fitsCompressJob(fits_template_t *t, fits_job_t *job);
+static PASSFAIL fitsCubeFlush(fits_cube_t *c);
+
+/*
+ * Name of a set of compressed streams
+ */
+static const char *
+fitsCompressName(fits_compress_t compress)
+{
+   switch (compress) {
+      case FITS_COMPRESS_VIDEO:
+	 return "VIDEO";
+      case FITS_COMPRESS_SAVE:
+	 return "SAVE";
+      case FITS_COMPRESS_BOTH:
+	 return "BOTH";
+      default:
+	 return "OFF";
    }
+}
 
-   for (i = debut; i < fin; i++) {
+/*
+ * Parse a compression specification, <OFF|VIDEO|SAVE|BOTH> [<workers>].
+ * The number of workers is left unchanged when it is not given.
+ */
+static PASSFAIL
+fitsCompressParse(int argc, char **argv, fits_compress_t *compress,
+      int *workers)
+{
+   char *stop_at = NULL;
+
+   if (argc < 1 || argc > 2) return FAIL;
+   if (!strcasecmp(argv[0], "OFF")) *compress = FITS_COMPRESS_OFF;
+   else if (!strcasecmp(argv[0], "VIDEO")) *compress = FITS_COMPRESS_VIDEO;
+   else if (!strcasecmp(argv[0], "SAVE")) *compress = FITS_COMPRESS_SAVE;
+   else if (!strcasecmp(argv[0], "BOTH")) *compress = FITS_COMPRESS_BOTH;
+   else return FAIL;
+   if (argc == 2) {
+      *workers = strtol(argv[1], &stop_at, 10);
+      if (*stop_at != '\0' || *workers < 1 ||
+	  *workers > COMPRESS_MAX_WORKERS) {
+	 return FAIL;
+      }
+   }
+   return PASS;
+}
+
+/*
+ * Name of a FITS queue overflow policy
+ */
+static const char *
+fitsPolicyName(fits_policy_t policy)
+{
+   switch (policy) {
+      case FITS_DROP_NEWEST:
+	 return "DROPNEWEST";
+      case FITS_BLOCK_SAVE:
+	 return "BLOCKSAVE";
+      default:
+	 return "DROPOLDEST";
+   }
+}
+
+/*
+ * Parse a FITS queue specification, <depth> [<DROPOLDEST|DROPNEWEST|
+ * BLOCKSAVE>]
+ */
+static PASSFAIL
+fitsQueueParse(int argc, char **argv, int *depth, fits_policy_t *policy)
+{
+   char *stop_at = NULL;
+
+   if (argc < 1 || argc > 2) return FAIL;
+   *depth = strtol(argv[0], &stop_at, 10);
+   if (*stop_at != '\0' || *depth < 1 || *depth > FITS_QUEUE_MAX) {
+      return FAIL;
+   }
+   if (argc == 2) {
+      if (!strcasecmp(argv[1], "DROPOLDEST")) *policy = FITS_DROP_OLDEST;
+      else if (!strcasecmp(argv[1], "DROPNEWEST")) *policy = FITS_DROP_NEWEST;
+      else if (!strcasecmp(argv[1], "BLOCKSAVE")) *policy = FITS_BLOCK_SAVE;
+      else return FAIL;
+   }
+   return PASS;
+}
+
+/*
+ * Write the pending cube while the FITS writer is idle, at the end of the
+ * SAVE sequence or of the video, or once its flush time elapsed.  Called
+ * and returns with the queue locked.
+ */
+static void
+fitsCubeIdle(fits_queue_t *q)
+{
+   fits_cube_t *c = &fits_cube;
+   struct timespec deadline;
+   BOOLEAN flush = q->cube_end;
+
+   q->cube_end = FALSE;
+   if (c->count == 0) {
+      pthread_cond_wait(&q->cond, &q->lock);
+      return;
+   }
+   if (flush == FALSE) {
+      if (c->flush <= 0) {
+	 pthread_cond_wait(&q->cond, &q->lock);
+	 return;
+      }
+      deadline.tv_sec = (time_t)(c->start + c->flush);
+      deadline.tv_nsec = (long)((c->start + c->flush - deadline.tv_sec) *
+	    1e9);
+      if (pthread_cond_timedwait(&q->cond, &q->lock, &deadline) !=
+	  ETIMEDOUT || q->count > 0) {
+	 return;
+      }
+   }
+
+   pthread_mutex_unlock(&q->lock);
+   if (fitsCubeFlush(c) != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	    "(%s:%d) unable to write the pending FITS cube: %s",
+	    __FILE__, __LINE__, strerror(errno));
+   }
+   pthread_mutex_lock(&q->lock);
+}
+
+/*
+ * Body of the FITS writer thread: write the queued frames in order
+ */
+static void *
+fitsQueueThread(void *p_args)
+{
+   fits_queue_t *q = (fits_queue_t *)p_args;
+   static fits_template_t t;
+   struct timeval now;
+   fits_job_t *job;
+   BOOLEAN compress;
+   int index;
+
+   pthread_mutex_lock(&q->lock);
+   for (;;) {
+      while (q->count == 0) {
+	 fitsCubeIdle(q);
+      }
+      index = q->fifo[q->head];
+      q->head = (q->head + 1) % FITS_QUEUE_MAX;
+      q->count--;
+      pthread_cond_broadcast(&q->cond);
+
+      /*
+       * A frame no worker started is compressed here rather than waited
+       * for
+       */
+      job = &q->pool[index];
+      compress = (job->comp_state == COMP_PENDING);
+      if (compress == TRUE) job->comp_state = COMP_BUSY;
+      while (compress == FALSE && job->comp_state == COMP_BUSY) {
+	 pthread_cond_wait(&q->cond, &q->lock);
+      }
+      pthread_mutex_unlock(&q->lock);
+
+      if (compress == TRUE) {
+	 fitsCompressJob(&t, job);
+	 pthread_mutex_lock(&q->lock);
+	 job->comp_state = COMP_DONE;
+	 pthread_mutex_unlock(&q->lock);
+      }
+      fitsStageJob(job);
+      gettimeofday(&now, NULL);
+
+      pthread_mutex_lock(&q->lock);
+      q->written++;
+      if ((now.tv_sec - job->info.capture.tv_sec) +
+	  (now.tv_usec - job->info.capture.tv_usec) * 1e-6 > FITS_LATE_TIME) {
+	 q->late++;
+      }
+      if (job->comp_state == COMP_DONE && job->comp_status == PASS) {
+	 q->compressed++;
+	 q->comp_in += job->info.image_width * job->info.image_height *
+	    sizeof(uint16_t);
+	 q->comp_out += job->comp_size;
+      }
+      q->free_list[q->nfree++] = index;
+      pthread_cond_broadcast(&q->cond);
+   }
+   return NULL;
+}
+
+/*
+ * Body of a compression worker: compress the oldest queued frame that
+ * waits for it
+ */
+static void *
+fitsCompressThread(void *p_args)
+{
+   fits_queue_t *q = (fits_queue_t *)p_args;
+   fits_template_t *t;
+   fits_job_t *job;
+   int i;
+
+   t = (fits_template_t *)cli_malloc(sizeof(*t));
+   memset(t, 0, sizeof(*t));
+
+   pthread_mutex_lock(&q->lock);
+   for (;;) {
+      job = NULL;
+      for (i = 0; i < q->count && job == NULL; i++) {
+	 job = &q->pool[q->fifo[(q->head + i) % FITS_QUEUE_MAX]];
+	 if (job->comp_state != COMP_PENDING) job = NULL;
+      }
+      if (job == NULL) {
+	 pthread_cond_wait(&q->cond, &q->lock);
+	 continue;
+      }
+      job->comp_state = COMP_BUSY;
+      pthread_mutex_unlock(&q->lock);
+
+      fitsCompressJob(t, job);
+
+      pthread_mutex_lock(&q->lock);
+      job->comp_state = COMP_DONE;
+      if (job->comp_dropped == TRUE) {
+	 job->comp_dropped = FALSE;
+	 q->free_list[q->nfree++] = job - q->pool;
+      }
+      pthread_cond_broadcast(&q->cond);
+   }
+   return NULL;
+}
+
+/*
+ * Allocate the job pool and start the FITS writer and compression threads
+ */
+static PASSFAIL
+fitsQueueCreate(fits_queue_t *q, int depth, fits_policy_t policy,
+      fits_compress_t compress, int nworkers)
+{
+   int i;
+
+   memset(q, 0, sizeof(*q));
+   q->depth = depth;
+   q->policy = policy;
+   q->compress = compress;
+   for (i = 0; i < FITS_POOL_SIZE; i++) {
+      q->pool[i].pixels = (unsigned short *)
+	 cli_malloc(SIZE_X * SIZE_Y * sizeof(uint16_t));
+      q->pool[i].coadd_pixels = (unsigned short *)
+	 cli_malloc(GUIDE_SIZE_X * GUIDE_SIZE_Y * sizeof(uint16_t));
+      q->free_list[q->nfree++] = i;
+   }
+   pthread_mutex_init(&q->lock, NULL);
+   pthread_cond_init(&q->cond, NULL);
+
+   q->reentrant = fits_is_reentrant() ? TRUE : FALSE;
+   if (q->reentrant == FALSE) {
+      cfht_logv(CFHT_MAIN, CFHT_WARN,
+	    "(%s:%d) cfitsio is not reentrant: frames compressed by the FITS "
+	    "writer only, recorded uncompressed", __FILE__, __LINE__);
+      nworkers = 0;
+   }
+
+   if (pthread_create(&q->thread, NULL, fitsQueueThread, q)) {
+      cfht_logv(CFHT_MAIN, CFHT_ERROR,
+	    "(%s:%d) %s: failed creating FITS writer thread",
+	    __FILE__, __LINE__, __FUNCTION__);
+      return FAIL;
+   }
+   pthread_detach(q->thread);
+
+   for (i = 0; i < nworkers; i++) {
+      if (pthread_create(&q->workers[i], NULL, fitsCompressThread, q)) {
+	 cfht_logv(CFHT_MAIN, CFHT_WARN,
+	       "(%s:%d) %s: failed creating compression worker %d",
+	       __FILE__, __LINE__, __FUNCTION__, i);
+	 break;
+      }
+      pthread_detach(q->workers[i]);
+      q->nworkers++;
+   }
+
+   return PASS;
+}
+
+/*
+ * Get a job to fill with the next frame, applying the overflow policy when
+ * the queue is full.  NULL is returned when the new frame is dropped.  A
+ * dropped FWHM measurement is requested again on the next frame.
+ */
+static fits_job_t *
+fitsQueueReserve(fits_queue_t *q, BOOLEAN save_active)
+{
+   int index;
+
+   pthread_mutex_lock(&q->lock);
+   while (q->count >= q->depth) {
+      if (q->policy == FITS_DROP_NEWEST) {
+	 q->dropped++;
+	 pthread_mutex_unlock(&q->lock);
+	 return NULL;
+      }
+      if (q->policy == FITS_BLOCK_SAVE && save_active) {
+	 pthread_cond_wait(&q->cond, &q->lock);
+	 continue;
+      }
+
+      /* Drop the oldest frame still waiting */
+      index = q->fifo[q->head];
+      q->head = (q->head + 1) % FITS_QUEUE_MAX;
+      q->count--;
+      q->dropped++;
+      if (q->pool[index].fwhm_request == TRUE) serv_info->psf_refit = TRUE;
+      if (q->pool[index].comp_state == COMP_BUSY) {
+	 q->pool[index].comp_dropped = TRUE;
+      }
+      else {
+	 q->free_list[q->nfree++] = index;
+      }
+   }
+   index = q->free_list[--q->nfree];
+   pthread_mutex_unlock(&q->lock);
+   return &q->pool[index];
+}
+
+/*
+ * Queue a job filled after fitsQueueReserve.  The frames of the compressed
+ * streams are left for the workers, except for cubes which are written
+ * uncompressed.  A frame of a SAVE sequence cancels an end of the pending
+ * cube that was not seen by the writer yet.
+ */
+static void
+fitsQueueCommit(fits_queue_t *q, fits_job_t *job)
+{
+   fits_compress_t stream = job->info.save ?
+      FITS_COMPRESS_SAVE : FITS_COMPRESS_VIDEO;
+
+   pthread_mutex_lock(&q->lock);
+   job->comp_state = COMP_NONE;
+   if ((q->compress & stream) &&
+       !(job->info.save == TRUE && job->info.cube_frames > 1)) {
+      job->comp_state = COMP_PENDING;
+   }
+   if (job->info.save == TRUE && job->info.save_last == FALSE) {
+      q->cube_end = FALSE;
+   }
+   q->fifo[(q->head + q->count) % FITS_QUEUE_MAX] = job - q->pool;
+   q->count++;
+   q->queued++;
+   pthread_cond_broadcast(&q->cond);
+   pthread_mutex_unlock(&q->lock);
+}
+
+/*
+ * End the pending cube at the end of a SAVE sequence or of the video.  The
+ * frame that would have ended it may be dropped or not written at all.
+ */
+static void
+fitsQueueCubeEnd(fits_queue_t *q)
+{
+   pthread_mutex_lock(&q->lock);
+   q->cube_end = TRUE;
+   pthread_cond_broadcast(&q->cond);
+   pthread_mutex_unlock(&q->lock);
+}
+
+/*
+ * Parse a video rate specification, <decimation> [<max rate (Hz)>]
+ */
+static PASSFAIL
+videoRateParse(int argc, char **argv, int *decimate, double *max_rate)
+{
+   char *stop_at = NULL;
+
+   if (argc < 1 || argc > 2) return FAIL;
+   *decimate = strtol(argv[0], &stop_at, 10);
+   if (*stop_at != '\0' || *decimate < 1 || *decimate > VIDEO_DECIMATE_MAX) {
+      return FAIL;
+   }
+   *max_rate = 0.0;
+   if (argc == 2) {
+      *max_rate = strtod(argv[1], &stop_at);
+      if (*stop_at != '\0' || *max_rate < 0) return FAIL;
+   }
+   return PASS;
+}
+
+/*
+ * Returns whether a frame goes to the FITS video stream.  The rate limit
+ * advances by whole periods so that its mean rate is kept even when it
+ * does not divide the frame rate.
+ */
+static BOOLEAN
+videoRateEmit(video_rate_t *vr, const struct timeval *capture,
+      BOOLEAN save_active)
+{
+   double now = capture->tv_sec + capture->tv_usec * 1e-6;
+   BOOLEAN emit = save_active;
+
+   if (emit == FALSE && vr->skipped_run + 1 >= vr->decimate) {
+      emit = (vr->max_rate <= 0 || now >= vr->next_due);
+   }
+   if (emit == FALSE) {
+      vr->skipped_run++;
+      vr->skipped++;
+      return FALSE;
+   }
+   if (vr->max_rate > 0) {
+      if (vr->next_due + 1.0 / vr->max_rate < now) vr->next_due = now;
+      vr->next_due += 1.0 / vr->max_rate;
+   }
+   vr->skipped_run = 0;
+   vr->emitted++;
+   return TRUE;
+}
+
+/*
+ * Parse a cube specification for SAVE sequences, OFF or <frames> [<flush
+ * time (s)>].  A cube holds at least 2 frames, OFF writes single frames.
+ */
+static PASSFAIL
+cubeParse(int argc, char **argv, int *frames, double *flush)
+{
+   char *stop_at = NULL;
+
+   if (argc < 1 || argc > 2) return FAIL;
+   *flush = 0.0;
+   if (!strcasecmp(argv[0], "OFF")) {
+      *frames = 0;
+      return argc == 1 ? PASS : FAIL;
+   }
+   *frames = strtol(argv[0], &stop_at, 10);
+   if (*stop_at != '\0' || *frames < 2 || *frames > CUBE_MAX_FRAMES) {
+      return FAIL;
+   }
+   if (argc == 2) {
+      *flush = strtod(argv[1], &stop_at);
+      if (*stop_at != '\0' || *flush < 0) return FAIL;
+   }
+   return PASS;
+}
+
+/*
+ * Create the shared memory frame ring, or reuse the one left by a
+ * previous server
+ */
+static PASSFAIL
+shmRingCreate(const char *name)
+{
+   void *p;
+   int fd;
+
+   if ((fd = shm_open(name, O_CREAT | O_RDWR, 0644)) < 0) {
+      cfht_logv(CFHT_MAIN, CFHT_WARN,
+	    "(%s:%d) %s: shm_open of %s failed: %s",
+	    __FILE__, __LINE__, __FUNCTION__, name, strerror(errno));
+      return FAIL;
+   }
+   if (ftruncate(fd, sizeof(raptor_shm_t)) != 0) {
+      cfht_logv(CFHT_MAIN, CFHT_WARN,
+	    "(%s:%d) %s: unable to size %s: %s",
+	    __FILE__, __LINE__, __FUNCTION__, name, strerror(errno));
+      close(fd);
+      return FAIL;
+   }
+   p = mmap(NULL, sizeof(raptor_shm_t), PROT_READ | PROT_WRITE, MAP_SHARED,
+	 fd, 0);
+   close(fd);
+   if (p == MAP_FAILED) {
+      cfht_logv(CFHT_MAIN, CFHT_WARN,
+	    "(%s:%d) %s: unable to map %s: %s",
+	    __FILE__, __LINE__, __FUNCTION__, name, strerror(errno));
+      return FAIL;
+   }
+   shm_ring = (raptor_shm_t *)p;
+
+   /*
+    * Readers attached to a previous server check the magic, so it is
+    * cleared while the slots are reset
+    */
+   __atomic_store_n(&shm_ring->magic, 0, __ATOMIC_RELEASE);
+   memset(shm_ring->slots, 0, sizeof(shm_ring->slots));
+   shm_ring->version = RAPTOR_SHM_VERSION;
+   shm_ring->nslots = RAPTOR_SHM_SLOTS;
+   shm_ring->slot_size = sizeof(raptor_shm_slot_t);
+   __atomic_store_n(&shm_ring->published, 0, __ATOMIC_RELEASE);
+   __atomic_store_n(&shm_ring->magic, RAPTOR_SHM_MAGIC, __ATOMIC_RELEASE);
+
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	 "(%s:%d) frame ring %s created, %d slots of %ld bytes",
+	 __FILE__, __LINE__, name, RAPTOR_SHM_SLOTS,
+	 (long)sizeof(raptor_shm_slot_t));
+   return PASS;
+}
+
+/*
+ * Publish a frame in the next slot of the shared memory ring.  The slot
+ * sequence is odd while the slot is written so that readers never use a
+ * partially written frame, and nothing waits for the readers.
+ */
+static void
+shmRingPublish(const frame_info_t *info, const void *pixels)
+{
+   raptor_shm_slot_t *slot;
+   uint64_t frame;
+   size_t npixels;
+
+   if (shm_ring == NULL) return;
+
+   frame = __atomic_load_n(&shm_ring->published, __ATOMIC_RELAXED);
+   slot = &shm_ring->slots[frame % RAPTOR_SHM_SLOTS];
+   npixels = (size_t)info->image_width * info->image_height;
+   if (npixels > RAPTOR_SHM_MAX_PIXELS) npixels = RAPTOR_SHM_MAX_PIXELS;
+
+   __atomic_store_n(&slot->seq, 2 * frame + 1, __ATOMIC_RELAXED);
+   __atomic_thread_fence(__ATOMIC_RELEASE);
+
+   slot->meta.frame = frame;
+   slot->meta.capture_sec = info->capture.tv_sec;
+   slot->meta.capture_usec = info->capture.tv_usec;
+   slot->meta.width = info->image_width;
+   slot->meta.height = info->image_height;
+   slot->meta.win_x0 = info->win_x0;
+   slot->meta.win_y0 = info->win_y0;
+   slot->meta.seqnum = info->frame_sequence;
+   slot->meta.guide_on = info->guide_on;
+   slot->meta.isu_on = info->isu_on;
+   slot->meta.save = info->save;
+   slot->meta.exposure_time = info->exposure_time;
+   slot->meta.frame_rate = info->frame_rate;
+   slot->meta.guide_xoff = info->guide_xoff;
+   slot->meta.guide_yoff = info->guide_yoff;
+   slot->meta.isu_mrad_x_delta_setup = info->isu_mrad_x_delta_setup;
+   slot->meta.isu_mrad_y_delta_setup = info->isu_mrad_y_delta_setup;
+   slot->meta.isu_mrad_x_status = info->isu_mrad_x_status;
+   slot->meta.isu_mrad_y_status = info->isu_mrad_y_status;
+   memcpy(slot->pixels, pixels, npixels * sizeof(uint16_t));
+
+   __atomic_store_n(&slot->seq, 2 * (frame + 1), __ATOMIC_RELEASE);
+   __atomic_store_n(&shm_ring->published, frame + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Returns whether a string is a floating point number
+ */
+   static int
+isFloat(const char *ch)
+{
+   uint8_t i;
+   int debut, fin;
+   int flagPt = 0;
+   int flagE = 0;
+   int iE = 0;
+
+   fin = strlen(ch);
+
+   if (strncmp(ch, "+", 1) == 0 || strncmp(ch, "-", 1) == 0) {
+      debut = 1; /* beginning with either a + or a - */
+   }
+   else if (isdigit(ch[0]) != 0) {
+      debut = 0; /* beginning with any digit */
+   }
+   else {
+      return 0;
+   }
+
+   if (debut == fin) {
+      return 0;
+   }
+
+   for (i = debut; i < fin; i++) {
+      if (isdigit(ch[i]) == 0) {
+	 if (flagPt == 0 && flagE == 0 && ch[i] == '.') {
+	    flagPt = 1;
+	 }
+	 else if (flagE == 0 && (ch[i] == 'E' || ch[i] == 'e')) {
+	    flagE = 1;
+	    iE = i;
+	 }
+	 else if (flagE == 1 && ch[i] == '-') {
+	    if (i != iE + 1) {
+	       return 0;
+	    }
+	 }
+	 else {
+	    return 0;
+	 }
+      }
+   }
+
+   return 1;
+}
+
+/*
+ * Returns whether a string is an Integer
+ */
+   static int
+isInt(const char *ch)
+{
+   uint8_t i;
+   int debut, fin;
+
+   fin = strlen(ch);
+
+   if (strncmp(ch, "+", 1) == 0 || strncmp(ch, "-", 1) == 0) {
+      debut = 1;
+   }
+   else if (isdigit(ch[0]) != 0) {
+      debut = 0;
+   }
+   else {
+      return 0;
+   }
+
+   if (debut == fin) {
+      return 0;
+   }
+
+   for (i = debut; i < fin; i++) {
       if (isdigit(ch[i]) == 0) {
 	 return 0;
       }
@@ -416,2206 +1743,5768 @@ void printresult(double *x, mp_result *result)
    {
       fprintf(stderr," %lf ",x[i]);
    }
-   fprintf(stderr,"\n");
+   fprintf(stderr,"\n");
+
+
+}
+
+#ifdef SIM_STAR
+/*
+ * This is a polar form of the Box-Muller transformation
+ * We start with two independent random numbers, x1 and x2, 
+ * which come from a uniform distribution (in the range from 0 to 1).
+ * Then apply the above transformations to get two new independent 
+ * random numbers which have a Gaussian distribution with zero mean 
+ * and a standard deviation of one. 
+ * Source: http://www.design.caltech.edu/erik/Misc/Gaussian.html
+ */
+void sampleNormal(double* y1, double* y2)
+{
+   double x1, x2, w;
+
+   do {
+      x1 = 2.0 * ((double)rand() / (RAND_MAX)) - 1.0;
+      x2 = 2.0 * ((double)rand() / (RAND_MAX)) - 1.0;
+      w = x1 * x1 + x2 * x2;
+   } while ( w >= 1.0 );
+
+   w = sqrt( (-2.0 * log( w ) ) / w );
+   *y1 = x1 * w;
+   *y2 = x2 * w;
+}
+#endif //SIM_STAR
+
+//--------------------------------------------------//
+//NORMALIZE THE RESIDUAL OF PIXEL K BY ITS NOISE AND APPLY THE ROBUST LOSS.
+//THE RESIDUAL IS REPLACED BY SIGN(R)*SQRT(2*RHO(R)) SO THAT MPFIT, WHICH
+//MINIMIZES THE SUM OF SQUARES, MINIMIZES THE SUM OF RHO.  THE RETURNED
+//FACTOR SCALES THE DERIVATIVES OF THE RAW RESIDUAL ACCORDINGLY.
+   static double
+psfWeightResidual(struct vars_struct *v, int k, double *dy)
+{
+   double r, a, c, t, rho, psi;
+
+   r = *dy / v->ferr[k];
+   a = fabs(r);
+   c = v->loss_scale;
+
+   switch (v->loss) {
+      case FIT_LOSS_HUBER:
+	 if (a <= c) break;
+	 *dy = copysign(sqrt(2.0*c*a - c*c), r);
+	 return c / (fabs(*dy) * v->ferr[k]);
+      case FIT_LOSS_TUKEY:
+	 if (a >= c) {
+	    *dy = copysign(c/sqrt(3.0), r);
+	    return 0.0;
+	 }
+	 t = 1.0 - (r/c)*(r/c);
+	 rho = c*c/6.0*(1.0 - t*t*t);
+	 psi = r*t*t;
+	 *dy = copysign(sqrt(2.0*rho), r);
+	 //SMALL RESIDUALS ARE QUADRATIC, AVOID 0/0
+	 if (a < 1e-6) return 1.0 / v->ferr[k];
+	 return psi / (*dy * v->ferr[k]);
+      default:
+	 break;
+   }
+   *dy = r;
+   return 1.0 / v->ferr[k];
+}
+
+//--------------------------------------------------//
+//AXIS-ALIGNED GAUSSIAN WITH INDEPENDENT FWHM IN X AND Y
+//P = {XC, YC, FWHM_X, FWHM_Y, AMPLITUDE, BACKGROUND}
+   static PASSFAIL
+gaussfunc2d(int m, int n, double *p, double *dy, double **dvec, void *vars)
+{
+
+   int i,j,k;  //COUNTERS
+   struct vars_struct *v = (struct vars_struct *) vars;  //STRUCTURE TO PASS PRIVATE DATA
+   double *flux;  //DATA VALUES
+   double xc, yc;        //THE VALUE OF THE CENTRE POINTS OF THE IMAGE
+   double sx2, sy2;      //SQUARED SIGMAS
+   double e;             //UNIT GAUSSIAN
+   double g;             //GAUSSIAN PART OF THE MODEL
+   double f;             //SCALE OF THE DERIVATIVES SET BY THE WEIGHTING
+
+   //SET THE LOCAL VARIABLES TO THE STRUCTURE.
+
+   flux=v->flux;
+   sx2=p[PSF_W1]*p[PSF_W1]*FWHM_TO_SIGMA2;
+   sy2=p[PSF_W2]*p[PSF_W2]*FWHM_TO_SIGMA2;
+
+   //CYCLE THROUGH THE VALUES. THE DATA/RESIDUALS ARE ONE D, X MAJOR
+
+   for (i=0;i<v->nx;i++)
+   {
+      for (j=0;j<v->ny;j++)
+      {
+	 k=i*v->ny+j;
+
+	 //CENTER VALUES
+	 xc=i-p[PSF_XC];
+	 yc=j-p[PSF_YC];
+
+	 e = exp(-0.5*(xc*xc/sx2+yc*yc/sy2));
+	 g = p[PSF_AMP]*e;
+	 dy[k] = flux[k] - g - p[PSF_BKG];
+
+	 //WEIGHTED RESIDUAL AND ANALYTIC DERIVATIVES, NULL WHEN NOT NEEDED
+	 f = psfWeightResidual(v, k, &dy[k]);
+	 if (dvec == NULL) continue;
+	 if (dvec[PSF_XC]) dvec[PSF_XC][k] = f*(-g*xc/sx2);
+	 if (dvec[PSF_YC]) dvec[PSF_YC][k] = f*(-g*yc/sy2);
+	 if (dvec[PSF_W1]) dvec[PSF_W1][k] = f*(-g*xc*xc/(sx2*p[PSF_W1]));
+	 if (dvec[PSF_W2]) dvec[PSF_W2][k] = f*(-g*yc*yc/(sy2*p[PSF_W2]));
+	 if (dvec[PSF_AMP]) dvec[PSF_AMP][k] = -f*e;
+	 if (dvec[PSF_BKG]) dvec[PSF_BKG][k] = -f;
+      }
+   }
+   return PASS;
+}
+
+//--------------------------------------------------//
+//CIRCULAR MOFFAT PROFILE A*(1+R^2/ALPHA^2)^-BETA + B, BROADER WINGS
+//P = {XC, YC, ALPHA, BETA, AMPLITUDE, BACKGROUND}
+   static PASSFAIL
+moffatfunc2d(int m, int n, double *p, double *dy, double **dvec, void *vars)
+{
+
+   int i,j,k;  //COUNTERS
+   struct vars_struct *v = (struct vars_struct *) vars;  //STRUCTURE TO PASS PRIVATE DATA
+   double *flux;  //DATA VALUES
+   double xc, yc, r2;    //OFFSETS FROM THE CENTRE AND SQUARED RADIUS
+   double a2, u, e, h;   //ALPHA^2, 1+R^2/ALPHA^2, PROFILE, AND A*BETA*U^(-BETA-1)
+   double f;             //SCALE OF THE DERIVATIVES SET BY THE WEIGHTING
+
+   flux=v->flux;
+   a2=p[PSF_W1]*p[PSF_W1];
+
+   for (i=0;i<v->nx;i++)
+   {
+      for (j=0;j<v->ny;j++)
+      {
+	 k=i*v->ny+j;
+
+	 xc=i-p[PSF_XC];
+	 yc=j-p[PSF_YC];
+	 r2=xc*xc+yc*yc;
+	 u=1.0+r2/a2;
+	 e=pow(u,-p[PSF_W2]);
+	 dy[k] = flux[k] - p[PSF_AMP]*e - p[PSF_BKG];
+
+	 //WEIGHTED RESIDUAL AND ANALYTIC DERIVATIVES, NULL WHEN NOT NEEDED
+	 f = psfWeightResidual(v, k, &dy[k]);
+	 if (dvec == NULL) continue;
+	 h=p[PSF_AMP]*p[PSF_W2]*e/u;
+	 if (dvec[PSF_XC]) dvec[PSF_XC][k] = f*(-2.0*h*xc/a2);
+	 if (dvec[PSF_YC]) dvec[PSF_YC][k] = f*(-2.0*h*yc/a2);
+	 if (dvec[PSF_W1]) dvec[PSF_W1][k] = f*(-2.0*h*r2/(a2*p[PSF_W1]));
+	 if (dvec[PSF_W2]) dvec[PSF_W2][k] = f*(p[PSF_AMP]*e*log(u));
+	 if (dvec[PSF_AMP]) dvec[PSF_AMP][k] = -f*e;
+	 if (dvec[PSF_BKG]) dvec[PSF_BKG][k] = -f;
+      }
+   }
+   return PASS;
+}
+
+//--------------------------------------------------//
+//ELLIPTICAL GAUSSIAN WITH MAJOR/MINOR FWHM AND ROTATION ANGLE (RADIANS)
+//P = {XC, YC, FWHM_A, FWHM_B, AMPLITUDE, BACKGROUND, THETA}
+   static PASSFAIL
+ellipgaussfunc2d(int m, int n, double *p, double *dy, double **dvec, void *vars)
+{
+
+   int i,j,k;  //COUNTERS
+   struct vars_struct *v = (struct vars_struct *) vars;  //STRUCTURE TO PASS PRIVATE DATA
+   double *flux;  //DATA VALUES
+   double xc, yc;        //OFFSETS FROM THE CENTRE
+   double xr, yr;        //OFFSETS ALONG THE ROTATED AXES
+   double sa2, sb2;      //SQUARED SIGMAS ALONG THE ROTATED AXES
+   double ct, st, e, g;
+   double f;             //SCALE OF THE DERIVATIVES SET BY THE WEIGHTING
+
+   flux=v->flux;
+   sa2=p[PSF_W1]*p[PSF_W1]*FWHM_TO_SIGMA2;
+   sb2=p[PSF_W2]*p[PSF_W2]*FWHM_TO_SIGMA2;
+   ct=cos(p[PSF_THETA]);
+   st=sin(p[PSF_THETA]);
+
+   for (i=0;i<v->nx;i++)
+   {
+      for (j=0;j<v->ny;j++)
+      {
+	 k=i*v->ny+j;
+
+	 xc=i-p[PSF_XC];
+	 yc=j-p[PSF_YC];
+	 xr=xc*ct+yc*st;
+	 yr=-xc*st+yc*ct;
+	 e = exp(-0.5*(xr*xr/sa2+yr*yr/sb2));
+	 g = p[PSF_AMP]*e;
+	 dy[k] = flux[k] - g - p[PSF_BKG];
+
+	 //WEIGHTED RESIDUAL AND ANALYTIC DERIVATIVES, NULL WHEN NOT NEEDED
+	 f = psfWeightResidual(v, k, &dy[k]);
+	 if (dvec == NULL) continue;
+	 if (dvec[PSF_XC]) dvec[PSF_XC][k] = f*(-g*(xr*ct/sa2-yr*st/sb2));
+	 if (dvec[PSF_YC]) dvec[PSF_YC][k] = f*(-g*(xr*st/sa2+yr*ct/sb2));
+	 if (dvec[PSF_W1]) dvec[PSF_W1][k] = f*(-g*xr*xr/(sa2*p[PSF_W1]));
+	 if (dvec[PSF_W2]) dvec[PSF_W2][k] = f*(-g*yr*yr/(sb2*p[PSF_W2]));
+	 if (dvec[PSF_AMP]) dvec[PSF_AMP][k] = -f*e;
+	 if (dvec[PSF_BKG]) dvec[PSF_BKG][k] = -f;
+	 if (dvec[PSF_THETA]) dvec[PSF_THETA][k] = f*(g*xr*yr*(1.0/sa2-1.0/sb2));
+      }
+   }
+   return PASS;
+}
+
+#define ELEM_SWAP(a,b) {register float t=(a);(a)=(b);(b)=t; }
+
+/** \fn  float GetF(float arr[], int n)
+ * \brief This function is the quick_select routine based on the algorithm found
+ * in Numerical Recipes in C.
+ *
+ * \param arr[] is the image
+ * \param n is the number of pixels in the image
+ * \return median value of an array
+ */
+double GetMedian(double arr[], int n){
+   int low, high;
+   int median;
+   int middle, ll, hh;
+
+   low = 0; high = n-1; median = (low + high) / 2;
+   for (;;) {
+
+      if (high <= low) /* One element only */
+	 return arr[median] ;
+
+      if (high == low + 1) { /* Two elements only */
+	 if (arr[low] > arr[high])
+	    ELEM_SWAP(arr[low], arr[high]) ;
+	 return arr[median] ;
+      }
+
+      /* Find median of low, middle and high items; swap into position low */
+      middle = (low + high) / 2;
+      if (arr[middle] > arr[high])
+	 ELEM_SWAP(arr[middle], arr[high])
+	    if (arr[low] > arr[high])
+	       ELEM_SWAP(arr[low], arr[high])
+		  if (arr[middle] > arr[low])
+		     ELEM_SWAP(arr[middle], arr[low])
+
+			/* Swap low item (now in position middle) into position (low+1) */
+			ELEM_SWAP(arr[middle], arr[low+1]) ;
+
+      /* Nibble from each end towards middle, swapping items when stuck */
+      ll = low + 1;
+      hh = high;
+      for (;;) {
+	 do ll++; while (arr[low] > arr[ll]) ;
+	 do hh--; while (arr[hh] > arr[low]) ;
+
+	 if (hh < ll) break;
+
+	 ELEM_SWAP(arr[ll], arr[hh])
+      }
+
+      /* Swap middle item (in position low) back into correct position */
+      ELEM_SWAP(arr[low], arr[hh])
+
+	 /* Re-set active partition */
+	 if (hh <= median) low = ll;
+      if (hh >= median) high = hh - 1;
+   }
+
+}
+#undef ELEM_SWAP
+
+/*
+ * Simple centroid calculation on the image
+ */
+static int
+calculateCentroid(unsigned short *image, int columns, int rows,
+      float *xc, float *yc) {
+
+   int i;
+   int j;
+   int val;
+   float sum,median;
+   double arr[columns*rows];
+
+   //arr=(double *)malloc(columns*rows*sizeof(double));
+
+   for (i=0;i<columns*rows;i++){
+      arr[i]=image[i];
+   }
+   median=GetMedian(arr,columns*rows);
+   //fprintf(stderr," median=%f ",median);
+
+   *xc = 0;
+   *yc = 0;
+   sum = 0;
+   for (i = 0; i < rows; i++) {
+      for (j = 0; j < columns; j++) {
+	 val = (image)[i * columns + j]-median;
+	 if (val > 0) {
+	    *xc += j * val;
+	    *yc += i * val;
+	    sum += val;
+	 }
+      }
+   }
+   if (sum > 0) {
+      *xc /= sum;
+      *yc /= sum;
+   }
+   else {
+      *xc = columns / 2.0;
+      *yc = rows / 2.0;
+   }
+
+   //free(arr);
+   return 0;
+}
+
+
+/*
+ * Name of a PSF model as used in the configuration file and the PSF command
+ */
+static const char *
+psfModelName(psf_model_t model)
+{
+   switch (model) {
+      case PSF_MOFFAT:
+	 return "MOFFAT";
+      case PSF_ELLIPTICAL:
+	 return "ELLIPTICAL";
+      default:
+	 return "GAUSSIAN";
+   }
+}
+
+/*
+ * Parse the name of a PSF model
+ */
+static PASSFAIL
+psfModelParse(const char *name, psf_model_t *model)
+{
+   if (!strcasecmp(name, "GAUSSIAN")) *model = PSF_GAUSSIAN;
+   else if (!strcasecmp(name, "MOFFAT")) *model = PSF_MOFFAT;
+   else if (!strcasecmp(name, "ELLIPTICAL")) *model = PSF_ELLIPTICAL;
+   else return FAIL;
+   return PASS;
+}
+
+/*
+ * Reset the shape used to seed the fits to a round star of the default FWHM
+ */
+static void
+psfShapeReset(psf_model_t model, double *shape)
+{
+   memset(shape, 0, PSF_NPARAMS * sizeof(double));
+   if (model == PSF_MOFFAT) {
+      shape[PSF_W2] = DEFAULT_MOFFAT_BETA;
+      shape[PSF_W1] = DEFAULT_PSF_FWHM /
+	 (2.0 * sqrt(pow(2.0, 1.0 / DEFAULT_MOFFAT_BETA) - 1.0));
+   }
+   else {
+      shape[PSF_W1] = DEFAULT_PSF_FWHM;
+      shape[PSF_W2] = DEFAULT_PSF_FWHM;
+   }
+}
+
+/*
+ * Parse a fit loss specification, NONE, HUBER [<k>] or TUKEY [<c>] with the
+ * tuning constant in units of the pixel noise
+ */
+static PASSFAIL
+fitLossParse(int argc, char **argv, fit_loss_t *loss, double *scale)
+{
+   char *end_p;
+
+   if (argc < 1 || argc > 2) return FAIL;
+   if (!strcasecmp(argv[0], "NONE") && argc == 1) {
+      *loss = FIT_LOSS_NONE;
+      *scale = 0;
+      return PASS;
+   }
+   if (!strcasecmp(argv[0], "HUBER")) {
+      *loss = FIT_LOSS_HUBER;
+      *scale = DEFAULT_HUBER_SCALE;
+   }
+   else if (!strcasecmp(argv[0], "TUKEY")) {
+      *loss = FIT_LOSS_TUKEY;
+      *scale = DEFAULT_TUKEY_SCALE;
+   }
+   else return FAIL;
+   if (argc == 2) {
+      *scale = strtod(argv[1], &end_p);
+      if (*end_p != '\0' || *scale <= 0) return FAIL;
+   }
+   return PASS;
+}
+
+/*
+ * Name of a fit loss
+ */
+static const char *
+fitLossName(fit_loss_t loss)
+{
+   switch (loss) {
+      case FIT_LOSS_HUBER:
+	 return "HUBER";
+      case FIT_LOSS_TUKEY:
+	 return "TUKEY";
+      default:
+	 return "NONE";
+   }
+}
+
+/*
+ * Load the dark frame subtracted from the guide images before the PSF fit.
+ * The file holds a full raster image, in the primary HDU or in the first
+ * image extension, of any BITPIX; cfitsio applies BZERO and BSCALE.
+ */
+static PASSFAIL
+loadDarkFrame(const char *path)
+{
+   fitsfile *fptr = NULL;
+   char errmsg[FLEN_ERRMSG];
+   long naxes[2] = { 0, 0 };
+   int bitpix, naxis = 0;
+   int status = 0, close_status = 0;
+   float *pixels;
+
+   if ((pixels = (float *)malloc(SIZE_X * SIZE_Y * sizeof(float))) == NULL) {
+      return FAIL;
+   }
+   fits_open_image(&fptr, path, READONLY, &status);
+   fits_get_img_param(fptr, 2, &bitpix, &naxis, naxes, &status);
+   if (status == 0 &&
+       (naxis != 2 || naxes[0] != SIZE_X || naxes[1] != SIZE_Y)) {
+      cfht_logv(CFHT_MAIN, CFHT_WARN,
+	    "(%s:%d) dark frame %s should be a %dx%d image",
+	    __FILE__, __LINE__, path, SIZE_X, SIZE_Y);
+      fits_close_file(fptr, &close_status);
+      free(pixels);
+      return FAIL;
+   }
+   fits_read_img(fptr, TFLOAT, 1, SIZE_X * SIZE_Y, NULL, pixels, NULL,
+	 &status);
+   if (fptr != NULL) fits_close_file(fptr, &close_status);
+   if (status != 0) {
+      fits_get_errstatus(status, errmsg);
+      cfht_logv(CFHT_MAIN, CFHT_WARN,
+	    "(%s:%d) unable to read dark frame %s: %s",
+	    __FILE__, __LINE__, path, errmsg);
+      free(pixels);
+      return FAIL;
+   }
+
+   pthread_mutex_lock(&psf_lock);
+   memcpy(dark_frame, pixels, SIZE_X * SIZE_Y * sizeof(float));
+   dark_loaded = TRUE;
+   pthread_mutex_unlock(&psf_lock);
+   free(pixels);
+
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	 "(%s:%d) dark frame %s loaded", __FILE__, __LINE__, path);
+   return PASS;
+}
+
+/*
+ * Body of the thread loading a dark frame requested by a client
+ */
+static void *
+darkLoadThread(void *p_args)
+{
+   PASSFAIL status = loadDarkFrame(dark_load.path);
+
+   pthread_mutex_lock(&psf_lock);
+   dark_load.status = status;
+   dark_load.busy = FALSE;
+   dark_load.done = TRUE;
+   pthread_mutex_unlock(&psf_lock);
+   return NULL;
+}
+
+/*
+ * Start loading a dark frame in the background.  FAIL is returned when a
+ * load is already in progress or the thread cannot be started.
+ */
+static PASSFAIL
+darkLoadStart(const char *path)
+{
+   pthread_t thread;
+
+   pthread_mutex_lock(&psf_lock);
+   if (dark_load.busy == TRUE) {
+      pthread_mutex_unlock(&psf_lock);
+      return FAIL;
+   }
+   strncpy(dark_load.path, path, sizeof(dark_load.path) - 1);
+   dark_load.path[sizeof(dark_load.path) - 1] = '\0';
+   dark_load.busy = TRUE;
+   dark_load.done = FALSE;
+   pthread_mutex_unlock(&psf_lock);
+
+   if (pthread_create(&thread, NULL, darkLoadThread, NULL)) {
+      cfht_logv(CFHT_MAIN, CFHT_WARN,
+	    "(%s:%d) %s: failed creating dark frame thread",
+	    __FILE__, __LINE__, __FUNCTION__);
+      pthread_mutex_lock(&psf_lock);
+      dark_load.busy = FALSE;
+      pthread_mutex_unlock(&psf_lock);
+      return FAIL;
+   }
+   pthread_detach(thread);
+   return PASS;
+}
+
+/*
+ * Take the result of a background load, from the main loop
+ */
+static void
+darkLoadPoll(void)
+{
+   pthread_mutex_lock(&psf_lock);
+   if (dark_load.done == TRUE) {
+      dark_load.done = FALSE;
+      if (dark_load.status == PASS) {
+	 strcpy(serv_info->dark_file, dark_load.path);
+      }
+   }
+   pthread_mutex_unlock(&psf_lock);
+}
+
+/*
+ * Fit the PSF model on the region around the star.  The image is a window
+ * of the detector whose lower left pixel is x0,y0.  The dark frame, if any,
+ * is subtracted first.  The centre of mass gives the first estimate of the
+ * position and selects a subregion of half the guide raster.  The widths
+ * (and the angle) are seeded from the last FWHM measurement and kept fixed
+ * when fit_shape is FALSE, which is what the centroid needs on every frame.
+ * The background is fixed at the median of the raster.
+ *
+ * Each pixel is weighted by its noise, read noise plus photon noise of the
+ * signal above the dark, when a read noise is configured.  The residuals
+ * then go through the robust loss.
+ *
+ * On return p holds the parameters in window coordinates, perror their 1
+ * sigma errors and chi2 the reduced chi2, and the number of iterations is
+ * returned.  If the fit failed, -1 is returned and p holds the centre of
+ * mass estimate.
+ */
+static int
+fitGuideStar(unsigned short *image, int columns, int rows, int x0, int y0,
+      psf_model_t model, BOOLEAN fit_shape, double *p, double *perror,
+      double *chi2)
+{
+   struct vars_struct v; //PRIVATE STRUCTURE WITH DATA/FUNCTION INFORMATION
+   mp_result result;     //STRUCTURE WITH RESULTS
+   mp_config config;     //SOLVER CONFIGURATION
+   mp_par pars[PSF_NPARAMS]; //FIXED PARAMETERS AND LIMITS
+   mp_func func;
+   double frame[columns*rows];  //DARK SUBTRACTED IMAGE
+   double arr[columns*rows];    //ARRAY FOR MEDIAN CALCULATION
+   double *subimage, *ferr;
+   double median, peak, signal;
+   double rn2, gain;
+   int fpix[2];                       //FIRST PIXELS OF SUBREGION [X,Y]
+   int lpix[2];                       //LAST PIXELS OF SUBREGION [X,Y]
+   int subx, suby, np, npar, nfree;
+   int i, j, k = 0;
+   int status;
+   BOOLEAN dark;
+   float xest = 0;
+   float yest = 0;
+
+   /*
+    *   First step, estimate the center of the point using Center of Mass
+    */
+   calculateCentroid(image, columns, rows, &xest, &yest);
+
+   pthread_mutex_lock(&psf_lock);
+   dark = dark_loaded && x0 + columns <= SIZE_X && y0 + rows <= SIZE_Y;
+   for (j = 0; j < rows; j++) {
+      for (i = 0; i < columns; i++) {
+	 frame[j*columns+i] = image[j*columns+i];
+	 if (dark) frame[j*columns+i] -= dark_frame[(y0+j)*SIZE_X+x0+i];
+      }
+   }
+   pthread_mutex_unlock(&psf_lock);
+
+   for (i=0;i<columns*rows;i++){
+      arr[i]=frame[i];
+   }
+   median=GetMedian(arr,columns*rows);
+
+   /*
+    *  Cut out the region near the point
+    */
+   fpix[0]=xest-columns/4;
+   fpix[1]=yest-rows/4;
+   lpix[0]=xest+columns/4-1;
+   lpix[1]=yest+rows/4-1;
+
+   if (fpix[0] < 0) fpix[0]=0;
+   if (fpix[1] < 0) fpix[1]=0;
+   if (lpix[0] > columns-1) lpix[0]=columns-1;
+   if (lpix[1] > rows-1) lpix[1]=rows-1;
+
+   //GET THE DIMENSIONS OF THE SUBREGION
+   subx=lpix[0]-fpix[0]+1;
+   suby=lpix[1]-fpix[1]+1;
+   np=subx*suby;
+
+   /*
+    * Without a dark, the signal above the median is the only photon noise
+    * that can be estimated.  The variance is never below one ADU.
+    */
+   gain = serv_info->det_gain > 0 ? serv_info->det_gain : DEFAULT_DET_GAIN;
+   rn2 = serv_info->det_read_noise / gain;
+   rn2 *= rn2;
+
+   subimage = malloc(np*sizeof(double));
+   ferr = malloc(np*sizeof(double));
+   peak = 0;
+   for (i=fpix[0];i<fpix[0]+subx;i++){
+      for (j=fpix[1];j<fpix[1]+suby;j++){
+	 subimage[k]=frame[j*columns+i];
+	 if (subimage[k] > peak) peak = subimage[k];
+	 if (serv_info->det_read_noise > 0) {
+	    signal = dark ? subimage[k] : subimage[k] - median;
+	    ferr[k] = sqrt(fmax(rn2 + fmax(signal, 0) / gain, 1.0));
+	 }
+	 else {
+	    ferr[k]=1.0;
+	 }
+	 k++;
+      }
+   }
+
+   /*
+    * Seed the parameters.  The amplitude comes from the brightest pixel so
+    * that the solver starts close to the solution whatever the flux.
+    */
+   p[PSF_XC] = xest-fpix[0];
+   p[PSF_YC] = yest-fpix[1];
+   p[PSF_AMP] = peak > median ? peak - median : 1.0;
+   p[PSF_BKG] = median;
+
+   memset(&result,0,sizeof(result));
+   result.xerror = perror;
+   memset(pars,0,sizeof(pars));
+   memset(&config,0,sizeof(config));
+   config.maxiter = PSF_MAX_ITER;
+
+   v.ferr = ferr;
+   v.flux = subimage;
+   v.nx = subx;
+   v.ny = suby;
+   /* The loss is tuned in sigmas, it needs the noise model */
+   v.loss = serv_info->det_read_noise > 0 ? serv_info->fit_loss :
+      FIT_LOSS_NONE;
+   v.loss_scale = serv_info->fit_loss_scale;
+
+   /* Derivatives are computed by the model functions */
+   for (i = 0; i < PSF_NPARAMS; i++) pars[i].side = 3;
+
+   /* Keep the widths positive and the Moffat beta in a sane range */
+   pars[PSF_W1].limited[0] = 1;
+   pars[PSF_W1].limits[0] = 0.1;
+   pars[PSF_W2].limited[0] = 1;
+   pars[PSF_W2].limits[0] = 0.1;
+   if (model == PSF_MOFFAT) {
+      pars[PSF_W2].limited[0] = 1;
+      pars[PSF_W2].limits[0] = 1.0;
+      pars[PSF_W2].limited[1] = 1;
+      pars[PSF_W2].limits[1] = 10.0;
+   }
+   nfree = 3;
+   if (fit_shape == FALSE) {
+      pars[PSF_W1].fixed = 1;
+      pars[PSF_W2].fixed = 1;
+      pars[PSF_THETA].fixed = 1;
+   }
+   else {
+      nfree += model == PSF_ELLIPTICAL ? 3 : 2;
+   }
+   pars[PSF_BKG].fixed = 1;
+
+   switch (model) {
+      case PSF_MOFFAT:
+	 func = moffatfunc2d;
+	 npar = PSF_THETA;
+	 break;
+      case PSF_ELLIPTICAL:
+	 func = ellipgaussfunc2d;
+	 npar = PSF_NPARAMS;
+	 break;
+      default:
+	 func = gaussfunc2d;
+	 npar = PSF_THETA;
+	 break;
+   }
+
+   status = mpfit(func, np, npar, p, pars, &config, (void *) &v, &result);
+
+   free(subimage);
+   free(ferr);
+
+   if (status <= 0 || p[PSF_XC] < 0 || p[PSF_XC] > subx - 1 ||
+       p[PSF_YC] < 0 || p[PSF_YC] > suby - 1) {
+      p[PSF_XC] = xest;
+      p[PSF_YC] = yest;
+      return -1;
+   }
+   p[PSF_XC] += fpix[0];
+   p[PSF_YC] += fpix[1];
+   *chi2 = np > nfree ? result.bestnorm / (np - nfree) : 0;
+   return result.niter;
+}
+
+/*
+ * Integrated flux of a fitted PSF above the background
+ */
+static double
+psfFlux(psf_model_t model, const double *p)
+{
+   if (model == PSF_MOFFAT) {
+      return p[PSF_W2] > 1 ?
+	 M_PI * p[PSF_W1] * p[PSF_W1] * p[PSF_AMP] / (p[PSF_W2] - 1) : NAN;
+   }
+   return 2 * M_PI * p[PSF_AMP] * fabs(p[PSF_W1] * p[PSF_W2]) *
+      FWHM_TO_SIGMA2;
+}
+
+/*
+ * MPFIS method for centroid calculation on the image, a window of the
+ * detector starting at x0,y0.  The errors of the centroid are kept for
+ * the PSF command.
+ */
+int *calculateCentroidMPFIT(unsigned short *image, int columns, int rows,
+      int x0, int y0, float *xc, float *yc) {
+
+   double p[PSF_NPARAMS];
+   double perror[PSF_NPARAMS];
+   double chi2 = 0;
+   psf_model_t model;
+
+   pthread_mutex_lock(&psf_lock);
+   model = serv_info->psf_model;
+   memcpy(p, serv_info->psf_shape, sizeof(p));
+   pthread_mutex_unlock(&psf_lock);
+
+   memset(perror, 0, sizeof(perror));
+   serv_info->psf_niter = fitGuideStar(image, columns, rows, x0, y0, model,
+	 FALSE, p, perror, &chi2);
+   if (serv_info->psf_niter >= 0) {
+      serv_info->psf_xerr = perror[PSF_XC];
+      serv_info->psf_yerr = perror[PSF_YC];
+      serv_info->psf_chi2 = chi2;
+      serv_info->psf_flux = psfFlux(model, p);
+      serv_info->psf_bkg = p[PSF_BKG];
+   }
+   *xc = p[PSF_XC];
+   *yc = p[PSF_YC];
+   return 0;
+
+}
+
+/*
+ * Fit the shape of the star and update its FWHM.  The fitted shape is kept
+ * to seed the centroid of the next frames.  The position of the star is
+ * returned in xc,yc if they are not NULL.
+ */
+static PASSFAIL
+measurePSF(unsigned short *image, int columns, int rows, int x0, int y0,
+      float *xc, float *yc)
+{
+
+   double p[PSF_NPARAMS];
+   double perror[PSF_NPARAMS];
+   double chi2;
+   psf_model_t model;
+   double fwhm_x, fwhm_y;
+
+   pthread_mutex_lock(&psf_lock);
+   model = serv_info->psf_model;
+   memcpy(p, serv_info->psf_shape, sizeof(p));
+   pthread_mutex_unlock(&psf_lock);
+
+   if (fitGuideStar(image, columns, rows, x0, y0, model, TRUE, p, perror,
+	    &chi2) < 0) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	    "(%s:%d) %s PSF fit failed, FWHM not updated",
+	    __FILE__, __LINE__, psfModelName(model));
+      return FAIL;
+   }
+
+   if (model == PSF_MOFFAT) {
+      fwhm_x = 2.0 * p[PSF_W1] * sqrt(pow(2.0, 1.0 / p[PSF_W2]) - 1.0);
+      fwhm_y = fwhm_x;
+   }
+   else {
+      fwhm_x = fabs(p[PSF_W1]);
+      fwhm_y = fabs(p[PSF_W2]);
+   }
+
+   pthread_mutex_lock(&psf_lock);
+   serv_info->fwhm_x = fwhm_x;
+   serv_info->fwhm_y = fwhm_y;
+   /* Only keep the shape if the model was not changed meanwhile */
+   if (serv_info->psf_model == model) {
+      memcpy(serv_info->psf_shape, p, sizeof(p));
+   }
+   pthread_mutex_unlock(&psf_lock);
+
+   if (xc != NULL) *xc = p[PSF_XC];
+   if (yc != NULL) *yc = p[PSF_YC];
+   return PASS;
+}
+
+/*
+ * This function is used to calculate the FWHM of the stellar point.
+ */
+int *calculatePointFWHM(unsigned short *image, int columns, int rows,
+      int x0, int y0)
+{
+   measurePSF(image, columns, rows, x0, y0, NULL, NULL);
+   return 0;
+
+}
+
+/*
+ * Clear the state and the innovation statistics of a predictor axis.
+ * The mode and the gains are kept.
+ */
+static void
+predictReset(predict_axis_t *axis)
+{
+   axis->primed = FALSE;
+   axis->x = 0;
+   axis->v = 0;
+   memset(axis->p, 0, sizeof(axis->p));
+   axis->applied = 0;
+   axis->n = 0;
+   axis->innov_sum = 0;
+   axis->innov_sum2 = 0;
+   axis->nis_sum = 0;
+}
+
+/*
+ * Configure a predictor axis from arguments of the form
+ *    OFF | ALPHABETA <alpha> <beta> | KALMAN <q> <r>
+ * as found in the guider configuration file or in a PREDICT command.
+ */
+static PASSFAIL
+predictConfigure(predict_axis_t *axis, int argc, char **argv)
+{
+   double a, b;
+
+   if (argc == 1 && !strcasecmp(argv[0], "OFF")) {
+      axis->mode = PREDICT_OFF;
+      predictReset(axis);
+      return PASS;
+   }
+
+   if (argc != 3 || !isFloat(argv[1]) || !isFloat(argv[2])) {
+      return FAIL;
+   }
+   a = atof(argv[1]);
+   b = atof(argv[2]);
+
+   if (!strcasecmp(argv[0], "ALPHABETA")) {
+      /* Stability region of the alpha-beta filter */
+      if (a <= 0 || a > 1 || b <= 0 || b >= 4 - 2 * a) {
+	 return FAIL;
+      }
+      axis->mode = PREDICT_ALPHABETA;
+      axis->alpha = a;
+      axis->beta = b;
+   }
+   else if (!strcasecmp(argv[0], "KALMAN")) {
+      if (a <= 0 || b <= 0) {
+	 return FAIL;
+      }
+      axis->mode = PREDICT_KALMAN;
+      axis->q = a;
+      axis->r = b;
+   }
+   else {
+      return FAIL;
+   }
+
+   predictReset(axis);
+   return PASS;
+}
+
+/*
+ * Absorb a new offset measurement z (arcsec) taken dt seconds after the
+ * previous one and return the offset expected lead seconds from now, once
+ * the correction will actually be applied by the ISU.  With the predictor
+ * off the measurement is returned untouched.
+ */
+static double
+predictUpdate(predict_axis_t *axis, double z, double dt, double lead)
+{
+   double pol;
+   double innov;
+
+   if (axis->mode == PREDICT_OFF) {
+      return z;
+   }
+
+   /* Position the star would have if no correction had been applied */
+   pol = z + axis->applied;
+
+   if (axis->primed == FALSE || dt <= 0) {
+      axis->x = pol;
+      axis->v = 0;
+      axis->p[0][0] = axis->r;
+      axis->p[0][1] = 0;
+      axis->p[1][0] = 0;
+      axis->p[1][1] = axis->r / (dt > 0 ? dt * dt : 1.0);
+      axis->primed = TRUE;
+      return z;
+   }
+
+   if (axis->mode == PREDICT_ALPHABETA) {
+      axis->x += axis->v * dt;
+      innov = pol - axis->x;
+      axis->x += axis->alpha * innov;
+      axis->v += (axis->beta / dt) * innov;
+   }
+   else {
+      double p00, p01, p11, s, k0, k1;
+
+      /* Constant velocity model driven by white acceleration noise */
+      axis->x += axis->v * dt;
+      p00 = axis->p[0][0] + dt * (axis->p[0][1] + axis->p[1][0]) +
+	 dt * dt * axis->p[1][1] + axis->q * dt * dt * dt / 3.0;
+      p01 = axis->p[0][1] + dt * axis->p[1][1] + axis->q * dt * dt / 2.0;
+      p11 = axis->p[1][1] + axis->q * dt;
+
+      innov = pol - axis->x;
+      s = p00 + axis->r;
+      k0 = p00 / s;
+      k1 = p01 / s;
+      axis->x += k0 * innov;
+      axis->v += k1 * innov;
+
+      axis->p[0][0] = (1 - k0) * p00;
+      axis->p[0][1] = (1 - k0) * p01;
+      axis->p[1][0] = axis->p[0][1];
+      axis->p[1][1] = p11 - k1 * p01;
+
+      axis->nis_sum += innov * innov / s;
+   }
+
+   axis->n++;
+   axis->innov_sum += innov;
+   axis->innov_sum2 += innov * innov;
+
+   return axis->x + axis->v * lead - axis->applied;
+}
+
+/*
+ * Record the correction (arcsec) that was sent to the ISU for an axis
+ */
+static void
+predictCommit(predict_axis_t *axis, double correction)
+{
+   if (axis->mode != PREDICT_OFF) {
+      axis->applied += correction;
+   }
+}
+
+/*
+ * Format the configuration and innovation statistics of a predictor axis
+ */
+static void
+predictFormat(char *buf, size_t size, const predict_axis_t *axis)
+{
+   double mean = 0, rms = 0, nis = 0;
+
+   if (axis->n > 0) {
+      mean = axis->innov_sum / axis->n;
+      rms = sqrt(axis->innov_sum2 / axis->n);
+      nis = axis->nis_sum / axis->n;
+   }
+
+   switch (axis->mode) {
+      case PREDICT_ALPHABETA:
+	 snprintf(buf, size, "ALPHABETA %.3f %.3f N=%ld MEAN=%.4f RMS=%.4f",
+	       axis->alpha, axis->beta, axis->n, mean, rms);
+	 break;
+      case PREDICT_KALMAN:
+	 snprintf(buf, size, "KALMAN %g %g N=%ld MEAN=%.4f RMS=%.4f NIS=%.2f",
+	       axis->q, axis->r, axis->n, mean, rms, nis);
+	 break;
+      default:
+	 snprintf(buf, size, "OFF");
+	 break;
+   }
+}
+
+/*
+ * Clear the co-add, keeping its depth
+ */
+static void
+coaddReset(coadd_t *co)
+{
+   co->count = 0;
+   co->next = 0;
+   co->added = 0;
+   co->measured = 0;
+   co->shift_sum_x = 0;
+   co->shift_sum_y = 0;
+   memset(co->sum, 0, sizeof(co->sum));
+}
+
+/*
+ * Add a frame to, or subtract it from, the co-add accumulator
+ */
+static void
+coaddAccumulate(uint32_t *sum, const uint16_t *frame, int n, BOOLEAN add)
+{
+   int i = 0;
+
+#ifdef __SSE2__
+   const __m128i zero = _mm_setzero_si128();
+
+   /* Eight pixels at a time, widened to 32 bits */
+   for (; i + 8 <= n; i += 8) {
+      __m128i f = _mm_load_si128((const __m128i *)(frame + i));
+      __m128i lo = _mm_unpacklo_epi16(f, zero);
+      __m128i hi = _mm_unpackhi_epi16(f, zero);
+      __m128i s0 = _mm_load_si128((const __m128i *)(sum + i));
+      __m128i s1 = _mm_load_si128((const __m128i *)(sum + i + 4));
+
+      if (add) {
+	 s0 = _mm_add_epi32(s0, lo);
+	 s1 = _mm_add_epi32(s1, hi);
+      }
+      else {
+	 s0 = _mm_sub_epi32(s0, lo);
+	 s1 = _mm_sub_epi32(s1, hi);
+      }
+      _mm_store_si128((__m128i *)(sum + i), s0);
+      _mm_store_si128((__m128i *)(sum + i + 4), s1);
+   }
+#endif // __SSE2__
+   for (; i < n; i++) {
+      if (add) sum[i] += frame[i];
+      else sum[i] -= frame[i];
+   }
+}
+
+/*
+ * Register a guide raster frame by shifting it by the whole pixel offset
+ * dx,dy of the star from the null position, and add it to the co-add.  The
+ * oldest frame is subtracted once the co-add is full.  Pixels shifted in
+ * from outside the raster repeat the edge.
+ */
+static void
+coaddAdd(coadd_t *co, const unsigned short *image, int dx, int dy)
+{
+   uint16_t *slot;
+   int x, y, sx, sy;
+
+   if (co->depth <= 0) return;
+
+   slot = co->ring[co->next];
+   if (co->count == co->depth) {
+      coaddAccumulate(co->sum, slot, GUIDE_SIZE_X * GUIDE_SIZE_Y, FALSE);
+      co->shift_sum_x -= co->shift_x[co->next];
+      co->shift_sum_y -= co->shift_y[co->next];
+   }
+   else {
+      co->count++;
+   }
+
+   for (y = 0; y < GUIDE_SIZE_Y; y++) {
+      sy = y + dy;
+      if (sy < 0) sy = 0;
+      if (sy > GUIDE_SIZE_Y - 1) sy = GUIDE_SIZE_Y - 1;
+      for (x = 0; x < GUIDE_SIZE_X; x++) {
+	 sx = x + dx;
+	 if (sx < 0) sx = 0;
+	 if (sx > GUIDE_SIZE_X - 1) sx = GUIDE_SIZE_X - 1;
+	 slot[y * GUIDE_SIZE_X + x] = image[sy * GUIDE_SIZE_X + sx];
+      }
+   }
+   coaddAccumulate(co->sum, slot, GUIDE_SIZE_X * GUIDE_SIZE_Y, TRUE);
+   co->shift_x[co->next] = dx;
+   co->shift_y[co->next] = dy;
+   co->shift_sum_x += dx;
+   co->shift_sum_y += dy;
+   co->next = (co->next + 1) % co->depth;
+   co->added++;
+}
+
+/*
+ * Mean of the co-added frames, and the mean shift that was removed by the
+ * registration
+ */
+static void
+coaddMean(const coadd_t *co, unsigned short *image, double *shift_x,
+      double *shift_y)
+{
+   int i;
+
+   for (i = 0; i < GUIDE_SIZE_X * GUIDE_SIZE_Y; i++) {
+      image[i] = (co->sum[i] + co->count / 2) / co->count;
+   }
+   *shift_x = (double)co->shift_sum_x / co->count;
+   *shift_y = (double)co->shift_sum_y / co->count;
+}
+
+/*
+ * Change the number of frames in the co-add, 0 to disable it
+ */
+static PASSFAIL
+coaddConfigure(coadd_t *co, int depth)
+{
+   if (depth < 0 || depth > COADD_MAX_FRAMES) return FAIL;
+   co->depth = depth;
+   coaddReset(co);
+   return PASS;
+}
+
+/* 
+ * Advance past leading whitespace in a string 
+ */
+   char *
+ltrim(char *str) 
+{
+
+   char *p;
+
+   if (str == NULL) 
+      return NULL;
+
+   for (p = str; (*p && isspace(*p)); p++)
+      ;
+
+   return p;
+}
+
+/* 
+ * Trim off trailing whitespace in a string 
+ */
+   char *
+rtrim(char *str) 
+{
+
+   int i;
+
+   if (str != NULL) {
+      for (i = strlen(str) - 1; (i >= 0 && isspace(str[i])); i--)
+	 ;
+      str[++i] = '\0';
+   }   
+
+   return str;
+}
+
+
+/* 
+ * Trim off all leading and trailing whitespace from a string 
+ */
+   char *
+trim(char *str) 
+{
+
+   return rtrim(ltrim(str));
+}
+
+
+/*
+ * Deallocate a client object
+ */
+   static void 
+deallocateClient(void *data) 
+{
+   client_info_t *cinfo = (client_info_t *)data;
+
+   if (data == NULL) {
+      return;
+   }
+
+   if (cinfo->hostname != NULL) {
+      free(cinfo->hostname);
+   }
+   free(cinfo);
+}
+
+
+/*
+ * Callback function used to compare two pointers.  This function is 
+ * used within the list comparison utilities.
+ */
+   static int
+comparePointer(const void *a, const void *b)
+{
+   if (a < b)
+      return -1;
+   else if (a > b)
+      return 1;
+   else
+      return 0;
+}
+
+
+/*
+ * Raptor OWL serial protocol.  A command is a few bytes followed by ETX
+ * and the XOR checksum of all the bytes before it.  Once the checksum and
+ * ACK modes are enabled by checkCameraStatus, the camera answers with the
+ * data requested, if any, then ACK and the checksum of the command.
+ */
+#define OWL_ETX 0x50
+#define OWL_ACK 0x50
+#define OWL_CMD_MAX 12               /* bytes of a command before ETX */
+#define OWL_ANY_REPLY (-1)           /* reply not checked */
+
+#define OWL_GET_STATUS 0x49
+#define OWL_SET_STATUS 0x4f
+#define OWL_STATUS_ACK_CHECKSUM 0x53 /* checksum and ACK modes enabled */
+
+/* Registers of the camera, multi byte values most significant first */
+#define OWL_REG_FPGA_CTRL 0x00
+#define OWL_FPGA_TEC_ON 0x81
+#define OWL_REG_AUTO_LEVEL 0x23
+#define OWL_REG_TEMP 0x6e            /* 2 bytes, sensor temperature ADC */
+#define OWL_REG_DIGITAL_GAIN 0xc6    /* 2 bytes, gain * 256 */
+#define OWL_REG_FRAME_RATE 0xdd      /* 4 bytes, period in 40 MHz counts */
+#define OWL_REG_EXPOSURE 0xee        /* 4 bytes, 40 MHz counts */
+#define OWL_REG_GAIN_MODE 0xf2
+#define OWL_GAIN_MODE_LOW 0x00
+#define OWL_GAIN_MODE_HIGH 0x06
+#define OWL_REG_NUC 0xf9
+#define OWL_NUC_OFF 0x01
+#define OWL_REG_TEC_SETPOINT_LSB 0xfa
+#define OWL_REG_TEC_SETPOINT_MSB 0xfb
+
+/* Manufacturing data: 16 bits little endian calibration points */
+#define OWL_MFG_SIZE 0x12
+#define OWL_MFG_ADC_0C 10
+#define OWL_MFG_ADC_40C 12
+#define OWL_MFG_DAC_0C 14
+#define OWL_MFG_DAC_40C 16
+
+/*
+ * Temperature calibration of the camera: ADC and DAC counts at 0 and 40 C
+ */
+typedef struct {
+   BOOLEAN valid;
+   unsigned int adc0;
+   unsigned int adc40;
+   unsigned int dac0;
+   unsigned int dac40;
+} owl_calib_t;
+
+/*
+ * The calibration is read once from the camera when it is connected, and
+ * saved in calib_file if set so that it is still known when the EEPROM
+ * can not be read
+ */
+static owl_calib_t owl_calib;
+static char calib_file[PATH_MAX];
+
+
+#ifdef SIM_CAMERA
+/*
+ * Emulator of the serial interface of the OWL 640, used in place of the
+ * camera link serial channel when SIM_CAMERA is defined.  It keeps the
+ * register map and the manufacturing data, checks the checksums, and
+ * answers as the camera does once the checksum and ACK modes are set by
+ * the status command.  A reply is available after the turnaround latency
+ * plus the time to send the command and the reply at the baud rate.  The
+ * sensor temperature settles toward the TEC set point while the TEC is
+ * on.  The serial session holds the line, so the emulator needs no lock.
+ */
+#define SIM_CAMERA_LATENCY 1.0       /* ms, default turnaround */
+#define SIM_CAMERA_AMBIENT 20.0      /* C, sensor with the TEC off */
+#define SIM_CAMERA_TEC_TAU 30.0      /* s, sensor time constant */
+
+#define OWL_STATUS_CHECKSUM 0x40     /* status bits */
+#define OWL_STATUS_ACK 0x10
+#define OWL_STATUS_FPGA_BOOTED 0x04
+#define OWL_ERR_CHECKSUM 0x52        /* sent in place of ACK */
+#define OWL_ERR_UNKNOWN_CMD 0x54
+
+typedef struct {
+   u_char regs[256];
+   u_char mfg[OWL_MFG_SIZE];
+   u_char status;
+   u_char addr;                 /* register selected for reading */
+   u_char out[SERBUFSIZE];      /* reply not read yet */
+   int nout;
+   struct timeval ready;        /* when the whole reply arrived */
+   double latency;              /* ms */
+   int baud;
+   double temp;                 /* sensor, C */
+   struct timeval temp_time;
+   long commands;
+   long errors;                 /* bad checksums and unknown commands */
+} owl_sim_t;
+
+static owl_sim_t owl_sim = {
+   .latency = SIM_CAMERA_LATENCY,
+   .baud = BAUD,
+   .temp = SIM_CAMERA_AMBIENT,
+   .mfg = {
+      0x34, 0x12,               /* serial number */
+      0x0f, 0x06, 0x0f,         /* build date */
+      'S', 'I', 'M', 0, 0,      /* build code */
+      0xf0, 0x05,               /* ADC at 0 C: 1520 */
+      0xe6, 0x0a,               /* ADC at 40 C: 2790 */
+      0xe8, 0x03,               /* DAC at 0 C: 1000 */
+      0xb8, 0x0b                /* DAC at 40 C: 3000 */
+   }
+};
+
+static unsigned int
+owlSimMfg(const owl_sim_t *sim, int offset)
+{
+   return sim->mfg[offset] | sim->mfg[offset + 1] << 8;
+}
+
+/*
+ * Update the sensor temperature and its ADC registers
+ */
+static void
+owlSimTemperature(owl_sim_t *sim)
+{
+   unsigned int adc0 = owlSimMfg(sim, OWL_MFG_ADC_0C);
+   unsigned int adc40 = owlSimMfg(sim, OWL_MFG_ADC_40C);
+   unsigned int dac0 = owlSimMfg(sim, OWL_MFG_DAC_0C);
+   unsigned int dac40 = owlSimMfg(sim, OWL_MFG_DAC_40C);
+   unsigned int dac, adc;
+   struct timeval now;
+   double target, dt;
+
+   gettimeofday(&now, NULL);
+   if (sim->temp_time.tv_sec == 0) sim->temp_time = now;
+   dt = (now.tv_sec - sim->temp_time.tv_sec) +
+      (now.tv_usec - sim->temp_time.tv_usec) * 1e-6;
+   sim->temp_time = now;
+
+   target = SIM_CAMERA_AMBIENT;
+   if (sim->regs[OWL_REG_FPGA_CTRL] & OWL_FPGA_TEC_ON) {
+      dac = sim->regs[OWL_REG_TEC_SETPOINT_MSB] << 8 |
+	 sim->regs[OWL_REG_TEC_SETPOINT_LSB];
+      target = ((double)dac - dac0) * 40.0 / ((double)dac40 - dac0);
+   }
+   sim->temp = target + (sim->temp - target) * exp(-dt / SIM_CAMERA_TEC_TAU);
+
+   adc = (unsigned int)(adc0 + sim->temp * ((double)adc40 - adc0) / 40.0);
+   sim->regs[OWL_REG_TEMP] = adc >> 8;
+   sim->regs[OWL_REG_TEMP + 1] = adc & 0xff;
+}
+
+/*
+ * Receive a command and prepare its reply
+ */
+static int
+owlSimWrite(owl_sim_t *sim, const u_char *cmd, int n)
+{
+   u_char checksum = 0;
+   double ms;
+   int i, ok = TRUE;
+
+   sim->commands++;
+   sim->nout = 0;
+   for (i = 0; i < n - 1; i++) checksum ^= cmd[i];
+   if (n < 3 || cmd[n - 2] != OWL_ETX ||
+       ((sim->status & OWL_STATUS_CHECKSUM) && cmd[n - 1] != checksum)) {
+      sim->errors++;
+      if (sim->status & OWL_STATUS_ACK) {
+	 sim->out[sim->nout++] = OWL_ERR_CHECKSUM;
+	 sim->out[sim->nout++] = cmd[n - 1];
+      }
+      ok = FALSE;
+   }
+   n -= 2;
+
+   if (ok == FALSE) {
+      /* Rejected */
+   }
+   else if (n == 1 && cmd[0] == OWL_GET_STATUS) {
+      sim->out[sim->nout++] = sim->status | OWL_STATUS_FPGA_BOOTED;
+   }
+   else if (n == 2 && cmd[0] == OWL_SET_STATUS) {
+      sim->status = cmd[1];
+   }
+   else if (n == 5 && cmd[0] == 0x53 && cmd[1] == 0xe0 && cmd[2] == 0x02) {
+      sim->regs[cmd[3]] = cmd[4];
+   }
+   else if (n == 4 && cmd[0] == 0x53 && cmd[1] == 0xe0 && cmd[2] == 0x01) {
+      sim->addr = cmd[3];
+   }
+   else if (n == 3 && cmd[0] == 0x53 && cmd[1] == 0xe1 && cmd[2] == 0x01) {
+      if (sim->addr == OWL_REG_TEMP) owlSimTemperature(sim);
+      sim->out[sim->nout++] = sim->regs[sim->addr];
+   }
+   else if (n == 8 && cmd[0] == 0x53 && cmd[1] == 0xae) {
+      /* EEPROM address of the manufacturing data */
+   }
+   else if (n == 3 && cmd[0] == 0x53 && cmd[1] == 0xaf &&
+	    cmd[2] <= OWL_MFG_SIZE) {
+      memcpy(sim->out, sim->mfg, cmd[2]);
+      sim->nout = cmd[2];
+   }
+   else {
+      sim->errors++;
+      ok = FALSE;
+      if (sim->status & OWL_STATUS_ACK) {
+	 sim->out[sim->nout++] = OWL_ERR_UNKNOWN_CMD;
+	 sim->out[sim->nout++] = cmd[n + 1];
+      }
+   }
+   if (ok == TRUE && (sim->status & OWL_STATUS_ACK)) {
+      sim->out[sim->nout++] = OWL_ACK;
+      sim->out[sim->nout++] = cmd[n + 1];
+   }
+
+   /* 10 bits per byte on the line */
+   ms = sim->latency + (n + 2 + sim->nout) * 10e3 / sim->baud;
+   gettimeofday(&sim->ready, NULL);
+   sim->ready.tv_usec += (long)(ms * 1e3);
+   sim->ready.tv_sec += sim->ready.tv_usec / 1000000;
+   sim->ready.tv_usec %= 1000000;
+   return 0;
+}
+
+/*
+ * Wait at most ms for the reply, which arrives all at once.  Returns the
+ * bytes available.
+ */
+static int
+owlSimWait(owl_sim_t *sim, int ms, int n)
+{
+   struct timeval now;
+   long us;
+
+   if (sim->nout == 0) return 0;
+   gettimeofday(&now, NULL);
+   us = (sim->ready.tv_sec - now.tv_sec) * 1000000L +
+      (sim->ready.tv_usec - now.tv_usec);
+   if (us > ms * 1000L) {
+      usleep(ms * 1000L);
+      return 0;
+   }
+   if (us > 0) usleep(us);
+   return sim->nout;
+}
+
+static int
+owlSimRead(owl_sim_t *sim, char *buf, int n)
+{
+   if (owlSimWait(sim, 0, n) == 0) return 0;
+   if (n > sim->nout) n = sim->nout;
+   memcpy(buf, sim->out, n);
+   memmove(sim->out, sim->out + n, sim->nout - n);
+   sim->nout -= n;
+   return n;
+}
+#endif //SIM_CAMERA
+
+
+/*
+ * Serial session with the camera.  The channel is configured once for a
+ * given EDT handle and only flushed again after an error, when the replies
+ * may be out of step with the commands.  The latency of the transactions
+ * is kept per operation and register; a read is accounted to the register
+ * selected before it.  The line is held for each command, and by the
+ * register helpers across the commands of a register access, so it is a
+ * recursive mutex.
+ */
+#define SERIAL_STATS_MAX 32
+
+typedef enum {
+   SERIAL_OP_STATUS, SERIAL_OP_SELECT, SERIAL_OP_READ, SERIAL_OP_WRITE,
+   SERIAL_OP_EEPROM, SERIAL_OP_OTHER
+} serial_op_t;
+
+static const char *serial_op_name[] = {
+   "STATUS", "SELECT", "READ", "WRITE", "EEPROM", "CMD"
+};
+
+typedef struct {
+   serial_op_t op;
+   int addr;                    /* register, -1 if none, first bytes if
+				   SERIAL_OP_OTHER */
+   long count;
+   long errors;
+   double total;                /* ms */
+   double max;
+} serial_stat_t;
+
+typedef struct {
+   pthread_mutex_t line;        /* held for a whole transaction, recursive */
+   pthread_mutex_t lock;        /* statistics, read by the main loop */
+   EdtDev *pdv;                 /* handle the channel is configured for */
+   BOOLEAN desync;              /* flush the channel before next command */
+   int timeout;                 /* ms, idle window of unknown replies */
+   long commands;
+   long errors;
+   long resyncs;
+   int selected;                /* register of the last select */
+   int nstats;
+   serial_stat_t stats[SERIAL_STATS_MAX];
+} serial_session_t;
+
+static serial_session_t serial_session = {
+   .line = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP,
+   .lock = PTHREAD_MUTEX_INITIALIZER,
+   .selected = -1
+};
+
+/*
+ * Account for a transaction of ncmd bytes that took ms
+ */
+static void
+serialRecord(serial_session_t *s, const u_char *cmd, int ncmd, double ms,
+	     BOOLEAN ok)
+{
+   serial_stat_t *st = NULL;
+   serial_op_t op = SERIAL_OP_OTHER;
+   int addr = -1;
+   int i;
+
+   if (ok == FALSE) s->desync = TRUE;
+
+   pthread_mutex_lock(&s->lock);
+   if (cmd[0] == OWL_GET_STATUS || cmd[0] == OWL_SET_STATUS) {
+      op = SERIAL_OP_STATUS;
+   }
+   else if (ncmd >= 4 && cmd[0] == 0x53 && cmd[1] == 0xe0) {
+      op = cmd[2] == 0x01 ? SERIAL_OP_SELECT : SERIAL_OP_WRITE;
+      addr = cmd[3];
+      if (op == SERIAL_OP_SELECT) s->selected = addr;
+   }
+   else if (ncmd >= 2 && cmd[0] == 0x53 && cmd[1] == 0xe1) {
+      op = SERIAL_OP_READ;
+      addr = s->selected;
+   }
+   else if (ncmd >= 2 && cmd[0] == 0x53 &&
+	    (cmd[1] == 0xae || cmd[1] == 0xaf)) {
+      op = SERIAL_OP_EEPROM;
+   }
+   else {
+      addr = ncmd >= 2 ? cmd[0] << 8 | cmd[1] : cmd[0] << 8;
+   }
+
+   s->commands++;
+   if (ok == FALSE) s->errors++;
+   for (i = 0; i < s->nstats; i++) {
+      if (s->stats[i].op == op && s->stats[i].addr == addr) {
+	 st = &s->stats[i];
+	 break;
+      }
+   }
+   if (st == NULL && s->nstats < SERIAL_STATS_MAX) {
+      st = &s->stats[s->nstats++];
+      memset(st, 0, sizeof(*st));
+      st->op = op;
+      st->addr = addr;
+   }
+   if (st != NULL) {
+      st->count++;
+      if (ok == FALSE) st->errors++;
+      st->total += ms;
+      if (ms > st->max) st->max = ms;
+   }
+   pthread_mutex_unlock(&s->lock);
+}
+
+static void
+serialStatsReset(serial_session_t *s)
+{
+   pthread_mutex_lock(&s->lock);
+   s->commands = s->errors = s->resyncs = 0;
+   s->nstats = 0;
+   pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * Byte level access to the serial channel of the camera, or to the
+ * emulator
+ */
+static int
+serialWrite(const u_char *cmd, int n)
+{
+#ifdef SIM_CAMERA
+   return owlSimWrite(&owl_sim, cmd, n);
+#else
+   /*
+    * using pdv_serial_binary_command instead of
+    * pdv_serial_write because it prepends a 'c' if FOI
+    */
+   return pdv_serial_binary_command(serv_info->pdv_p, (char *)cmd, n);
+#endif
+}
+
+static int
+serialWait(int ms, int n)
+{
+#ifdef SIM_CAMERA
+   return owlSimWait(&owl_sim, ms, n);
+#else
+   return pdv_serial_wait(serv_info->pdv_p, ms, n);
+#endif
+}
+
+static int
+serialRead(char *buf, int n)
+{
+#ifdef SIM_CAMERA
+   return owlSimRead(&owl_sim, buf, n);
+#else
+   return pdv_serial_read(serv_info->pdv_p, buf, n);
+#endif
+}
+
+/*
+ * Make the session ready for a command: open the channel if needed,
+ * configure it when the handle changed and flush it after an error
+ */
+static PASSFAIL
+serialSessionSync(serial_session_t *s)
+{
+   char buf[SERBUFSIZE+1];
+
+#ifdef SIM_CAMERA
+   s->timeout = SERIALTIMEOUT;
+#else
+   /* 
+    * open a handle to the device     
+    */
+   if (serv_info->pdv_p == NULL) {
+      if ((serv_info->pdv_p = pdv_open_channel(EDT_INTERFACE, 
+		  UNIT, CHANNEL)) == NULL) {
+	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	       "(%s:%d) pdv_open_channel request failed",
+	       __FILE__, __LINE__);
+	 return FAIL;
+      }
+   }
+
+   if (s->pdv != serv_info->pdv_p) {
+      /*
+       * Enable reading across the serial interface
+       */
+      pdv_serial_read_enable(serv_info->pdv_p);
+
+      /*
+       * Get the timeout value from EDT card configuration if it is too
+       * short
+       */
+      s->timeout = SERIALTIMEOUT;
+      if (s->timeout < 1) {
+	 s->timeout = serv_info->pdv_p->dd_p->serial_timeout;
+      }
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	    "(%s:%d) serial timeout value = %d",
+	    __FILE__, __LINE__, s->timeout);
+
+      /*
+       * Set the baud rate for the serial channel
+       */
+      pdv_set_baud(serv_info->pdv_p, BAUD);
+      s->pdv = serv_info->pdv_p;
+      s->desync = TRUE;
+   }
+#endif //SIM_CAMERA
+
+   if (s->desync == TRUE) {
+      /* 
+       * Flush any junk on the interface 
+       */
+      (void)serialRead(buf, SERBUFSIZE);
+      s->desync = FALSE;
+      pthread_mutex_lock(&s->lock);
+      s->resyncs++;
+      pthread_mutex_unlock(&s->lock);
+   }
+   return PASS;
+}
+
+/*
+ * Close the camera channel between two serial transactions
+ */
+static void
+serialChannelClose(serial_session_t *s)
+{
+   pthread_mutex_lock(&s->line);
+   pdv_close(serv_info->pdv_p);
+   serv_info->pdv_p = NULL;
+   pthread_mutex_unlock(&s->line);
+}
+
+/*
+ * Perform a write across the serial channel and read back the response.
+ * When the length of the response is known, expect bytes are read and
+ * the function returns as soon as they arrived, or fails if they did not
+ * within SERIAL_REPLY_TIMEOUT.  Otherwise the response is read, up to
+ * SERBUFSIZE bytes, until the channel stays idle.
+ */
+static PASSFAIL
+pdvSerialWriteRead(serial_session_t *s, const u_char *cmd, int ncmd,
+      u_char *reply, int expect, int *nreply)
+{
+   int ret, left;
+   char buf[SERBUFSIZE+1];
+   u_char lastbyte;
+   struct timeval start, now;
+
+   *nreply = 0;
+   if (serialSessionSync(s) != PASS) return FAIL;
+
+   if (serialWrite(cmd, ncmd) != 0) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	    "(%s:%d) can not send serial binary "
+	    "command to camera", __FILE__, __LINE__);
+      s->pdv = NULL;
+      return FAIL;
+   }
+
+   /*
+    * Read the known length response as it arrives
+    */
+   if (expect > 0) {
+      if (expect > SERBUFSIZE) expect = SERBUFSIZE;
+      gettimeofday(&start, NULL);
+      while (*nreply < expect) {
+	 gettimeofday(&now, NULL);
+	 left = SERIAL_REPLY_TIMEOUT - ((now.tv_sec - start.tv_sec) * 1000 +
+	       (now.tv_usec - start.tv_usec) / 1000);
+	 if (left <= 0 || serialWait(left, expect - *nreply) <= 0) {
+	    break;
+	 }
+	 ret = serialRead(buf, expect - *nreply);
+	 if (ret > 0) {
+	    memcpy(reply + *nreply, buf, ret);
+	    *nreply += ret;
+	 }
+      }
+      if (*nreply < expect) {
+	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	       "(%s:%d) serial reply timeout: %d bytes of %d received",
+	       __FILE__, __LINE__, *nreply, expect);
+	 return FAIL;
+      }
+      return PASS;
+   }
+
+   /*
+    * serial_timeout comes from the config file (or -t override flag in
+    * this app), or if not present defaults to 500 unless readonly
+    * defaults to 60000
+    */
+   serialWait(s->timeout, 64);
+
+   /*
+    * Handle the response
+    */
+   lastbyte = 0;
+   do {
+      ret = serialRead(buf, SERBUFSIZE);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	    "(%s:%d) read returned %d",
+	    __FILE__, __LINE__, ret);
+
+      if (ret > SERBUFSIZE - *nreply) ret = SERBUFSIZE - *nreply;
+      if (ret > 0) {
+	 lastbyte = (u_char)buf[ret - 1];
+	 memcpy(reply + *nreply, buf, ret);
+	 *nreply += ret;
+      }
+
+#ifdef SIM_CAMERA
+      (void)lastbyte;
+      ret = serialWait(500, 64);
+#else
+      u_char waitc;
+
+      if (serv_info->pdv_p->devid == PDVFOI_ID) {
+	 ret = pdv_serial_wait(serv_info->pdv_p, 500, 0);
+      } else if (pdv_get_waitchar(serv_info->pdv_p, &waitc) && 
+	    (lastbyte == waitc)) {
+	 ret = 0; /* jump out if waitchar is enabled/received */
+      }
+      else {
+	 ret = pdv_serial_wait(serv_info->pdv_p, 500, 64);
+      }
+#endif //SIM_CAMERA
+
+   } while (ret > 0);
+
+   return PASS;
+}
+
+
+/*
+ * Frame a command with ETX and its checksum, send it and check the reply
+ */
+static PASSFAIL
+owlTransact(serial_session_t *s, const u_char *cmd, int ncmd, u_char *data,
+      int ndata)
+{
+   u_char frame[OWL_CMD_MAX + 2];
+   u_char reply[SERBUFSIZE];
+   u_char checksum = 0;
+   int i, nreply;
+
+   if (ncmd > OWL_CMD_MAX) return FAIL;
+   for (i = 0; i < ncmd; i++) {
+      frame[i] = cmd[i];
+      checksum ^= cmd[i];
+   }
+   frame[ncmd] = OWL_ETX;
+   frame[ncmd + 1] = checksum ^ OWL_ETX;
+
+   if (pdvSerialWriteRead(s, frame, ncmd + 2, reply,
+	    ndata == OWL_ANY_REPLY ? 0 : ndata + 2, &nreply) != PASS) {
+      return FAIL;
+   }
+   if (ndata == OWL_ANY_REPLY) return PASS;
+
+   if (nreply != ndata + 2 || reply[ndata] != OWL_ACK ||
+       reply[ndata + 1] != frame[ncmd + 1]) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	    "(%s:%d) %s: bad reply to command %02x %02x: %d bytes instead"
+	    " of %d, ack %02x, checksum %02x instead of %02x",
+	    __FILE__, __LINE__, __FUNCTION__, cmd[0], ncmd > 1 ? cmd[1] : 0,
+	    nreply, ndata + 2, nreply > ndata ? reply[ndata] : 0,
+	    nreply > ndata + 1 ? reply[ndata + 1] : 0, frame[ncmd + 1]);
+      return FAIL;
+   }
+   if (ndata > 0) memcpy(data, reply, ndata);
+   return PASS;
+}
+
+
+/*
+ * Send a command to the camera and check its reply: ndata bytes of data,
+ * copied to data, then ACK and the checksum of the command.  The reply is
+ * not checked if ndata is OWL_ANY_REPLY.  A failed command has the serial
+ * session flushed before the next one.
+ */
+static PASSFAIL
+owlCommand(const u_char *cmd, int ncmd, u_char *data, int ndata)
+{
+   struct timeval start, end;
+   PASSFAIL status;
+
+   pthread_mutex_lock(&serial_session.line);
+   gettimeofday(&start, NULL);
+   status = owlTransact(&serial_session, cmd, ncmd, data, ndata);
+   gettimeofday(&end, NULL);
+   serialRecord(&serial_session, cmd, ncmd, (end.tv_sec - start.tv_sec) * 1e3 +
+	 (end.tv_usec - start.tv_usec) * 1e-3, status == PASS ? TRUE : FALSE);
+   pthread_mutex_unlock(&serial_session.line);
+   return status;
+}
+
+
+/*
+ * Write n bytes to the consecutive registers starting at addr.  The line
+ * is held across the commands, like in the other register helpers, so
+ * that the commands of another thread do not come in between.
+ */
+static PASSFAIL
+regWrite(u_char addr, const u_char *bytes, int n)
+{
+   u_char cmd[5] = { 0x53, 0xe0, 0x02, 0x00, 0x00 };
+   PASSFAIL status = PASS;
+   int i;
+
+   pthread_mutex_lock(&serial_session.line);
+   for (i = 0; i < n && status == PASS; i++) {
+      cmd[3] = addr + i;
+      cmd[4] = bytes[i];
+      if ((status = owlCommand(cmd, sizeof(cmd), NULL, 0)) != PASS) {
+	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	       "(%s:%d) unable to write camera register 0x%02x",
+	       __FILE__, __LINE__, cmd[3]);
+      }
+   }
+   pthread_mutex_unlock(&serial_session.line);
+   return status;
+}
+
+
+/*
+ * Read n bytes from the consecutive registers starting at addr.  Each
+ * byte is a select and a read, which no other command may separate.
+ */
+static PASSFAIL
+regRead(u_char addr, u_char *bytes, int n)
+{
+   u_char select[4] = { 0x53, 0xe0, 0x01, 0x00 };
+   static const u_char read[3] = { 0x53, 0xe1, 0x01 };
+   PASSFAIL status = PASS;
+   int i;
+
+   pthread_mutex_lock(&serial_session.line);
+   for (i = 0; i < n && status == PASS; i++) {
+      select[3] = addr + i;
+      if (owlCommand(select, sizeof(select), NULL, 0) != PASS ||
+	  owlCommand(read, sizeof(read), &bytes[i], 1) != PASS) {
+	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	       "(%s:%d) unable to read camera register 0x%02x",
+	       __FILE__, __LINE__, select[3]);
+	 status = FAIL;
+      }
+   }
+   pthread_mutex_unlock(&serial_session.line);
+   return status;
+}
+
+
+/*
+ * Write a value of n bytes, most significant first
+ */
+static PASSFAIL
+regWriteValue(u_char addr, int n, unsigned long value)
+{
+   u_char bytes[4];
+   int i;
+
+   for (i = n - 1; i >= 0; i--) {
+      bytes[i] = value & 0xff;
+      value >>= 8;
+   }
+   return regWrite(addr, bytes, n);
+}
+
+
+/*
+ * Read a value of n bytes, most significant first
+ */
+static PASSFAIL
+regReadValue(u_char addr, int n, unsigned long *value)
+{
+   u_char bytes[4];
+   int i;
+
+   if (regRead(addr, bytes, n) != PASS) return FAIL;
+   *value = 0;
+   for (i = 0; i < n; i++) *value = (*value << 8) | bytes[i];
+   return PASS;
+}
+
+
+/*
+ * Change a value of n bytes, most significant first in the registers.
+ * The camera uses each byte as soon as it is written, so the values it
+ * runs with meanwhile depend on the order of the writes.  Written most
+ * significant first when the value grows and least significant first
+ * when it shrinks, they never go below the smaller of the old and new
+ * values; in the opposite order they never go above the larger one.
+ * floor selects the first bound.  Only the bytes that differ are written.
+ */
+static PASSFAIL
+regChangeValue(u_char addr, int n, unsigned long value, BOOLEAN floor)
+{
+   unsigned long old, v;
+   u_char was[4], bytes[4];
+   BOOLEAN msb_first;
+   PASSFAIL status = PASS;
+   int i, k;
+
+   pthread_mutex_lock(&serial_session.line);
+   if (regReadValue(addr, n, &old) != PASS) {
+      pthread_mutex_unlock(&serial_session.line);
+      return FAIL;
+   }
+   msb_first = ((value > old) == (floor == TRUE)) ? TRUE : FALSE;
+   for (i = n - 1, v = value; i >= 0; i--) {
+      was[i] = old & 0xff;
+      bytes[i] = v & 0xff;
+      old >>= 8;
+      v >>= 8;
+   }
+   for (k = 0; k < n && status == PASS; k++) {
+      i = (msb_first == TRUE) ? k : n - 1 - k;
+      if (bytes[i] != was[i]) status = regWrite(addr + i, &bytes[i], 1);
+   }
+   pthread_mutex_unlock(&serial_session.line);
+   return status;
+}
+
+
+/*
+ * Time n round trips of a 4 bytes register read and of the write back of
+ * the value just read, through the whole serial layer: mean and maximum
+ * of each in ms, and the mean time of a single command.  The line is held
+ * throughout, so that the value written back is the one the camera has
+ * and no other command comes in between.  The caller makes sure that the
+ * camera worker is idle.
+ */
+static PASSFAIL
+serialBench(char *reply, size_t len, int n)
+{
+   struct timespec t0, t1;
+   unsigned long value = 0, check;
+   double ms, sum[2] = { 0, 0 }, max[2] = { 0, 0 };
+   PASSFAIL status = PASS;
+   long commands;
+   int i, k;
+
+   pthread_mutex_lock(&serial_session.line);
+   pthread_mutex_lock(&serial_session.lock);
+   commands = serial_session.commands;
+   pthread_mutex_unlock(&serial_session.lock);
+
+   for (i = 0; i < n && status == PASS; i++) {
+      for (k = 0; k < 2 && status == PASS; k++) {
+	 clock_gettime(CLOCK_MONOTONIC, &t0);
+	 if (k == 0) status = regReadValue(OWL_REG_EXPOSURE, 4, &check);
+	 else status = regWriteValue(OWL_REG_EXPOSURE, 4, check);
+	 clock_gettime(CLOCK_MONOTONIC, &t1);
+	 if (status != PASS) {
+	    snprintf(reply, len, "register %s failed after %d round trips",
+		  k == 0 ? "read" : "write", i);
+	    break;
+	 }
+	 ms = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) * 1e-6;
+	 sum[k] += ms;
+	 if (ms > max[k]) max[k] = ms;
+      }
+      if (status == PASS && i > 0 && check != value) {
+	 snprintf(reply, len, "read %08lx instead of %08lx", check, value);
+	 status = FAIL;
+      }
+      value = check;
+   }
+   pthread_mutex_unlock(&serial_session.line);
+   if (status != PASS) return FAIL;
+
+   pthread_mutex_lock(&serial_session.lock);
+   commands = serial_session.commands - commands;
+   pthread_mutex_unlock(&serial_session.lock);
+   snprintf(reply, len, "N=%d READ=%.2f/%.2fms WRITE=%.2f/%.2fms "
+	 "COMMAND=%.3fms", n, sum[0] / n, max[0], sum[1] / n, max[1],
+	 commands > 0 ? (sum[0] + sum[1]) / commands : 0.0);
+   return PASS;
+}
+
+
+/*
+ * Read the temperature calibration from the manufacturing data.  A
+ * calibration with the same count at 0C and 40C cannot be used, and is
+ * rejected like a saved one.
+ */
+static PASSFAIL
+owlReadCalibration(owl_calib_t *calib)
+{
+   static const u_char select[8] =
+      { 0x53, 0xae, 0x05, 0x01, 0x00, 0x00, 0x02, 0x00 };
+   static const u_char read[3] = { 0x53, 0xaf, OWL_MFG_SIZE };
+   u_char mfg[OWL_MFG_SIZE];
+   PASSFAIL status;
+
+   pthread_mutex_lock(&serial_session.line);
+   status = owlCommand(select, sizeof(select), NULL, 0);
+   if (status == PASS) {
+      status = owlCommand(read, sizeof(read), mfg, sizeof(mfg));
+   }
+   pthread_mutex_unlock(&serial_session.line);
+   if (status != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	    "(%s:%d) unable to read the manufacturing data of the camera",
+	    __FILE__, __LINE__);
+      return FAIL;
+   }
+   calib->adc0 = mfg[OWL_MFG_ADC_0C] | mfg[OWL_MFG_ADC_0C + 1] << 8;
+   calib->adc40 = mfg[OWL_MFG_ADC_40C] | mfg[OWL_MFG_ADC_40C + 1] << 8;
+   calib->dac0 = mfg[OWL_MFG_DAC_0C] | mfg[OWL_MFG_DAC_0C + 1] << 8;
+   calib->dac40 = mfg[OWL_MFG_DAC_40C] | mfg[OWL_MFG_DAC_40C + 1] << 8;
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	 "(%s:%d) ADC0d=%u ADC40d=%u DAC0d=%u DAC40d=%u",
+	 __FILE__, __LINE__, calib->adc0, calib->adc40, calib->dac0,
+	 calib->dac40);
+   if (calib->adc40 == calib->adc0 || calib->dac40 == calib->dac0) {
+      cfht_logv(CFHT_MAIN, CFHT_WARN,
+	    "(%s:%d) invalid calibration in the manufacturing data",
+	    __FILE__, __LINE__);
+      calib->valid = FALSE;
+      return FAIL;
+   }
+   calib->valid = TRUE;
+   return PASS;
+}
+
+
+/*
+ * Save the calibration in, or load it from, a one line text file.  The
+ * file is written under a temporary name and renamed, so that a crash
+ * never leaves a truncated copy.
+ */
+static PASSFAIL
+owlCalibrationSave(const owl_calib_t *calib, const char *path)
+{
+   char tmp_path[PATH_MAX];
+   FILE *fp;
+   int ok;
+
+   snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+   if ((fp = fopen(tmp_path, "w")) == NULL) {
+      cfht_logv(CFHT_MAIN, CFHT_WARN,
+	    "(%s:%d) unable to save the camera calibration in %s: %s",
+	    __FILE__, __LINE__, tmp_path, strerror(errno));
+      return FAIL;
+   }
+   ok = fprintf(fp, "%u %u %u %u\n", calib->adc0, calib->adc40, calib->dac0,
+		calib->dac40) > 0;
+   if (fclose(fp) != 0) ok = 0;
+   if (!ok || rename(tmp_path, path) != 0) {
+      cfht_logv(CFHT_MAIN, CFHT_WARN,
+	    "(%s:%d) unable to save the camera calibration in %s: %s",
+	    __FILE__, __LINE__, path, strerror(errno));
+      unlink(tmp_path);
+      return FAIL;
+   }
+   return PASS;
+}
+
+static PASSFAIL
+owlCalibrationLoad(owl_calib_t *calib, const char *path)
+{
+   FILE *fp;
+   int n;
+
+   if ((fp = fopen(path, "r")) == NULL) return FAIL;
+   n = fscanf(fp, "%u %u %u %u", &calib->adc0, &calib->adc40, &calib->dac0,
+	 &calib->dac40);
+   fclose(fp);
+   if (n != 4 || calib->adc40 == calib->adc0 || calib->dac40 == calib->dac0) {
+      cfht_logv(CFHT_MAIN, CFHT_WARN,
+	    "(%s:%d) invalid camera calibration in %s",
+	    __FILE__, __LINE__, path);
+      return FAIL;
+   }
+   calib->valid = TRUE;
+   return PASS;
+}
+
+
+/*
+ * Calibration of the camera, read from the camera the first time and then
+ * reused.  The saved copy is only used when the camera does not answer.
+ * NULL is returned when the calibration is unknown.
+ */
+static const owl_calib_t *
+owlCalibration(void)
+{
+   if (owl_calib.valid == TRUE) return &owl_calib;
+
+   if (owlReadCalibration(&owl_calib) == PASS) {
+      if (calib_file[0] != '\0') owlCalibrationSave(&owl_calib, calib_file);
+      return &owl_calib;
+   }
+   if (calib_file[0] != '\0' &&
+       owlCalibrationLoad(&owl_calib, calib_file) == PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_WARN,
+	    "(%s:%d) using the camera calibration saved in %s",
+	    __FILE__, __LINE__, calib_file);
+      return &owl_calib;
+   }
+   return NULL;
+}
+
+
+/*
+ * Check the camera status
+ */
+static PASSFAIL 
+checkCameraStatus(void){
+
+   static const u_char get_status[1] = { OWL_GET_STATUS };
+   static const u_char set_status[2] =
+      { OWL_SET_STATUS, OWL_STATUS_ACK_CHECKSUM };
+
+   /*
+    * Send the "Get system status" command to the camera.  Its reply is
+    * not checked since the ACK mode may not be enabled yet.
+    */
+   if (owlCommand(get_status, sizeof(get_status), NULL,
+	    OWL_ANY_REPLY) != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	    "(%s:%d) there is no response from the camera...check power",
+	    __FILE__, __LINE__);
+      return FAIL;
+
+   }
+
+   /*
+    * Enable the checksum and ACK modes, which the camera acknowledges
+    */
+   if (owlCommand(set_status, sizeof(set_status), NULL, 0) != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	    "(%s:%d) expected response not received from the camera",
+	    __FILE__, __LINE__);
+      return FAIL;
+   }
+
+   return PASS;
+}
+
+
+/*
+ * Set the non-uniform image correction state
+ */
+static PASSFAIL
+setGuiderNUC(int mode){
+
+   if (mode != 0) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	    "(%s:%d) not able to turn on camera non-uniform correction."
+	    "  Functionality not implemented yet", __FILE__, __LINE__);
+      return FAIL;
+   }
+
+   if (regWriteValue(OWL_REG_NUC, 1, OWL_NUC_OFF) != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
+	    "(%s:%d) not able to turn off camera non-uniform"
+	    " correction", __FILE__, __LINE__);
+      return FAIL;
+   }
+
+   return PASS;
+}
+
+
+/*
+ * Turn on or off the guider auto level
+ */
+static PASSFAIL
+setGuiderAutoLevel(int mode) {
+
+   if (mode != 0) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	    "(%s:%d) not able to turn on camera automatic level."
+	    "  Functionality not implemented yet", __FILE__, __LINE__);
+      return FAIL;
+   }
+
+   if (regWriteValue(OWL_REG_AUTO_LEVEL, 1, 0) != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
+	    "(%s:%d) not able to turn off camera automatic level", 
+	    __FILE__, __LINE__);
+      return FAIL;
+   }
+
+   return PASS;
+}
+
+
+/*
+ * Enable the TEC cooler
+ */
+static PASSFAIL
+enableGuiderTEC(void) {
+
+   if (regWriteValue(OWL_REG_FPGA_CTRL, 1, OWL_FPGA_TEC_ON) != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	    "(%s:%d) can not enable TEC cooler", 
+	    __FILE__, __LINE__);
+      return FAIL;
+   }
+
+   return PASS;
+}
+
+
+/*
+ * Set the guider TEC temperature set point
+ */
+static PASSFAIL
+setGuiderTECPoint(float temp){
+
+   const owl_calib_t *calib;
+   unsigned long value;
+   float co, slope, count;
+
+   if ((calib = owlCalibration()) == NULL) {
+      return FAIL;
+   }
+
+   slope = (calib->dac40 - calib->dac0) / (40);
+   co = calib->dac0;
+   count = temp * slope + co;
+   value = (unsigned long)count;
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
+	 "(%s:%d) TEC set point count = %04lx value=%f",
+	 __FILE__, __LINE__, value, count);
+
+   /*
+    * The set point registers are in reverse order
+    */
+   pthread_mutex_lock(&serial_session.line);
+   if (regWriteValue(OWL_REG_TEC_SETPOINT_MSB, 1, value >> 8) != PASS ||
+       regWriteValue(OWL_REG_TEC_SETPOINT_LSB, 1, value) != PASS) {
+      pthread_mutex_unlock(&serial_session.line);
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
+	    "(%s:%d) not able to send command to camera", 
+	    __FILE__, __LINE__);
+      return FAIL;
+   }
+   pthread_mutex_unlock(&serial_session.line);
+
+   return PASS;
+}
+
+
+/* 
+ * Get the guider TEC set point
+ */
+static PASSFAIL 
+getGuiderTECPoint(float *temp) {
+
+   const owl_calib_t *calib;
+   unsigned long msb, lsb;
+   float value, slope, co;
+
+   if ((calib = owlCalibration()) == NULL) {
+      return FAIL;
+   }
+
+   /* Reading Current TEC setpoint */
+   pthread_mutex_lock(&serial_session.line);
+   if (regReadValue(OWL_REG_TEC_SETPOINT_MSB, 1, &msb) != PASS ||
+       regReadValue(OWL_REG_TEC_SETPOINT_LSB, 1, &lsb) != PASS) {
+      pthread_mutex_unlock(&serial_session.line);
+      return FAIL;
+   }
+   pthread_mutex_unlock(&serial_session.line);
+
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
+	 "(%s:%d) TEC set point count = %04lx", __FILE__, __LINE__,
+	 msb << 8 | lsb);
+   value = (float)(msb << 8 | lsb);
+   slope = (40.0) / ((float)calib->dac40 - (float)calib->dac0);
+   co = -(slope * (float)calib->dac0);
 
+   *temp = (slope * value) + co;
 
+   return PASS;
 }
 
-#ifdef SIM_STAR
+
 /*
- * This is a polar form of the Box-Muller transformation
- * We start with two independent random numbers, x1 and x2, 
- * which come from a uniform distribution (in the range from 0 to 1).
- * Then apply the above transformations to get two new independent 
- * random numbers which have a Gaussian distribution with zero mean 
- * and a standard deviation of one. 
- * Source: http://www.design.caltech.edu/erik/Misc/Gaussian.html
+ * Set the frame rate for the guider
  */
-void sampleNormal(double* y1, double* y2)
-{
-   double x1, x2, w;
+static PASSFAIL
+setGuiderFrameRate(double count) {
 
-   do {
-      x1 = 2.0 * ((double)rand() / (RAND_MAX)) - 1.0;
-      x2 = 2.0 * ((double)rand() / (RAND_MAX)) - 1.0;
-      w = x1 * x1 + x2 * x2;
-   } while ( w >= 1.0 );
+   unsigned long period = (unsigned long)(40e8/(unsigned long)(count*100));
 
-   w = sqrt( (-2.0 * log( w ) ) / w );
-   *y1 = x1 * w;
-   *y2 = x2 * w;
-}
-#endif //SIM_STAR
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	 "(%s:%d) frame rate = %f period count = %lu", 
+	 __FILE__, __LINE__, count, period);
 
-//--------------------------------------------------//
-   static PASSFAIL
-gaussfunc2d(int m, int n, double *p, double *dy, double **dvec, void *vars)
-{
+   /* The period may not drop below the exposure while it changes */
+   if (regChangeValue(OWL_REG_FRAME_RATE, 4, period, TRUE) != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	    "(%s:%d) not able to send command to camera", 
+	    __FILE__, __LINE__);
+      return FAIL;
+   }
 
-   int i,j;    //COUNTERS, SIZE OF IMAGE
-   int n1;     //SIZE OF IMAGE, ASSUMING A SQUARE
-   struct vars_struct *v = (struct vars_struct *) vars;  //STRUCTURE TO PASS PRIVATE DATA
-   double *flux;  //DATA VALUES
-   double xc, yc;        //THE VALUE OF THE CENTRE POINTS OF THE IMAGE
+   return PASS;
+}
 
-   //SET THE LOCAL VARIABLES TO THE STRUCTURE.
 
-   flux=v->flux;
+/*
+ * Get the frame rate for the guide camera 
+ */
+static PASSFAIL 
+getGuiderFrameRate(double *count){
+   unsigned long value;
+
+   if (regReadValue(OWL_REG_FRAME_RATE, 4, &value) != PASS) {
+      return FAIL;
+   }
 
-   //ASSUMING A SQUARE IMAGE, GET THE DIMENSIONS OF EACH SIDE
+   if (value == 0){
+      *count = 0;
+   } else{
+      *count = 40e6/value;
+   }
 
-   n1=(int)sqrt(m);
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
+	 "(%s:%d) count = %lu, Frame rate=%4.2f",
+	 __FILE__, __LINE__, value, *count);
 
+   return PASS;
+}
 
-   //CYCLE THROUGH THE VALUES. THE DATA/RESIDUALS ARE ONE D,
-   //MAP THE COORDINATES TO THAT ASSUMING A SQUARE
 
-   for (i=0;i<n1;i++)
-   {
-      for (j=0;j<n1;j++)
-      {
-	 //CENTER VALUES
-	 xc=i-p[0];
-	 yc=j-p[1];
+/*
+ * Set the exposure time for the camera 
+ */
+static PASSFAIL
+setGuiderExptime(unsigned long count) {
 
-	 //EQUATION ASSUMING INDEPENDENT FWHM IN X AND Y DIRECTIONS
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	 "(%s:%d) exposure count = %lu", __FILE__, __LINE__, count);
 
-	 dy[i*n1+j] = ((flux[i*n1+j] - p[4]*exp(-0.5*(xc*xc/(p[2]*p[2]*0.180337)+yc*yc/(p[3]*p[3]*0.180337)))-p[5]));
-      }
+   /* The exposure may not exceed the frame period while it changes */
+   if (regChangeValue(OWL_REG_EXPOSURE, 4, count, FALSE) != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
+	    "(%s:%d) not able to send command to camera", 
+	    __FILE__, __LINE__);
+      return FAIL;
    }
+
    return PASS;
 }
 
 
-#define ELEM_SWAP(a,b) {register float t=(a);(a)=(b);(b)=t; }
-
-/** \fn  float GetF(float arr[], int n)
- * \brief This function is the quick_select routine based on the algorithm found
- * in Numerical Recipes in C.
- *
- * \param arr[] is the image
- * \param n is the number of pixels in the image
- * \return median value of an array
+/*
+ * Get the exposure time for the camera 
  */
-double GetMedian(double arr[], int n){
-   int low, high;
-   int median;
-   int middle, ll, hh;
+static PASSFAIL 
+getGuiderExptime(unsigned long *count) {
 
-   low = 0; high = n-1; median = (low + high) / 2;
-   for (;;) {
+   if (regReadValue(OWL_REG_EXPOSURE, 4, count) != PASS) {
+      return FAIL;
+   }
 
-      if (high <= low) /* One element only */
-	 return arr[median] ;
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	 "(%s:%d) exposure count = %lu", __FILE__, __LINE__, *count);
 
-      if (high == low + 1) { /* Two elements only */
-	 if (arr[low] > arr[high])
-	    ELEM_SWAP(arr[low], arr[high]) ;
-	 return arr[median] ;
-      }
+   return PASS;
+}
 
-      /* Find median of low, middle and high items; swap into position low */
-      middle = (low + high) / 2;
-      if (arr[middle] > arr[high])
-	 ELEM_SWAP(arr[middle], arr[high])
-	    if (arr[low] > arr[high])
-	       ELEM_SWAP(arr[low], arr[high])
-		  if (arr[middle] > arr[low])
-		     ELEM_SWAP(arr[middle], arr[low])
 
-			/* Swap low item (now in position middle) into position (low+1) */
-			ELEM_SWAP(arr[middle], arr[low+1]) ;
+/*
+ * Get the digital gain for the camera 
+ */
+static PASSFAIL
+getDigitalGain(int *value) {
 
-      /* Nibble from each end towards middle, swapping items when stuck */
-      ll = low + 1;
-      hh = high;
-      for (;;) {
-	 do ll++; while (arr[low] > arr[ll]) ;
-	 do hh--; while (arr[hh] > arr[low]) ;
+   unsigned long gain;
 
-	 if (hh < ll) break;
+   if (regReadValue(OWL_REG_DIGITAL_GAIN, 2, &gain) != PASS) {
+      return FAIL;
+   }
 
-	 ELEM_SWAP(arr[ll], arr[hh])
-      }
+   *value = gain / 256;
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	 "(%s:%d) gain count = %04lx gain=%i",
+	 __FILE__, __LINE__, gain, *value);
 
-      /* Swap middle item (in position low) back into correct position */
-      ELEM_SWAP(arr[low], arr[hh])
+   return PASS;
+}
 
-	 /* Re-set active partition */
-	 if (hh <= median) low = ll;
-      if (hh >= median) high = hh - 1;
+
+/*
+ * Set the value of the digital gain
+ */
+static PASSFAIL 
+setDigitalGain(int value){
+
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	 "(%s:%d) gain=%i", __FILE__, __LINE__, value);
+
+   if (regWriteValue(OWL_REG_DIGITAL_GAIN, 2,
+	    (unsigned long)(value*256)) != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
+	    "(%s:%d) not able to send command to camera", 
+	    __FILE__, __LINE__);
+      return FAIL;
    }
 
+   return PASS;
 }
-#undef ELEM_SWAP
+
 
 /*
- * Simple centroid calculation on the image
+ * Set the guider gain mode
  */
-static int
-calculateCentroid(unsigned short *image, int columns, int rows,
-      float *xc, float *yc) {
-
-   int i;
-   int j;
-   int val;
-   float sum,median;
-   double arr[columns*rows];
-
-   //arr=(double *)malloc(columns*rows*sizeof(double));
+static PASSFAIL 
+setGuiderGainMode(int mode){
 
-   for (i=0;i<columns*rows;i++){
-      arr[i]=image[i];
+   if (mode != LOWGAIN && mode != HIGHGAIN) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	    "(%s:%d) there is no this specified gain mode for this"
+	    " camera", __FILE__, __LINE__);
+      return FAIL;
    }
-   median=GetMedian(arr,columns*rows);
-   //fprintf(stderr," median=%f ",median);
 
-   *xc = 0;
-   *yc = 0;
-   sum = 0;
-   for (i = 0; i < rows; i++) {
-      for (j = 0; j < columns; j++) {
-	 val = (image)[i * columns + j]-median;
-	 if (val > 0) {
-	    *xc += j * val;
-	    *yc += i * val;
-	    sum += val;
-	 }
-      }
-   }
-   if (sum > 0) {
-      *xc /= sum;
-      *yc /= sum;
-   }
-   else {
-      *xc = columns / 2.0;
-      *yc = rows / 2.0;
+   if (regWriteValue(OWL_REG_GAIN_MODE, 1, mode == LOWGAIN ?
+	    OWL_GAIN_MODE_LOW : OWL_GAIN_MODE_HIGH) != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
+	    "(%s:%d) not able to switch to %s gain mode", 
+	    __FILE__, __LINE__, mode == LOWGAIN ? "low" : "high");
+      return FAIL;
    }
 
-   //free(arr);
-   return 0;
+   return PASS;
 }
 
 
-/*
- * MPFIS method for centroid calculation on the image
+/* 
+ * Get the guider gain mode
  */
-int *calculateCentroidMPFIT(unsigned short *image, int columns, int rows,
-      float *xc, float *yc) {
+static PASSFAIL 
+getGuiderGainMode(int *mode) {
+   unsigned long value;
 
-   struct vars_struct v; //PRIVATE STRUCTURE WITH DATA/FUNCTION INFORMATION
-   mp_result result;     //STRUCTURE WITH RESULTS
-   mp_par pars[6];	//VARIABLE THAT HOLDS INFORMATION ABOUT FIXING PARAMETERS - DATA TYPE IN MPFIT
+   if (regReadValue(OWL_REG_GAIN_MODE, 1, &value) != PASS) {
+      return FAIL;
+   }
 
-   double median;
+   if (value == OWL_GAIN_MODE_LOW){
+      *mode = LOWGAIN;
+   }
+   if (value == OWL_GAIN_MODE_HIGH){
+      *mode = HIGHGAIN;
+   }
 
-   double *ferr=NULL;
+   return PASS;
+}
 
-   // Array for median calculation
-   double arr[columns*rows];
 
-   double perror[6];	//ERRORS IN RETURNED PARAMETERS
+/* 
+ * Check the temperature of the camera
+ */
+static PASSFAIL
+checkGuiderTemp(float *temp) {
 
-   int i,j,k=0;
-   int npoints;
+   const owl_calib_t *calib;
+   unsigned long adc;
+   float value, slope, co;
 
-   /*
-    *   First step, estimate the center of the point using Center of Mass
-    */
-   float xest = 0;
-   float yest = 0;
-   calculateCentroid(image, GUIDE_SIZE_X, GUIDE_SIZE_Y,&xest, &yest);
-   //fprintf(stderr,"x=%f y=%f ",xest,yest);
+   if ((calib = owlCalibration()) == NULL) {
+      return FAIL;
+   }
 
-   /*
-    *  Cut out the region near the point
+   /* 
+    * Reading the sensor temperature
     */
-   int fpix[2];                       //FIRST PIXELS OF SUBREGION [X,Y]
-   int lpix[2];                       //LAST PIXELS OF SUBREGION [X,Y]
-   int subx, suby,np;
-   double *subimage;
-
-   fpix[0]=xest-GUIDE_SIZE_X/4;
-   fpix[1]=yest-GUIDE_SIZE_Y/4;
-   lpix[0]=xest+GUIDE_SIZE_X/4-1;
-   lpix[1]=yest+GUIDE_SIZE_Y/4-1;
-
-   if (xest-GUIDE_SIZE_X/4 < 0) fpix[0]=0;
-   if (yest-GUIDE_SIZE_X/4 < 0) fpix[1]=0;
-   if (xest-GUIDE_SIZE_X/4 > 32) lpix[0]=32;
-   if (yest-GUIDE_SIZE_X/4 > 32) lpix[1]=32;
-
+   if (regReadValue(OWL_REG_TEMP, 2, &adc) != PASS) {
+      return FAIL;
+   }
 
-   //GET THE DIMENSIONS OF THE SUBREGION
-   subx=lpix[0]-fpix[0]+1;
-   suby=lpix[1]-fpix[1]+1;
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
+	 "(%s:%d) temperature count = %04lx", __FILE__, __LINE__, adc);
+   value = (float)adc;
+   slope = (40.0) / ((float)calib->adc40 - (float)calib->adc0);
+   co = -(slope * (float)calib->adc0);
 
-   // Copy the central region
-   subimage = malloc(subx*suby*sizeof(double));
-   ferr = malloc(subx*suby*sizeof(double));
-   //fprintf(stderr,"subx=%i %i \n",subx,suby);
+   *temp = (slope * value) + co;
 
-   for (i=fpix[0];i<fpix[0]+subx;i++){
-      for (j=fpix[1];j<fpix[1]+suby;j++){
-	 subimage[k]=(double)image[j*columns+i];
-	 ferr[k]=1.0;
-	 k++;
-      }
-   }
+   return PASS;
+}
 
-   npoints=columns*rows;
-   np=subx*suby;
+/*
+ * Camera control worker.  A serial command to the camera takes tens of
+ * milliseconds, too long for the main loop which also acquires the frames
+ * and serves the clients.  The camera commands are queued as jobs that
+ * the worker thread executes one at a time, the user jobs always before
+ * the status polls, and the main loop runs the completion callback of
+ * each job in camWorkerPoll.  sockserv only lets clientReceive reply in
+ * place, so a set command is acknowledged once queued.
+ *
+ * The main loop keeps a snapshot of the camera settings and sensor
+ * temperature, refreshed in the background every interval of each item
+ * and whenever a job completes.  The queries are answered from the
+ * snapshot with its age.  A FRESH query queues a read ahead of the
+ * background ones and is still answered from the snapshot, flagged
+ * REFRESHING: the main loop never waits for the camera, the client asks
+ * again for the new value.
+ */
+#define CAM_QUEUE_MAX 32
+#define DEFAULT_POLL_TEMP 10.0         /* s between temperature reads */
+#define DEFAULT_POLL_SETTINGS 60.0     /* s between reads of the settings */
+
+typedef enum {
+   CAM_PRIO_USER,               /* commands of the clients */
+   CAM_PRIO_POLL,               /* status refreshes */
+   CAM_PRIOS
+} cam_prio_t;
+
+typedef enum {
+   CAM_EXPTIME,                 /* ms */
+   CAM_FRAMERATE,               /* Hz */
+   CAM_TEC,                     /* set point, degrees C */
+   CAM_TEMP,                    /* sensor, degrees C, read only */
+   CAM_GAINMODE,                /* LOWGAIN or HIGHGAIN, read only */
+   CAM_DGAIN,                   /* digital gain, read only */
+   CAM_ITEMS
+} cam_item_t;
+
+typedef struct cam_job {
+   cam_item_t item;
+   BOOLEAN set;
+   double value;                /* value to set, then value read */
+   PASSFAIL status;
+   struct timeval finished;     /* when the camera acknowledged the job */
+   void (*done)(struct cam_job *job);  /* run by the main loop */
+   struct cam_job *next;
+} cam_job_t;
 
-   //ferr = malloc(npoints*sizeof(double));
-   //arr = malloc(npoints*sizeof(double));
-   for (i=0;i<npoints;i++){
-      //ferr[i]=1.0;
-      arr[i]=(double)image[i];
-   }
-   median=GetMedian(arr,columns*rows);
+typedef struct {
+   pthread_t thread;
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+   BOOLEAN running;             /* jobs are executed inline when not */
+   cam_job_t pool[CAM_QUEUE_MAX];
+   cam_job_t *free_list;
+   cam_job_t *head[CAM_PRIOS];  /* pending jobs, oldest first */
+   cam_job_t *tail[CAM_PRIOS];
+   cam_job_t *done_head;        /* completed, callback not run yet */
+   cam_job_t *done_tail;
+   cam_job_t *busy;             /* job being executed */
+   long executed;
+   long rejected;               /* jobs refused with the queue full */
+
+   /* Only used by the main loop */
+   PASSFAIL last_status[CAM_ITEMS]; /* of the last completed job */
+   double value[CAM_ITEMS];     /* snapshot of the camera */
+   struct timeval stamp[CAM_ITEMS]; /* when read or set, 0 if never */
+   double interval[CAM_ITEMS];  /* s between reads, 0 for none */
+   struct timeval polled[CAM_ITEMS]; /* last background read queued */
+} cam_worker_t;
+
+static cam_worker_t cam_worker;
 
-   double p[] = {xest-fpix[0],yest-fpix[1],2.5,2.5,12800.0,median};
+/*
+ * Exposure time and frame rate changes.  Both are 4 bytes registers
+ * written one byte at a time, and the camera must never run with an
+ * exposure longer than its frame period.  While a register changes its
+ * value stays above the smaller of the old and new periods, or below the
+ * larger of the old and new exposures (regChangeValue), so shortening the
+ * exposure before the period and lengthening it after keeps the exposure
+ * within the period throughout.  The client commands only stage
+ * the new values; the main loop sends them right after a frame was
+ * acquired, as consecutive jobs of the worker, and the server values used
+ * by the FITS headers and the ISU slopes switch on the first frame
+ * acquired a whole new frame period after the camera took them.
+ */
+typedef enum {
+   CAM_STAGE_IDLE,              /* nothing sent to the camera */
+   CAM_STAGE_SENT,              /* jobs queued to the worker */
+   CAM_STAGE_LANDED             /* taken by the camera, waiting a frame */
+} cam_stage_state_t;
 
-   memset(&result,0,sizeof(result));
-   result.xerror = perror;
-   memset(pars,0,sizeof(pars));
-   //fprintf(stderr,"init=%f %f\n",xest-fpix[0],yest-fpix[1]);
+typedef struct {
+   BOOLEAN exptime_staged;      /* values waiting for a frame boundary */
+   double exptime;              /* ms */
+   BOOLEAN rate_staged;
+   double rate;                 /* Hz */
+   cam_stage_state_t state;
+   int outstanding;             /* jobs of the transaction not completed */
+   BOOLEAN exptime_sent;        /* items of the transaction */
+   BOOLEAN rate_sent;
+   BOOLEAN failed;
+   double sent_exptime;         /* values the camera took */
+   double sent_rate;
+   struct timeval landed;       /* when the last job completed */
+   int generation;              /* changes applied so far */
+} cam_stage_t;
+
+static cam_stage_t cam_stage;
+
+static const char *cam_item_name[CAM_ITEMS] = {
+   "exposure time", "frame rate", "TEC set point", "temperature",
+   "gain mode", "digital gain"
+};
 
-   v.ferr = ferr;
-   v.flux = subimage;
+static const char *cam_item_key[CAM_ITEMS] = {
+   "EXPTIME", "FRAMERATE", "TEC", "TEMP", "GAINMODE", "DGAIN"
+};
 
-   //pars[1].fixed = 0;
-   pars[2].fixed = 1;
-   pars[3].fixed = 1;
-   //pars[4].fixed = 1;
-   //pars[5].fixed = 1;
-   pars[5].fixed = 1;
+static double
+camElapsed(const struct timeval *from, const struct timeval *to)
+{
+   return (to->tv_sec - from->tv_sec) + (to->tv_usec - from->tv_usec) * 1e-6;
+}
 
+/*
+ * Send the serial commands of a job to the camera
+ */
+static void
+camExecute(cam_job_t *job)
+{
+   unsigned long count;
+   double rate;
+   float temp;
+   int gain;
 
+   job->status = FAIL;
+   switch (job->item) {
+   case CAM_EXPTIME:
+      if (job->set == TRUE) {
+	 job->status = setGuiderExptime(job->value * 40e3);
+      }
+      else if ((job->status = getGuiderExptime(&count)) == PASS) {
+	 job->value = count / 40e3;
+      }
+      break;
+   case CAM_FRAMERATE:
+      /* Read back what the camera made of a new rate */
+      if (job->set == TRUE && setGuiderFrameRate(job->value) != PASS) {
+	 break;
+      }
+      if ((job->status = getGuiderFrameRate(&rate)) == PASS) {
+	 job->value = rate;
+      }
+      break;
+   case CAM_TEC:
+      if (job->set == TRUE) {
+	 job->status = setGuiderTECPoint(job->value);
+      }
+      else if ((job->status = getGuiderTECPoint(&temp)) == PASS) {
+	 job->value = temp;
+      }
+      break;
+   case CAM_TEMP:
+      if (job->set == FALSE &&
+	  (job->status = checkGuiderTemp(&temp)) == PASS) {
+	 job->value = temp;
+      }
+      break;
+   case CAM_GAINMODE:
+      if (job->set == FALSE &&
+	  (job->status = getGuiderGainMode(&gain)) == PASS) {
+	 job->value = gain;
+      }
+      break;
+   case CAM_DGAIN:
+      if (job->set == FALSE &&
+	  (job->status = getDigitalGain(&gain)) == PASS) {
+	 job->value = gain;
+      }
+      break;
+   default:
+      break;
+   }
+}
 
-   // TODO: Error on the return value of this function need to be handled
-   mpfit(gaussfunc2d, np, 6, p, pars, 0, (void *) &v, &result);
+/*
+ * Body of the camera control thread: execute the pending jobs, highest
+ * priority first
+ */
+static void *
+camThread(void *p_args)
+{
+   cam_worker_t *w = (cam_worker_t *)p_args;
+   cam_job_t *job;
+   int prio;
 
+   pthread_mutex_lock(&w->lock);
+   for (;;) {
+      job = NULL;
+      for (prio = 0; prio < CAM_PRIOS && job == NULL; prio++) {
+	 if ((job = w->head[prio]) != NULL) {
+	    w->head[prio] = job->next;
+	    if (w->head[prio] == NULL) w->tail[prio] = NULL;
+	 }
+      }
+      if (job == NULL) {
+	 pthread_cond_wait(&w->cond, &w->lock);
+	 continue;
+      }
+      w->busy = job;
+      pthread_mutex_unlock(&w->lock);
 
-   //fprintf(stderr,"total time=%f \n",last_ts-current_ts);
+      camExecute(job);
+      gettimeofday(&job->finished, NULL);
 
-   //printresult(p, &result);
+      pthread_mutex_lock(&w->lock);
+      w->busy = NULL;
+      job->next = NULL;
+      if (w->done_tail != NULL) w->done_tail->next = job;
+      else w->done_head = job;
+      w->done_tail = job;
+      w->executed++;
+   }
+   return NULL;
+}
 
-   free(subimage);
-   free(ferr);
+/*
+ * Start the camera control thread.  The sensor temperature and the
+ * settings are read in the background every poll_temp and poll_settings
+ * seconds, 0 to never read them.
+ */
+static PASSFAIL
+camWorkerCreate(cam_worker_t *w, double poll_temp, double poll_settings)
+{
+   int i;
 
-   if (fpix[1]+p[1] < 0){
-      *yc=yest;
-   } else {
-      *yc=fpix[1]+p[1];
+   memset(w, 0, sizeof(*w));
+   for (i = 0; i < CAM_QUEUE_MAX; i++) {
+      w->pool[i].next = w->free_list;
+      w->free_list = &w->pool[i];
    }
+   for (i = 0; i < CAM_ITEMS; i++) {
+      w->last_status[i] = PASS;
+      w->interval[i] = (i == CAM_TEMP) ? poll_temp : poll_settings;
+   }
+   pthread_mutex_init(&w->lock, NULL);
+   pthread_cond_init(&w->cond, NULL);
 
-   if (fpix[0]+p[0] < 0){
-      *xc=xest;
-   } else {
-      *xc=fpix[0]+p[0];
+   if (pthread_create(&w->thread, NULL, camThread, w)) {
+      cfht_logv(CFHT_MAIN, CFHT_ERROR,
+	    "(%s:%d) %s: failed creating camera control thread",
+	    __FILE__, __LINE__, __FUNCTION__);
+      return FAIL;
    }
-   return 0;
+   pthread_detach(w->thread);
+   w->running = TRUE;
 
+   return PASS;
 }
 
 /*
- * This function is used to calculate the FWHM of the stellar point.
+ * Record a value known to be in the camera, set at startup
  */
-int *calculatePointFWHM(unsigned short *image, int columns, int rows)
+static void
+camSnapshotSet(cam_worker_t *w, cam_item_t item, double value)
 {
+   w->value[item] = value;
+   gettimeofday(&w->stamp[item], NULL);
+   w->polled[item] = w->stamp[item];
+   w->last_status[item] = PASS;
+}
 
-   struct vars_struct v; //PRIVATE STRUCTURE WITH DATA/FUNCTION INFORMATION
-   mp_result result;     //STRUCTURE WITH RESULTS
-   mp_par pars[6];	//VARIABLE THAT HOLDS INFORMATION ABOUT FIXING PARAMETERS - DATA TYPE IN MPFIT
-
-   double median;
+/*
+ * Account for a completed job in the snapshot and run its callback
+ */
+static void
+camApply(cam_worker_t *w, cam_job_t *job)
+{
+   w->last_status[job->item] = job->status;
+   if (job->status == PASS) {
+      w->value[job->item] = job->value;
+      gettimeofday(&w->stamp[job->item], NULL);
+   }
+   if (job->done != NULL) job->done(job);
+}
 
-   double *ferr=NULL;
+/*
+ * Queue a job for the camera.  A job of the same kind still pending at
+ * that priority is reused, so a burst of queries only reads the camera
+ * once and only the last of several set values is sent.  Before the
+ * worker runs the job is executed right away.  FAIL is returned when the
+ * queue is full, or when an inline job failed.
+ */
+static PASSFAIL
+camSubmit(cam_worker_t *w, cam_prio_t prio, cam_item_t item, BOOLEAN set,
+      double value, void (*done)(cam_job_t *))
+{
+   cam_job_t *job;
+
+   if (w->running == FALSE) {
+      cam_job_t now;
+
+      memset(&now, 0, sizeof(now));
+      now.item = item;
+      now.set = set;
+      now.value = value;
+      now.done = done;
+      camExecute(&now);
+      gettimeofday(&now.finished, NULL);
+      camApply(w, &now);
+      return now.status;
+   }
+
+   pthread_mutex_lock(&w->lock);
+   for (job = w->head[prio]; job != NULL; job = job->next) {
+      if (job->item == item && job->set == set) break;
+   }
+   if (job == NULL) {
+      if ((job = w->free_list) == NULL) {
+	 w->rejected++;
+	 pthread_mutex_unlock(&w->lock);
+	 cfht_logv(CFHT_MAIN, CFHT_WARN,
+	       "(%s:%d) camera command queue full, %s %s dropped",
+	       __FILE__, __LINE__, set == TRUE ? "setting" : "reading",
+	       cam_item_name[item]);
+	 return FAIL;
+      }
+      w->free_list = job->next;
+      job->item = item;
+      job->set = set;
+      job->next = NULL;
+      if (w->tail[prio] != NULL) w->tail[prio]->next = job;
+      else w->head[prio] = job;
+      w->tail[prio] = job;
+   }
+   job->value = value;
+   job->done = done;
+   pthread_cond_broadcast(&w->cond);
+   pthread_mutex_unlock(&w->lock);
 
-   // Array for median calculation
-   double arr[columns*rows];
+   return PASS;
+}
 
-   double perror[6];	//ERRORS IN RETURNED PARAMETERS
+/*
+ * TRUE when the worker has no job queued or being executed
+ */
+static BOOLEAN
+camWorkerIdle(cam_worker_t *w)
+{
+   BOOLEAN idle;
+   int prio;
 
-   int i,j,k=0;
-   int npoints;
+   pthread_mutex_lock(&w->lock);
+   idle = (w->busy == NULL);
+   for (prio = 0; prio < CAM_PRIOS; prio++) {
+      if (w->head[prio] != NULL) idle = FALSE;
+   }
+   pthread_mutex_unlock(&w->lock);
+   return idle;
+}
 
-   /*
-    *   First step, estimate the center of the point using Center of Mass
-    */
-   float xest = 0;
-   float yest = 0;
-   calculateCentroid(image, GUIDE_SIZE_X, GUIDE_SIZE_Y,&xest, &yest);
+/*
+ * Completion callback of the camera jobs: keep the server values in line
+ * with the camera
+ */
+static void
+camJobDone(cam_job_t *job)
+{
+   if (job->status != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	    "(%s:%d) unable to %s %s %s the Raptor camera",
+	    __FILE__, __LINE__, job->set == TRUE ? "set" : "read",
+	    cam_item_name[job->item], job->set == TRUE ? "in" : "from");
+      return;
+   }
 
-#ifdef DEBUG
-   // fprintf(stderr,"x_estimated=%.2f y_estimated=%.2f \n",xest,yest);
-#endif //DEBUG
-   /*
-    *  Cut out the region near the point
-    */
-   int fpix[2];                       //FIRST PIXELS OF SUBREGION [X,Y]
-   int lpix[2];                       //LAST PIXELS OF SUBREGION [X,Y]
-   int subx, suby,np;
-   double *subimage;
+   /* The values being changed switch on a frame boundary */
+   if (cam_stage.state != CAM_STAGE_IDLE &&
+       (job->item == CAM_EXPTIME || job->item == CAM_FRAMERATE)) {
+      return;
+   }
 
-   fpix[0]=xest-GUIDE_SIZE_X/4;
-   fpix[1]=yest-GUIDE_SIZE_Y/4;
-   lpix[0]=xest+GUIDE_SIZE_X/4-1;
-   lpix[1]=yest+GUIDE_SIZE_Y/4-1;
+   switch (job->item) {
+   case CAM_EXPTIME:
+      serv_info->exposure_time = job->value;
+      if (job->set == TRUE) {
+	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	       "(%s:%d) exposure time in camera set to %.3f ms",
+	       __FILE__, __LINE__, serv_info->exposure_time);
+      }
+      break;
+   case CAM_FRAMERATE:
+      serv_info->frame_rate = job->value;
+      if (job->set == TRUE) {
+	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	       "(%s:%d) frame rate in camera set to %5.2f Hz",
+	       __FILE__, __LINE__, serv_info->frame_rate);
+      }
+      break;
+   case CAM_TEC:
+      serv_info->tec_setpoint = job->value;
+      if (job->set == TRUE) {
+	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	       "(%s:%d) TEC set point in camera set to %4.1f degrees C",
+	       __FILE__, __LINE__, serv_info->tec_setpoint);
+      }
+      break;
+   case CAM_TEMP:
+      serv_info->temp = job->value;
+      break;
+   default:
+      break;
+   }
+}
 
-   if (xest-GUIDE_SIZE_X/4 < 0) fpix[0]=0;
-   if (yest-GUIDE_SIZE_X/4 < 0) fpix[1]=0;
-   if (xest-GUIDE_SIZE_X/4 > 32) lpix[0]=32;
-   if (yest-GUIDE_SIZE_X/4 > 32) lpix[1]=32;
+/*
+ * Apply the completed jobs and queue the background reads that are due,
+ * from the main loop
+ */
+static void
+camWorkerPoll(cam_worker_t *w)
+{
+   cam_job_t *list, *job;
+   struct timeval now;
+   int i;
 
+   if (w->running == FALSE) return;
 
-   //GET THE DIMENSIONS OF THE SUBREGION
-   subx=lpix[0]-fpix[0]+1;
-   suby=lpix[1]-fpix[1]+1;
+   pthread_mutex_lock(&w->lock);
+   list = w->done_head;
+   w->done_head = w->done_tail = NULL;
+   pthread_mutex_unlock(&w->lock);
 
-   // Copy the central region
-   subimage = malloc(subx*suby*sizeof(double));
-   ferr = malloc(subx*suby*sizeof(double));
-   //fprintf(stderr,"subx=%i %i \n",subx,suby);
+   for (job = list; job != NULL; job = job->next) camApply(w, job);
 
-   for (i=fpix[0];i<fpix[0]+subx;i++){
-      for (j=fpix[1];j<fpix[1]+suby;j++){
-	 subimage[k]=(double)image[j*columns+i];
-	 ferr[k]=1.0;
-	 k++;
+   if (list != NULL) {
+      pthread_mutex_lock(&w->lock);
+      while ((job = list) != NULL) {
+	 list = job->next;
+	 job->next = w->free_list;
+	 w->free_list = job;
       }
+      pthread_mutex_unlock(&w->lock);
    }
 
-   npoints=columns*rows;
-   np=subx*suby;
+   gettimeofday(&now, NULL);
+   for (i = 0; i < CAM_ITEMS; i++) {
+      if (w->interval[i] <= 0 ||
+	  camElapsed(&w->polled[i], &now) < w->interval[i]) {
+	 continue;
+      }
+      w->polled[i] = now;
+      (void)camSubmit(w, CAM_PRIO_POLL, i, FALSE, 0, camJobDone);
+   }
+}
 
-   //ferr = malloc(npoints*sizeof(double));
-   //arr = malloc(npoints*sizeof(double));
-   for (i=0;i<npoints;i++){
-      //ferr[i]=1.0;
-      arr[i]=(double)image[i];
+/*
+ * Stage a new exposure time (ms) or frame rate (Hz), sent to the camera
+ * at the next frame boundary.  A later value replaces one not sent yet.
+ */
+static void
+camStage(cam_stage_t *s, cam_item_t item, double value)
+{
+   if (item == CAM_EXPTIME) {
+      s->exptime = value;
+      s->exptime_staged = TRUE;
    }
-   median=GetMedian(arr,columns*rows);
+   else if (item == CAM_FRAMERATE) {
+      s->rate = value;
+      s->rate_staged = TRUE;
+   }
+}
 
-   double p[] = {xest-fpix[0],yest-fpix[1],2.5,2.5,12800.0,median};
+/*
+ * Switch the server to the values the camera took
+ */
+static void
+camStageCommit(cam_stage_t *s)
+{
+   if (s->exptime_sent == TRUE && s->sent_exptime > 0) {
+      serv_info->exposure_time = s->sent_exptime;
+   }
+   if (s->rate_sent == TRUE && s->sent_rate > 0) {
+      serv_info->frame_rate = s->sent_rate;
+   }
+   s->state = CAM_STAGE_IDLE;
 
-   memset(&result,0,sizeof(result));
-   result.xerror = perror;
-   memset(pars,0,sizeof(pars));
-   //fprintf(stderr,"init=%f %f\n",xest-fpix[0],yest-fpix[1]);
+   if (s->exptime_sent == TRUE || s->rate_sent == TRUE) {
+      s->generation++;
 
-   v.ferr = ferr;
-   v.flux = subimage;
+      /* The measured latency depends on both */
+      serv_info->loop_latency = 0;
 
-   //pars[1].fixed = 0;
-   //pars[2].fixed = 1;
-   //pars[3].fixed = 1;
-   //pars[4].fixed = 1;
-   //pars[5].fixed = 1;
-   pars[5].fixed = 1;
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	    "(%s:%d) exposure time %.3f ms and frame rate %5.2f Hz in use"
+	    " from frame %d (change %d)", __FILE__, __LINE__,
+	    serv_info->exposure_time, serv_info->frame_rate,
+	    serv_info->frame_sequence + 1, s->generation);
+   }
 
+   /* Find out what the camera really runs with after a failure */
+   if (s->failed == TRUE) {
+      (void)camSubmit(&cam_worker, CAM_PRIO_POLL, CAM_EXPTIME, FALSE, 0,
+	    camJobDone);
+      (void)camSubmit(&cam_worker, CAM_PRIO_POLL, CAM_FRAMERATE, FALSE, 0,
+	    camJobDone);
+   }
+}
 
-   // TODO: Error on the return value of this function need to be handled
-   mpfit(gaussfunc2d, np, 6, p, pars, 0, (void *) &v, &result);
+/*
+ * Completion callback of the jobs of a transaction
+ */
+static void
+camStageDone(cam_job_t *job)
+{
+   cam_stage_t *s = &cam_stage;
 
+   if (job->status != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	    "(%s:%d) unable to set %s in the Raptor camera",
+	    __FILE__, __LINE__, cam_item_name[job->item]);
+      s->failed = TRUE;
+      if (job->item == CAM_EXPTIME) s->exptime_sent = FALSE;
+      else s->rate_sent = FALSE;
+   }
+   else if (job->item == CAM_EXPTIME) {
+      s->sent_exptime = job->value;
+   }
+   else {
+      s->sent_rate = job->value;
+   }
+   if (--s->outstanding > 0) return;
 
-   //fprintf(stderr,"total time=%f \n",last_ts-current_ts);
+   s->landed = job->finished;
+   s->state = CAM_STAGE_LANDED;
+   if (serv_info->video_on == FALSE) camStageCommit(s);
+}
 
-   //printresult(p, &result);
-   serv_info->fwhm_x=p[2];
-   serv_info->fwhm_y=p[3];
+/*
+ * Send the staged values to the camera, from the main loop right after a
+ * frame, or at any time without video.  The exposure is shortened before
+ * the frame period and lengthened after it.
+ */
+static void
+camStageSend(cam_stage_t *s, cam_worker_t *w)
+{
+   cam_item_t order[2];
+   double value[2];
+   int i, n = 0;
 
-   free(subimage);
-   free(ferr);
-   return 0;
+   if (s->state != CAM_STAGE_IDLE ||
+       (s->exptime_staged == FALSE && s->rate_staged == FALSE)) {
+      return;
+   }
 
+   if (s->exptime_staged == TRUE && s->exptime <= serv_info->exposure_time) {
+      order[n] = CAM_EXPTIME;
+      value[n++] = s->exptime;
+   }
+   if (s->rate_staged == TRUE) {
+      order[n] = CAM_FRAMERATE;
+      value[n++] = s->rate;
+   }
+   if (s->exptime_staged == TRUE && s->exptime > serv_info->exposure_time) {
+      order[n] = CAM_EXPTIME;
+      value[n++] = s->exptime;
+   }
+
+   s->exptime_sent = s->rate_sent = s->failed = FALSE;
+   s->exptime_staged = s->rate_staged = FALSE;
+   s->outstanding = n;
+   s->state = CAM_STAGE_SENT;
+   for (i = 0; i < n; i++) {
+      if (order[i] == CAM_EXPTIME) s->exptime_sent = TRUE;
+      else s->rate_sent = TRUE;
+
+      /* Jobs run inline before the worker starts complete right here */
+      if (camSubmit(w, CAM_PRIO_USER, order[i], TRUE, value[i],
+	       camStageDone) != PASS && w->running == TRUE) {
+	 /* Queue full, the rest is sent after the next frame */
+	 for (; i < n; i++) {
+	    camStage(s, order[i], value[i]);
+	    if (order[i] == CAM_EXPTIME) s->exptime_sent = FALSE;
+	    else s->rate_sent = FALSE;
+	    s->outstanding--;
+	 }
+	 if (s->outstanding == 0) s->state = CAM_STAGE_IDLE;
+	 break;
+      }
+   }
 }
 
-/* 
- * Advance past leading whitespace in a string 
+/*
+ * Called for each frame acquired: the server switches to the new values
+ * on the first frame captured a whole new frame period after the camera
+ * took them
  */
-   char *
-ltrim(char *str) 
+static void
+camStageFrame(cam_stage_t *s, const struct timeval *capture)
 {
+   double period;
 
-   char *p;
+   if (s->state != CAM_STAGE_LANDED) return;
 
-   if (str == NULL) 
-      return NULL;
+   period = 1.0 / (s->rate_sent == TRUE && s->sent_rate > 0 ? s->sent_rate :
+	 (serv_info->frame_rate > 0 ? serv_info->frame_rate :
+	  DEFAULT_FRAME_RATE));
+   if (camElapsed(&s->landed, capture) < period) return;
 
-   for (p = str; (*p && isspace(*p)); p++)
-      ;
+   camStageCommit(s);
+}
 
-   return p;
+/*
+ * Frame rate ceiling.  The camera integrates while it reads the previous
+ * frame out, so the frame period can be no shorter than the readout of
+ * the window, nor than the exposure plus the fixed overhead of a frame.
+ * The main loop must also be done with a frame before the next one
+ * arrives.  Only FRAME_RATE_MARGIN of the resulting rate is deemed safe.
+ * The window is the one the camera sends: the guide raster is cropped by
+ * the frame grabber and does not shorten the readout.
+ */
+#define DEFAULT_PCLOCK_MHZ 40.0
+#define DEFAULT_READOUT_LINE_CLOCKS 16.0
+#define DEFAULT_READOUT_FRAME_US 50.0
+#define FRAME_RATE_MARGIN 0.95
+
+typedef struct {
+   double readout;              /* s, each term of the frame period */
+   double exposure;
+   double proc;
+   double rate;                 /* Hz, highest safe rate */
+} frame_limit_t;
+
+/*
+ * Ceiling of the frame rate for an exposure time (ms)
+ */
+static void
+frameRateLimit(double exptime, frame_limit_t *lim)
+{
+   double pclock = serv_info->pclock_mhz > 0 ? serv_info->pclock_mhz :
+      DEFAULT_PCLOCK_MHZ;
+   double period;
+
+   lim->readout = serv_info->readout_height *
+      (serv_info->readout_width + serv_info->readout_line_clocks) /
+      (pclock * 1e6) + serv_info->readout_frame_us * 1e-6;
+   lim->exposure = exptime * 1e-3 + serv_info->readout_frame_us * 1e-6;
+   lim->proc = serv_info->proc_time;
+
+   period = lim->readout;
+   if (lim->exposure > period) period = lim->exposure;
+   if (lim->proc > period) period = lim->proc;
+   lim->rate = FRAME_RATE_MARGIN / period;
 }
 
-/* 
- * Trim off trailing whitespace in a string 
+/*
+ * Exposure time (ms) and frame rate (Hz) the camera will run with, the
+ * staged values when there are
  */
-   char *
-rtrim(char *str) 
+static double
+frameExptime(void)
 {
+   return cam_stage.exptime_staged == TRUE ? cam_stage.exptime :
+      serv_info->exposure_time;
+}
 
-   int i;
+static double
+frameRate(void)
+{
+   return cam_stage.rate_staged == TRUE ? cam_stage.rate :
+      serv_info->frame_rate;
+}
 
-   if (str != NULL) {
-      for (i = strlen(str) - 1; (i >= 0 && isspace(str[i])); i--)
-	 ;
-      str[++i] = '\0';
-   }   
+/*
+ * Shortest exposure time (ms) reaching a signal to noise ratio on the
+ * guide star, scaled from the flux of the last centroid fit.  The noise
+ * is the photon noise of the star, the read noise and, once a dark is
+ * subtracted, the photon noise of the background in an aperture of
+ * radius FWHM.  Without a dark the fitted background is mostly the
+ * detector offset, which is not noise.
+ */
+static PASSFAIL
+snrExptime(double snr, double *exptime)
+{
+   double fwhm, npix, star, bkg, rn2, b, c;
+   float fwhm_x, fwhm_y;
 
-   return str;
+   if (serv_info->psf_flux <= 0 || serv_info->exposure_time <= 0) {
+      return FAIL;
+   }
+   psfFwhm(&fwhm_x, &fwhm_y);
+   fwhm = (fwhm_x > 0 && fwhm_y > 0) ? (fwhm_x + fwhm_y) / 2 :
+      DEFAULT_PSF_FWHM;
+   npix = M_PI * fwhm * fwhm;
+
+   /* e- per ms */
+   star = serv_info->psf_flux * serv_info->det_gain /
+      serv_info->exposure_time;
+   bkg = (serv_info->dark_file[0] != '\0' && serv_info->psf_bkg > 0) ?
+      serv_info->psf_bkg * serv_info->det_gain / serv_info->exposure_time :
+      0;
+   rn2 = serv_info->det_read_noise * serv_info->det_read_noise;
+
+   /* snr^2 (star t + npix (bkg t + rn2)) = (star t)^2 */
+   b = snr * snr * (star + npix * bkg);
+   c = snr * snr * npix * rn2;
+   *exptime = (b + sqrt(b * b + 4 * star * star * c)) / (2 * star * star);
+   return PASS;
 }
 
-
-/* 
- * Trim off all leading and trailing whitespace from a string 
+/*
+ * Get an item from the snapshot and the age of its value (s).  With fresh
+ * set a read of the camera is queued first and refreshing tells whether
+ * the value answered is older than that read: it is not before the worker
+ * runs, the read is then done right away.  FAIL is returned when the
+ * value was never read or when the last command of this item failed.
  */
-   char *
-trim(char *str) 
+static PASSFAIL
+camQuery(cam_worker_t *w, cam_item_t item, BOOLEAN fresh, double *age,
+      BOOLEAN *refreshing)
 {
+   struct timeval now;
 
-   return rtrim(ltrim(str));
+   *refreshing = FALSE;
+   if (fresh == TRUE) {
+      if (camSubmit(w, CAM_PRIO_USER, item, FALSE, 0, camJobDone) != PASS) {
+	 return FAIL;
+      }
+      *refreshing = w->running;
+   }
+   if (w->last_status[item] != PASS || w->stamp[item].tv_sec == 0) {
+      return FAIL;
+   }
+   gettimeofday(&now, NULL);
+   *age = camElapsed(&w->stamp[item], &now);
+   return PASS;
+}
+
+/*
+ * Format the reply to the query of an item
+ */
+static void
+camReply(char *buffer, const char *cmd, cam_item_t item, BOOLEAN fresh)
+{
+   BOOLEAN refreshing;
+   double age;
+   int used;
+
+   if (camQuery(&cam_worker, item, fresh, &age, &refreshing) != PASS) {
+      if (refreshing == TRUE) {
+	 sprintf(buffer, "%c %s \"Reading %s from the camera, ask again\"",
+	       FAIL_CHAR, cmd, cam_item_name[item]);
+      }
+      else {
+	 sprintf(buffer, "%c %s \"Unable to read %s in the camera\"",
+	       FAIL_CHAR, cmd, cam_item_name[item]);
+      }
+      return;
+   }
+   switch (item) {
+   case CAM_EXPTIME:
+      used = sprintf(buffer, "%c %s %.9f AGE=%.1f", PASS_CHAR, cmd,
+	    cam_worker.value[item], age);
+      break;
+   case CAM_FRAMERATE:
+      used = sprintf(buffer, "%c %s %5.2f AGE=%.1f", PASS_CHAR, cmd,
+	    cam_worker.value[item], age);
+      break;
+   default:
+      used = sprintf(buffer, "%c %s %4.1f degrees C AGE=%.1f", PASS_CHAR,
+	    cmd, cam_worker.value[item], age);
+      break;
+   }
+   if (refreshing == TRUE) sprintf(buffer + used, " REFRESHING");
 }
 
+/*
+ * Format the whole snapshot, <item>=<value>/<age s> or <item>=UNKNOWN,
+ * after the poll intervals
+ */
+static int
+camFormatSnapshot(char *buf, cam_worker_t *w)
+{
+   struct timeval now;
+   int used, i;
+
+   gettimeofday(&now, NULL);
+   used = sprintf(buf, " POLL=%g/%g", w->interval[CAM_TEMP],
+	 w->interval[CAM_EXPTIME]);
+   for (i = 0; i < CAM_ITEMS; i++) {
+      if (w->last_status[i] != PASS || w->stamp[i].tv_sec == 0) {
+	 used += sprintf(buf + used, " %s=UNKNOWN", cam_item_key[i]);
+      }
+      else if (i == CAM_GAINMODE) {
+	 used += sprintf(buf + used, " %s=%s/%.1f", cam_item_key[i],
+	       w->value[i] == HIGHGAIN ? "HIGH" : "LOW",
+	       camElapsed(&w->stamp[i], &now));
+      }
+      else {
+	 used += sprintf(buf + used, " %s=%.3f/%.1f", cam_item_key[i],
+	       w->value[i], camElapsed(&w->stamp[i], &now));
+      }
+   }
+   return used;
+}
 
-   char ** 
-stringSplit(char *a_str, const char a_delim)
+/*
+ * Parse the background read intervals, [POLL] <temperature s>
+ * [<settings s>], 0 to never read.  The settings interval defaults to
+ * DEFAULT_POLL_SETTINGS.
+ */
+static PASSFAIL
+camPollParse(int argc, char **argv, double *poll_temp, double *poll_settings)
 {
-   char** result    = 0;
-   size_t count     = 0;
-   char* tmp        = a_str;
-   char* last_comma = 0;
-   char delim[2];
-   delim[0] = a_delim;
-   delim[1] = 0;
+   char *stop_at = NULL;
 
-   //printf("%s\n",a_str);
-   /* Count how many elements will be extracted. */
-   while (*tmp)
-   {
-      if (a_delim == *tmp)
-      {
-	 count++;
-	 last_comma = tmp;
-      }
-      tmp++;
+   if (argc > 0 && !strcasecmp(argv[0], "POLL")) {
+      argc--;
+      argv++;
    }
+   if (argc < 1 || argc > 2) return FAIL;
+   *poll_temp = strtod(argv[0], &stop_at);
+   if (*stop_at != '\0' || *poll_temp < 0) return FAIL;
+   *poll_settings = DEFAULT_POLL_SETTINGS;
+   if (argc == 2) {
+      *poll_settings = strtod(argv[1], &stop_at);
+      if (*stop_at != '\0' || *poll_settings < 0) return FAIL;
+   }
+   return PASS;
+}
 
-   /* Add space for trailing token. */
-   count += last_comma < (a_str + strlen(a_str) - 1);
-
-   /* Add space for terminating null string so caller
-      knows where the list of returned strings ends. */
-   count++;
+/*
+ * Bring up of the camera at startup.  The FAST mode reads the registers
+ * the server sets, once, and only writes and verifies the ones that differ
+ * from their target, so that a restart with the camera already set up
+ * costs a few dozen short serial commands.  It falls back to the FULL
+ * mode, which sets and reads back everything, when anything goes wrong.
+ * The bring up runs on its own thread while the rest of the server
+ * starts.
+ */
+#define CAM_INIT_REGS 8
 
-   result = malloc(sizeof(char*) * count);
+typedef enum {
+   CAM_INIT_FAST,
+   CAM_INIT_FULL
+} cam_init_mode_t;
 
-   if (result)
-   {
-      size_t idx  = 0;
-      char* token = strtok(a_str, delim);
+typedef struct {
+   const char *name;
+   u_char addr;
+   int size;                    /* bytes, most significant first */
+   unsigned long value;         /* target */
+   unsigned long current;       /* read from the camera */
+} cam_init_reg_t;
 
-      while (token)
-      {
-	 assert(idx < count);
-	 *(result + idx++) = strdup(token);
-	 token = strtok(0, delim);
-      }
-      assert(idx == count - 1);
-      *(result + idx) = 0;
-   }
+typedef struct {
+   cam_init_mode_t mode;
+   BOOLEAN bitload;             /* bitfile loaded in the board */
+   PASSFAIL status;
+   int gain_mode;               /* read back from the camera */
+   int digital_gain;
+   int nregs;
+   int nwritten;
+   double board_ms;             /* time spent in each phase */
+   double status_ms;
+   double calib_ms;
+   double read_ms;
+   double write_ms;
+   double verify_ms;
+   double total_ms;
+} cam_init_t;
+
+static double
+camInitMs(struct timeval *since)
+{
+   struct timeval now;
+   double ms;
 
-   return result;
+   gettimeofday(&now, NULL);
+   ms = camElapsed(since, &now) * 1e3;
+   *since = now;
+   return ms;
 }
 
-
 /*
- * Deallocate a client object
+ * Returns whether the board already runs the bitfile of the camera
+ * configuration, in which case it is not loaded again
  */
-   static void 
-deallocateClient(void *data) 
+static BOOLEAN
+camInitBoardReady(EdtDev *edt_p, const Dependent *dd_p)
 {
-   client_info_t *cinfo = (client_info_t *)data;
-
-   if (data == NULL) {
-      return;
-   }
-
-   if (cinfo->hostname != NULL) {
-      free(cinfo->hostname);
-   }
-   free(cinfo);
+   char loaded[256];
+   const char *want, *have;
+
+   if (dd_p->rbtfile[0] == '\0') return FALSE;
+   loaded[0] = '\0';
+   if (edt_get_bitname(edt_p, loaded, sizeof(loaded)) != 0 ||
+       loaded[0] == '\0') {
+      return FALSE;
+   }
+   want = strrchr(dd_p->rbtfile, '/');
+   want = (want != NULL) ? want + 1 : dd_p->rbtfile;
+   have = strrchr(loaded, '/');
+   have = (have != NULL) ? have + 1 : loaded;
+   return strcmp(want, have) == 0 ? TRUE : FALSE;
 }
 
-
 /*
- * Callback function used to compare two pointers.  This function is 
- * used within the list comparison utilities.
+ * Registers set by the server and their target values
  */
-   static int
-comparePointer(const void *a, const void *b)
+static int
+camInitPlan(cam_init_reg_t *regs, const owl_calib_t *calib)
 {
-   if (a < b)
-      return -1;
-   else if (a > b)
-      return 1;
-   else
-      return 0;
+   float slope = (calib->dac40 - calib->dac0) / (40);
+   float tec = DEFAULT_TEC_SETPOINT * slope + calib->dac0;
+   int n = 0;
+
+#define CAM_INIT_REG(n_, a_, s_, v_) \
+   regs[n].name = n_; regs[n].addr = a_; regs[n].size = s_; \
+   regs[n].value = v_; n++
+
+   CAM_INIT_REG("NUC", OWL_REG_NUC, 1, OWL_NUC_OFF);
+   CAM_INIT_REG("AUTO_LEVEL", OWL_REG_AUTO_LEVEL, 1, 0);
+   CAM_INIT_REG("FPGA_CTRL", OWL_REG_FPGA_CTRL, 1, OWL_FPGA_TEC_ON);
+   CAM_INIT_REG("GAIN_MODE", OWL_REG_GAIN_MODE, 1, OWL_GAIN_MODE_HIGH);
+   /* The set point registers are in reverse order */
+   CAM_INIT_REG("TEC_SETPOINT", OWL_REG_TEC_SETPOINT_LSB, 2,
+	 ((unsigned long)tec & 0xff) << 8 | ((unsigned long)tec >> 8 & 0xff));
+   CAM_INIT_REG("DIGITAL_GAIN", OWL_REG_DIGITAL_GAIN, 2,
+	 DEFAULT_DIGITAL_GAIN * 256);
+   CAM_INIT_REG("EXPOSURE", OWL_REG_EXPOSURE, 4,
+	 (unsigned long)(DEFAULT_EXPOSURE_TIME * 40e3));
+   CAM_INIT_REG("FRAME_RATE", OWL_REG_FRAME_RATE, 4,
+	 (unsigned long)(40e8 / (unsigned long)(DEFAULT_FRAME_RATE * 100)));
+#undef CAM_INIT_REG
+
+   return n;
 }
 
-
 /*
- * Perform a write across the serial channel and read back the response
+ * Write the exposure (40 MHz counts) and the frame rate (Hz) through
+ * their setters, in the order of camStageSend: an exposure shorter than
+ * the current one before the period, a longer one after it, so that a
+ * camera left running keeps its exposure within its period
  */
-static PASSFAIL 
-pdvSerialWriteRead(char *ibuf_p, char **response){
+static PASSFAIL
+camInitTiming(unsigned long exposure, unsigned long current,
+      BOOLEAN set_exposure, BOOLEAN set_rate)
+{
+   BOOLEAN shorter = (set_exposure == TRUE && exposure <= current);
 
-   int timeout = SERIALTIMEOUT;
-   int ret, i;
-   int length=0;
-   static char temp[256];
-   char buf[SERBUFSIZE+1];
-   u_char hbuf[SERBUFSIZE];
-   u_char lastbyte, waitc;
-   u_int val;
+   if (shorter == TRUE && setGuiderExptime(exposure) != PASS) return FAIL;
+   if (set_rate == TRUE && setGuiderFrameRate(DEFAULT_FRAME_RATE) != PASS) {
+      return FAIL;
+   }
+   if (set_exposure == TRUE && shorter == FALSE &&
+       setGuiderExptime(exposure) != PASS) {
+      return FAIL;
+   }
+   return PASS;
+}
 
+/*
+ * Read the registers and write the ones that differ, then read these back
+ */
+static PASSFAIL
+camInitFast(cam_init_t *init)
+{
+   cam_init_reg_t regs[CAM_INIT_REGS];
+   const owl_calib_t *calib;
+   struct timeval t;
+   unsigned long check;
+   int i, exposure = -1, rate = -1;
+
+   gettimeofday(&t, NULL);
+   if (checkCameraStatus() != PASS) return FAIL;
+   init->status_ms = camInitMs(&t);
+
+   if ((calib = owlCalibration()) == NULL) return FAIL;
+   init->calib_ms = camInitMs(&t);
+
+   init->nregs = camInitPlan(regs, calib);
+   for (i = 0; i < init->nregs; i++) {
+      if (regReadValue(regs[i].addr, regs[i].size, &regs[i].current) != PASS) {
+	 return FAIL;
+      }
+   }
+   init->read_ms = camInitMs(&t);
 
-   temp[0] = '\0';
+   init->nwritten = 0;
+   for (i = 0; i < init->nregs; i++) {
+      if (regs[i].current == regs[i].value) continue;
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	    "(%s:%d) camera %s is %0*lx, set to %0*lx", __FILE__, __LINE__,
+	    regs[i].name, 2 * regs[i].size, regs[i].current,
+	    2 * regs[i].size, regs[i].value);
+      init->nwritten++;
+      if (regs[i].addr == OWL_REG_EXPOSURE) exposure = i;
+      else if (regs[i].addr == OWL_REG_FRAME_RATE) rate = i;
+      else if (regWriteValue(regs[i].addr, regs[i].size, regs[i].value)
+	       != PASS) {
+	 return FAIL;
+      }
+   }
+   if (camInitTiming(exposure >= 0 ? regs[exposure].value : 0,
+	    exposure >= 0 ? regs[exposure].current : 0,
+	    exposure >= 0 ? TRUE : FALSE, rate >= 0 ? TRUE : FALSE) != PASS) {
+      return FAIL;
+   }
+   init->write_ms = camInitMs(&t);
 
-   /* 
-    * open a handle to the device     
-    */
-   if (serv_info->pdv_p == NULL) {
-      if ((serv_info->pdv_p = pdv_open_channel(EDT_INTERFACE, 
-		  UNIT, CHANNEL)) == NULL) {
+   for (i = 0; i < init->nregs; i++) {
+      if (regs[i].current == regs[i].value) continue;
+      if (regReadValue(regs[i].addr, regs[i].size, &check) != PASS ||
+	  check != regs[i].value) {
 	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	       "(%s:%d) pdv_open_channel request failed",
-	       __FILE__, __LINE__);
+	       "(%s:%d) camera %s does not read back as set",
+	       __FILE__, __LINE__, regs[i].name);
 	 return FAIL;
       }
    }
+   init->verify_ms = camInitMs(&t);
 
-   /*
-    * Enable reading across the serial interface
-    */
-   pdv_serial_read_enable(serv_info->pdv_p);
+   init->gain_mode = HIGHGAIN;
+   init->digital_gain = DEFAULT_DIGITAL_GAIN;
+   serv_info->tec_setpoint = DEFAULT_TEC_SETPOINT;
+   serv_info->exposure_time = DEFAULT_EXPOSURE_TIME;
+   serv_info->frame_rate = DEFAULT_FRAME_RATE;
+   return PASS;
+}
+
+/*
+ * Set every register and read back the gains
+ */
+static PASSFAIL
+camInitFull(cam_init_t *init)
+{
+   unsigned long exposure;
 
    /*
-    * Get the timeout value from EDT card configuration if it is too short
+    * Check the system status from the camera
     */
-   if (timeout < 1) {
-      timeout = serv_info->pdv_p->dd_p->serial_timeout;
+   if (checkCameraStatus() != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_ERROR,
+	    "(%s:%d) there is no response from the camera when checking"
+	    " the camera status", __FILE__, __LINE__);
+      return FAIL;
    }
    cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	 "(%s:%d) serial timeout value = %d",
-	 __FILE__, __LINE__, timeout);
+	 "(%s:%d) camera status OK", __FILE__, __LINE__);
 
    /*
-    * Set the baud rate for the serial channel
+    * Read the temperature calibration once for all
     */
-   pdv_set_baud(serv_info->pdv_p, BAUD);
+   if (owlCalibration() == NULL) {
+      cfht_logv(CFHT_MAIN, CFHT_ERROR,
+	    "(%s:%d) not able to get the camera calibration",
+	    __FILE__, __LINE__);
+      return FAIL;
+   }
 
    /* 
-    * Flush any junk on the interface 
+    * Turn off non-uniform correction
     */
-   (void)pdv_serial_read(serv_info->pdv_p, buf, SERBUFSIZE);
+   if (setGuiderNUC(0) != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_ERROR,
+	    "(%s:%d) not able to set NUC status", 
+	    __FILE__, __LINE__);
+      return FAIL;
+
+   }
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	 "(%s:%d) camera NUC turned off", __FILE__, __LINE__);
 
-   i = 0;
+   /* 
+    * Turn off Auto Level 
+    */
+   if (setGuiderAutoLevel(0) != 0) {
+      cfht_logv(CFHT_MAIN, CFHT_ERROR,
+	    "(%s:%d) not able to set camera auto level", 
+	    __FILE__, __LINE__);
+      return FAIL;
 
-   strip_newline(ibuf_p);
+   }
    cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	 "(%s:%d) serial command request = %s",
-	 __FILE__, __LINE__, ibuf_p);
+	 "(%s:%d) camera auto level turned off", __FILE__, __LINE__);
 
    /*
-    * Process the serial input request in order to detect possible errors
-    */ 
-   while (*ibuf_p) {
-      while ((*ibuf_p == ' ') || (*ibuf_p == '\t')) {
-	 ++ibuf_p;
-      }
+    * Enable TEC cooler
+    */
+   if (enableGuiderTEC() != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	    "(%s:%d) enable TEC control failed", 
+	    __FILE__, __LINE__);
+      return FAIL;
+   }
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	 "(%s:%d) camera TEC enabled", 
+	 __FILE__, __LINE__);
 
-      if (*ibuf_p == '\0') {
-	 break;
-      }
+   if (checkCameraStatus() != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_ERROR,
+	    "(%s:%d) there is no response from the camera when checking"
+	    " the camera status", __FILE__, __LINE__);
+      return FAIL;
+   }
 
-      if (sscanf(ibuf_p, "%x", &val) != 1) {
-	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	       "(%s:%d) error reading input byte %d", 
-	       __FILE__, __LINE__, i);
-	 i = 0;
-	 break;
-      }
+   /*
+    * Set the camera to the high gain mode
+    */
+   if (setGuiderGainMode(HIGHGAIN) != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	    "(%s:%d) unable to set camera to high-gain mode",
+	    __FILE__, __LINE__);
+      //return FAIL;
+   }
 
-      if (val > 0xff) {
-	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	       "(%s:%d) hex string format error -- expect hex bytes"
-	       " separated by spaces, e.g. '00 a0 ff ...",
-	       __FILE__, __LINE__);
-	 i = 0;
-	 break;
-      }
-      else {
-	 hbuf[i++] = val;
-      }
+   /*
+    * Read back the gain mode to verify that the guider is in the high
+    * gain mode
+    */
+   if (getGuiderGainMode(&init->gain_mode) != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	    "(%s:%d) unable to retrieve gain mode from the"
+	    " camera", __FILE__, __LINE__);
+      return FAIL;
+   }
+   if (init->gain_mode != HIGHGAIN) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	    "(%s:%d) gain read back from the camera=%d which is not"
+	    " the expected high-gain mode",
+	    __FILE__, __LINE__, init->gain_mode);
+      return FAIL;
+   }
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	 "(%s:%d) camera is set to HIGH gain mode",
+	 __FILE__, __LINE__);
 
-      while ((*ibuf_p != ' ') && (*ibuf_p != '\t') && (*ibuf_p != '\0')) {
-	 ++ibuf_p;
-      }
+   /*
+    * Set a temperature set point
+    */
+   if (setGuiderTECPoint(DEFAULT_TEC_SETPOINT) != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	    "(%s:%d) unable to set the TEC setpoint to %.2f"
+	    " degrees", __FILE__, __LINE__, 
+	    DEFAULT_TEC_SETPOINT);
+      return FAIL;
    }
+   serv_info->tec_setpoint = DEFAULT_TEC_SETPOINT;
+
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	 "(%s:%d) TEC setpoint set to %.2f degrees",
+	 __FILE__, __LINE__, DEFAULT_TEC_SETPOINT);
 
 
    /*
-    * using pdv_serial_binary_command instead of
-    * pdv_serial_write because it prepends a 'c' if FOI
+    * Set the digital gain value to be 1
     */
-   if (i) {
-      if (pdv_serial_binary_command(serv_info->pdv_p, (char *)hbuf, i) != 0) {
-	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	       "(%s:%d) can not send serial binary "
-	       "command to camera", __FILE__, __LINE__);
-	 return FAIL;
-      }
+   if (setDigitalGain(DEFAULT_DIGITAL_GAIN) != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	    "(%s:%d) unable to set default digital gain of %d",
+	    __FILE__, __LINE__, DEFAULT_DIGITAL_GAIN);
+      return FAIL;
    }
 
    /*
-    * serial_timeout comes from the config file (or -t override flag in
-    * this app), or if not present defaults to 500 unless readonly
-    * defaults to 60000
+    * Read back the digital gain value and make sure it matches what is 
+    * expected
     */
-   pdv_serial_wait(serv_info->pdv_p, timeout, 64);
+   if (getDigitalGain(&init->digital_gain) != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	    "(%s:%d) unable to retrieve digital gain from the"
+	    " camera", __FILE__, __LINE__);
+      return FAIL;
+   }
+   if (init->digital_gain != DEFAULT_DIGITAL_GAIN) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	    "(%s:%d) digital gain retrieved from the camera does not"
+	    " match what is expected (%d != %d)", 
+	    __FILE__, __LINE__, init->digital_gain, DEFAULT_DIGITAL_GAIN);
+      return FAIL;
+   }
 
    /*
-    * Handle the response
+    * Set the default exposure time to be 10 milliseconds and the default
+    * frame rate to be 50 Hz, in the order that keeps the exposure within
+    * the period of the camera
     */
-   lastbyte = 0;
-   do {
-      ret = pdv_serial_read(serv_info->pdv_p, buf, SERBUFSIZE);
-      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
-	    "(%s:%d) read returned %d",
-	    __FILE__, __LINE__, ret);
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	 "(%s:%d) attempting to set the exposure time to %.3f ms and the "
+	 "frame rate to %5.2f Hz", __FILE__, __LINE__, DEFAULT_EXPOSURE_TIME,
+	 DEFAULT_FRAME_RATE);
+   if (getGuiderExptime(&exposure) != PASS ||
+       camInitTiming((unsigned long)(DEFAULT_EXPOSURE_TIME * 40e3), exposure,
+	     TRUE, TRUE) != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	    "(%s:%d) unable to set exposure time to %.3f ms and frame rate "
+	    "to %5.2f Hz", __FILE__, __LINE__, DEFAULT_EXPOSURE_TIME,
+	    DEFAULT_FRAME_RATE);
+      return FAIL;
+   }
+   serv_info->exposure_time = DEFAULT_EXPOSURE_TIME;
+   serv_info->frame_rate = DEFAULT_FRAME_RATE;
+
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	 "(%s:%d) exposure time in camera set to %.3f ms, frame rate to "
+	 "%5.2f Hz", __FILE__, __LINE__, serv_info->exposure_time,
+	 serv_info->frame_rate);
+
+   return PASS;
+}
 
-      if (*buf) {
-	 lastbyte = (u_char)buf[strlen(buf)-1];
+/*
+ * Body of the camera bring up thread
+ */
+static void *
+camInitThread(void *p_args)
+{
+   cam_init_t *init = (cam_init_t *)p_args;
+   struct timeval start, t;
+
+   gettimeofday(&start, NULL);
+   t = start;
+   init->status = FAIL;
+   if (init->mode == CAM_INIT_FAST) {
+      if ((init->status = camInitFast(init)) != PASS) {
+	 cfht_logv(CFHT_MAIN, CFHT_WARN,
+	       "(%s:%d) fast camera initialization failed, setting every"
+	       " register", __FILE__, __LINE__);
+	 init->mode = CAM_INIT_FULL;
       }
+   }
+   if (init->mode == CAM_INIT_FULL) {
+      gettimeofday(&t, NULL);
+      init->status = camInitFull(init);
+      init->write_ms = camInitMs(&t);
+   }
+   init->total_ms = init->board_ms + camInitMs(&start);
 
-      if (ret != 0) {
-	 int i;
+   if (init->status == PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	    "(%s:%d) camera %s initialization in %.0f ms: board %.0f ms"
+	    " (bitfile %s), status %.0f ms, calibration %.0f ms, read %d"
+	    " registers %.0f ms, wrote %d %.0f ms, verified %.0f ms",
+	    __FILE__, __LINE__,
+	    init->mode == CAM_INIT_FAST ? "fast" : "full", init->total_ms,
+	    init->board_ms, init->bitload == TRUE ? "loaded" : "skipped",
+	    init->status_ms, init->calib_ms, init->nregs, init->read_ms,
+	    init->nwritten, init->write_ms, init->verify_ms);
+   }
+   return NULL;
+}
 
-	 buf[ret + 1] = 0;
+#ifdef UNUSED_CODE
+/*
+ * Process the guider image
+ */
+static PASSFAIL
+detrendImage(unsigned char *raw,  unsigned char *flat,  unsigned char *dark,  unsigned char *mask){
 
-	 if (ret) {
-	    for (i = 0; i < ret; i++) {
-	       sprintf(temp, "%s %02x", temp,(u_char) buf[i]);
-	    }
-	 }
-	 length += ret;
-      }
+   int i,size;
+   unsigned char val;
 
-      if (serv_info->pdv_p->devid == PDVFOI_ID) {
-	 ret = pdv_serial_wait(serv_info->pdv_p, 500, 0);
-      } else if (pdv_get_waitchar(serv_info->pdv_p, &waitc) && 
-	    (lastbyte == waitc)) {
-	 ret = 0; /* jump out if waitchar is enabled/received */
+
+#ifdef DEBUG
+   printf("Begin processing image....\n");
+#endif //DEBUG
+
+   // TODO: As is this function will not work since the size parameter is
+   //       never set.
+
+   /* Go through each pixel */
+   for (i=0;i<size;i++){
+      val=raw[i];
+      val=val-dark[i];
+      val=val/flat[i];
+      val=val/mask[i];
+      //if (i == 20400){printf("pixel value=%f\n",val);}
+
+      if (val > SATURATION){
+	 raw[i]=0;
       }
-      else {
-	 ret = pdv_serial_wait(serv_info->pdv_p, 500, 64);
+      if (val < -SATURATION){
+	 raw[i]=val;
       }
 
-   } while (ret > 0);
-
-   //   pdv_close(serv_info->pdv_p);
-   //   serv_info->pdv_p = NULL;
-
-   *response = trim(temp);
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	 "(%s:%d) response = %s", __FILE__, __LINE__, *response);
+   }
 
    return PASS;
 }
-
+#endif //UNUSED_CODE
 
 /*
- * Check the camera status
+ * Take a snapshot of the server state needed to build the FITS header of
+ * the frame just acquired.  The frame sequence bookkeeping of SAVE 
+ * requests is done here, in acquisition order.
  */
-static PASSFAIL 
-checkCameraStatus(char **response){
-
-   char send_string[256];
-
-   /*
-    * Send the "Get system status" command to the camera
-    */
-   snprintf(send_string, sizeof(send_string)-1, "49 50 19");
-   if (pdvSerialWriteRead(send_string, response) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	    "(%s:%d) there is no response from the camera...check power",
-	    __FILE__, __LINE__);
-      return FAIL;
-
-   }
+static void
+frameInfoSnapshot(frame_info_t *info, const struct timeval *capture)
+{
+   info->capture = *capture;
+   info->image_width = serv_info->image_width;
+   info->image_height = serv_info->image_height;
+   info->exposure_time = serv_info->exposure_time;
+   info->frame_rate = serv_info->frame_rate;
+   info->tec_setpoint = serv_info->tec_setpoint;
+   info->det_temp = cam_worker.stamp[CAM_TEMP].tv_sec != 0 ?
+      cam_worker.value[CAM_TEMP] : fh_fits_real_null;
+   info->cam_settings = cam_stage.generation;
 
-   /*
-    * Set the "set system status (=0x53)" command to the camera
+   /* 
+    * Set the frame sequence to be show acquire unless we are saving images
     */
-   snprintf(send_string, sizeof(send_string)-1, "4f 53 50 4c");
-   if (pdvSerialWriteRead(send_string, response) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	    "(%s:%d) there is no response from the camera...check power",
-	    __FILE__, __LINE__);
-      return FAIL;
-
-   }
+   info->etype_guide = (serv_info->frame_sequence > 0);
+   info->save = (serv_info->frame_save_count > 0);
+   info->save_last = FALSE;
+   info->cube_frames = serv_info->cube_frames;
+   info->cube_flush = serv_info->cube_flush;
+   strncpy(info->fits_comment, serv_info->fits_comment,
+	 sizeof(info->fits_comment));
+   info->frame_sequence = ++(serv_info->frame_sequence);
+
+   info->win_x0 = serv_info->win_x0;
+   info->win_y0 = serv_info->win_y0;
+   info->guide_x0 = serv_info->guide_x0;
+   info->guide_y0 = serv_info->guide_y0;
+   info->null_x = serv_info->null_x;
+   info->null_y = serv_info->null_y;
+   info->guide_on = serv_info->guide_on;
+   info->guide_xoff = serv_info->guide_xoff;
+   info->guide_yoff = serv_info->guide_yoff;
+   info->coadd_count = coadd.depth > 0 ? serv_info->coadd_count : 0;
+   info->coadd_xoff = serv_info->coadd_xoff;
+   info->coadd_yoff = serv_info->coadd_yoff;
+   info->isu_on = serv_info->isu_on;
+   info->isu_mrad_x_delta_setup = serv_info->isu_mrad_x_delta_setup;
+   info->isu_mrad_y_delta_setup = serv_info->isu_mrad_y_delta_setup;
+   info->isu_mrad_x_status = serv_info->isu_mrad_x_status;
+   info->isu_mrad_y_status = serv_info->isu_mrad_y_status;
+   info->exp_on = serv_info->exp_on;
+   strncpy(info->filename, serv_info->filename, sizeof(info->filename));
+   strncpy(info->ra, serv_info->ra, sizeof(info->ra));
+   strncpy(info->dec, serv_info->dec, sizeof(info->dec));
+   info->equinox = serv_info->equinox;
+   info->objmag = serv_info->objmag;
 
    /*
-    * Check the response against the expected response
+    * If the frame count has been reached, clear out the save 
+    * information
     */
-   if (strcmp ("50 4c", *response) != 0) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	    "(%s:%d) expected response not received from the camera",
-	    __FILE__, __LINE__);
-      return FAIL;
+   if (strcmp(serv_info->fits_comment, fh_fits_string_null) &&
+       (serv_info->frame_sequence >= serv_info->frame_save_count)) {
+      serv_info->fits_comment[0] = '\0';
+      serv_info->frame_save_count = 0;
+      serv_info->frame_sequence = 0;
+      info->save_last = info->save;
    }
-
-   return PASS;
 }
 
-
 /*
- * Set the non-uniform image correction state
+ * Format a card, blank padded, into the FITS_CARD_SIZE bytes at card
  */
-static PASSFAIL
-setGuiderNUC(int mode){
+static void
+fitsFormatCard(char *card, const char *key, const char *value,
+      const char *comment)
+{
+   char buf[FITS_CARD_SIZE + 1];
 
-   char send_string[256];
-   char *response;
+   snprintf(buf, sizeof(buf), "%-8.8s= %-*s / %s", key, FITS_VALUE_WIDTH,
+	 value != NULL ? value : "", comment);
+   memset(card, ' ', FITS_CARD_SIZE);
+   memcpy(card, buf, strlen(buf));
+}
 
-   if (mode == 0){
-      snprintf(send_string, sizeof(send_string)-1, "53 e0 02 f9 01 50 19");
-      if (pdvSerialWriteRead(send_string, &response) != PASS) {
-	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	       "(%s:%d) no response from camera when setting NUC state", 
-	       __FILE__, __LINE__);
-	 return FAIL;
-      }
+/*
+ * Append a card to the FITS header template.  The value is already
+ * formatted, a NULL value leaves it undefined.  The offset of the value
+ * field is returned.
+ */
+static size_t
+fitsAddCard(fits_template_t *t, const char *key, const char *value,
+      const char *comment)
+{
+   size_t offset = t->size + FITS_VALUE_OFFSET;
 
-      /* 
-       * Check the response against the expected response
-       */
-      if (strcmp ("50 19", response) != 0){
-	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	       "(%s:%d) not able to turn off camera non-uniform"
-	       " correction", __FILE__, __LINE__);
-	 return FAIL;
-      }
-   } else {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	    "(%s:%d) not able to turn on camera non-uniform correction."
-	    "  Functionality not implemented yet", __FILE__, __LINE__);
-      return FAIL;
-   }
+   /* Always leave room for the END card */
+   assert(t->size + 2 * FITS_CARD_SIZE <= sizeof(t->header));
 
-   return PASS;
+   fitsFormatCard(t->header + t->size, key, value, comment);
+   t->size += FITS_CARD_SIZE;
+   return offset;
 }
 
-
 /*
- * Turn on or off the guider auto level
+ * Template cards of the different types, formatted as fh would
  */
-static PASSFAIL
-setGuiderAutoLevel(int mode) {
+static size_t
+fitsAddInt(fits_template_t *t, const char *key, long value,
+      const char *comment)
+{
+   char buf[32];
 
-   char send_string[256];
-   char *response;
+   snprintf(buf, sizeof(buf), "%*ld", FITS_VALUE_WIDTH, value);
+   return fitsAddCard(t, key, buf, comment);
+}
 
-   if (mode == 0) {
-      snprintf(send_string, sizeof(send_string)-1, "53 e0 02 23 00 50 c2");
-      if (pdvSerialWriteRead(send_string, &response) != PASS) {
-	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	       "(%s:%d) no response from camera when setting auto level"
-	       " state", __FILE__, __LINE__);
-	 return FAIL;
-      }
+static size_t
+fitsAddFlt(fits_template_t *t, const char *key, double value, int digits,
+      const char *comment)
+{
+   char buf[32];
 
-      if (strcmp ("50 c2", response) != 0) {
-	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	       "(%s:%d) not able to turn off camera automatic level", 
-	       __FILE__, __LINE__);
-	 return FAIL;
-      }
-   } else {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	    "(%s:%d) not able to turn on camera automatic level."
-	    "  Functionality not implemented yet", __FILE__, __LINE__);
-      return FAIL;
+   if (value == fh_fits_real_null || !isfinite(value)) {
+      return fitsAddCard(t, key, NULL, comment);
    }
-
-   return PASS;
+   snprintf(buf, sizeof(buf), "%*.*G", FITS_VALUE_WIDTH, digits, value);
+   return fitsAddCard(t, key, buf, comment);
 }
 
-
 /*
- * Enable the TEC cooler
+ * String values are padded to at least width characters so that they can
+ * be patched in place.  A NULL value is left undefined.  Quotes are
+ * doubled as FITS requires, and the value is cut to the 68 characters
+ * that fit in a card once escaped, never in the middle of a doubled quote.
  */
-static PASSFAIL
-enableGuiderTEC(void) {
+#define FITS_STRING_MAX 68
 
-   char send_string[256];
-   char *response;
+static size_t
+fitsAddStr(fits_template_t *t, const char *key, const char *value,
+      int width, const char *comment)
+{
+   char buf[FITS_STRING_MAX + 3];
+   int n = 0;
 
-   snprintf(send_string, sizeof(send_string)-1, "53 e0 02 00 81 50 60");
-   if (pdvSerialWriteRead(send_string, &response) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	    "(%s:%d) no response from camera when enabling the TEC cooler",
-	    __FILE__, __LINE__);
-      return FAIL;
+   if (value == NULL) {
+      return fitsAddCard(t, key, NULL, comment);
    }
+   if (width < 8) width = 8;
+   if (width > FITS_STRING_MAX) width = FITS_STRING_MAX;
 
-   if (strcmp ("50 60", response) != 0) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	    "(%s:%d) can not enable TEC cooler", 
-	    __FILE__, __LINE__);
-      return FAIL;
+   buf[0] = '\'';
+   for (; *value != '\0'; value++) {
+      if (n + (*value == '\'' ? 2 : 1) > FITS_STRING_MAX) break;
+      buf[1 + n++] = *value;
+      if (*value == '\'') buf[1 + n++] = '\'';
    }
-
-   return PASS;
+   while (n < width) buf[1 + n++] = ' ';
+   buf[1 + n] = '\'';
+   buf[2 + n] = '\0';
+   return fitsAddCard(t, key, buf, comment);
 }
 
-
 /*
- * Set the guider TEC temperature set point
+ * Right justify an integer in a numeric value field
  */
-static PASSFAIL
-setGuiderTECPoint(float temp){
+static void
+fitsPatchInt(char *field, long value)
+{
+   char *p = field + FITS_VALUE_WIDTH;
+   unsigned long u = value < 0 ? -(unsigned long)value : (unsigned long)value;
 
-   char hexstring[50];
-   char longreps[256];
-   char strtmp[3];
+   do {
+      *--p = '0' + u % 10;
+      u /= 10;
+   } while (u != 0 && p > field);
+   if (value < 0 && p > field) *--p = '-';
+   while (p > field) *--p = ' ';
+}
 
-   char *response;
-   char string[256];
-   char cmdstring[256];
-   char **tokens;
+/*
+ * Right justify a real number with a fixed number of decimals in a numeric
+ * value field.  fh_fits_real_null leaves the value undefined, as does a
+ * NaN or an infinity, which FITS cannot represent.
+ */
+static void
+fitsPatchFixed(char *field, double value, int decimals)
+{
+   static const double scale[] = { 1, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6 };
+   char *p = field + FITS_VALUE_WIDTH;
+   unsigned long long u;
+   BOOLEAN negative;
+   int i;
 
-   unsigned int dac40d, dac0d;
-   unsigned int comd0[6]={0x53,0xe0,0x02,0xfb,0x00,0x50};
-   unsigned int comd1[6]={0x53,0xe0,0x02,0xfa,0x00,0x50};
+   if (value == fh_fits_real_null || !isfinite(value)) {
+      memset(field, ' ', FITS_VALUE_WIDTH);
+      return;
+   }
+   negative = value < 0;
+   if (fabs(value) * scale[decimals] > 1e17) {
+      char buf[32];
 
-   unsigned int valtmp, csum0, csum1;
+      snprintf(buf, sizeof(buf), "%*.*G", FITS_VALUE_WIDTH, 13, value);
+      memcpy(field, buf, FITS_VALUE_WIDTH);
+      return;
+   }
+   u = (unsigned long long)(fabs(value) * scale[decimals] + 0.5);
+   for (i = 0; i < decimals; i++) {
+      *--p = '0' + u % 10;
+      u /= 10;
+   }
+   *--p = '.';
+   do {
+      *--p = '0' + u % 10;
+      u /= 10;
+   } while (u != 0);
+   if (negative) *--p = '-';
+   while (p > field) *--p = ' ';
+}
 
+/*
+ * Replace the text of a string value of the given width added by fitsAddStr
+ */
+static void
+fitsPatchStr(char *field, const char *value, int width)
+{
+   char *p = field + 1;
+   char *end = p + width;
 
-   float co,slope,count;
+   while (*value != '\0' && p < end) *p++ = *value++;
+   while (p < end) *p++ = ' ';
+}
 
-   hexstring[0] = '\0';
+/*
+ * Collect the values formatted in the template
+ */
+static void
+fitsStaticKey(const frame_info_t *info, fits_static_t *key)
+{
+   memset(key, 0, sizeof(*key));
+   key->image_width = info->image_width;
+   key->image_height = info->image_height;
+   key->exposure_time = info->exposure_time;
+   key->frame_rate = info->frame_rate;
+   key->tec_setpoint = info->tec_setpoint;
+   key->det_temp = info->det_temp;
+   key->cam_settings = info->cam_settings;
+   key->etype_guide = info->etype_guide;
+   strncpy(key->fits_comment, info->fits_comment,
+	 sizeof(key->fits_comment) - 1);
+   key->guide_x0 = info->guide_x0;
+   key->guide_y0 = info->guide_y0;
+   key->null_x = info->null_x;
+   key->null_y = info->null_y;
+   key->exp_on = info->exp_on;
+   if (info->exp_on == TRUE) {
+      strncpy(key->filename, info->filename, sizeof(key->filename) - 1);
+      strncpy(key->ra, info->ra, sizeof(key->ra) - 1);
+      strncpy(key->dec, info->dec, sizeof(key->dec) - 1);
+      key->equinox = info->equinox;
+      key->objmag = info->objmag;
+   }
+}
 
-   /* 
-    * Getting manufacturing data from camera 
-    */
-   snprintf(string, sizeof(string)-1, "53 ae 05 01 00 00 02 00 50 ab");
-   if (pdvSerialWriteRead(string, &response) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	    "(%s:%d) error occurred sending %s to the camera",
-	    __FILE__, __LINE__, string);
-      return FAIL;
+/*
+ * Build the header template for the values in key.  The per frame cards
+ * are left undefined, they are patched by fitsPatchFrame.  The header of a
+ * cube has a third axis, patched when the cube is written, and announces
+ * the table extension.
+ */
+static void
+fitsBuildTemplate(fits_template_t *t, const fits_static_t *key, BOOLEAN cube)
+{
+   size_t *o = t->offset;
+
+   t->size = 0;
+   t->key = *key;
+   t->date_sec = -1;
+
+   fitsAddCard(t, "SIMPLE", "                   T", "Standard FITS");
+   fitsAddInt(t, "BITPIX", 16,"16-bit data");
+   fitsAddInt(t, "NAXIS",  cube ? 3 : 2, "Number of axes");
+   fitsAddInt(t, "NAXIS1", key->image_width, "Number of pixel columns");
+   fitsAddInt(t, "NAXIS2", key->image_height, "Number of pixel rows");
+   if (cube == TRUE) {
+      o[FC_NAXIS3] = fitsAddCard(t, "NAXIS3", NULL, "Number of frames");
+      fitsAddCard(t, "EXTEND", "                   T",
+	    "Frame table in extension");
+   }
+   fitsAddInt(t, "PCOUNT", 0, "No 'random' parameters");
+   fitsAddInt(t, "GCOUNT", 1, "Only one group");
+   o[FC_DATE] = fitsAddStr(t, "DATE", "", FITS_DATE_WIDTH,
+	 "UTC Date of file creation");
+   o[FC_HSTTIME] = fitsAddStr(t, "HSTTIME", "", FITS_HSTTIME_WIDTH,
+	 "Local time in Hawaii");
+   o[FC_UNIXTIME] = fitsAddCard(t, "UNIXTIME", NULL,
+	 "Fractional UNIX timestamp when image was taken");
+   fitsAddStr(t, "ORIGIN", "CFHT", 8, "Canada-France-Hawaii Telescope");
+   fitsAddFlt(t, "BZERO", 32768.0, 6, "Zero factor");
+   fitsAddFlt(t, "BSCALE", 1.0, 2, "Scale factor");
+   fitsAddFlt(t, "ETIME", key->exposure_time, 6, "Integration time (ms)");
+   fitsAddStr(t, "ETYPE", key->etype_guide ? "GUIDE" : "ACQUIRE", 8,
+	 "Exposure type");
+   fitsAddStr(t, "IMGINFO", strcmp(key->fits_comment, fh_fits_string_null) ?
+	 key->fits_comment : NULL, 8, "Sequence details");
+   fitsAddFlt(t, "FRMRATE", key->frame_rate, 4, "Requested frame rate (Hz)");
+   fitsAddInt(t, "CAMSET", key->cam_settings,
+	 "Exposure time and frame rate changes");
+   fitsAddFlt(t, "TEMP", key->tec_setpoint, 6, "TEC cooler setpoint (C)");
+   fitsAddFlt(t, "DETTEMP", key->det_temp, 2, "Sensor temperature (C)");
+   o[FC_SEQNUM] = fitsAddCard(t, "SEQNUM", NULL, "Frame sequence number");
+   fitsAddFlt(t, "PIXSCALE", PIXSCALE, 5, "Pixel scale (arcseconds / pixel)");
+   o[FC_WIN_X0] = fitsAddCard(t, "WIN_X0", NULL,
+	 "X0 coordinate for the camera raster");
+   o[FC_WIN_Y0] = fitsAddCard(t, "WIN_Y0", NULL,
+	 "Y0 coordinate for the camera raster");
+   o[FC_WIN_X1] = fitsAddCard(t, "WIN_X1", NULL,
+	 "X1 coordinate for the camera raster");
+   o[FC_WIN_Y1] = fitsAddCard(t, "WIN_Y1", NULL,
+	 "Y1 coordinate for the camera raster");
+   fitsAddInt(t, "GUIDE_X0", key->guide_x0,
+	 "X0 coordinate for the guide raster");
+   fitsAddInt(t, "GUIDE_Y0", key->guide_y0,
+	 "Y0 coordinate for the guide raster");
+   fitsAddInt(t, "GUIDE_X1", key->guide_x0 + GUIDE_SIZE_X - 1,
+	 "X1 coordinate for the guide raster");
+   fitsAddInt(t, "GUIDE_Y1", key->guide_y0 + GUIDE_SIZE_Y - 1,
+	 "Y1 coordinate for the guide raster");
+   fitsAddFlt(t, "NULLX", key->null_x, 5,
+	 "Null position (center of aperture hole in X");
+   fitsAddFlt(t, "NULLY", key->null_y, 5,
+	 "Null position (center of aperture hole in Y");
+   o[FC_GD_XOFF] = fitsAddCard(t, "GD_XOFF", NULL, "Guide star offset in X");
+   o[FC_GD_YOFF] = fitsAddCard(t, "GD_YOFF", NULL, "Guide star offset in Y");
+   o[FC_GD_NCOAD] = fitsAddCard(t, "GD_NCOAD", NULL,
+	 "Number of frames in the guide co-add");
+   o[FC_GD_CXOFF] = fitsAddCard(t, "GD_CXOFF", NULL,
+	 "Co-added guide star offset in X");
+   o[FC_GD_CYOFF] = fitsAddCard(t, "GD_CYOFF", NULL,
+	 "Co-added guide star offset in Y");
+   o[FC_SMRAD_X] = fitsAddCard(t, "SMRAD_X", NULL,
+	 "delta X position sent to the ISU in mrad");
+   o[FC_SMRAD_Y] = fitsAddCard(t, "SMRAD_Y", NULL,
+	 "delta Y position sent to the ISU in mrad");
+   o[FC_RMRAD_X] = fitsAddCard(t, "RMRAD_X", NULL,
+	 "X position read from the ISU in mrad");
+   o[FC_RMRAD_Y] = fitsAddCard(t, "RMRAD_Y", NULL,
+	 "Y position read from the ISU in mrad");
+   if (key->exp_on == TRUE) {
+      fitsAddStr(t, "FILENAME", strcmp(key->filename, fh_fits_string_null) ?
+	    key->filename : NULL, 8, "Observation file name");
+      fitsAddStr(t, "RA", strcmp(key->ra, fh_fits_string_null) ?
+	    key->ra : NULL, 8, "Telescope right ascension");
+      fitsAddStr(t, "DEC", strcmp(key->dec, fh_fits_string_null) ?
+	    key->dec : NULL, 8, "Telescope declination");
+      fitsAddFlt(t, "EQUINOX", key->equinox, 5, "Equinox");
+      fitsAddFlt(t, "OBJMAG", key->objmag, 5, "Object magnitude");
    }
-   snprintf(string, sizeof(string)-1, "53 af 12 50 be");
-   if (pdvSerialWriteRead(string, &response) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	    "(%s:%d) error occurred sending %s to the camera",
-	    __FILE__, __LINE__, string);
-      return FAIL;
+   else {
+      fitsAddStr(t, "FILENAME", NULL, 8, "Observation file name");
+      fitsAddStr(t, "RA", NULL, 8, "Telescope right ascension");
+      fitsAddStr(t, "DEC", NULL, 8, "Telescope declination");
+      fitsAddFlt(t, "EQUINOX", fh_fits_real_null, 5, "Equinox");
+      fitsAddFlt(t, "OBJMAG", fh_fits_real_null, 5, "Object magnitude");
    }
-   strncpy(longreps, response, sizeof(longreps));
-   tokens = stringSplit(longreps, ' ');
-   snprintf(hexstring, sizeof(hexstring)-1, "%s%s", 
-	 *(tokens+17), *(tokens+16));
-   dac40d = strtoul(hexstring, 0, 16);
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	 "(%s:%d) DAC40d --> HEX = %s value=%i",
-	 __FILE__, __LINE__, hexstring, dac40d);
-   snprintf(hexstring, sizeof(hexstring)-1, "%s%s",
-	 *(tokens+15), *(tokens+14));
-   dac0d = strtoul(hexstring, 0, 16);
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	 "(%s:%d) DAC0d --> HEX = %s value=%i",
-	 __FILE__, __LINE__, hexstring, dac0d);
-   free(tokens);
 
-   slope = (dac40d - dac0d) / (40);
-   co = dac0d;
-   count = temp * slope + co;
+   /* END card and blank cards up to the end of the block */
+   memset(t->header + t->size, ' ', sizeof(t->header) - t->size);
+   memcpy(t->header + t->size, "END", 3);
+   t->size = (t->size + FITS_CARD_SIZE + FITS_BLOCK_SIZE - 1) /
+      FITS_BLOCK_SIZE * FITS_BLOCK_SIZE;
 
-   snprintf(hexstring, sizeof(hexstring)-1, "%04lx", (unsigned long)(count));
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	 "(%s:%d) hexstring = %s value=%f",
-	 __FILE__, __LINE__, hexstring, count);
+   t->valid = TRUE;
+}
 
-   /*
-    * Preparing serial command 
-    */
+/*
+ * Convert the pixels to FITS: unsigned values are stored signed with
+ * BZERO 32768, big endian.  Flipping the sign bit and swapping the bytes
+ * is the same as swapping first and flipping bit 7.
+ */
+static void
+fitsConvertScalar(uint16_t *out, const uint16_t *in, int npix)
+{
+   int i;
 
-   /* 
-    * Command line 1 
-    */
-   strncpy(strtmp, hexstring, 2);
-   strtmp[2] = '\0';
-   valtmp = strtoul(strtmp, 0, 16);
-   csum0 = comd0[0] ^ comd0[1] ^ comd0[2] ^ comd0[3] ^ valtmp ^ comd0[5];
+   for (i = 0; i < npix; i++) {
+      uint16_t v = in[i] ^ 0x8000;
+      out[i] = (uint16_t)((v >> 8) | (v << 8));
+   }
+}
 
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	 "(%s:%d) comd= %02x %02x %02x %02x %02x %02x %02x",
-	 __FILE__, __LINE__, comd0[0], comd0[1], comd0[2], comd0[3],
-	 valtmp, comd0[5], csum0);
+#ifdef __SSE2__
+static void
+fitsConvertSSE2(uint16_t *out, const uint16_t *in, int npix)
+{
+   const __m128i sign = _mm_set1_epi16(0x0080);
+   int i = 0;
 
-   snprintf(cmdstring, sizeof(cmdstring)-1, 
-	 "%02x %02x %02x %02x %02x %02x %02x",
-	 comd0[0], comd0[1], comd0[2], comd0[3], valtmp, comd0[5], csum0);
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	 "(%s:%d) command=%s", __FILE__, __LINE__, cmdstring);
+   /* The buffers are not always 16 bytes aligned within a cube */
+   for (; i + 16 <= npix; i += 16) {
+      __m128i a = _mm_loadu_si128((const __m128i *)(in + i));
+      __m128i b = _mm_loadu_si128((const __m128i *)(in + i + 8));
 
-   if (pdvSerialWriteRead(cmdstring, &response) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	    "(%s:%d) not able to send command to camera", 
-	    __FILE__, __LINE__);
-      return FAIL;
+      a = _mm_or_si128(_mm_slli_epi16(a, 8), _mm_srli_epi16(a, 8));
+      b = _mm_or_si128(_mm_slli_epi16(b, 8), _mm_srli_epi16(b, 8));
+      _mm_storeu_si128((__m128i *)(out + i), _mm_xor_si128(a, sign));
+      _mm_storeu_si128((__m128i *)(out + i + 8), _mm_xor_si128(b, sign));
    }
+   fitsConvertScalar(out + i, in + i, npix - i);
+}
+#endif // __SSE2__
 
-   /* 
-    * Command line 2 
-    */
-   snprintf(hexstring, sizeof(hexstring), "%04lx", (unsigned long)(count));
-   strncpy(strtmp, hexstring + 2, 3);
-   strtmp[2] = '\0';
-   valtmp = strtoul(strtmp, 0, 16);
-
-   csum1 = comd1[0] ^ comd1[1] ^ comd1[2] ^ comd1[3] ^ valtmp ^ comd1[5];
+#ifdef HAVE_AVX2_KERNELS
+/*
+ * Built for AVX2 whatever the compiler flags, only called when the CPU
+ * has it
+ */
+__attribute__((target("avx2"))) static void
+fitsConvertAVX2(uint16_t *out, const uint16_t *in, int npix)
+{
+   const __m256i swap = _mm256_setr_epi8(
+	 1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+	 1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+   const __m256i sign = _mm256_set1_epi16(0x0080);
+   int i = 0;
+
+   for (; i + 32 <= npix; i += 32) {
+      __m256i a = _mm256_loadu_si256((const __m256i *)(in + i));
+      __m256i b = _mm256_loadu_si256((const __m256i *)(in + i + 16));
+
+      a = _mm256_xor_si256(_mm256_shuffle_epi8(a, swap), sign);
+      b = _mm256_xor_si256(_mm256_shuffle_epi8(b, swap), sign);
+      _mm256_storeu_si256((__m256i *)(out + i), a);
+      _mm256_storeu_si256((__m256i *)(out + i + 16), b);
+   }
+   fitsConvertScalar(out + i, in + i, npix - i);
+}
+#endif // HAVE_AVX2_KERNELS
 
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	 "(%s:%d) comd= %02x %02x %02x %02x %02x %02x %02x",
-	 __FILE__, __LINE__, comd1[0], comd1[1], comd1[2], comd1[3],
-	 valtmp, comd1[5], csum1);
+/*
+ * Conversion kernels, best last.  The one used is selected at startup by
+ * fitsConvertSelect.
+ */
+typedef struct {
+   const char *name;
+   void (*convert)(uint16_t *out, const uint16_t *in, int npix);
+   BOOLEAN avx2;                /* needs a CPU with AVX2 */
+} fits_kernel_t;
+
+static const fits_kernel_t fits_kernels[] = {
+   { "SCALAR", fitsConvertScalar, FALSE },
+#ifdef __SSE2__
+   { "SSE2", fitsConvertSSE2, FALSE },
+#endif // __SSE2__
+#ifdef HAVE_AVX2_KERNELS
+   { "AVX2", fitsConvertAVX2, TRUE },
+#endif // HAVE_AVX2_KERNELS
+};
+#define FITS_KERNELS ((int)(sizeof(fits_kernels) / sizeof(fits_kernels[0])))
 
-   snprintf(cmdstring, sizeof(cmdstring)-1, 
-	 "%02x %02x %02x %02x %02x %02x %02x",
-	 comd1[0], comd1[1], comd1[2], comd1[3], valtmp, comd1[5], csum1);
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	 "(%s:%d) command=%s", __FILE__, __LINE__, cmdstring);
+static const fits_kernel_t *fits_kernel = &fits_kernels[0];
 
-   if (pdvSerialWriteRead(cmdstring, &response) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	    "(%s:%d) not able to send command to camera", 
-	    __FILE__, __LINE__);
-      return FAIL;
+static BOOLEAN
+fitsKernelSupported(const fits_kernel_t *k)
+{
+#ifdef HAVE_AVX2_KERNELS
+   if (k->avx2 == TRUE) {
+      __builtin_cpu_init();
+      return __builtin_cpu_supports("avx2") ? TRUE : FALSE;
    }
-
-   return PASS;
+#endif // HAVE_AVX2_KERNELS
+   return TRUE;
 }
 
-
-/* 
- * Get the guider TEC set point
+/*
+ * Select the best kernel the CPU supports.  This is called before the
+ * threads that convert pixels are started.
  */
-static PASSFAIL 
-getGuiderTECPoint(float *temp) {
-
-   char hexstring[50];
-   char longreps[256];
-
-   char *response;
-   char string[256];
-   char **tokens;
-   unsigned long dac40d, dac0d;
+static void
+fitsConvertSelect(void)
+{
+   int i;
 
-   float value, slope, co;
+   for (i = 0; i < FITS_KERNELS; i++) {
+      if (fitsKernelSupported(&fits_kernels[i]) == TRUE) {
+	 fits_kernel = &fits_kernels[i];
+      }
+   }
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	 "(%s:%d) FITS pixels converted by the %s kernel",
+	 __FILE__, __LINE__, fits_kernel->name);
+}
 
-   hexstring[0] = '\0';
+static void
+fitsConvertPixels(uint16_t *out, const uint16_t *in, int npix)
+{
+   fits_kernel->convert(out, in, npix);
+}
 
-   /* 
-    * Getting manufacturing data from camera 
-    */
-   snprintf(string, sizeof(string)-1, "53 ae 05 01 00 00 02 00 50 ab");
-   if (pdvSerialWriteRead(string, &response) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	    "(%s:%d) error occurred sending %s to the camera",
-	    __FILE__, __LINE__, string);
-      return FAIL;
-   }
-   snprintf(string, sizeof(string)-1, "53 af 12 50 be");
-   if (pdvSerialWriteRead(string, &response) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	    "(%s:%d) error occurred sending %s to the camera",
-	    __FILE__, __LINE__, string);
+/*
+ * Time the conversion kernels on a guide raster and on a full frame, in
+ * microseconds per frame, after checking they all give the result of the
+ * scalar one.  The result is written in reply, of size len.
+ */
+static PASSFAIL
+fitsConvertBench(char *reply, size_t len)
+{
+   static const int sizes[][3] = {
+      { GUIDE_SIZE_X, GUIDE_SIZE_Y, 20000 },
+      { SIZE_X, SIZE_Y, 200 }
+   };
+   uint16_t *in = NULL, *ref = NULL, *out = NULL;
+   struct timespec t0, t1;
+   size_t used = 0;
+   double us[2];
+   int i, k, n, npix;
+
+   npix = SIZE_X * SIZE_Y;
+   if (posix_memalign((void **)&in, 64, npix * sizeof(uint16_t)) != 0 ||
+       posix_memalign((void **)&ref, 64, npix * sizeof(uint16_t)) != 0 ||
+       posix_memalign((void **)&out, 64, npix * sizeof(uint16_t)) != 0) {
+      free(in);
+      free(ref);
+      snprintf(reply, len, "unable to allocate the buffers");
       return FAIL;
    }
-   strncpy(longreps, response, sizeof(longreps));
-   tokens = stringSplit(longreps, ' ');
-   snprintf(hexstring, sizeof(hexstring)-1, "%s%s", 
-	 *(tokens+17), *(tokens+16));
-   dac40d = strtoul(hexstring, 0, 16);
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	 "(%s:%d) DAC40d --> HEX = %s value=%lu",
-	 __FILE__, __LINE__, hexstring, dac40d);
-   snprintf(hexstring, sizeof(hexstring)-1, "%s%s",
-	 *(tokens+15), *(tokens+14));
-   dac0d = strtoul(hexstring, 0, 16);
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	 "(%s:%d) DAC0d --> HEX = %s value=%lu",
-	 __FILE__, __LINE__, hexstring, dac0d);
-   free(tokens);
+   for (i = 0; i < npix; i++) in[i] = (uint16_t)(i * 2654435761u >> 16);
+   fitsConvertScalar(ref, in, npix);
+
+   used += snprintf(reply + used, len - used, "KERNEL=%s", fits_kernel->name);
+   for (k = 0; k < FITS_KERNELS; k++) {
+      if (fitsKernelSupported(&fits_kernels[k]) == FALSE) continue;
+
+      /* An odd count also exercises the scalar tail */
+      memset(out, 0, npix * sizeof(uint16_t));
+      fits_kernels[k].convert(out, in, npix - 3);
+      if (memcmp(out, ref, (npix - 3) * sizeof(uint16_t)) != 0) {
+	 snprintf(reply, len, "%s kernel gives wrong pixels",
+	       fits_kernels[k].name);
+	 free(in);
+	 free(ref);
+	 free(out);
+	 return FAIL;
+      }
 
-   /* Reading Current TEC setpoint */
-   snprintf(string, sizeof(string)-1, "53 e0 01 fb 50 19");
-   if (pdvSerialWriteRead(string, &response) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	    "(%s:%d) error occurred sending %s to the camera",
-	    __FILE__, __LINE__, string);
-      return FAIL;
-   }
-   snprintf(string, sizeof(string)-1, "53 e1 01 50 e3");
-   if (pdvSerialWriteRead(string, &response) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	    "(%s:%d) error occurred sending %s to the camera",
-	    __FILE__, __LINE__, string);
-      return FAIL;
+      for (i = 0; i < 2; i++) {
+	 npix = sizes[i][0] * sizes[i][1];
+	 clock_gettime(CLOCK_MONOTONIC, &t0);
+	 for (n = 0; n < sizes[i][2]; n++) {
+	    fits_kernels[k].convert(out, in, npix);
+	    __asm__ __volatile__("" : : "r"(out) : "memory");
+	 }
+	 clock_gettime(CLOCK_MONOTONIC, &t1);
+	 us[i] = ((t1.tv_sec - t0.tv_sec) * 1e6 +
+	       (t1.tv_nsec - t0.tv_nsec) * 1e-3) / sizes[i][2];
+      }
+      npix = SIZE_X * SIZE_Y;
+      used += snprintf(reply + used, len - used, " %s=%.2f/%.1fus",
+	    fits_kernels[k].name, us[0], us[1]);
    }
-   strncpy(longreps, response, sizeof(longreps));
-   tokens = stringSplit(longreps, ' ');
-   snprintf(hexstring, sizeof(hexstring)-1, "%s", *(tokens));
-   free(tokens);
+   free(in);
+   free(ref);
+   free(out);
+   return PASS;
+}
 
-   snprintf(string, sizeof(string)-1, "53 e0 01 fa 50 18");
-   if (pdvSerialWriteRead(string, &response) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	    "(%s:%d) error occurred sending %s to the camera",
-	    __FILE__, __LINE__, string);
-      return FAIL;
-   }
-   snprintf(string, sizeof(string)-1, "53 e1 01 50 e3");
-   if (pdvSerialWriteRead(string, &response) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	    "(%s:%d) error occurred sending %s to the camera",
-	    __FILE__, __LINE__, string);
-      return FAIL;
+/*
+ * Make sure there are enough conversion buffers for frames of the given
+ * size.  The buffers are sized for a full raster frame and never freed,
+ * since the pipe may still reference a spliced one.  The number of vmsplice
+ * buffers covers a pipe capacity plus the frame being written.
+ */
+static PASSFAIL
+fitsOutputPrepare(fits_output_t *out, size_t frame_bytes)
+{
+   struct stat st;
+   int nslots;
+
+   if (out->checked == FALSE) {
+      out->checked = TRUE;
+      out->frame_bytes = FITS_HEADER_BLOCKS * FITS_BLOCK_SIZE +
+	 SIZE_X * SIZE_Y * sizeof(uint16_t);
+      out->fifo = fstat(STDOUT_FILENO, &st) == 0 && S_ISFIFO(st.st_mode);
+      if (out->fifo) {
+	 out->pipe_size = fcntl(STDOUT_FILENO, F_GETPIPE_SZ);
+	 if (out->pipe_size <= 0) out->fifo = FALSE;
+      }
+      if (out->vmsplice == TRUE && out->fifo == FALSE) {
+	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	       "(%s:%d) STDOUT is not a pipe, vmsplice is not used",
+	       __FILE__, __LINE__);
+      }
+      if (posix_memalign((void **)&out->copy, 4096, out->frame_bytes) != 0) {
+	 out->copy = NULL;
+      }
    }
-   strncpy(longreps, response, sizeof(longreps));
-   tokens = stringSplit(longreps, ' ');
-   snprintf(string, sizeof(string)-1, "%s", hexstring);
-   snprintf(hexstring, sizeof(hexstring)-1, "%s%s", string, *(tokens));
-   free(tokens);
-
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	 "(%s:%d) HEX = %s", __FILE__, __LINE__, hexstring);
-   value = (float)strtoul(hexstring, 0, 16);
-   slope = (40.0) / ((float)dac40d - (float)dac0d);
-   co = -(slope * (float)dac0d);
+   if (out->copy == NULL || frame_bytes > out->frame_bytes) return FAIL;
 
-   *temp = (slope * value) + co;
+   if (out->vmsplice == FALSE || out->fifo == FALSE) return PASS;
+   nslots = out->pipe_size / frame_bytes + 2;
+   if (nslots > FITS_OUTPUT_MAX_SLOTS) nslots = FITS_OUTPUT_MAX_SLOTS;
+   while (out->nslots < nslots) {
+      fits_slot_t *slot = &out->slots[out->nslots];
 
+      if (posix_memalign((void **)&slot->data, 4096, out->frame_bytes) != 0) {
+	 break;
+      }
+      slot->spliced_at = -1;
+      out->nslots++;
+   }
    return PASS;
 }
 
-
 /*
- * Set the frame rate for the guider
+ * Next vmsplice buffer if it is no longer referenced by the pipe, NULL if
+ * the frame must be copied with writev
+ */
+static fits_slot_t *
+fitsOutputSlot(fits_output_t *out)
+{
+   fits_slot_t *slot;
+
+   if (out->nslots == 0) return NULL;
+   slot = &out->slots[out->next];
+   if (slot->spliced_at >= 0 &&
+       out->out_bytes - slot->spliced_at < out->pipe_size) {
+      return NULL;
+   }
+   out->next = (out->next + 1) % out->nslots;
+   return slot;
+}
+
+/*
+ * Send the whole vector, with writev or vmsplice
  */
 static PASSFAIL
-setGuiderFrameRate(double count) {
-
-   unsigned char hexstring[20];
-   char string[80];
-   char *response;
-
-   char strtmp[3];
+fitsOutputWrite(fits_output_t *out, struct iovec *iov, int iovcnt,
+      BOOLEAN splice)
+{
+   ssize_t n;
 
-   unsigned int comd0[6]={0x53,0xe0,0x02,0xdd,0x00,0x50};
-   unsigned int comd1[6]={0x53,0xe0,0x02,0xde,0x00,0x50};
-   unsigned int comd2[6]={0x53,0xe0,0x02,0xdf,0x00,0x50};
-   unsigned int comd3[6]={0x53,0xe0,0x02,0xe0,0x00,0x50};
+   while (iovcnt > 0) {
+      n = splice ? vmsplice(STDOUT_FILENO, iov, iovcnt, 0) :
+	 writev(STDOUT_FILENO, iov, iovcnt);
+      if (n < 0) {
+	 if (errno == EINTR) continue;
+	 return FAIL;
+      }
+      out->out_bytes += n;
 
-   unsigned int valtmp, csum0, csum1, csum2, csum3;
+      /* Skip what was written, the rest is sent again */
+      while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+	 n -= iov->iov_len;
+	 iov++;
+	 iovcnt--;
+      }
+      if (iovcnt > 0) {
+	 iov->iov_base = (char *)iov->iov_base + n;
+	 iov->iov_len -= n;
+      }
+   }
+   return PASS;
+}
 
-   snprintf((char *)hexstring, sizeof(hexstring)-1, "%08lx",
-	 (unsigned long)(40e8/(unsigned long)(count*100)));
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	 "(%s:%d) hexstring = %s value=%f count = %lu", 
-	 __FILE__, __LINE__, hexstring, count,
-	 (unsigned long)(40e8/(unsigned long)(count*100)));
+/*
+ * Patch the per frame cards of a header template with the values of a
+ * frame
+ */
+static void
+fitsPatchFrame(fits_template_t *t, const frame_info_t *info)
+{
+   char *h = t->header;
 
    /*
-    * Preparing serial command 
-    */
-
-   /* 
-    * Command line 1 
+    * The dates only change once per second
     */
-   strncpy(strtmp, (char *)hexstring, 2);
-   strtmp[2] = '\0';
-
-   valtmp = strtoul(strtmp, 0, 16);
-
-   csum0 = comd0[0] ^ comd0[1] ^ comd0[2] ^ comd0[3] ^ valtmp ^ comd0[5];
+   if (info->capture.tv_sec != t->date_sec) {
+      time_t date = info->capture.tv_sec;
+      struct tm tm;
+      char fitscard[FH_MAX_STRLEN];
+
+      strftime(fitscard, sizeof(fitscard)-1, "%Y-%m-%dT%T",
+	    gmtime_r(&date, &tm));
+      fitsPatchStr(h + t->offset[FC_DATE], fitscard, FITS_DATE_WIDTH);
+      strftime(fitscard, sizeof(fitscard)-1, "%a %b %d %H:%M:%S %Z %Y",
+	    localtime_r(&date, &tm));
+      fitsPatchStr(h + t->offset[FC_HSTTIME], fitscard, FITS_HSTTIME_WIDTH);
+      t->date_sec = info->capture.tv_sec;
+   }
+
+   fitsPatchFixed(h + t->offset[FC_UNIXTIME],
+	 info->capture.tv_sec + (info->capture.tv_usec / 1000000.0), 6);
+   fitsPatchInt(h + t->offset[FC_SEQNUM], info->frame_sequence);
+   fitsPatchInt(h + t->offset[FC_WIN_X0], info->win_x0);
+   fitsPatchInt(h + t->offset[FC_WIN_Y0], info->win_y0);
+   fitsPatchInt(h + t->offset[FC_WIN_X1],
+	 info->win_x0 + info->image_width - 1);
+   fitsPatchInt(h + t->offset[FC_WIN_Y1],
+	 info->win_y0 + info->image_height - 1);
+   fitsPatchFixed(h + t->offset[FC_GD_XOFF],
+	 info->guide_on ? info->guide_xoff : fh_fits_real_null, 5);
+   fitsPatchFixed(h + t->offset[FC_GD_YOFF],
+	 info->guide_on ? info->guide_yoff : fh_fits_real_null, 5);
+   fitsPatchInt(h + t->offset[FC_GD_NCOAD], info->coadd_count);
+   fitsPatchFixed(h + t->offset[FC_GD_CXOFF],
+	 info->guide_on && info->coadd_count > 0 ?
+	 info->coadd_xoff : fh_fits_real_null, 5);
+   fitsPatchFixed(h + t->offset[FC_GD_CYOFF],
+	 info->guide_on && info->coadd_count > 0 ?
+	 info->coadd_yoff : fh_fits_real_null, 5);
+   fitsPatchFixed(h + t->offset[FC_SMRAD_X],
+	 info->isu_on ? info->isu_mrad_x_delta_setup : fh_fits_real_null, 5);
+   fitsPatchFixed(h + t->offset[FC_SMRAD_Y],
+	 info->isu_on ? info->isu_mrad_y_delta_setup : fh_fits_real_null, 5);
+   fitsPatchFixed(h + t->offset[FC_RMRAD_X],
+	 info->isu_on ? info->isu_mrad_x_status : fh_fits_real_null, 5);
+   fitsPatchFixed(h + t->offset[FC_RMRAD_Y],
+	 info->isu_on ? info->isu_mrad_y_status : fh_fits_real_null, 5);
+}
 
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	 "(%s:%d) comd= %02x %02x %02x %02x %02x %02x %02x",
-	 __FILE__, __LINE__, comd0[0], comd0[1], comd0[2],
-	 comd0[3], valtmp, comd0[5], csum0);
+/*
+ * Take a pointer to image data and create a FITS image using this data
+ * and send it to STDOUT.  The header template is rebuilt only when one of
+ * its values changed, otherwise only the per frame cards are patched.
+ */
+static PASSFAIL
+writeFITSImage(const frame_info_t *info, unsigned short *image_p) {
 
-   snprintf(string, sizeof(string)-1, "%02x %02x %02x %02x %02x %02x %02x",
-	 comd0[0], comd0[1], comd0[2], comd0[3], valtmp, comd0[5], csum0);
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	 "(%s:%d) command = %s", __FILE__, __LINE__, string);
+   static fits_template_t t;
+   static const char zero[FITS_BLOCK_SIZE];
+   fits_static_t key;
+   fits_slot_t *slot;
+   struct iovec iov[3];
+   char *h, *buf;
+   int npix = info->image_width * info->image_height;
+   size_t pix_bytes = npix * sizeof(uint16_t);
 
-   if (pdvSerialWriteRead(string, &response) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	    "(%s:%d) not able to send command to camera", 
-	    __FILE__, __LINE__);
-      return FAIL;
+   fitsStaticKey(info, &key);
+   if (t.valid == FALSE || memcmp(&key, &t.key, sizeof(key)) != 0) {
+      fitsBuildTemplate(&t, &key, FALSE);
    }
+   fitsPatchFrame(&t, info);
+   h = t.header;
 
-   /* 
-    * Command line 2 
+   /*
+    * Convert the pixels next to a copy of the header when the frame is
+    * spliced, as the template is patched again for the next frame
     */
-   snprintf((char *)hexstring, sizeof(hexstring)-1, "%08lx",
-	 (unsigned long)(40e8/(unsigned long)(count*100)));
-   strncpy(strtmp, (char *)hexstring + 2, 3);
-   strtmp[2] = '\0';
-   valtmp = strtoul(strtmp, 0, 16);
-
-   csum1 = comd1[0] ^ comd1[1] ^ comd1[2] ^ comd1[3] ^ valtmp ^ comd1[5];
-
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	 "(%s:%d) comd= %02x %02x %02x %02x %02x %02x %02x",
-	 __FILE__, __LINE__, comd1[0], comd1[1], comd1[2],
-	 comd1[3], valtmp, comd1[5], csum1);
-
-   snprintf(string, sizeof(string)-1, "%02x %02x %02x %02x %02x %02x %02x",
-	 comd1[0], comd1[1], comd1[2], comd1[3], valtmp, comd1[5], csum1);
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	 "(%s:%d) command = %s", __FILE__, __LINE__, string);
-
-   if (pdvSerialWriteRead(string, &response) != PASS) {
+   if (fitsOutputPrepare(&fits_output, sizeof(t.header) + pix_bytes)
+       != PASS) {
       cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	    "(%s:%d) not able to send command to camera", 
-	    __FILE__, __LINE__);
+		"(%s:%d) unable to allocate the FITS output buffers",
+		__FILE__, __LINE__);
       return FAIL;
    }
-
-   /* 
-    * Command line 3 
-    */
-   snprintf((char *)hexstring, sizeof(hexstring)-1, "%08lx",
-	 (unsigned long)(40e8/(unsigned long)(count*100)));
-   strncpy(strtmp, (char *)hexstring + 4, 2);
-   strtmp[2] = '\0';
-   valtmp = strtoul(strtmp, 0, 16);
-
-   csum2 = comd2[0] ^ comd2[1] ^ comd2[2] ^ comd2[3] ^ valtmp ^ comd2[5];
-
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	 "(%s:%d) comd= %02x %02x %02x %02x %02x %02x %02x",
-	 __FILE__, __LINE__, comd2[0], comd2[1], comd2[2],
-	 comd2[3], valtmp, comd2[5], csum2);
-
-   snprintf(string, sizeof(string)-1, "%02x %02x %02x %02x %02x %02x %02x",
-	 comd2[0], comd2[1], comd2[2], comd2[3], valtmp, comd2[5], csum2);
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	 "(%s:%d) command = %s", __FILE__, __LINE__, string);
-
-   if (pdvSerialWriteRead(string, &response) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	    "(%s:%d) not able to send command to camera", 
-	    __FILE__, __LINE__);
-      return FAIL;
+   slot = fitsOutputSlot(&fits_output);
+   buf = slot != NULL ? slot->data : fits_output.copy;
+   if (slot != NULL) {
+      memcpy(buf, h, t.size);
+      iov[0].iov_base = buf;
    }
+   else {
+      iov[0].iov_base = h;
+   }
+   iov[0].iov_len = t.size;
+   fitsConvertPixels((uint16_t *)(buf + sizeof(t.header)), image_p, npix);
+   iov[1].iov_base = buf + sizeof(t.header);
+   iov[1].iov_len = pix_bytes;
+   iov[2].iov_base = (void *)zero;
+   iov[2].iov_len = (FITS_BLOCK_SIZE - pix_bytes % FITS_BLOCK_SIZE) %
+      FITS_BLOCK_SIZE;
 
    /* 
-    * Command line 4 
+    * Write out the header, the image data and the padding at once
     */
-   snprintf((char *)hexstring, sizeof(hexstring)-1, "%08lx",
-	 (unsigned long)(40e8/(unsigned long)(count*100)));
-   strncpy(strtmp, (char *)(hexstring+6), 2);
-   strtmp[2] = '\0';
-   valtmp = strtoul(strtmp, 0, 16);
-
-   csum3 = comd3[0] ^ comd3[1] ^ comd3[2] ^ comd3[3] ^ valtmp ^ comd3[5];
-
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	 "(%s:%d) comd= %02x %02x %02x %02x %02x %02x %02x",
-	 __FILE__, __LINE__, comd3[0], comd3[1], comd3[2],
-	 comd3[3], valtmp, comd3[5], csum3);
-
-   snprintf(string, sizeof(string)-1, "%02x %02x %02x %02x %02x %02x %02x",
-	 comd3[0], comd3[1], comd3[2], comd3[3], valtmp, comd3[5], csum3);
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	 "(%s:%d) command = %s", __FILE__, __LINE__, string);
-
-   if (pdvSerialWriteRead(string, &response) != PASS) {
+   if (fitsOutputWrite(&fits_output, iov, iov[2].iov_len ? 3 : 2,
+	    slot != NULL) != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) unable to write FITS image", __FILE__, __LINE__);
       cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	    "(%s:%d) not able to send command to camera", 
-	    __FILE__, __LINE__);
+		"%s (errno=%d)", strerror(errno), errno);
       return FAIL;
    }
-
+   if (slot != NULL) {
+      slot->spliced_at = fits_output.out_bytes;
+      fits_output.spliced++;
+   }
+   else {
+      fits_output.copied++;
+   }
+   
    return PASS;
 }
 
 
 /*
- * Get the frame rate for the guide camera 
+ * Compress a frame with the cards of a header template into a FITS file
+ * in memory: an empty primary HDU followed by the Rice compressed image,
+ * which starts at *hdu when hdu is not NULL.  The structural cards of the
+ * template are written by cfitsio.  The buffer is kept for the next
+ * frames and grown by cfitsio when needed.
  */
-static PASSFAIL 
-getGuiderFrameRate(double *count){
-   unsigned long value;
-   char hexstring[50]="";
-   char longreps[256];
-
-   char *string=NULL;
-   char *response=NULL;
-   char **tokens;
-
-   hexstring[0] = '\0';
-
+static PASSFAIL
+fitsCompressImage(const fits_template_t *t, unsigned short *image_p,
+      int width, int height, void **data, size_t *alloc, size_t *size,
+      size_t *hdu)
+{
+   static const char *skip[] = { "SIMPLE ", "XTENSION", "BITPIX ", "NAXIS",
+      "PCOUNT ", "GCOUNT ", "BZERO ", "BSCALE ", "EXTEND ", NULL };
+   fitsfile *fptr;
+   long naxes[2];
+   LONGLONG headstart, datastart, dataend;
+   char card[FITS_CARD_SIZE + 1];
+   char errmsg[FLEN_ERRMSG];
+   size_t pos;
+   int status = 0;
+   int i;
 
-   //snprintf(string, sizeof(string)-1, "53 e0 01 dd 50 3f");
-   string="53 e0 01 dd 50 3f";
-   if (pdvSerialWriteRead(string, &response) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	    "(%s:%d) error occurred sending %s to the camera",
-	    __FILE__, __LINE__, string);
-      return FAIL;
-   }
-   //snprintf(string, sizeof(string)-1, "53 e1 01 50 e3");
-   string="53 e1 01 50 e3";
-   if (pdvSerialWriteRead(string, &response) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	    "(%s:%d) error occurred sending %s to the camera",
-	    __FILE__, __LINE__, string);
-      return FAIL;
-   }
-   strncpy(longreps, response, sizeof(longreps));
-   tokens = stringSplit(longreps, ' ');
-   //snprintf(string, sizeof(string)-1, "%s", hexstring);
-   //snprintf(hexstring, sizeof(hexstring)-1, "%s%s",
-   //    string, *(tokens));
-   sprintf(hexstring,"%s%s",hexstring,*(tokens));
-   free(tokens);
-
-   //snprintf(string, sizeof(string)-1, "53 e0 01 de 50 3c");
-   string = "53 e0 01 de 50 3c";
-   if (pdvSerialWriteRead(string, &response) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	    "(%s:%d) error occurred sending %s to the camera",
-	    __FILE__, __LINE__, string);
-      return FAIL;
-   }
-   //snprintf(string, sizeof(string)-1, "53 e1 01 50 e3");
-   string = "53 e1 01 50 e3";
-   if (pdvSerialWriteRead(string, &response) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	    "(%s:%d) error occurred sending %s to the camera",
-	    __FILE__, __LINE__, string);
-      return FAIL;
-   }
-   strncpy(longreps, response, sizeof(longreps));
-   tokens = stringSplit(longreps, ' ');
-   //snprintf(string, sizeof(string)-1, "%s", hexstring);
-   //    snprintf(hexstring, sizeof(string)-1, "%s%s",
-   // 	    string, *(tokens));
-   sprintf(hexstring,"%s%s",hexstring,*(tokens));
-   free(tokens);
-
-   //snprintf(string, sizeof(string)-1, "53 e0 01 df 50 3d");
-   string = "53 e0 01 df 50 3d";
-   if (pdvSerialWriteRead(string, &response) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	    "(%s:%d) error occurred sending %s to the camera",
-	    __FILE__, __LINE__, string);
-      return FAIL;
-   }
-   //snprintf(string, sizeof(string)-1, "53 e1 01 50 e3");
-   string = "53 e1 01 50 e3";
-   if (pdvSerialWriteRead(string, &response) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	    "(%s:%d) error occurred sending %s to the camera",
-	    __FILE__, __LINE__, string);
-      return FAIL;
-   }
-   strncpy(longreps, response, sizeof(longreps));
-   tokens = stringSplit(longreps, ' ');
-   //snprintf(string, sizeof(string), "%s", hexstring);
-   //    snprintf(hexstring, sizeof(hexstring)-1, "%s%s",
-   // 	    string, *(tokens));
-   sprintf(hexstring,"%s%s",hexstring,*(tokens));
-   free(tokens);
-
-   //snprintf(string, sizeof(string)-1, "53 e0 01 e0 50 02");
-   string = "53 e0 01 e0 50 02";
-   if (pdvSerialWriteRead(string, &response) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	    "(%s:%d) error occurred sending %s to the camera",
-	    __FILE__, __LINE__, string);
-      return FAIL;
+   if (*data == NULL) {
+      *alloc = 2 * FITS_HEADER_BLOCKS * FITS_BLOCK_SIZE +
+	 width * height * sizeof(uint16_t);
+      if ((*data = malloc(*alloc)) == NULL) {
+	 *alloc = 0;
+	 return FAIL;
+      }
    }
-   //snprintf(string, sizeof(string)-1, "53 e1 01 50 e3");
-   string = "53 e1 01 50 e3";
-   if (pdvSerialWriteRead(string, &response) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	    "(%s:%d) error occurred sending %s to the camera",
-	    __FILE__, __LINE__, string);
+   naxes[0] = width;
+   naxes[1] = height;
+
+   fits_create_memfile(&fptr, data, alloc, 16 * FITS_BLOCK_SIZE, realloc,
+	 &status);
+   if (status != 0) {
+      fits_get_errstatus(status, errmsg);
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	    "(%s:%d) unable to create the compressed FITS file: %s",
+	    __FILE__, __LINE__, errmsg);
       return FAIL;
    }
-   strncpy(longreps, response, sizeof(longreps));
-   tokens = stringSplit(longreps, ' ');
-   //snprintf(string, sizeof(string)-1, "%s", hexstring);
-   //    snprintf(hexstring, sizeof(hexstring)-1, "%s%s",
-   // 	    string, *(tokens));
-   sprintf(hexstring,"%s%s",hexstring,*(tokens));
-   free(tokens);
+   fits_create_img(fptr, USHORT_IMG, 0, NULL, &status);
+   fits_set_compression_type(fptr, RICE_1, &status);
+   fits_create_img(fptr, USHORT_IMG, 2, naxes, &status);
+   for (pos = 0; status == 0 && pos < t->size; pos += FITS_CARD_SIZE) {
+      const char *c = t->header + pos;
 
-   value = strtoul(hexstring, 0, 16);
-   if (value == 0){
-      *count = 0;
-   } else{
-      *count = 40e6/value;
+      if (!strncmp(c, "END ", 4)) break;
+      for (i = 0; skip[i] != NULL; i++) {
+	 if (!strncmp(c, skip[i], strlen(skip[i]))) break;
+      }
+      if (skip[i] != NULL) continue;
+      memcpy(card, c, FITS_CARD_SIZE);
+      card[FITS_CARD_SIZE] = '\0';
+      fits_write_record(fptr, card, &status);
+   }
+   fits_write_img(fptr, TUSHORT, 1, (LONGLONG)width * height, image_p,
+	 &status);
+
+   /* The compressed HDU ends the file, on a block boundary */
+   fits_flush_file(fptr, &status);
+   fits_get_hduaddrll(fptr, &headstart, &datastart, &dataend, &status);
+   *size = (size_t)dataend;
+   if (hdu != NULL) *hdu = (size_t)headstart;
+   if (status != 0) {
+      int close_status = 0;
+
+      fits_get_errstatus(status, errmsg);
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	    "(%s:%d) unable to compress the FITS image: %s",
+	    __FILE__, __LINE__, errmsg);
+      fits_close_file(fptr, &close_status);
+      return FAIL;
    }
-
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	 "(%s:%d) hexstring = %s, count = %lu, Frame rate=%4.2f",
-	 __FILE__, __LINE__, hexstring, value, *count);
-
-   return PASS;
+   fits_close_file(fptr, &status);
+   return status == 0 ? PASS : FAIL;
 }
 
-
 /*
- * Set the exposure time for the camera 
+ * Compression of a queued frame, run by a worker or by the FITS writer.
+ * Each thread keeps its own header template.
  */
-static PASSFAIL
-setGuiderExptime(unsigned long count) {
-
-   unsigned char hexstring[20];
-   char string[80];
-   char *response;
-
-   char strtmp[3];
+static void
+fitsCompressJob(fits_template_t *t, fits_job_t *job)
+{
+   fits_static_t key;
 
-   unsigned int comd0[6]={0x53,0xe0,0x02,0xee,0x00,0x50};
-   unsigned int comd1[6]={0x53,0xe0,0x02,0xef,0x00,0x50};
-   unsigned int comd2[6]={0x53,0xe0,0x02,0xf0,0x00,0x50};
-   unsigned int comd3[6]={0x53,0xe0,0x02,0xf1,0x00,0x50};
+   fitsStaticKey(&job->info, &key);
+   if (t->valid == FALSE || memcmp(&key, &t->key, sizeof(key)) != 0) {
+      fitsBuildTemplate(t, &key, FALSE);
+   }
+   fitsPatchFrame(t, &job->info);
+   job->comp_status = fitsCompressImage(t, job->pixels,
+	 job->info.image_width, job->info.image_height, &job->comp_data,
+	 &job->comp_alloc, &job->comp_size, NULL);
+}
 
-   unsigned int valtmp, csum0, csum1, csum2, csum3;
+/*
+ * Store big endian values in a binary table row
+ */
+static unsigned char *
+fitsPutI4(unsigned char *p, int32_t value)
+{
+   uint32_t u = __builtin_bswap32((uint32_t)value);
 
-   snprintf((char *)hexstring, sizeof(hexstring)-1, "%08lx", count);
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	 "(%s:%d) hexstring = %s count = %lu", 
-	 __FILE__, __LINE__, hexstring, count);
+   memcpy(p, &u, sizeof(u));
+   return p + sizeof(u);
+}
 
-   /*
-    * Preparing serial command 
-    */
+static unsigned char *
+fitsPutR4(unsigned char *p, float value)
+{
+   uint32_t u;
 
-   /* 
-    * Command line 1 
-    */
-   strncpy(strtmp, (char *)hexstring, 2);
-   strtmp[2] = '\0';
-   valtmp = strtoul(strtmp, 0, 16);
+   memcpy(&u, &value, sizeof(u));
+   return fitsPutI4(p, (int32_t)u);
+}
 
-   csum0 = comd0[0] ^ comd0[1] ^ comd0[2] ^ comd0[3] ^ valtmp ^ comd0[5];
+static unsigned char *
+fitsPutR8(unsigned char *p, double value)
+{
+   uint64_t u;
 
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	 "comd= %02x %02x %02x %02x %02x %02x %02x",
-	 comd0[0], comd0[1], comd0[2], comd0[3], valtmp, comd0[5], csum0);
+   memcpy(&u, &value, sizeof(u));
+   u = __builtin_bswap64(u);
+   memcpy(p, &u, sizeof(u));
+   return p + sizeof(u);
+}
 
-   snprintf(string, sizeof(string)-1, "%02x %02x %02x %02x %02x %02x %02x",
-	 comd0[0], comd0[1], comd0[2], comd0[3], valtmp, comd0[5], csum0);
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	 "(%s:%d) command = %s", __FILE__, __LINE__, string);
+/*
+ * Write the pending cube: the image with its third axis, then the table
+ * of the per frame values.  Undefined values are NaN in the table.
+ */
+static PASSFAIL
+fitsCubeFlush(fits_cube_t *c)
+{
+   static const struct {
+      const char *type;
+      const char *form;
+      const char *unit;
+   } column[CUBE_TFIELDS] = {
+      { "UNIXTIME", "1D", "s" },
+      { "SEQNUM", "1J", "" },
+      { "WIN_X0", "1J", "pixel" },
+      { "WIN_Y0", "1J", "pixel" },
+      { "GD_XOFF", "1E", "arcsec" },
+      { "GD_YOFF", "1E", "arcsec" },
+      { "SMRAD_X", "1D", "mrad" },
+      { "SMRAD_Y", "1D", "mrad" },
+      { "RMRAD_X", "1D", "mrad" },
+      { "RMRAD_Y", "1D", "mrad" }
+   };
+   static const char zero[FITS_BLOCK_SIZE];
+   static fits_template_t tab;
+   struct iovec iov[6];
+   size_t pix_bytes = c->count * c->frame_bytes;
+   size_t row_bytes = c->count * CUBE_ROW_BYTES;
+   char key[9];
+   int i;
 
-   if (pdvSerialWriteRead(string, &response) != PASS) {
+   if (c->count == 0) return PASS;
+
+   fitsPatchInt(c->t.header + c->t.offset[FC_NAXIS3], c->count);
+
+   tab.size = 0;
+   fitsAddStr(&tab, "XTENSION", "BINTABLE", 8, "Binary table extension");
+   fitsAddInt(&tab, "BITPIX", 8, "8-bit bytes");
+   fitsAddInt(&tab, "NAXIS", 2, "Number of axes");
+   fitsAddInt(&tab, "NAXIS1", CUBE_ROW_BYTES, "Bytes per frame");
+   fitsAddInt(&tab, "NAXIS2", c->count, "Number of frames");
+   fitsAddInt(&tab, "PCOUNT", 0, "No heap");
+   fitsAddInt(&tab, "GCOUNT", 1, "Only one group");
+   fitsAddInt(&tab, "TFIELDS", CUBE_TFIELDS, "Number of columns");
+   fitsAddStr(&tab, "EXTNAME", "FRAMES", 8, "Per frame values of the cube");
+   for (i = 0; i < CUBE_TFIELDS; i++) {
+      snprintf(key, sizeof(key), "TTYPE%d", i + 1);
+      fitsAddStr(&tab, key, column[i].type, 8, "Column name");
+      snprintf(key, sizeof(key), "TFORM%d", i + 1);
+      fitsAddStr(&tab, key, column[i].form, 8, "Column format");
+      snprintf(key, sizeof(key), "TUNIT%d", i + 1);
+      fitsAddStr(&tab, key, column[i].unit, 8, "Column unit");
+   }
+   memset(tab.header + tab.size, ' ', sizeof(tab.header) - tab.size);
+   memcpy(tab.header + tab.size, "END", 3);
+   tab.size = (tab.size + FITS_CARD_SIZE + FITS_BLOCK_SIZE - 1) /
+      FITS_BLOCK_SIZE * FITS_BLOCK_SIZE;
+
+   iov[0].iov_base = c->t.header;
+   iov[0].iov_len = c->t.size;
+   iov[1].iov_base = c->pixels;
+   iov[1].iov_len = pix_bytes;
+   iov[2].iov_base = (void *)zero;
+   iov[2].iov_len = (FITS_BLOCK_SIZE - pix_bytes % FITS_BLOCK_SIZE) %
+      FITS_BLOCK_SIZE;
+   iov[3].iov_base = tab.header;
+   iov[3].iov_len = tab.size;
+   iov[4].iov_base = c->rows;
+   iov[4].iov_len = row_bytes;
+   iov[5].iov_base = (void *)zero;
+   iov[5].iov_len = (FITS_BLOCK_SIZE - row_bytes % FITS_BLOCK_SIZE) %
+      FITS_BLOCK_SIZE;
+
+   c->count = 0;
+   if (fitsOutputWrite(&fits_output, iov, 6, FALSE) != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) unable to write FITS cube", __FILE__, __LINE__);
       cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	    "(%s:%d) not able to send command to camera", 
-	    __FILE__, __LINE__);
+		"%s (errno=%d)", strerror(errno), errno);
       return FAIL;
    }
+   c->written++;
+   return PASS;
+}
 
-   /* 
-    * Command line 2 
-    */
-   snprintf((char *)hexstring, sizeof(hexstring)-1, "%08lx",
-	 count);
-   strncpy(strtmp, (char *)hexstring + 2, 3);
-   strtmp[2] = '\0';
-   valtmp = strtoul(strtmp, 0, 16);
-
-   csum1 = comd1[0] ^ comd1[1] ^ comd1[2] ^ comd1[3] ^ valtmp ^ comd1[5];
-
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	 "comd= %02x %02x %02x %02x %02x %02x %02x",
-	 comd1[0], comd1[1], comd1[2], comd1[3], valtmp, comd1[5], csum1);
-
-   snprintf(string, sizeof(string)-1, "%02x %02x %02x %02x %02x %02x %02x",
-	 comd1[0], comd1[1], comd1[2], comd1[3], valtmp, comd1[5], csum1);
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	 "(%s:%d) command = %s", __FILE__, __LINE__, string);
-
-   if (pdvSerialWriteRead(string, &response) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	    "(%s:%d) not able to send command to camera", 
-	    __FILE__, __LINE__);
+/*
+ * Add a frame of a SAVE sequence to the pending cube, writing the cube
+ * first if the frame cannot be added to it or starts a new sequence, and
+ * afterwards if it is complete
+ */
+static PASSFAIL
+fitsCubeAdd(fits_cube_t *c, const frame_info_t *info,
+      const unsigned short *image_p)
+{
+   fits_static_t key;
+   unsigned char *row;
+   int npix = info->image_width * info->image_height;
+   size_t frame_bytes = npix * sizeof(uint16_t);
+   double now = info->capture.tv_sec + info->capture.tv_usec * 1e-6;
+   BOOLEAN guide = info->guide_on;
+   BOOLEAN isu = info->isu_on;
+
+   if (c->pixels == NULL &&
+       (c->pixels = (char *)malloc(CUBE_MAX_BYTES)) == NULL) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) unable to allocate the FITS cube buffer",
+		__FILE__, __LINE__);
       return FAIL;
    }
 
-   /* 
-    * Command line 3 
-    */
-   snprintf((char *)hexstring, sizeof(hexstring)-1, "%08lx", count);
-   strncpy(strtmp, (char *)hexstring + 4, 2);
-   strtmp[2] = '\0';
-   valtmp = strtoul(strtmp, 0, 16);
+   fitsStaticKey(info, &key);
+   if (c->count > 0 &&
+       (memcmp(&key, &c->t.key, sizeof(key)) != 0 ||
+	info->frame_sequence == 1 ||
+	c->count >= info->cube_frames ||
+	(c->count + 1) * frame_bytes > CUBE_MAX_BYTES ||
+	(info->cube_flush > 0 && now - c->start >= info->cube_flush))) {
+      if (fitsCubeFlush(c) != PASS) return FAIL;
+   }
+
+   if (c->count == 0) {
+      fitsBuildTemplate(&c->t, &key, TRUE);
+      fitsPatchFrame(&c->t, info);
+      c->start = now;
+      c->flush = info->cube_flush;
+      c->frame_bytes = frame_bytes;
+   }
+   fitsConvertPixels((uint16_t *)(c->pixels + c->count * frame_bytes),
+	 image_p, npix);
+
+   row = c->rows[c->count];
+   row = fitsPutR8(row, now);
+   row = fitsPutI4(row, info->frame_sequence);
+   row = fitsPutI4(row, info->win_x0);
+   row = fitsPutI4(row, info->win_y0);
+   row = fitsPutR4(row, guide ? info->guide_xoff : NAN);
+   row = fitsPutR4(row, guide ? info->guide_yoff : NAN);
+   row = fitsPutR8(row, isu ? info->isu_mrad_x_delta_setup : NAN);
+   row = fitsPutR8(row, isu ? info->isu_mrad_y_delta_setup : NAN);
+   row = fitsPutR8(row, isu ? info->isu_mrad_x_status : NAN);
+   row = fitsPutR8(row, isu ? info->isu_mrad_y_status : NAN);
+   c->count++;
+
+   if (c->count >= info->cube_frames || info->save_last == TRUE) {
+      return fitsCubeFlush(c);
+   }
+   return PASS;
+}
 
-   csum2 = comd2[0] ^ comd2[1] ^ comd2[2] ^ comd2[3] ^ valtmp ^ comd2[5];
+/*
+ * Job of the FITS stage: measure the FWHM if requested, then serialize
+ * the frame to STDOUT.  This runs concurrently with the acquisition and
+ * the centroiding of the next frame.
+ */
+static void
+fitsStageJob(void *p_args)
+{
+   fits_job_t *job = (fits_job_t *)p_args;
 
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	 "comd= %02x %02x %02x %02x %02x %02x %02x",
-	 comd2[0], comd2[1], comd2[2], comd2[3], valtmp, comd2[5], csum2);
+   if (job->fwhm_request == TRUE) {
+      calculatePointFWHM(job->pixels, GUIDE_SIZE_X, GUIDE_SIZE_Y,
+	    job->info.win_x0, job->info.win_y0);
+   }
 
-   snprintf(string, sizeof(string)-1, "%02x %02x %02x %02x %02x %02x %02x",
-	 comd2[0], comd2[1], comd2[2], comd2[3], valtmp, comd2[5], csum2);
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	 "(%s:%d) command = %s", __FILE__, __LINE__, string);
+   /*
+    * Measure the FWHM and the slow offset on the co-add.  The registration
+    * shifts removed from the frames are added back to the position found
+    * on the co-add.  The dark is subtracted at the window position, which
+    * is only approximate for the shifted frames.
+    */
+   if (job->coadd_request == TRUE) {
+      float xc, yc;
+
+      if (measurePSF(job->coadd_pixels, GUIDE_SIZE_X, GUIDE_SIZE_Y,
+	       job->info.win_x0, job->info.win_y0, &xc, &yc) == PASS) {
+	 serv_info->coadd_xoff = (job->info.guide_x0 + xc + 0.5 +
+	       job->coadd_shift_x - job->info.null_x) * PIXSCALE;
+	 serv_info->coadd_yoff = (job->info.guide_y0 + yc + 0.5 +
+	       job->coadd_shift_y - job->info.null_y) * PIXSCALE;
+      }
+   }
 
-   if (pdvSerialWriteRead(string, &response) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	    "(%s:%d) not able to send command to camera", 
-	    __FILE__, __LINE__);
-      return FAIL;
+   /*
+    * Frames of a SAVE sequence go to a cube when cubes are enabled.  A
+    * pending cube is written before any single frame.
+    */
+   if (job->info.save == TRUE && job->info.cube_frames > 1) {
+      if (fitsCubeAdd(&fits_cube, &job->info, job->pixels) != PASS) {
+	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	       "(%s:%d) unable to add the frame to the FITS cube",
+	       __FILE__, __LINE__);
+      }
+      return;
    }
+   if (fits_cube.count > 0) fitsCubeFlush(&fits_cube);
 
-   /* 
-    * Command line 4 
+   /*
+    * A frame that failed to compress is written uncompressed
     */
-   snprintf((char *)hexstring, sizeof(hexstring)-1, "%08lx", count);
-   strncpy (strtmp, (char *)hexstring + 6, 2);
-   strtmp[2] = '\0';
-   valtmp = strtoul(strtmp, 0, 16);
+   if (job->comp_state == COMP_DONE && job->comp_status == PASS) {
+      struct iovec iov;
 
-   csum3 = comd3[0] ^ comd3[1] ^ comd3[2] ^ comd3[3] ^ valtmp ^ comd3[5];
+      iov.iov_base = job->comp_data;
+      iov.iov_len = job->comp_size;
+      if (fitsOutputWrite(&fits_output, &iov, 1, FALSE) != PASS) {
+	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	       "(%s:%d) unable to write compressed FITS image: %s",
+	       __FILE__, __LINE__, strerror(errno));
+      }
+      return;
+   }
 
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	 "comd= %02x %02x %02x %02x %02x %02x %02x",
-	 comd3[0], comd3[1], comd3[2], comd3[3], valtmp, comd3[5], csum3);
+   if (writeFITSImage(&job->info, job->pixels) != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	    "(%s:%d) unable to create FITS file and write it to"
+	    " STDOUT", __FILE__, __LINE__);
+   }
+}
 
-   snprintf(string, sizeof(string)-1, "%02x %02x %02x %02x %02x %02x %02x",
-	 comd3[0], comd3[1], comd3[2], comd3[3], valtmp, comd3[5], csum3);
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	 "(%s:%d) command = %s", __FILE__, __LINE__, string);
+/*
+ * Write a buffer at an offset of the recorded file
+ */
+static PASSFAIL
+recordWrite(recorder_t *rec, off_t offset, const char *buf, size_t len)
+{
+   ssize_t n;
 
-   if (pdvSerialWriteRead(string, &response) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	    "(%s:%d) not able to send command to camera", 
-	    __FILE__, __LINE__);
-      return FAIL;
+   while (len > 0) {
+      n = pwrite(rec->fd, buf, len, offset);
+      if (n < 0) {
+	 if (errno == EINTR) continue;
+	 return FAIL;
+      }
+      buf += n;
+      len -= n;
+      offset += n;
    }
-
    return PASS;
 }
 
-
 /*
- * Get the exposure time for the camera 
+ * Append to the recorded file.  The staging buffer is written once full,
+ * so that every O_DIRECT write is aligned, after making sure the space is
+ * preallocated.
  */
-static PASSFAIL 
-getGuiderExptime(unsigned long *count) {
-
-   char hexstring[50];
-   char longreps[256];
-
-   char *response;
-   char string[256];
-   char** tokens;
-
-   hexstring[0] = '\0';
-
-   snprintf(string, sizeof(string)-1, "53 e0 01 ee 50 0c");
-   if (pdvSerialWriteRead(string, &response) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	    "(%s:%d) error occurred sending %s to the camera",
-	    __FILE__, __LINE__, string);
-      return FAIL;
-   }
-   snprintf(string, sizeof(string)-1, "53 e1 01 50 e3");
-   if (pdvSerialWriteRead(string, &response) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	    "(%s:%d) error occurred sending %s to the camera",
-	    __FILE__, __LINE__, string);
-      return FAIL;
+static PASSFAIL
+recordAppend(recorder_t *rec, const void *data, size_t len)
+{
+   const char *p = (const char *)data;
+   size_t n;
+
+   while (len > 0) {
+      n = RECORD_CHUNK - rec->staged;
+      if (n > len) n = len;
+      if (p != NULL) memcpy(rec->stage + rec->staged, p, n);
+      else memset(rec->stage + rec->staged, 0, n);
+      rec->staged += n;
+      len -= n;
+      if (p != NULL) p += n;
+
+      if (rec->staged == RECORD_CHUNK) {
+	 if (rec->stage_offset + RECORD_CHUNK > rec->allocated) {
+	    if (fallocate(rec->fd, FALLOC_FL_KEEP_SIZE, rec->allocated,
+			  RECORD_PREALLOC) == 0) {
+	       rec->allocated += RECORD_PREALLOC;
+	    }
+	    else {
+	       /* Not supported by the file system, just write */
+	       rec->allocated = LLONG_MAX;
+	    }
+	 }
+	 if (recordWrite(rec, rec->stage_offset, rec->stage, RECORD_CHUNK)
+	     != PASS) {
+	    return FAIL;
+	 }
+	 rec->stage_offset += RECORD_CHUNK;
+	 rec->staged = 0;
+      }
    }
-   strncpy(longreps, response, sizeof(longreps));
-   tokens = stringSplit(longreps, ' ');
-   snprintf(string, sizeof(string)-1, "%s", hexstring);
-   snprintf(hexstring, sizeof(hexstring)-1, "%s%s", string, *(tokens));
-   free(tokens);
+   return PASS;
+}
 
-   snprintf(string, sizeof(string)-1, "53 e0 01 ef 50 0d");
-   if (pdvSerialWriteRead(string, &response) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	    "(%s:%d) error occurred sending %s to the camera",
-	    __FILE__, __LINE__, string);
-      return FAIL;
-   }
-   snprintf(string, sizeof(string)-1, "53 e1 01 50 e3");
-   if (pdvSerialWriteRead(string, &response) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	    "(%s:%d) error occurred sending %s to the camera",
-	    __FILE__, __LINE__, string);
-      return FAIL;
+/*
+ * End the recorded file: write the last staged bytes, padded to the
+ * alignment, and cut the file to its real size
+ */
+static void
+recordClose(recorder_t *rec)
+{
+   size_t len = (rec->staged + RECORD_ALIGN - 1) / RECORD_ALIGN *
+      RECORD_ALIGN;
+   off_t size = rec->stage_offset + rec->staged;
+
+   memset(rec->stage + rec->staged, 0, len - rec->staged);
+   if ((len > 0 &&
+	recordWrite(rec, rec->stage_offset, rec->stage, len) != PASS) ||
+       ftruncate(rec->fd, size) != 0) {
+      cfht_logv(CFHT_MAIN, CFHT_WARN,
+	    "(%s:%d) unable to complete %s: %s",
+	    __FILE__, __LINE__, rec->path, strerror(errno));
+   }
+   close(rec->fd);
+   rec->fd = -1;
+   if (rec->idx != NULL) fclose(rec->idx);
+   rec->idx = NULL;
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	 "(%s:%d) recorded %s, %lld bytes", __FILE__, __LINE__, rec->path,
+	 (long long)size);
+}
+
+/*
+ * Create the file of a new sequence, named after the capture time of its
+ * first frame, and write its primary header
+ */
+static PASSFAIL
+recordOpen(recorder_t *rec, const frame_info_t *info)
+{
+   fits_template_t *h = &rec->t;
+   char path[sizeof(rec->path)];
+   char date[32];
+   char value[72];
+   time_t sec = info->capture.tv_sec;
+   struct tm tm;
+   int flags = O_WRONLY | O_CREAT | O_EXCL;
+   int i;
+
+   if (rec->stage == NULL) {
+      if (posix_memalign((void **)&rec->stage, RECORD_ALIGN, RECORD_CHUNK)
+	  != 0) {
+	 rec->stage = NULL;
+	 return FAIL;
+      }
+      rec->scratch = (unsigned short *)
+	 cli_malloc(SIZE_X * SIZE_Y * sizeof(uint16_t));
    }
-   strncpy(longreps, response, sizeof(longreps));
-   tokens = stringSplit(longreps, ' ');
-   snprintf(string, sizeof(string)-1, "%s", hexstring);
-   snprintf(hexstring, sizeof(hexstring)-1, "%s%s", string, *(tokens));
-   free(tokens);
 
-   snprintf(string, sizeof(string)-1, "53 e0 01 f0 50 12");
-   if (pdvSerialWriteRead(string, &response) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	    "(%s:%d) error occurred sending %s to the camera",
-	    __FILE__, __LINE__, string);
+   gmtime_r(&sec, &tm);
+   strftime(date, sizeof(date), "%Y%m%d_%H%M%S", &tm);
+   pthread_mutex_lock(&rec->lock);
+   for (i = 0; i < 100; i++) {
+      if (i == 0) {
+	 snprintf(path, sizeof(path), "%s/raptor_%s.fits", rec->dir, date);
+      }
+      else {
+	 snprintf(path, sizeof(path), "%s/raptor_%s_%d.fits", rec->dir, date,
+	       i);
+      }
+      rec->direct = TRUE;
+      rec->fd = open(path, flags | O_DIRECT, 0644);
+      if (rec->fd < 0 && errno == EINVAL) {
+	 rec->direct = FALSE;
+	 rec->fd = open(path, flags, 0644);
+      }
+      if (rec->fd >= 0 || errno != EEXIST) break;
+   }
+   strcpy(rec->path, path);
+   pthread_mutex_unlock(&rec->lock);
+   if (rec->fd < 0) {
+      cfht_logv(CFHT_MAIN, CFHT_WARN,
+	    "(%s:%d) unable to create %s: %s",
+	    __FILE__, __LINE__, path, strerror(errno));
       return FAIL;
    }
-   snprintf(string, sizeof(string)-1, "53 e1 01 50 e3");
-   if (pdvSerialWriteRead(string, &response) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	    "(%s:%d) error occurred sending %s to the camera",
-	    __FILE__, __LINE__, string);
-      return FAIL;
+   if (rec->direct == FALSE) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	    "(%s:%d) O_DIRECT not supported for %s, writing through the "
+	    "page cache", __FILE__, __LINE__, path);
    }
-   strncpy(longreps, response, sizeof(longreps));
-   tokens = stringSplit(longreps, ' ');
-   snprintf(string, sizeof(string)-1, "%s", hexstring);
-   snprintf(hexstring, sizeof(hexstring)-1, "%s%s", string, *(tokens));
-   free(tokens);
 
-   snprintf(string, sizeof(string)-1, "53 e0 01 f1 50 13");
-   if (pdvSerialWriteRead(string, &response) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	    "(%s:%d) error occurred sending %s to the camera",
-	    __FILE__, __LINE__, string);
-      return FAIL;
+   rec->staged = 0;
+   rec->stage_offset = 0;
+   rec->allocated = 0;
+
+   snprintf(path + strlen(path), sizeof(path) - strlen(path), ".idx");
+   if ((rec->idx = fopen(path, "w")) != NULL) {
+      fprintf(rec->idx, "# SEQNUM OFFSET BYTES UNIXTIME\n");
    }
-   snprintf(string, sizeof(string)-1, "53 e1 01 50 e3");
-   if (pdvSerialWriteRead(string, &response) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	    "(%s:%d) error occurred sending %s to the camera",
-	    __FILE__, __LINE__, string);
+
+   /*
+    * Primary header without data, the frames follow as extensions
+    */
+   h->size = 0;
+   fitsAddCard(h, "SIMPLE", "                   T", "Standard FITS");
+   fitsAddInt(h, "BITPIX", 16, "16-bit data");
+   fitsAddInt(h, "NAXIS", 0, "No data in the primary HDU");
+   fitsAddCard(h, "EXTEND", "                   T", "Frames in extensions");
+   strftime(date, sizeof(date), "%Y-%m-%dT%T", &tm);
+   fitsAddStr(h, "DATE", date, FITS_DATE_WIDTH, "UTC Date of the first frame");
+   fitsAddStr(h, "ORIGIN", "CFHT", 8, "Canada-France-Hawaii Telescope");
+   strncpy(value, info->fits_comment, sizeof(value) - 1);
+   value[sizeof(value) - 1] = '\0';
+   fitsAddStr(h, "IMGINFO", strcmp(value, fh_fits_string_null) ? value : NULL,
+	 8, "Sequence details");
+   memset(h->header + h->size, ' ', FITS_BLOCK_SIZE - h->size);
+   memcpy(h->header + h->size, "END", 3);
+   h->valid = FALSE;
+   if (recordAppend(rec, h->header, FITS_BLOCK_SIZE) != PASS) {
+      recordClose(rec);
       return FAIL;
    }
-   strncpy(longreps, response, sizeof(longreps));
-   tokens = stringSplit(longreps, ' ');
-   snprintf(string, sizeof(string)-1, "%s", hexstring);
-   snprintf(hexstring, sizeof(hexstring), "%s%s", string, *(tokens));
-   free(tokens);
-
-   *count = strtoul(hexstring, 0, 16);
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	 "(%s:%d) hexstring = %s count = %lu",
-	 __FILE__, __LINE__, hexstring, *count);
 
+   pthread_mutex_lock(&rec->lock);
+   rec->files++;
+   pthread_mutex_unlock(&rec->lock);
    return PASS;
 }
 
-
 /*
- * Get the digital gain for the camera 
+ * Append a frame as an image extension, with the header of the stdout
+ * frames.  A compressed frame is the extension of the file made by
+ * fitsCompressImage, without its empty primary HDU; the frame is written
+ * uncompressed when the compression fails.
  */
 static PASSFAIL
-getDigitalGain(int *value) {
-
-   char hexstring[50];
-   char longreps[256];
-   char string[256];
-
-   char *response;
-   char **tokens;
-
-   hexstring[0] = '\0';
-
-   snprintf(string, sizeof(string)-1, "53 e0 01 c6 50 24");
-   if (pdvSerialWriteRead(string, &response) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	    "(%s:%d) error occurred sending %s to the camera",
-	    __FILE__, __LINE__, string);
-      return FAIL;
-   }
-   snprintf(string, sizeof(string)-1, "53 e1 01 50 e3");
-   if (pdvSerialWriteRead(string, &response) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	    "(%s:%d) error occurred sending %s to the camera",
-	    __FILE__, __LINE__, string);
-      return FAIL;
+recordWriteFrame(recorder_t *rec, const frame_info_t *info,
+      const unsigned short *pixels, BOOLEAN compress)
+{
+   fits_template_t *t = &rec->t;
+   fits_static_t key;
+   int npix = info->image_width * info->image_height;
+   size_t pix_bytes = npix * sizeof(uint16_t);
+   size_t pad = (FITS_BLOCK_SIZE - pix_bytes % FITS_BLOCK_SIZE) %
+      FITS_BLOCK_SIZE;
+   size_t comp_size, hdu;
+   off_t offset = rec->stage_offset + rec->staged;
+
+   fitsStaticKey(info, &key);
+   if (t->valid == FALSE || memcmp(&key, &t->key, sizeof(key)) != 0) {
+      fitsBuildTemplate(t, &key, FALSE);
+      fitsFormatCard(t->header, "XTENSION", "'IMAGE   '",
+	    "Image extension");
+   }
+   fitsPatchFrame(t, info);
+
+   if (compress == TRUE &&
+       fitsCompressImage(t, (unsigned short *)pixels, info->image_width,
+	     info->image_height, &rec->comp_data, &rec->comp_alloc,
+	     &comp_size, &hdu) == PASS) {
+      if (recordAppend(rec, (char *)rec->comp_data + hdu, comp_size - hdu)
+	  != PASS) {
+	 return FAIL;
+      }
+      if (rec->idx != NULL) {
+	 fprintf(rec->idx, "%d %lld %lu %.6f\n", info->frame_sequence,
+	       (long long)offset, (unsigned long)(comp_size - hdu),
+	       info->capture.tv_sec + info->capture.tv_usec * 1e-6);
+      }
+      return PASS;
    }
-   strncpy(longreps, response, sizeof(longreps));
-   tokens = stringSplit(longreps, ' ');
-   snprintf(string, sizeof(string)-1, "%s", hexstring);
-   snprintf(hexstring, sizeof(hexstring)-1, "%s%s", string, *(tokens));
-   free(tokens);
+   fitsConvertPixels(rec->scratch, pixels, npix);
 
-   snprintf(string, sizeof(string)-1, "53 e0 01 c7 50 25");
-   if (pdvSerialWriteRead(string, &response) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	    "(%s:%d) error occurred sending %s to the camera",
-	    __FILE__, __LINE__, string);
+   if (recordAppend(rec, t->header, t->size) != PASS ||
+       recordAppend(rec, rec->scratch, pix_bytes) != PASS ||
+       recordAppend(rec, NULL, pad) != PASS) {
       return FAIL;
    }
-   snprintf(string, sizeof(string), "53 e1 01 50 e3");
-   if (pdvSerialWriteRead(string, &response) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	    "(%s:%d) error occurred sending %s to the camera",
-	    __FILE__, __LINE__, string);
-      return FAIL;
+   if (rec->idx != NULL) {
+      fprintf(rec->idx, "%d %lld %lu %.6f\n", info->frame_sequence,
+	    (long long)offset, (unsigned long)(t->size + pix_bytes + pad),
+	    info->capture.tv_sec + info->capture.tv_usec * 1e-6);
    }
-   strncpy(longreps, response, sizeof(longreps));
-   tokens = stringSplit(longreps, ' ');
-
-   snprintf(string, sizeof(string)-1, "%s", hexstring);
-   snprintf(hexstring, sizeof(hexstring)-1, "%s%s", string, *(tokens));
-   free(tokens);
-
-   *value = strtoul(hexstring, 0, 16) / 256;
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	 "(%s:%d) hexstring = %s gain=%i",
-	 __FILE__, __LINE__, hexstring, *value);
-
    return PASS;
 }
 
-
 /*
- * Set the value of the digital gain
+ * Body of the recorder thread.  A sequence starts with its first frame or
+ * with the first frame recorded after it, and ends with its last frame or
+ * with an end marker queued when it was interrupted.
  */
-static PASSFAIL 
-setDigitalGain(int value){
-
-   unsigned char hexstring[50];
-   char string[256];
-   char *response;
-
-   char strtmp[3];
-
-   unsigned int comd0[6]={0x53,0xe0,0x02,0xc6,0x00,0x50};
-   unsigned int comd1[6]={0x53,0xe0,0x02,0xc7,0x00,0x50};
-
-   unsigned int valtmp, csum0, csum1;
-
-   snprintf((char *)hexstring, sizeof(hexstring)-1, "%04lx",
-	 (unsigned long)(value*256));
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	 "(%s:%d) hexstring = %s value=%i",
-	 __FILE__, __LINE__, hexstring, value);
-
-   /*
-    * Preparing serial command 
-    */
-
-   /* 
-    * Command line 1 
-    */
-   strncpy(strtmp, (char *)hexstring, 2);
-   strtmp[2] = '\0';
-   valtmp = strtoul(strtmp, 0, 16);
-   csum0 = comd0[0] ^ comd0[1] ^ comd0[2] ^ comd0[3] ^ valtmp ^ comd0[5];
+static void *
+recordThread(void *p_args)
+{
+   recorder_t *rec = (recorder_t *)p_args;
+   record_job_t *job;
+   BOOLEAN failed = FALSE;
 
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	 "(%s:%d) comd= %02x %02x %02x %02x %02x %02x %02x",
-	 __FILE__, __LINE__, comd0[0], comd0[1], comd0[2], comd0[3], 
-	 valtmp, comd0[5], csum0);
+   pthread_mutex_lock(&rec->lock);
+   for (;;) {
+      while (rec->count == 0) {
+	 pthread_cond_wait(&rec->cond, &rec->lock);
+      }
+      job = &rec->ring[rec->head];
+      pthread_mutex_unlock(&rec->lock);
 
-   snprintf(string, sizeof(string)-1, "%02x %02x %02x %02x %02x %02x %02x",
-	 comd0[0], comd0[1], comd0[2], comd0[3], valtmp, comd0[5], csum0);
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	 "(%s:%d) command=%s", __FILE__, __LINE__, string);
+      if (job->close_only == TRUE || job->info.frame_sequence == 1) {
+	 if (rec->fd >= 0) recordClose(rec);
+	 failed = FALSE;
+      }
+      if (job->close_only == FALSE) {
+	 if (rec->fd < 0 && failed == FALSE) {
+	    failed = (recordOpen(rec, &job->info) != PASS);
+	 }
+	 if (rec->fd >= 0) {
+	    if (recordWriteFrame(rec, &job->info, job->pixels,
+				 job->compress) != PASS) {
+	       cfht_logv(CFHT_MAIN, CFHT_WARN,
+		     "(%s:%d) unable to write to %s: %s",
+		     __FILE__, __LINE__, rec->path, strerror(errno));
+	       recordClose(rec);
+	       failed = TRUE;
+	    }
+	    else {
+	       pthread_mutex_lock(&rec->lock);
+	       rec->frames++;
+	       pthread_mutex_unlock(&rec->lock);
+	    }
+	 }
+	 if (job->info.save_last == TRUE) {
+	    if (rec->fd >= 0) recordClose(rec);
+	    failed = FALSE;
+	 }
+      }
 
-   if (pdvSerialWriteRead(string, &response) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	    "(%s:%d) not able to send command to camera", 
-	    __FILE__, __LINE__);
-      return FAIL;
+      pthread_mutex_lock(&rec->lock);
+      rec->head = (rec->head + 1) % RECORD_RING_SLOTS;
+      rec->count--;
    }
+   return NULL;
+}
 
-   /* 
-    * Command line 2 
-    */
-   snprintf((char *)hexstring, sizeof(hexstring)-1, "%04lx", 
-	 (unsigned long)(value*256));
-   strncpy(strtmp, (char *)hexstring + 2, 3);
-   strtmp[2] = '\0';
-   valtmp = strtoul(strtmp, 0, 16);
-
-   csum1 = comd1[0] ^ comd1[1] ^ comd1[2] ^ comd1[3] ^ valtmp ^ comd1[5];
-
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	 "(%s:%d) comd= %02x %02x %02x %02x %02x %02x %02x",
-	 __FILE__, __LINE__, comd1[0], comd1[1], comd1[2], comd1[3], 
-	 valtmp, comd1[5], csum1);
+/*
+ * Allocate the frame ring and start the recorder thread
+ */
+static PASSFAIL
+recordCreate(recorder_t *rec)
+{
+   int i;
 
-   snprintf(string, sizeof(string)-1, "%02x %02x %02x %02x %02x %02x %02x",
-	 comd1[0], comd1[1], comd1[2], comd1[3], valtmp, comd1[5], csum1);
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	 "(%s:%d) command=%s", __FILE__, __LINE__, string);
+   pthread_mutex_init(&rec->lock, NULL);
+   pthread_cond_init(&rec->cond, NULL);
+   rec->fd = -1;
+   for (i = 0; i < RECORD_RING_SLOTS; i++) {
+      rec->ring[i].pixels = (unsigned short *)
+	 cli_malloc(SIZE_X * SIZE_Y * sizeof(uint16_t));
+   }
 
-   if (pdvSerialWriteRead(string, &response) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	    "(%s:%d) not able to send command to camera", 
-	    __FILE__, __LINE__);
+   if (pthread_create(&rec->thread, NULL, recordThread, rec)) {
+      cfht_logv(CFHT_MAIN, CFHT_ERROR,
+	    "(%s:%d) %s: failed creating recorder thread",
+	    __FILE__, __LINE__, __FUNCTION__);
       return FAIL;
    }
+   pthread_detach(rec->thread);
 
    return PASS;
 }
 
-
 /*
- * Set the guider gain mode
+ * Hand a frame over to the recorder, from the main loop.  Only the frames
+ * of SAVE sequences are recorded, compressed like the SAVE stream when
+ * cfitsio is reentrant, and an interrupted sequence is ended with a
+ * marker.  The pixels are copied
+ * outside of the lock, the slot after the queued ones is only used by the
+ * main loop.
  */
-static PASSFAIL 
-setGuiderGainMode(int mode){
-
-   char string[256];
-   char *response;
+static void
+recordFrame(recorder_t *rec, const frame_info_t *info,
+      const unsigned short *pixels)
+{
+   record_job_t *job;
+   BOOLEAN record;
+
+   pthread_mutex_lock(&rec->lock);
+   record = (info->save == TRUE && rec->dir[0] != '\0');
+   if (record == FALSE && rec->active == TRUE) {
+      rec->active = FALSE;
+      rec->close_pending = TRUE;
+   }
+   if (rec->close_pending == TRUE && rec->count < RECORD_RING_SLOTS) {
+      job = &rec->ring[(rec->head + rec->count) % RECORD_RING_SLOTS];
+      job->close_only = TRUE;
+      rec->count++;
+      rec->close_pending = FALSE;
+      pthread_cond_broadcast(&rec->cond);
+   }
+   if (record == FALSE) {
+      pthread_mutex_unlock(&rec->lock);
+      return;
+   }
+   rec->active = !info->save_last;
+   if (rec->count == RECORD_RING_SLOTS) {
+      rec->lost++;
+      if (info->save_last == TRUE) rec->close_pending = TRUE;
+      pthread_mutex_unlock(&rec->lock);
+      return;
+   }
+   job = &rec->ring[(rec->head + rec->count) % RECORD_RING_SLOTS];
+   pthread_mutex_unlock(&rec->lock);
+
+   job->close_only = FALSE;
+   pthread_mutex_lock(&fits_queue.lock);
+   job->compress = (fits_queue.reentrant == TRUE &&
+		    (fits_queue.compress & FITS_COMPRESS_SAVE)) ? TRUE : FALSE;
+   pthread_mutex_unlock(&fits_queue.lock);
+   job->info = *info;
+   memcpy(job->pixels, pixels,
+	 info->image_width * info->image_height * sizeof(uint16_t));
+
+   pthread_mutex_lock(&rec->lock);
+   rec->count++;
+   pthread_cond_broadcast(&rec->cond);
+   pthread_mutex_unlock(&rec->lock);
+}
 
-   if (mode == LOWGAIN){
-      snprintf(string, sizeof(string)-1, "53 e0 02 f2 00 50 13");
-      if (pdvSerialWriteRead(string, &response) != PASS) {
-	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	       "(%s:%d) error occurred sending %s to the camera",
-	       __FILE__, __LINE__, string);
-	 return FAIL;
+/*
+ * Listening socket of the telemetry stream, on a TCP port of the host
+ * address (ALL for all the interfaces) or on a Unix socket path.  A
+ * stale socket left at the path is removed, but not any other file.
+ */
+static int
+telemetryListen(const char *host, const char *port, const char *path)
+{
+   struct addrinfo hints, *ai = NULL;
+   struct sockaddr_un sun;
+   struct stat st;
+   int fd, on = 1;
+
+   if (path != NULL) {
+      memset(&sun, 0, sizeof(sun));
+      sun.sun_family = AF_UNIX;
+      strncpy(sun.sun_path, path, sizeof(sun.sun_path) - 1);
+      if (lstat(path, &st) == 0) {
+	 if (!S_ISSOCK(st.st_mode)) {
+	    cfht_logv(CFHT_MAIN, CFHT_WARN,
+		  "(%s:%d) %s: %s exists and is not a socket",
+		  __FILE__, __LINE__, __FUNCTION__, path);
+	    return -1;
+	 }
+	 unlink(path);
       }
-
-      if (strcmp ("50 13", response) != 0) {
-	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	       "(%s:%d) not able to switch to low gain mode", 
-	       __FILE__, __LINE__);
-	 return FAIL;
+      fd = socket(AF_UNIX, SOCK_STREAM, 0);
+      if (fd >= 0 && bind(fd, (struct sockaddr *)&sun, sizeof(sun)) != 0) {
+	 close(fd);
+	 fd = -1;
       }
    }
-
-   if (mode == HIGHGAIN){
-      snprintf(string, sizeof(string), "53 e0 02 f2 06 50 15");
-      if (pdvSerialWriteRead(string, &response) != PASS) {
-	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	       "(%s:%d) there is no response from the camera", 
-	       __FILE__, __LINE__);
-	 return FAIL;
+   else {
+      memset(&hints, 0, sizeof(hints));
+      hints.ai_family = AF_INET;
+      hints.ai_socktype = SOCK_STREAM;
+      hints.ai_flags = AI_PASSIVE;
+      if (getaddrinfo(strcasecmp(host, "ALL") != 0 ? host : NULL, port,
+		      &hints, &ai) != 0) {
+	 cfht_logv(CFHT_MAIN, CFHT_WARN,
+	       "(%s:%d) %s: unknown address %s",
+	       __FILE__, __LINE__, __FUNCTION__, host);
+	 return -1;
       }
-
-      if (strcmp ("50 15", response) != 0) {
-	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	       "(%s:%d) not able to switch to high gain mode", 
-	       __FILE__, __LINE__);
-	 return FAIL;
+      fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+      if (fd >= 0) {
+	 setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	 if (bind(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+	    close(fd);
+	    fd = -1;
+	 }
       }
+      freeaddrinfo(ai);
    }
-
-   if (mode > 1) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	    "(%s:%d) there is no this specified gain mode for this"
-	    " camera", __FILE__, __LINE__);
-      return FAIL;
+   if (fd >= 0 && (listen(fd, TELEMETRY_MAX_CLIENTS) != 0 ||
+	    fcntl(fd, F_SETFL, O_NONBLOCK) != 0)) {
+      close(fd);
+      fd = -1;
    }
-
-   return PASS;
+   if (fd < 0) {
+      cfht_logv(CFHT_MAIN, CFHT_WARN,
+	    "(%s:%d) %s: unable to listen on %s %s: %s",
+	    __FILE__, __LINE__, __FUNCTION__, path != NULL ? "socket" : "port",
+	    path != NULL ? path : port, strerror(errno));
+   }
+   return fd;
 }
 
-
-/* 
- * Get the guider gain mode
+/*
+ * Accept a subscriber, which starts with the next record published
  */
-static PASSFAIL 
-getGuiderGainMode(int *mode) {
-   int value;
-   char hexstring[50];
-   char longreps[256];
-   char string[256];
+static void
+telemetryAccept(telemetry_t *t, int listen_fd)
+{
+   telemetry_client_t *c;
+   int fd;
 
-   char *response;
-   char **tokens;
+   if ((fd = accept(listen_fd, NULL, NULL)) < 0) return;
+   if (t->nclients == TELEMETRY_MAX_CLIENTS ||
+       fcntl(fd, F_SETFL, O_NONBLOCK) != 0) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	    "(%s:%d) %s: telemetry subscriber refused",
+	    __FILE__, __LINE__, __FUNCTION__);
+      close(fd);
+      return;
+   }
 
-   hexstring[0] = '\0';
+   pthread_mutex_lock(&t->lock);
+   c = &t->clients[t->nclients++];
+   memset(c, 0, sizeof(*c));
+   c->fd = fd;
+   c->decimate = 1;
+   c->next = t->published;
+   pthread_mutex_unlock(&t->lock);
+}
 
-   snprintf(string, sizeof(string)-1, "53 e0 01 f2 50 10");
-   if (pdvSerialWriteRead(string, &response) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	    "(%s:%d) error occurred sending %s to the camera",
-	    __FILE__, __LINE__, string);
-      return FAIL;
-   }
-   snprintf(string, sizeof(string)-1, "53 e1 01 50 e3");
-   if (pdvSerialWriteRead(string, &response) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	    "(%s:%d) error occurred sending %s to the camera",
-	    __FILE__, __LINE__, string);
-      return FAIL;
-   }
-   strncpy(longreps, response, sizeof(longreps));
-   tokens = stringSplit(longreps, ' ');
-   snprintf(string, sizeof(string)-1, "%s", hexstring);
-   snprintf(hexstring, sizeof(hexstring)-1, "%s%s", string, *(tokens));
-   free(tokens);
+static void
+telemetryDrop(telemetry_t *t, int i)
+{
+   telemetry_client_t *c = &t->clients[i];
 
-   value = strtoul(hexstring, 0, 16);
-   if (value == 0){
-      *mode = LOWGAIN;
-   }
-   if (value == 6){
-      *mode = HIGHGAIN;
+   if (c->skipped > 0) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	    "(%s:%d) %s: telemetry subscriber skipped %ld records",
+	    __FILE__, __LINE__, __FUNCTION__, c->skipped);
    }
+   close(c->fd);
+   pthread_mutex_lock(&t->lock);
+   *c = t->clients[--t->nclients];
+   pthread_mutex_unlock(&t->lock);
+}
 
+/*
+ * Read the requests of a subscriber.  FAIL is returned when it closed the
+ * connection.
+ */
+static PASSFAIL
+telemetryReceive(telemetry_client_t *c)
+{
+   char *eol;
+   ssize_t n;
+   int decimate;
+
+   n = recv(c->fd, c->in + c->in_len, sizeof(c->in) - 1 - c->in_len, 0);
+   if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) return FAIL;
+   if (n < 0) return PASS;
+   c->in_len += n;
+   c->in[c->in_len] = '\0';
+
+   while ((eol = strchr(c->in, '\n')) != NULL) {
+      *eol = '\0';
+      if (sscanf(c->in, "DECIMATE %d", &decimate) == 1 && decimate > 0) {
+	 c->decimate = decimate;
+      }
+      c->in_len -= eol + 1 - c->in;
+      memmove(c->in, eol + 1, c->in_len + 1);
+   }
+   /* A line that does not fit is garbage */
+   if (c->in_len == sizeof(c->in) - 1) c->in_len = 0;
    return PASS;
 }
 
-
-/* 
- * Check the temperature of the camera
+/*
+ * Send the records a subscriber did not get yet, until its socket is
+ * full.  The records overwritten in the ring meanwhile are skipped.
+ * FAIL is returned when the connection is broken.
  */
 static PASSFAIL
-checkGuiderTemp(float *temp) {
-
-   char hexstring[50];
-   char longreps[256];
-   char string[256];
-
-   char *response;
-   char **tokens;
-   unsigned long adc40d, adc0d;
+telemetrySend(telemetry_t *t, telemetry_client_t *c)
+{
+   ssize_t n;
 
-   float value, slope, co;
+   for (;;) {
+      if (c->out_pending == TRUE) {
+	 n = send(c->fd, (char *)&c->out + c->out_sent,
+	       sizeof(c->out) - c->out_sent, MSG_NOSIGNAL);
+	 if (n < 0) {
+	    return (errno == EAGAIN || errno == EINTR) ? PASS : FAIL;
+	 }
+	 c->out_sent += n;
+	 if (c->out_sent < sizeof(c->out)) return PASS;
+	 c->out_pending = FALSE;
+      }
 
-   hexstring[0] = '\0';
+      pthread_mutex_lock(&t->lock);
+      if (c->next == t->published) {
+	 pthread_mutex_unlock(&t->lock);
+	 return PASS;
+      }
+      if (t->published - c->next > TELEMETRY_RING) {
+	 c->skipped += t->published - TELEMETRY_RING - c->next;
+	 c->next = t->published - TELEMETRY_RING;
+      }
+      c->out = t->ring[c->next % TELEMETRY_RING];
+      c->next++;
+      pthread_mutex_unlock(&t->lock);
 
-   /* 
-    * Getting manufacturing data from camera 
-    */
-   snprintf(string, sizeof(string)-1, "53 ae 05 01 00 00 02 00 50 ab");
-   if (pdvSerialWriteRead(string, &response) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	    "(%s:%d) error occurred sending %s to the camera",
-	    __FILE__, __LINE__, string);
-      return FAIL;
-   }
-   snprintf(string, sizeof(string)-1, "53 af 12 50 be");
-   if (pdvSerialWriteRead(string, &response) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	    "(%s:%d) error occurred sending %s to the camera",
-	    __FILE__, __LINE__, string);
-      return FAIL;
+      if (c->out.frame % c->decimate == 0) {
+	 c->out_sent = 0;
+	 c->out_pending = TRUE;
+      }
    }
-   strncpy(longreps, response, sizeof(longreps));
-   tokens = stringSplit(longreps, ' ');
-   snprintf(hexstring, sizeof(hexstring)-1, "%s%s", 
-	 *(tokens+13), *(tokens+12));
-   adc40d = strtoul(hexstring, 0, 16);
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	 "(%s:%d) ADC40d --> HEX = %s value=%lu",
-	 __FILE__, __LINE__, hexstring, adc40d);
-   snprintf(hexstring, sizeof(hexstring)-1, "%s%s",
-	 *(tokens+11), *(tokens+10));
-   adc0d = strtoul(hexstring, 0, 16);
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	 "(%s:%d) ADC0d --> HEX = %s value=%lu",
-	 __FILE__, __LINE__, hexstring, adc0d);
-   free(tokens);
+}
 
-   /* 
-    * Reading Current TEC setpoint 
-    */
-   snprintf(string, sizeof(string)-1, "53 e0 01 6e 50 8c");
-   if (pdvSerialWriteRead(string, &response) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	    "(%s:%d) error occurred sending %s to the camera",
-	    __FILE__, __LINE__, string);
-      return FAIL;
-   }
-   snprintf(string, sizeof(string)-1, "53 e1 01 50 e3");
-   if (pdvSerialWriteRead(string, &response) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	    "(%s:%d) error occurred sending %s to the camera",
-	    __FILE__, __LINE__, string);
-      return FAIL;
-   }
-   strncpy(longreps, response, sizeof(longreps));
-   tokens = stringSplit(longreps, ' ');
-   snprintf(hexstring, sizeof(hexstring)-1, "%s", *(tokens));
-   free(tokens);
+/*
+ * Telemetry thread: accept the subscribers and send them the records
+ */
+static void *
+telemetryThread(void *arg)
+{
+   telemetry_t *t = (telemetry_t *)arg;
+   struct pollfd fds[3 + TELEMETRY_MAX_CLIENTS];
+   char drain[64];
+   int i, nfds, nclients;
+   uint64_t published;
 
-   snprintf(string, sizeof(string)-1, "53 e0 01 6f 50 8d");
-   if (pdvSerialWriteRead(string, &response) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	    "(%s:%d) error occurred sending %s to the camera",
-	    __FILE__, __LINE__, string);
-      return FAIL;
-   }
-   snprintf(string, sizeof(string)-1, "53 e1 01 50 e3");
-   if (pdvSerialWriteRead(string, &response) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	    "(%s:%d) error occurred sending %s to the camera",
-	    __FILE__, __LINE__, string);
-      return FAIL;
-   }
-   strncpy(longreps, response, sizeof(longreps));
-   tokens = stringSplit(longreps, ' ');
-   snprintf(string, sizeof(string), "%s", hexstring);
-   snprintf(hexstring, sizeof(hexstring)-1, "%s%s",
-	 string, *(tokens));
-   free(tokens);
+   for (;;) {
+      pthread_mutex_lock(&t->lock);
+      published = t->published;
+      pthread_mutex_unlock(&t->lock);
+
+      fds[0].fd = t->wake[0];
+      fds[1].fd = t->listen_tcp;
+      fds[2].fd = t->listen_unix;
+      for (i = 0; i < 3; i++) fds[i].events = POLLIN;
+      nclients = t->nclients;
+      for (i = 0; i < nclients; i++) {
+	 fds[3 + i].fd = t->clients[i].fd;
+	 fds[3 + i].events = POLLIN;
+	 if (t->clients[i].out_pending == TRUE ||
+	     t->clients[i].next != published) {
+	    fds[3 + i].events |= POLLOUT;
+	 }
+      }
+      nfds = 3 + nclients;
 
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	 "(%s:%d) HEX = %s", __FILE__, __LINE__, hexstring);
-   value = (float)strtoul(hexstring, 0, 16);
-   slope = (40.0) / ((float)adc40d - (float)adc0d);
-   co = -(slope * (float)adc0d);
+      if (poll(fds, nfds, -1) < 0) {
+	 if (errno == EINTR) continue;
+	 cfht_logv(CFHT_MAIN, CFHT_WARN,
+	       "(%s:%d) %s: poll failed: %s - telemetry stopped",
+	       __FILE__, __LINE__, __FUNCTION__, strerror(errno));
+	 return NULL;
+      }
 
-   *temp = (slope * value) + co;
+      if (fds[0].revents & POLLIN) {
+	 while (read(t->wake[0], drain, sizeof(drain)) > 0);
+      }
 
-   return PASS;
+      /*
+       * Clients are dropped from the end first so that the pollfd of the
+       * clients not handled yet stay in place
+       */
+      for (i = nclients - 1; i >= 0; i--) {
+	 if (((fds[3 + i].revents & POLLIN) &&
+	      telemetryReceive(&t->clients[i]) != PASS) ||
+	     (fds[3 + i].revents & (POLLERR | POLLNVAL)) ||
+	     telemetrySend(t, &t->clients[i]) != PASS) {
+	    telemetryDrop(t, i);
+	 }
+      }
+
+      if (fds[1].revents & POLLIN) telemetryAccept(t, t->listen_tcp);
+      if (fds[2].revents & POLLIN) telemetryAccept(t, t->listen_unix);
+   }
+   return NULL;
 }
 
-#ifdef UNUSED_CODE
 /*
- * Process the guider image
+ * Open the telemetry sockets and start the thread serving them
  */
 static PASSFAIL
-detrendImage(unsigned char *raw,  unsigned char *flat,  unsigned char *dark,  unsigned char *mask){
-
-   int i,size;
-   unsigned char val;
-
-
-#ifdef DEBUG
-   printf("Begin processing image....\n");
-#endif //DEBUG
-
-   // TODO: As is this function will not work since the size parameter is
-   //       never set.
+telemetryCreate(telemetry_t *t)
+{
+   int i;
 
-   /* Go through each pixel */
-   for (i=0;i<size;i++){
-      val=raw[i];
-      val=val-dark[i];
-      val=val/flat[i];
-      val=val/mask[i];
-      //if (i == 20400){printf("pixel value=%f\n",val);}
+   if (strcasecmp(t->port, "OFF") != 0) {
+      t->listen_tcp = telemetryListen(t->host, t->port, NULL);
+   }
+   if (t->socket_path[0] != '\0') {
+      t->listen_unix = telemetryListen(NULL, NULL, t->socket_path);
+   }
+   if (t->listen_tcp < 0 && t->listen_unix < 0) return FAIL;
 
-      if (val > SATURATION){
-	 raw[i]=0;
-      }
-      if (val < -SATURATION){
-	 raw[i]=val;
-      }
+   if (pipe(t->wake) != 0) {
+      cfht_logv(CFHT_MAIN, CFHT_WARN,
+	    "(%s:%d) %s: pipe failed: %s",
+	    __FILE__, __LINE__, __FUNCTION__, strerror(errno));
+      t->wake[0] = t->wake[1] = -1;
+      return FAIL;
+   }
+   for (i = 0; i < 2; i++) fcntl(t->wake[i], F_SETFL, O_NONBLOCK);
 
+   if (pthread_create(&t->thread, NULL, telemetryThread, t)) {
+      cfht_logv(CFHT_MAIN, CFHT_WARN,
+	    "(%s:%d) %s: failed creating telemetry thread",
+	    __FILE__, __LINE__, __FUNCTION__);
+      close(t->wake[0]);
+      close(t->wake[1]);
+      t->wake[0] = t->wake[1] = -1;
+      return FAIL;
    }
+   pthread_detach(t->thread);
 
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	 "(%s:%d) telemetry published on port %s of %s socket %s",
+	 __FILE__, __LINE__, t->listen_tcp >= 0 ? t->port : "OFF", t->host,
+	 t->listen_unix >= 0 ? t->socket_path : "OFF");
    return PASS;
 }
-#endif //UNUSED_CODE
 
 /*
- * Take a pointer to image data and create a FITS image using this data
- * and send it to STDOUT
+ * Put the record of a frame in the ring, from the main loop.  The frame
+ * number is assigned here so that it counts every acquired frame.
  */
-static PASSFAIL
-writeFITSImage(unsigned char *image_p) {
-
-   HeaderUnit hu;
-   time_t date = time(NULL);
-   int fd = STDOUT_FILENO;
-   char fitscard[FH_MAX_STRLEN];
-   struct timeval tv;
-   struct timezone tz;
-   fh_result fh_error;
+static void
+telemetryPublish(telemetry_t *t, raptor_telemetry_t *rec)
+{
+   char wake = 0;
 
-   /*
-    * Create the header unit
-    */
-   hu = fh_create();
+   rec->frame = t->frame++;
+   if (t->wake[1] < 0) return;
 
-   /*
-    * Populate the headers 
-    */
-   fh_set_bool(hu, FH_AUTO, "SIMPLE", 1, "Standard FITS");
-   fh_set_int(hu,  FH_AUTO, "BITPIX", 16,"16-bit data");
-   fh_set_int(hu,  FH_AUTO, "NAXIS",  2, "Number of axes");
-   fh_set_int(hu,  FH_AUTO, "NAXIS1", serv_info->image_width, 
-	 "Number of pixel columns");
-   fh_set_int(hu,  FH_AUTO, "NAXIS2", serv_info->image_height, 
-	 "Number of pixel rows");
-   fh_set_int(hu,  FH_AUTO, "PCOUNT", 0, "No 'random' parameters");
-   fh_set_int(hu,  FH_AUTO, "GCOUNT", 1, "Only one group");
-
-   strftime(fitscard, sizeof(fitscard)-1, "%Y-%m-%dT%T", gmtime(&date));
-   fh_set_str(hu, FH_AUTO, "DATE", fitscard, "UTC Date of file creation");
-   strftime(fitscard, sizeof(fitscard)-1, "%a %b %d %H:%M:%S %Z %Y", 
-	 localtime(&date));
-   fh_set_str(hu, FH_AUTO, "HSTTIME", fitscard, "Local time in Hawaii");
-   gettimeofday(&tv, &tz);
-   fh_set_flt(hu, FH_AUTO, "UNIXTIME", tv.tv_sec + (tv.tv_usec / 1000000.0), 
-	 13, "Fractional UNIX timestamp when image was taken");
-   fh_set_str(hu, FH_AUTO, "ORIGIN", "CFHT", "Canada-France-Hawaii Telescope");
-   fh_set_flt(hu, FH_AUTO, "BZERO", 32768.0, 6,	"Zero factor");
-   fh_set_flt(hu, FH_AUTO, "BSCALE", 1.0, 2, "Scale factor");
-   fh_set_flt(hu, FH_AUTO, "ETIME", serv_info->exposure_time, 6, 
-	 "Integration time (ms)");
+   pthread_mutex_lock(&t->lock);
+   t->ring[t->published % TELEMETRY_RING] = *rec;
+   t->published++;
+   pthread_mutex_unlock(&t->lock);
 
-   /* 
-    * Set the frame sequence to be show acquire unless we are saving images
-    */
-   if (serv_info->frame_sequence > 0) {
-      fh_set_str(hu, FH_AUTO, "ETYPE", "GUIDE", "Exposure type");
-   }
-   else {
-      fh_set_str(hu, FH_AUTO, "ETYPE", "ACQUIRE", "Exposure type");
-   }
-
-   fh_set_str(hu, FH_AUTO, "IMGINFO", serv_info->fits_comment, 
-	 "Sequence details");
-   fh_set_flt(hu, FH_AUTO, "FRMRATE", serv_info->frame_rate, 4,
-	 "Requested frame rate (Hz)");
-   fh_set_flt(hu, FH_AUTO, "TEMP", serv_info->tec_setpoint, 6, 
-	 "TEC cooler setpoint (C)");
-   gettimeofday(&tv, &tz);
-   fh_set_int(hu, FH_AUTO, "SEQNUM", ++(serv_info->frame_sequence), 
-	 "Frame sequence number");
-   fh_set_flt(hu, FH_AUTO, "PIXSCALE", PIXSCALE, 5, 
-	 "Pixel scale (arcseconds / pixel)");
-   fh_set_int(hu, FH_AUTO, "WIN_X0", serv_info->win_x0, 
-	      "X0 coordinate for the camera raster");
-   fh_set_int(hu, FH_AUTO, "WIN_Y0", serv_info->win_y0, 
-	      "Y0 coordinate for the camera raster");
-   fh_set_int(hu, FH_AUTO, "WIN_X1", 
-	      serv_info->win_x0 + serv_info->image_width - 1,
-	      "X1 coordinate for the camera raster");
-   fh_set_int(hu, FH_AUTO, "WIN_Y1", 
-	      serv_info->win_y0 + serv_info->image_height - 1,
-	      "Y1 coordinate for the camera raster");
-   fh_set_int(hu, FH_AUTO, "GUIDE_X0", serv_info->guide_x0,
-	      "X0 coordinate for the guide raster");
-   fh_set_int(hu, FH_AUTO, "GUIDE_Y0", serv_info->guide_y0,
-	      "Y0 coordinate for the guide raster");
-   fh_set_int(hu, FH_AUTO, "GUIDE_X1",
-	      serv_info->guide_x0 + GUIDE_SIZE_X - 1,
-	      "X1 coordinate for the guide raster");
-   fh_set_int(hu, FH_AUTO, "GUIDE_Y1",
-	      serv_info->guide_y0 + GUIDE_SIZE_Y - 1,
-	      "Y1 coordinate for the guide raster");
-   fh_set_flt(hu, FH_AUTO, "NULLX", serv_info->null_x, 5, 
-	      "Null position (center of aperture hole in X");
-   fh_set_flt(hu, FH_AUTO, "NULLY", serv_info->null_y, 5, 
-	      "Null position (center of aperture hole in Y");
-   if (serv_info->guide_on == TRUE) {
-      fh_set_flt(hu, FH_AUTO, "GD_XOFF", serv_info->guide_xoff,5, 
-		 "Guide star offset in X");
-      fh_set_flt(hu, FH_AUTO, "GD_YOFF", serv_info->guide_yoff,5, 
-		 "Guide star offset in Y");
-   }
-   else {
-      fh_set_flt(hu, FH_AUTO, "GD_XOFF", fh_fits_real_null,5, 
-		 "Guide star offset in X");
-      fh_set_flt(hu, FH_AUTO, "GD_YOFF", fh_fits_real_null,5, 
-		 "Guide star offset in Y");
-   }
-   if (serv_info->isu_on == TRUE){
-      fh_set_flt(hu, FH_AUTO, "SMRAD_X", serv_info->isu_mrad_x_delta_setup,5, 
-		 "delta X position sent to the ISU in mrad");
-      fh_set_flt(hu, FH_AUTO, "SMRAD_Y", serv_info->isu_mrad_y_delta_setup,5, 
-		 "delta Y position sent to the ISU in mrad");
-      fh_set_flt(hu, FH_AUTO, "RMRAD_X", serv_info->isu_mrad_x_status,5, 
-		 "X position read from the ISU in mrad");
-      fh_set_flt(hu, FH_AUTO, "RMRAD_Y", serv_info->isu_mrad_y_status,5, 
-		 "Y position read from the ISU in mrad");
+   /* A full pipe already has the thread woken up */
+   if (write(t->wake[1], &wake, 1) < 0 && errno != EAGAIN) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	    "(%s:%d) %s: unable to wake telemetry thread: %s",
+	    __FILE__, __LINE__, __FUNCTION__, strerror(errno));
    }
-   else {
-      fh_set_flt(hu, FH_AUTO, "SMRAD_X", fh_fits_real_null,5, 
-		 "X position sent to the ISU in mrad");
-      fh_set_flt(hu, FH_AUTO, "SMRAD_Y", fh_fits_real_null,5, 
-		 "Y position sent to the ISU in mrad");
-      fh_set_flt(hu, FH_AUTO, "RMRAD_X", fh_fits_real_null,5, 
-		 "X position read from the ISU in mrad");
-      fh_set_flt(hu, FH_AUTO, "RMRAD_Y", fh_fits_real_null,5, 
-		 "Y position read from the ISU in mrad");
-   }
-   if (serv_info->exp_on == TRUE){
-      fh_set_str(hu, FH_AUTO, "FILENAME", serv_info->filename, 
-		 "Observation file name");
-      fh_set_str(hu, FH_AUTO, "RA", serv_info->ra,"Telescope right ascension");
-      fh_set_str(hu, FH_AUTO, "DEC", serv_info->dec,"Telescope declination");
-      fh_set_flt(hu, FH_AUTO, "EQUINOX", serv_info->equinox,5, "Equinox");
-      fh_set_flt(hu, FH_AUTO, "OBJMAG", serv_info->objmag,5, 
-		 "Object magnitude");
+}
+
+/*
+ * Telemetry record of a frame.  status is the number of iterations of the
+ * centroid fit, or RAPTOR_TELEMETRY_NOT_GUIDING if no centroid was
+ * computed on the frame; xc and yc are then ignored.
+ */
+static void
+telemetryRecord(raptor_telemetry_t *rec, const frame_info_t *info,
+      int status, double xc, double yc)
+{
+   BOOLEAN fit = (status >= 0);
+
+   memset(rec, 0, sizeof(*rec));
+   rec->magic = RAPTOR_TELEMETRY_MAGIC;
+   rec->version = RAPTOR_TELEMETRY_VERSION;
+   rec->size = sizeof(*rec);
+   rec->seqnum = info->frame_sequence;
+   rec->status = status;
+   rec->timestamp = info->capture.tv_sec + info->capture.tv_usec * 1e-6;
+   rec->xc = status != RAPTOR_TELEMETRY_NOT_GUIDING ?
+      info->guide_x0 + xc : NAN;
+   rec->yc = status != RAPTOR_TELEMETRY_NOT_GUIDING ?
+      info->guide_y0 + yc : NAN;
+   rec->xerr = fit ? serv_info->psf_xerr : NAN;
+   rec->yerr = fit ? serv_info->psf_yerr : NAN;
+   rec->flux = fit ? serv_info->psf_flux : NAN;
+   psfFwhm(&rec->fwhm_x, &rec->fwhm_y);
+   rec->background = fit ? serv_info->psf_bkg : NAN;
+   rec->chi2 = fit ? serv_info->psf_chi2 : NAN;
+   rec->guide_xoff = info->guide_on == TRUE ? info->guide_xoff : NAN;
+   rec->guide_yoff = info->guide_on == TRUE ? info->guide_yoff : NAN;
+   rec->reserved = NAN;
+   if (info->isu_on == TRUE) {
+      rec->isu_cmd_x = info->isu_mrad_x_delta_setup;
+      rec->isu_cmd_y = info->isu_mrad_y_delta_setup;
+      rec->isu_meas_x = info->isu_mrad_x_status;
+      rec->isu_meas_y = info->isu_mrad_y_status;
    }
    else {
-      fh_set_str(hu, FH_AUTO, "FILENAME", fh_fits_string_null, 
-		 "Observation file name");
-      fh_set_str(hu, FH_AUTO, "RA", fh_fits_string_null, 
-		 "Telescope right ascension");
-      fh_set_str(hu, FH_AUTO, "DEC", fh_fits_string_null, 
-		 "Telescope declination");
-      fh_set_flt(hu, FH_AUTO, "EQUINOX", fh_fits_real_null,5, 
-		 "Equinox");
-      fh_set_flt(hu, FH_AUTO, "OBJMAG", fh_fits_real_null,5, 
-		 "Object magnitude");
+      rec->isu_cmd_x = rec->isu_cmd_y = NAN;
+      rec->isu_meas_x = rec->isu_meas_y = NAN;
    }
+}
 
-   /*
-    * If the frame count has been reached, clear out the save 
-    * information
-    */
-   if (strcmp(serv_info->fits_comment, fh_fits_string_null) &&
-       (serv_info->frame_sequence >= serv_info->frame_save_count)) {
-      serv_info->fits_comment[0] = '\0';
-      serv_info->frame_save_count = 0;
-      serv_info->frame_sequence = 0;
-   }
+#ifdef HAVE_ISU
+/*
+ * Job of the ISU readback stage: check the error status of the axes if
+ * requested and read the current angles back.  This runs concurrently with
+ * the centroid calculation, which does not depend on it.
+ */
+static void
+isuStageJob(void *p_args)
+{
+   isu_job_t *job = (isu_job_t *)p_args;
 
-   /* 
-    * Write out the FITS header 
-    */
-   if ((fh_error = fh_write(hu, fd)) != FH_SUCCESS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-		"(%s:%d) unable to write FITS header"
-		" (fh_error = %d)\n", __FILE__, __LINE__,
-		fh_error);
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-		"%s (errno=%d)", strerror(errno), errno);
-      return FAIL;
+   if (job->check == TRUE) {
+      job->check_status = check_isu(&job->x_fault, &job->y_fault);
    }
-   
-   /*
-    * Write out the image data
-    */
-   if ((fh_error = fh_write_padded_image(hu, fd,
-					 (unsigned short *)image_p, 
-					 serv_info->image_width *
-					 serv_info->image_height *
-					 sizeof(uint16_t), FH_TYPESIZE_16U)) 
-       != FH_SUCCESS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-		"(%s:%d) unable to write FITS image data"
-		" (fh_error = %d)\n", __FILE__, __LINE__,
-		fh_error);
-      return FAIL;
+   if (job->readback == TRUE) {
+      job->readback_status = get_angles(&job->x_angle, &job->y_angle);
    }
-   
-   /*
-    * Free up the memory for the FITS header
-    */
-   fh_destroy(hu);
-   
-   return PASS;
 }
+#endif // HAVE_ISU
 
 
 /*
@@ -2755,26 +7644,9 @@ clientReceive(void *client, char *buffer)
        * Handle a query of the current exposure time
        */
       if (!strcasecmp(buf_p, EXPTIME_CMD)) {
-	 unsigned long count;
-
-	 if (getGuiderExptime(&count) != PASS) {
-	    cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-		  "(%s:%d) unable to read exposure time from the"
-		  " Raptor camera", __FILE__, __LINE__);
-	    sprintf(buffer, "%c %s \"Unable to exposure time in the camera\"", 
-		  FAIL_CHAR, EXPTIME_CMD);
-	    cfht_logv(CFHT_MAIN, CFHT_DEBUG,
-		  "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
-	    return;
-	 }
-	 serv_info->exposure_time = count / 40e3;
-
-	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	       "(%s:%d) exposure time is %.9f ms",
-	       __FILE__, __LINE__, serv_info->exposure_time);
-	 sprintf(buffer, "%c %s %.9f", PASS_CHAR, EXPTIME_CMD, 
-	       serv_info->exposure_time);
-
+	 camReply(buffer, EXPTIME_CMD, CAM_EXPTIME, FALSE);
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	       "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
 	 return;
       }
 
@@ -2782,37 +7654,9 @@ clientReceive(void *client, char *buffer)
        * Handle a query of the frame rate
        */
       if (!strcasecmp(buf_p, FRAMERATE_CMD)) {
-	 sprintf(buffer, "%c %s", PASS_CHAR, FRAMERATE_CMD);
+	 camReply(buffer, FRAMERATE_CMD, CAM_FRAMERATE, FALSE);
 	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
 	       "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
-
-	 char* camera_response=NULL;
-	 double frame_rate;
-
-	 /* Make sure the connection with camera is still alive */
-	 if (checkCameraStatus(&camera_response) != PASS) {
-	    cfht_logv(CFHT_MAIN, CFHT_ERROR,
-		  "(%s:%d) there is no response from the camera when checking"
-		  " the camera status - exiting", __FILE__, __LINE__);
-	 }
-	 if (getGuiderFrameRate(&frame_rate) != PASS) {
-	    cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-		  "(%s:%d) unable to read frame rate from the"
-		  " Raptor camera", __FILE__, __LINE__);
-	    sprintf(buffer, "%c %s \"Unable to read frame rate in"
-		  " the camera\"", FAIL_CHAR, FRAMERATE_CMD);
-	    cfht_logv(CFHT_MAIN, CFHT_DEBUG,
-		  "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
-	    return;
-
-	 }
-	 serv_info->frame_rate = frame_rate;
-
-	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	       "(%s:%d) frame rate in camera set to %5.2f Hz",
-	       __FILE__, __LINE__, frame_rate);
-	 sprintf(buffer, "%c %s %5.2f", PASS_CHAR, FRAMERATE_CMD, frame_rate);
-
 	 return;
       }
 
@@ -2820,26 +7664,9 @@ clientReceive(void *client, char *buffer)
        * Handle a query for the TEC set point
        */
       if (!strcasecmp(buf_p, TEC_CMD)) {
-	 float setpoint;
-
-	 if (getGuiderTECPoint(&setpoint) != PASS) {
-	    cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-		  "(%s:%d) unable to read TEC set point from the"
-		  " Raptor camera", __FILE__, __LINE__);
-	    sprintf(buffer, "%c %s \"Unable to read TEC set point in"
-		  " the camera\"", FAIL_CHAR, TEC_CMD);
-	    cfht_logv(CFHT_MAIN, CFHT_DEBUG,
-		  "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
-	    return;
-	 }
-	 serv_info->tec_setpoint = setpoint;
-
-	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	       "(%s:%d) TEC set point is %4.1f degrees C",
-	       __FILE__, __LINE__, setpoint);
-	 sprintf(buffer, "%c %s %4.1f degrees C", PASS_CHAR, 
-	       TEC_CMD, setpoint);
-
+	 camReply(buffer, TEC_CMD, CAM_TEC, FALSE);
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	       "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
 	 return;
       }
 
@@ -2847,26 +7674,22 @@ clientReceive(void *client, char *buffer)
        * Handle a query for the temperature
        */
       if (!strcasecmp(buf_p, TEMP_CMD)) {
-	 float temp;
-
-	 if (checkGuiderTemp(&temp) != PASS) {
-	    cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-		  "(%s:%d) unable to read temperature from the"
-		  " Raptor camera", __FILE__, __LINE__);
-	    sprintf(buffer, "%c %s \"Unable to read temperature in"
-		  " the camera\"", FAIL_CHAR, TEMP_CMD);
-	    cfht_logv(CFHT_MAIN, CFHT_DEBUG,
-		  "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
-	    return;
-	 }
-	 serv_info->temp = temp;
+	 camReply(buffer, TEMP_CMD, CAM_TEMP, FALSE);
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	       "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	 return;
+      }
 
-	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	       "(%s:%d) Temperarure is %4.1f degrees C",
-	       __FILE__, __LINE__, temp);
-	 sprintf(buffer, "%c %s %4.1f degrees C", PASS_CHAR, 
-	       TEMP_CMD, temp);
+      /*
+       * Handle a query of the snapshot of the camera settings
+       */
+      if (!strcasecmp(buf_p, CAMERA_CMD)) {
+	 int used;
 
+	 used = sprintf(buffer, "%c %s", PASS_CHAR, CAMERA_CMD);
+	 camFormatSnapshot(buffer + used, &cam_worker);
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	       "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
 	 return;
       }
 
@@ -2901,6 +7724,225 @@ clientReceive(void *client, char *buffer)
 	 return;
       }
 
+      /*
+       * Handle a query of the centroid predictor configuration and of its
+       * innovation statistics
+       */
+      if (!strcasecmp(buf_p, PREDICT_CMD)) {
+	 char xstats[128];
+	 char ystats[128];
+
+	 predictFormat(xstats, sizeof(xstats),
+	       &serv_info->predict[PREDICT_X]);
+	 predictFormat(ystats, sizeof(ystats),
+	       &serv_info->predict[PREDICT_Y]);
+	 sprintf(buffer, "%c %s X: %s Y: %s LATENCY=%.2f ms", PASS_CHAR,
+	       PREDICT_CMD, xstats, ystats, serv_info->loop_latency * 1e3);
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	       "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	 return;
+      }
+
+      /*
+       * Handle a query of the PSF model used by the centroid and of the
+       * last fitted shape
+       */
+      if (!strcasecmp(buf_p, PSF_CMD)) {
+	 double shape[PSF_NPARAMS];
+	 psf_model_t model;
+	 float fwhm_x, fwhm_y;
+
+	 pthread_mutex_lock(&psf_lock);
+	 model = serv_info->psf_model;
+	 memcpy(shape, serv_info->psf_shape, sizeof(shape));
+	 fwhm_x = serv_info->fwhm_x;
+	 fwhm_y = serv_info->fwhm_y;
+	 pthread_mutex_unlock(&psf_lock);
+	 sprintf(buffer, "%c %s %s W1=%.3f W2=%.3f THETA=%.1f FWHM=%.2f %.2f"
+	       " NITER=%d XERR=%.4f YERR=%.4f CHI2=%.2f", PASS_CHAR, PSF_CMD,
+	       psfModelName(model), shape[PSF_W1], shape[PSF_W2],
+	       shape[PSF_THETA] * 180.0 / M_PI, fwhm_x, fwhm_y,
+	       serv_info->psf_niter, serv_info->psf_xerr,
+	       serv_info->psf_yerr, serv_info->psf_chi2);
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	       "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	 return;
+      }
+
+      /*
+       * Handle a query of the FITS writer queue and of its counters
+       */
+      if (!strcasecmp(buf_p, FITSQ_CMD)) {
+	 pthread_mutex_lock(&fits_queue.lock);
+	 sprintf(buffer, "%c %s %d %s QUEUED=%d TOTAL=%ld WRITTEN=%ld "
+	       "DROPPED=%ld LATE=%ld", PASS_CHAR, FITSQ_CMD, fits_queue.depth,
+	       fitsPolicyName(fits_queue.policy), fits_queue.count,
+	       fits_queue.queued, fits_queue.written, fits_queue.dropped,
+	       fits_queue.late);
+	 pthread_mutex_unlock(&fits_queue.lock);
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	       "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	 return;
+      }
+
+      /*
+       * Handle a query of the FITS video rate and of its counters
+       */
+      if (!strcasecmp(buf_p, VIDEORATE_CMD)) {
+	 sprintf(buffer, "%c %s %d %.2f EMITTED=%ld SKIPPED=%ld", PASS_CHAR,
+	       VIDEORATE_CMD, video_rate.decimate, video_rate.max_rate,
+	       video_rate.emitted, video_rate.skipped);
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	       "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	 return;
+      }
+
+      /*
+       * Handle a query of the serial session statistics: count, mean and
+       * maximum latency in ms of each operation, per register
+       */
+      if (!strcasecmp(buf_p, SERIAL_CMD)) {
+	 serial_session_t *ss = &serial_session;
+	 size_t used;
+	 int i;
+
+	 pthread_mutex_lock(&ss->lock);
+	 used = sprintf(buffer, "%c %s COMMANDS=%ld ERRORS=%ld RESYNCS=%ld",
+	       PASS_CHAR, SERIAL_CMD, ss->commands, ss->errors, ss->resyncs);
+	 for (i = 0; i < ss->nstats; i++) {
+	    serial_stat_t *st = &ss->stats[i];
+
+	    used += sprintf(buffer + used, " %s", serial_op_name[st->op]);
+	    if (st->op == SERIAL_OP_OTHER) {
+	       used += sprintf(buffer + used, ":%04X", st->addr);
+	    }
+	    else if (st->addr >= 0) {
+	       used += sprintf(buffer + used, ":%02X", st->addr);
+	    }
+	    used += sprintf(buffer + used, "=%ld/%.1f/%.1f", st->count,
+		  st->total / st->count, st->max);
+	 }
+	 pthread_mutex_unlock(&ss->lock);
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	       "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	 return;
+      }
+
+      /*
+       * Handle a query of the telemetry stream
+       */
+      if (!strcasecmp(buf_p, TELEMETRY_CMD)) {
+	 pthread_mutex_lock(&telemetry.lock);
+	 sprintf(buffer, "%c %s PORT=%s SOCKET=%s CLIENTS=%d RECORDS=%lu",
+	       PASS_CHAR, TELEMETRY_CMD,
+	       telemetry.listen_tcp >= 0 ? telemetry.port : "OFF",
+	       telemetry.listen_unix >= 0 ? telemetry.socket_path : "OFF",
+	       telemetry.nclients, (unsigned long)telemetry.published);
+	 pthread_mutex_unlock(&telemetry.lock);
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	       "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	 return;
+      }
+
+      /*
+       * Handle a query of the recorder of SAVE sequences
+       */
+      if (!strcasecmp(buf_p, RECORD_CMD)) {
+	 pthread_mutex_lock(&recorder.lock);
+	 sprintf(buffer, "%c %s %s FILES=%ld FRAMES=%ld LOST=%ld LAST=%s",
+	       PASS_CHAR, RECORD_CMD,
+	       recorder.dir[0] != '\0' ? recorder.dir : "OFF",
+	       recorder.files, recorder.frames, recorder.lost,
+	       recorder.path[0] != '\0' ? recorder.path : "NONE");
+	 pthread_mutex_unlock(&recorder.lock);
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	       "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	 return;
+      }
+
+      /*
+       * Handle a query of the compression of the FITS output
+       */
+      if (!strcasecmp(buf_p, COMPRESS_CMD)) {
+	 pthread_mutex_lock(&fits_queue.lock);
+	 sprintf(buffer, "%c %s %s WORKERS=%d FRAMES=%ld RATIO=%.2f",
+	       PASS_CHAR, COMPRESS_CMD, fitsCompressName(fits_queue.compress),
+	       fits_queue.nworkers, fits_queue.compressed,
+	       fits_queue.comp_out > 0 ?
+	       fits_queue.comp_in / fits_queue.comp_out : 0.0);
+	 pthread_mutex_unlock(&fits_queue.lock);
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	       "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	 return;
+      }
+
+      /*
+       * Handle a query of the cubes of SAVE sequences
+       */
+      if (!strcasecmp(buf_p, CUBE_CMD)) {
+	 if (serv_info->cube_frames > 1) {
+	    sprintf(buffer, "%c %s %d %.2f WRITTEN=%ld", PASS_CHAR, CUBE_CMD,
+		  serv_info->cube_frames, serv_info->cube_flush,
+		  fits_cube.written);
+	 }
+	 else {
+	    sprintf(buffer, "%c %s OFF", PASS_CHAR, CUBE_CMD);
+	 }
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	       "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	 return;
+      }
+
+      /*
+       * Handle a query of the shared memory frame ring
+       */
+      if (!strcasecmp(buf_p, SHM_CMD)) {
+	 if (shm_ring == NULL) {
+	    sprintf(buffer, "%c %s OFF", PASS_CHAR, SHM_CMD);
+	 }
+	 else {
+	    sprintf(buffer, "%c %s %s SLOTS=%d PUBLISHED=%llu", PASS_CHAR,
+		  SHM_CMD, RAPTOR_SHM_NAME, RAPTOR_SHM_SLOTS,
+		  (unsigned long long)__atomic_load_n(&shm_ring->published,
+		     __ATOMIC_RELAXED));
+	 }
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	       "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	 return;
+      }
+
+      /*
+       * Handle a query of the co-add of the faint star mode
+       */
+      if (!strcasecmp(buf_p, COADD_CMD)) {
+	 sprintf(buffer, "%c %s %d COUNT=%d XOFF=%.3f YOFF=%.3f", PASS_CHAR,
+	       COADD_CMD, coadd.depth, coadd.count, serv_info->coadd_xoff,
+	       serv_info->coadd_yoff);
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	       "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	 return;
+      }
+
+      /*
+       * Handle a query of the detector noise model weighting the PSF fit
+       */
+      if (!strcasecmp(buf_p, NOISE_CMD)) {
+	 BOOLEAN loading;
+
+	 pthread_mutex_lock(&psf_lock);
+	 loading = dark_load.busy;
+	 pthread_mutex_unlock(&psf_lock);
+	 sprintf(buffer, "%c %s GAIN=%.3f RN=%.2f LOSS=%s %.3f DARK=%s%s",
+	       PASS_CHAR, NOISE_CMD, serv_info->det_gain,
+	       serv_info->det_read_noise, fitLossName(serv_info->fit_loss),
+	       serv_info->fit_loss_scale,
+	       serv_info->dark_file[0] ? serv_info->dark_file : "OFF",
+	       loading == TRUE ? " LOADING" : "");
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	       "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	 return;
+      }
+
       /*
        * If we made it this far, this is an unrecognized command request
        * from the client which doesn't have parameters.
@@ -3001,14 +8043,133 @@ clientReceive(void *client, char *buffer)
       return;
    }
 
+   /*
+    * Handle a query of the current sensor temperature
+    */
+   if (!strcasecmp(buf_p, TEMP_CMD)) {
+      if (strcasecmp(cargv[0], FRESH_ARG) != 0) {
+	 sprintf(buffer, "%c %s \"Usage: %s [%s]\"", FAIL_CHAR, TEMP_CMD,
+	       TEMP_CMD, FRESH_ARG);
+      }
+      else {
+	 camReply(buffer, TEMP_CMD, CAM_TEMP, TRUE);
+      }
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	    "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return;
+   }
+
+   /*
+    * Read all the camera settings, or change the intervals of their
+    * background reads
+    */
+   if (!strcasecmp(buf_p, CAMERA_CMD)) {
+      double poll_temp, poll_settings;
+      BOOLEAN refreshing = FALSE;
+      int used, i;
+
+      if (cargc == 1 && !strcasecmp(cargv[0], FRESH_ARG)) {
+	 for (i = 0; i < CAM_ITEMS; i++) {
+	    (void)camSubmit(&cam_worker, CAM_PRIO_USER, i, FALSE, 0,
+		  camJobDone);
+	 }
+	 refreshing = cam_worker.running;
+      }
+      else if (camPollParse(cargc, cargv, &poll_temp,
+		  &poll_settings) == PASS) {
+	 for (i = 0; i < CAM_ITEMS; i++) {
+	    cam_worker.interval[i] = (i == CAM_TEMP) ?
+	       poll_temp : poll_settings;
+	 }
+      }
+      else {
+	 sprintf(buffer, "%c %s \"Usage: %s [%s | POLL <temperature s> "
+	       "[<settings s>]]\"", FAIL_CHAR, CAMERA_CMD, CAMERA_CMD,
+	       FRESH_ARG);
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	       "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	 return;
+      }
+      used = sprintf(buffer, "%c %s", PASS_CHAR, CAMERA_CMD);
+      used += camFormatSnapshot(buffer + used, &cam_worker);
+      if (refreshing == TRUE) sprintf(buffer + used, " REFRESHING");
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	    "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return;
+   }
+
    /*
     * Handle a frame rate command from a client 
     */
    if (!strcasecmp(buf_p, FRAMERATE_CMD)) {
+      frame_limit_t lim;
       double frame_rate;
-      char *camera_response = NULL;
       char *stop_at = NULL;
 
+      /* A FRESH query reads the camera rather than the snapshot */
+      if (!strcasecmp(cargv[0], FRESH_ARG)) {
+	 camReply(buffer, FRAMERATE_CMD, CAM_FRAMERATE, TRUE);
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	       "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	 return;
+      }
+
+      /* Highest safe rate with the exposure time, and its terms in ms */
+      if (!strcasecmp(cargv[0], MAX_ARG)) {
+	 frameRateLimit(frameExptime(), &lim);
+	 sprintf(buffer, "%c %s %s %.2f READOUT=%.3f EXPOSURE=%.3f"
+	       " PROCESSING=%.3f", PASS_CHAR, FRAMERATE_CMD, MAX_ARG,
+	       lim.rate, lim.readout * 1e3, lim.exposure * 1e3,
+	       lim.proc * 1e3);
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	       "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	 return;
+      }
+
+      /*
+       * Shortest exposure reaching a signal to noise ratio on the star,
+       * at the highest rate it allows
+       */
+      if (!strcasecmp(cargv[0], SNR_ARG)) {
+	 double snr = 0, exptime;
+
+	 if (cargc == 2) snr = strtod(cargv[1], &stop_at);
+	 if (cargc != 2 || *stop_at != '\0' || snr <= 0) {
+	    sprintf(buffer, "%c \"Invalid frame rate command. Should be %s"
+		  " %s <signal to noise ratio>\"", FAIL_CHAR, FRAMERATE_CMD,
+		  SNR_ARG);
+	    cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		  "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	    return;
+	 }
+	 if (snrExptime(snr, &exptime) != PASS) {
+	    sprintf(buffer, "%c %s \"No star measured yet\"", FAIL_CHAR,
+		  FRAMERATE_CMD);
+	    cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		  "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	    return;
+	 }
+	 frameRateLimit(exptime, &lim);
+	 if (1e3 / lim.rate > USER_TIMEOUT) {
+	    sprintf(buffer, "%c %s \"Star too faint, it needs %.0f ms\"",
+		  FAIL_CHAR, FRAMERATE_CMD, exptime);
+	    cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		  "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	    return;
+	 }
+	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	       "(%s:%d) signal to noise ratio %.1f needs %.3f ms, setting"
+	       " the frame rate to %5.2f Hz", __FILE__, __LINE__, snr,
+	       exptime, lim.rate);
+	 camStage(&cam_stage, CAM_EXPTIME, exptime);
+	 camStage(&cam_stage, CAM_FRAMERATE, lim.rate);
+	 sprintf(buffer, "%c %s %5.2f %s=%.3f", PASS_CHAR, FRAMERATE_CMD,
+	       lim.rate, EXPTIME_CMD, exptime);
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	       "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	 return;
+      }
+
       frame_rate = strtod(cargv[0], &stop_at);
 
       /* Make sure the frame rate is valid */
@@ -3019,56 +8180,30 @@ clientReceive(void *client, char *buffer)
 	       "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
 	 return;
       }
-      if (frame_rate <= 0 || (1e3 / frame_rate) > USER_TIMEOUT ||
-	    frame_rate > 120) {
+      if (frame_rate <= 0 || (1e3 / frame_rate) > USER_TIMEOUT) {
 	 sprintf(buffer, "%c %s \"Frame Rate Specified is Invalid\"", 
 	       FAIL_CHAR, FRAMERATE_CMD);
 	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
 	       "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
 	 return;
       }
-
-      /* Make sure the connection with camera is still alive */
-      if (checkCameraStatus(&camera_response) != PASS) {
-	 cfht_logv(CFHT_MAIN, CFHT_ERROR,
-	       "(%s:%d) there is no response from the camera when checking"
-	       " the camera status - exiting", __FILE__, __LINE__);
-      }
-      /* 
-       * Try to update the frame rate of the camera
-       */
-      //cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-      //"(%s:%d) attempting to set the frame rate to %5.2f Hz",
-      //__FILE__, __LINE__, frame_rate);
-      if (setGuiderFrameRate(frame_rate) != PASS) {
-	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	       "(%s:%d) unable to set frame rate to %5.2f Hz",
-	       __FILE__, __LINE__, frame_rate);
-	 sprintf(buffer, "%c %s \"Unable to set frame rate in the camera\"", 
-	       FAIL_CHAR, FRAMERATE_CMD);
+      frameRateLimit(frameExptime(), &lim);
+      if (frame_rate > lim.rate) {
+	 sprintf(buffer, "%c %s \"Frame rate above the %.2f Hz ceiling\"",
+	       FAIL_CHAR, FRAMERATE_CMD, lim.rate);
 	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
 	       "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
 	 return;
       }
 
-      /*
-       * Just to be sure read back the frame rate from the camera
+      /* 
+       * Stage the new frame rate, sent to the camera between two frames
+       * and read back once it is set
        */
-      if (getGuiderFrameRate(&frame_rate) != PASS) {
-	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	       "(%s:%d) unable to read frame rate from the"
-	       " Raptor camera", __FILE__, __LINE__);
-	 sprintf(buffer, "%c %s \"Unable to read frame rate in the camera\"", 
-	       FAIL_CHAR, FRAMERATE_CMD);
-	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
-	       "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
-	 return;
-      }
-      serv_info->frame_rate = frame_rate;
-
       cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	    "(%s:%d) frame rate in camera set to %5.2f Hz",
+	    "(%s:%d) attempting to set the frame rate to %5.2f Hz",
 	    __FILE__, __LINE__, frame_rate);
+      camStage(&cam_stage, CAM_FRAMERATE, frame_rate);
       sprintf(buffer, "%c %s %5.2f", PASS_CHAR, FRAMERATE_CMD, frame_rate);
 
       return;
@@ -3081,6 +8216,14 @@ clientReceive(void *client, char *buffer)
       double exptime;
       char *stop_at = NULL;
 
+      /* A FRESH query reads the camera rather than the snapshot */
+      if (!strcasecmp(cargv[0], FRESH_ARG)) {
+	 camReply(buffer, EXPTIME_CMD, CAM_EXPTIME, TRUE);
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	       "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	 return;
+      }
+
       exptime = strtod(cargv[0], &stop_at);
 
       /* Make sure the exposure time is valid */
@@ -3093,30 +8236,29 @@ clientReceive(void *client, char *buffer)
 	 return;
       }
 
+      /* It must fit in the frame period */
+      {
+	 frame_limit_t lim;
+
+	 frameRateLimit(exptime, &lim);
+	 if (frameRate() > FRAME_RATE_MARGIN / lim.exposure) {
+	    sprintf(buffer, "%c %s \"Exposure time too long for %.2f Hz\"",
+		  FAIL_CHAR, EXPTIME_CMD, frameRate());
+	    cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		  "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	    return;
+	 }
+      }
+
       /* 
-       * Try to update the exposure time of the camera
+       * Stage the new exposure time, sent to the camera between two
+       * frames
        */
-      exptime *= 40e3;
       cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
 	    "(%s:%d) attempting to set the exposure time to %5.2f ms",
 	    __FILE__, __LINE__, exptime);
-      if (setGuiderExptime(exptime) != PASS) {
-	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	       "(%s:%d) unable to set exposure time to %5.2f ms",
-	       __FILE__, __LINE__, exptime / 40e3);
-	 sprintf(buffer, "%c %s \"Unable to set exposure time in the"
-	       " camera\"", FAIL_CHAR, EXPTIME_CMD);
-	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
-	       "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
-	 return;
-      }
-      serv_info->exposure_time = exptime / 40e3;
-
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	    "(%s:%d) exposure time in camera set to %.3f ms",
-	    __FILE__, __LINE__, serv_info->exposure_time);
-      sprintf(buffer, "%c %s %5.2f", PASS_CHAR, EXPTIME_CMD,
-	    serv_info->exposure_time);
+      camStage(&cam_stage, CAM_EXPTIME, exptime);
+      sprintf(buffer, "%c %s %5.2f", PASS_CHAR, EXPTIME_CMD, exptime);
 
       return;
    }
@@ -3128,6 +8270,14 @@ clientReceive(void *client, char *buffer)
       float setpoint;
       char *stop_at = NULL;
 
+      /* A FRESH query reads the camera rather than the snapshot */
+      if (!strcasecmp(cargv[0], FRESH_ARG)) {
+	 camReply(buffer, TEC_CMD, CAM_TEC, TRUE);
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	       "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	 return;
+      }
+
       setpoint = strtod(cargv[0], &stop_at);
 
       /* Make sure the set point is valid */
@@ -3140,27 +8290,19 @@ clientReceive(void *client, char *buffer)
       }
 
       /* 
-       * Try to update the TEC set point of the camera
+       * Queue the new TEC set point of the camera
        */
       cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
 	    "(%s:%d) attempting to set the TEC setpoint to %5.2f degrees"
 	    " C", __FILE__, __LINE__, setpoint);
-      if (setGuiderTECPoint(setpoint) != PASS) {
-	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	       "(%s:%d) unable to set TEC setpoint to %5.2f degrees C",
-	       __FILE__, __LINE__, setpoint);
+      if (camSubmit(&cam_worker, CAM_PRIO_USER, CAM_TEC, TRUE,
+	       setpoint, camJobDone) != PASS) {
 	 sprintf(buffer, "%c %s \"Unable to set TEC set point in the"
 	       " camera\"", FAIL_CHAR, TEC_CMD);
 	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
 	       "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
 	 return;
       }
-
-      serv_info->tec_setpoint = setpoint;
-
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	    "(%s:%d) TEC cooler set point in camera set to %5.2f"
-	    " degrees C", __FILE__, __LINE__, setpoint);
       sprintf(buffer, "%c %s %5.2f", PASS_CHAR, TEC_CMD, setpoint);
 
       return;
@@ -3186,86 +8328,475 @@ clientReceive(void *client, char *buffer)
    }
 
    /*
-    * Handle a request to turn on or off the ISU mode from a client
+    * Handle a request to turn on or off the ISU mode from a client
+    */
+   if (!strcasecmp(buf_p, ISU_CMD)) {
+      if ((!strcasecmp(cargv[0], "ON")) && (cargc == 1)) {
+
+#ifdef HAVE_ISU
+	 /* Check if the ISU needs to perform a new homing */
+	 if (check_isu_homed(&homed) != PASS) {
+	    cfht_logv(CFHT_MAIN, CFHT_WARN, "(%s:%d) Failed checking "
+		  "homing status of the ISU mechanism",
+		  __FILE__, __LINE__);
+	    homed = 0;
+	 }  
+	 if (homed == 0) {
+	    /* 
+	     * Home the ISU in a separate thread because 
+	     * otherwise blocks video
+	     */
+	    if (pthread_create(&home_isu_t, NULL, home_isu_thread, NULL)) {
+	       cfht_logv(CFHT_MAIN, CFHT_ERROR, "(%s:%d) Fatal error on "
+		     "the fast guiding loop: failed creating homing thread",
+		     __FILE__, __LINE__);
+	       exit(EXIT_FAILURE);
+	    }
+	    if (pthread_detach(home_isu_t)) {
+	       cfht_logv(CFHT_MAIN, CFHT_ERROR, "(%s:%d) Fatal error on "
+		     "the fast guiding loop: failed joining homing thread",
+		     __FILE__, __LINE__);
+	       exit(EXIT_FAILURE);
+	    }  
+	    /*
+	     * It is immediately  confirmed on telnet but the confirmation in 
+	     * the logs is printed when homing is really finished
+	     */
+	    sprintf(buffer, "%c ON", PASS_CHAR);
+	 }
+	 else {
+	    cfht_logv(CFHT_MAIN, CFHT_LOGONLY, "(%s:%d) ISU was already "
+		  "homed", __FILE__, __LINE__);
+	    if (enable_isu() != PASS) {
+	       cfht_logv(CFHT_MAIN, CFHT_WARN, "(%s:%d) Failed enabling "
+		     " the ISU mechanism", __FILE__, __LINE__);
+	       sprintf(buffer, "%c OFF", FAIL_CHAR);
+	    }
+	    else {
+	       serv_info->isu_on = TRUE;
+	       sprintf(buffer, "%c ON", PASS_CHAR);
+#ifdef SIM_STAR
+	       cfht_logv(CFHT_MAIN, CFHT_LOGONLY, "(%s:%d) Beware that "
+		     "SIM_STAR is defined and the centroid algorithm is NOT called",
+		     __FILE__, __LINE__);
+#endif //SIM_STAR
+#ifdef DEBUG
+	       cfht_logv(CFHT_MAIN, CFHT_LOGONLY, "(%s:%d) Beware that "
+		     "DEBUG is defined and status / setup positions are written in "
+		     "outputs csv file", __FILE__, __LINE__);
+#endif //DEBUG
+	    }
+	 }
+#endif //HAVE_ISU
+
+      } else if ((!strcasecmp(cargv[0], "OFF")) && (cargc == 1)) {
+
+#ifdef HAVE_ISU
+	 /* Stop the ISU */
+	 if (stop_isu() != PASS) {
+	    cfht_logv(CFHT_MAIN, CFHT_WARN, "(%s:%d) Failed stopping "
+		  " the ISU mechanism", __FILE__, __LINE__);
+	    sprintf(buffer, "%c OFF", FAIL_CHAR);
+	 }
+	 else {
+	    serv_info->isu_on = FALSE;
+	    sprintf(buffer, "%c OFF", PASS_CHAR);
+	 }
+#endif //HAVE_ISU
+
+      }
+      else {
+	 sprintf(buffer, "%c \"Invalid isu mode\"", FAIL_CHAR);
+      }
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	    "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return;
+   }
+
+   /*
+    * Handle a request to configure the centroid predictor.  The expected
+    * syntax is PREDICT RESET or PREDICT <X|Y|XY> <OFF|ALPHABETA <alpha>
+    * <beta>|KALMAN <q> <r>>
+    */
+   if (!strcasecmp(buf_p, PREDICT_CMD)) {
+      predict_axis_t x_axis = serv_info->predict[PREDICT_X];
+      predict_axis_t y_axis = serv_info->predict[PREDICT_Y];
+      BOOLEAN do_x, do_y;
+
+      if (cargc == 1 && !strcasecmp(cargv[0], "RESET")) {
+	 predictReset(&serv_info->predict[PREDICT_X]);
+	 predictReset(&serv_info->predict[PREDICT_Y]);
+	 sprintf(buffer, "%c %s RESET", PASS_CHAR, PREDICT_CMD);
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	       "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	 return;
+      }
+
+      do_x = !strcasecmp(cargv[0], "X") || !strcasecmp(cargv[0], "XY");
+      do_y = !strcasecmp(cargv[0], "Y") || !strcasecmp(cargv[0], "XY");
+      if ((do_x == FALSE && do_y == FALSE) ||
+	  (do_x && predictConfigure(&x_axis, cargc - 1, cargv + 1) != PASS) ||
+	  (do_y && predictConfigure(&y_axis, cargc - 1, cargv + 1) != PASS)) {
+	 sprintf(buffer, "%c \"Invalid predict command. Should be %s RESET"
+	       " or %s <X|Y|XY> <OFF|ALPHABETA alpha beta|KALMAN q r>\"",
+	       FAIL_CHAR, PREDICT_CMD, PREDICT_CMD);
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	       "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	 return;
+      }
+
+      serv_info->predict[PREDICT_X] = x_axis;
+      serv_info->predict[PREDICT_Y] = y_axis;
+      sprintf(buffer, "%c %s %s", PASS_CHAR, PREDICT_CMD, cargv[0]);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	    "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return;
+   }
+
+   /*
+    * Handle a request to select the PSF model fitted by the centroid.  The
+    * expected syntax is PSF <GAUSSIAN|MOFFAT|ELLIPTICAL>.  The shape seeding
+    * the centroid goes back to a round star until the next FWHM measurement.
+    */
+   if (!strcasecmp(buf_p, PSF_CMD)) {
+      psf_model_t model;
+
+      if (cargc != 1 || psfModelParse(cargv[0], &model) != PASS) {
+	 sprintf(buffer, "%c \"Invalid PSF command. Should be %s "
+	       "<GAUSSIAN|MOFFAT|ELLIPTICAL>\"", FAIL_CHAR, PSF_CMD);
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	       "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	 return;
+      }
+
+      pthread_mutex_lock(&psf_lock);
+      serv_info->psf_model = model;
+      psfShapeReset(model, serv_info->psf_shape);
+      pthread_mutex_unlock(&psf_lock);
+      serv_info->psf_refit = TRUE;
+      sprintf(buffer, "%c %s %s", PASS_CHAR, PSF_CMD, psfModelName(model));
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	    "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return;
+   }
+
+   /*
+    * Handle a request to enable the recorder of SAVE sequences.  The
+    * expected syntax is RECORD <directory> or RECORD OFF.  A sequence being
+    * recorded is ended when the recorder is turned off.
+    */
+   if (!strcasecmp(buf_p, RECORD_CMD)) {
+      struct stat st;
+
+      if (cargc != 1 ||
+	  (strcasecmp(cargv[0], "OFF") &&
+	   (strlen(cargv[0]) >= sizeof(recorder.dir) ||
+	    stat(cargv[0], &st) != 0 || !S_ISDIR(st.st_mode) ||
+	    access(cargv[0], W_OK) != 0))) {
+	 sprintf(buffer, "%c \"Invalid record command. Should be %s OFF or "
+	       "%s <writable directory>\"", FAIL_CHAR, RECORD_CMD, RECORD_CMD);
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	       "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	 return;
+      }
+      pthread_mutex_lock(&recorder.lock);
+      if (!strcasecmp(cargv[0], "OFF")) recorder.dir[0] = '\0';
+      else strcpy(recorder.dir, cargv[0]);
+      pthread_mutex_unlock(&recorder.lock);
+      sprintf(buffer, "%c %s %s", PASS_CHAR, RECORD_CMD, cargv[0]);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	    "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return;
+   }
+
+   /*
+    * Handle a request to reset the serial session statistics.  The
+    * expected syntax is SERIAL RESET.
+    */
+   if (!strcasecmp(buf_p, SERIAL_CMD)) {
+      if (cargc != 1 || strcasecmp(cargv[0], "RESET") != 0) {
+	 sprintf(buffer, "%c \"Invalid serial command. Should be %s "
+	       "RESET\"", FAIL_CHAR, SERIAL_CMD);
+      }
+      else {
+	 serialStatsReset(&serial_session);
+	 sprintf(buffer, "%c %s RESET", PASS_CHAR, SERIAL_CMD);
+      }
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	    "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return;
+   }
+
+   /*
+    * Handle a request to benchmark a processing kernel.  The expected
+    * syntax is BENCH CONVERT, which times the FITS pixel conversion on a
+    * guide raster and on a full frame, or BENCH SERIAL [<n>], which times
+    * n (100 by default) register round trips with the camera.  They block
+    * the acquisition, for up to a few seconds, and are refused while
+    * guiding.  BENCH SERIAL is also refused while the camera worker has
+    * commands to run or an exposure time or frame rate change is staged.
+    */
+   if (!strcasecmp(buf_p, BENCH_CMD)) {
+      char result[200];
+      char *stop_at = NULL;
+      long n = 100;
+      PASSFAIL status = FAIL;
+
+      if (cargc == 2) n = strtol(cargv[1], &stop_at, 10);
+      if (!(cargc == 1 && !strcasecmp(cargv[0], "CONVERT")) &&
+	  !(cargc >= 1 && cargc <= 2 && !strcasecmp(cargv[0], "SERIAL") &&
+	    (stop_at == NULL || *stop_at == '\0') && n >= 1 && n <= 1000)) {
+	 sprintf(buffer, "%c \"Invalid bench command. Should be %s "
+	       "CONVERT or %s SERIAL [<1-1000>]\"", FAIL_CHAR, BENCH_CMD,
+	       BENCH_CMD);
+      }
+      else if (serv_info->guide_on == TRUE) {
+	 sprintf(buffer, "%c \"%s is not allowed while guiding\"",
+	       FAIL_CHAR, BENCH_CMD);
+      }
+      else if (!strcasecmp(cargv[0], "SERIAL") &&
+	       (camWorkerIdle(&cam_worker) == FALSE ||
+		cam_stage.state != CAM_STAGE_IDLE ||
+		cam_stage.exptime_staged == TRUE ||
+		cam_stage.rate_staged == TRUE)) {
+	 sprintf(buffer, "%c \"Camera commands in progress, try %s SERIAL "
+	       "again\"", FAIL_CHAR, BENCH_CMD);
+      }
+      else {
+	 if (!strcasecmp(cargv[0], "CONVERT")) {
+	    status = fitsConvertBench(result, sizeof(result));
+	 }
+	 else {
+	    status = serialBench(result, sizeof(result), n);
+	 }
+	 if (status != PASS) {
+	    sprintf(buffer, "%c \"%s\"", FAIL_CHAR, result);
+	 }
+	 else {
+	    sprintf(buffer, "%c %s %s %s", PASS_CHAR, BENCH_CMD, cargv[0],
+		  result);
+	 }
+      }
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	    "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return;
+   }
+
+   /*
+    * Handle a request to select the compressed streams.  The expected
+    * syntax is COMPRESS <OFF|VIDEO|SAVE|BOTH>; the number of workers is
+    * only set by the configuration file.  It applies to the next queued
+    * frames.
+    */
+   if (!strcasecmp(buf_p, COMPRESS_CMD)) {
+      fits_compress_t compress;
+      int workers;
+
+      if (cargc != 1 ||
+	  fitsCompressParse(cargc, cargv, &compress, &workers) != PASS) {
+	 sprintf(buffer, "%c \"Invalid compress command. Should be %s "
+	       "<OFF|VIDEO|SAVE|BOTH>\"", FAIL_CHAR, COMPRESS_CMD);
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	       "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	 return;
+      }
+      pthread_mutex_lock(&fits_queue.lock);
+      fits_queue.compress = compress;
+      pthread_mutex_unlock(&fits_queue.lock);
+      sprintf(buffer, "%c %s %s", PASS_CHAR, COMPRESS_CMD,
+	    fitsCompressName(compress));
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	    "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return;
+   }
+
+   /*
+    * Handle a request to write the frames of SAVE sequences as cubes.  The
+    * expected syntax is CUBE OFF or CUBE <frames> [<flush s>], where a
+    * partial cube is written after the flush time (0 to wait until it is
+    * full or the sequence ends).  It applies to the next acquired frames.
+    */
+   if (!strcasecmp(buf_p, CUBE_CMD)) {
+      int frames;
+      double flush;
+
+      if (cubeParse(cargc, cargv, &frames, &flush) != PASS) {
+	 sprintf(buffer, "%c \"Invalid cube command. Should be %s OFF or "
+	       "%s <2-%d> [<flush s>]\"", FAIL_CHAR, CUBE_CMD, CUBE_CMD,
+	       CUBE_MAX_FRAMES);
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	       "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	 return;
+      }
+      serv_info->cube_frames = frames;
+      serv_info->cube_flush = flush;
+      sprintf(buffer, "%c %s %s", PASS_CHAR, CUBE_CMD, cargv[0]);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	    "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return;
+   }
+
+   /*
+    * Handle a request to set the FITS video rate.  The expected syntax is
+    * VIDEORATE RESET to clear the counters or VIDEORATE <n> [<max Hz>] to
+    * write one frame out of n, at most max Hz (0 for no limit).
+    */
+   if (!strcasecmp(buf_p, VIDEORATE_CMD)) {
+      int decimate;
+      double max_rate;
+
+      if (cargc == 1 && !strcasecmp(cargv[0], "RESET")) {
+	 video_rate.emitted = 0;
+	 video_rate.skipped = 0;
+      }
+      else if (videoRateParse(cargc, cargv, &decimate, &max_rate) == PASS) {
+	 video_rate.decimate = decimate;
+	 video_rate.max_rate = max_rate;
+      }
+      else {
+	 sprintf(buffer, "%c \"Invalid video rate. Should be %s RESET or "
+	       "%s <1-%d> [<max Hz>]\"", FAIL_CHAR, VIDEORATE_CMD,
+	       VIDEORATE_CMD, VIDEO_DECIMATE_MAX);
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	       "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	 return;
+      }
+      sprintf(buffer, "%c %s %d %.2f", PASS_CHAR, VIDEORATE_CMD,
+	    video_rate.decimate, video_rate.max_rate);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	    "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return;
+   }
+
+   /*
+    * Handle a request to configure the FITS writer queue.  The expected
+    * syntax is FITSQ RESET to clear the counters or FITSQ <depth>
+    * [DROPOLDEST|DROPNEWEST|BLOCKSAVE].  Frames already queued beyond a
+    * smaller depth are still written.
+    */
+   if (!strcasecmp(buf_p, FITSQ_CMD)) {
+      int depth;
+      fits_policy_t policy;
+
+      pthread_mutex_lock(&fits_queue.lock);
+      policy = fits_queue.policy;
+      if (cargc == 1 && !strcasecmp(cargv[0], "RESET")) {
+	 fits_queue.queued = 0;
+	 fits_queue.written = 0;
+	 fits_queue.dropped = 0;
+	 fits_queue.late = 0;
+      }
+      else if (fitsQueueParse(cargc, cargv, &depth, &policy) == PASS) {
+	 fits_queue.depth = depth;
+	 fits_queue.policy = policy;
+	 pthread_cond_broadcast(&fits_queue.cond);
+      }
+      else {
+	 pthread_mutex_unlock(&fits_queue.lock);
+	 sprintf(buffer, "%c \"Invalid FITS queue command. Should be %s RESET"
+	       " or %s <1-%d> [DROPOLDEST|DROPNEWEST|BLOCKSAVE]\"", FAIL_CHAR,
+	       FITSQ_CMD, FITSQ_CMD, FITS_QUEUE_MAX);
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	       "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	 return;
+      }
+      pthread_mutex_unlock(&fits_queue.lock);
+      sprintf(buffer, "%c %s %s", PASS_CHAR, FITSQ_CMD, cargv[0]);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	    "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return;
+   }
+
+   /*
+    * Handle a request to set the number of guide frames in the co-add of
+    * the faint star mode.  The expected syntax is COADD <frames>, 0 turns
+    * the co-add off.
     */
-   if (!strcasecmp(buf_p, ISU_CMD)) {
-      if ((!strcasecmp(cargv[0], "ON")) && (cargc == 1)) {
-
-#ifdef HAVE_ISU
-	 /* Check if the ISU needs to perform a new homing */
-	 if (check_isu_homed(&homed) != PASS) {
-	    cfht_logv(CFHT_MAIN, CFHT_WARN, "(%s:%d) Failed checking "
-		  "homing status of the ISU mechanism",
-		  __FILE__, __LINE__);
-	    homed = 0;
-	 }  
-	 if (homed == 0) {
-	    /* 
-	     * Home the ISU in a separate thread because 
-	     * otherwise blocks video
-	     */
-	    if (pthread_create(&home_isu_t, NULL, home_isu_thread, NULL)) {
-	       cfht_logv(CFHT_MAIN, CFHT_ERROR, "(%s:%d) Fatal error on "
-		     "the fast guiding loop: failed creating homing thread",
-		     __FILE__, __LINE__);
-	       exit(EXIT_FAILURE);
-	    }
-	    if (pthread_detach(home_isu_t)) {
-	       cfht_logv(CFHT_MAIN, CFHT_ERROR, "(%s:%d) Fatal error on "
-		     "the fast guiding loop: failed joining homing thread",
-		     __FILE__, __LINE__);
-	       exit(EXIT_FAILURE);
-	    }  
-	    /*
-	     * It is immediately  confirmed on telnet but the confirmation in 
-	     * the logs is printed when homing is really finished
-	     */
-	    sprintf(buffer, "%c ON", PASS_CHAR);
-	 }
-	 else {
-	    cfht_logv(CFHT_MAIN, CFHT_LOGONLY, "(%s:%d) ISU was already "
-		  "homed", __FILE__, __LINE__);
-	    if (enable_isu() != PASS) {
-	       cfht_logv(CFHT_MAIN, CFHT_WARN, "(%s:%d) Failed enabling "
-		     " the ISU mechanism", __FILE__, __LINE__);
-	       sprintf(buffer, "%c OFF", FAIL_CHAR);
-	    }
-	    else {
-	       serv_info->isu_on = TRUE;
-	       sprintf(buffer, "%c ON", PASS_CHAR);
-#ifdef SIM_STAR
-	       cfht_logv(CFHT_MAIN, CFHT_LOGONLY, "(%s:%d) Beware that "
-		     "SIM_STAR is defined and the centroid algorithm is NOT called",
-		     __FILE__, __LINE__);
-#endif //SIM_STAR
-#ifdef DEBUG
-	       cfht_logv(CFHT_MAIN, CFHT_LOGONLY, "(%s:%d) Beware that "
-		     "DEBUG is defined and status / setup positions are written in "
-		     "outputs csv file", __FILE__, __LINE__);
-#endif //DEBUG
-	    }
-	 }
-#endif //HAVE_ISU
+   if (!strcasecmp(buf_p, COADD_CMD)) {
+      char *stop_at = NULL;
+      long depth = -1;
 
-      } else if ((!strcasecmp(cargv[0], "OFF")) && (cargc == 1)) {
+      if (cargc == 1) {
+	 depth = strtol(cargv[0], &stop_at, 10);
+      }
+      if (cargc != 1 || *stop_at != '\0' ||
+	  coaddConfigure(&coadd, (int)depth) != PASS) {
+	 sprintf(buffer, "%c \"Invalid coadd command. Should be %s <0-%d>\"",
+	       FAIL_CHAR, COADD_CMD, COADD_MAX_FRAMES);
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	       "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	 return;
+      }
+      serv_info->coadd_count = 0;
+      sprintf(buffer, "%c %s %d", PASS_CHAR, COADD_CMD, coadd.depth);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	    "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return;
+   }
 
-#ifdef HAVE_ISU
-	 /* Stop the ISU */
-	 if (stop_isu() != PASS) {
-	    cfht_logv(CFHT_MAIN, CFHT_WARN, "(%s:%d) Failed stopping "
-		  " the ISU mechanism", __FILE__, __LINE__);
-	    sprintf(buffer, "%c OFF", FAIL_CHAR);
+   /*
+    * Handle a request to configure the weighting of the PSF fit.  The
+    * expected syntax is NOISE <gain> <read noise>, NOISE LOSS <NONE|HUBER
+    * [k]|TUKEY [c]> or NOISE DARK <file|OFF>.  A read noise of 0 disables
+    * the weighting.  The dark frame is loaded in the background, and
+    * replaces the current one once read.
+    */
+   if (!strcasecmp(buf_p, NOISE_CMD)) {
+      fit_loss_t loss;
+      double scale;
+
+      if (cargc >= 2 && !strcasecmp(cargv[0], "LOSS")) {
+	 if (fitLossParse(cargc - 1, cargv + 1, &loss, &scale) != PASS) {
+	    sprintf(buffer, "%c \"Invalid noise command. Should be %s LOSS "
+		  "<NONE|HUBER [k]|TUKEY [c]>\"", FAIL_CHAR, NOISE_CMD);
+	    cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		  "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	    return;
 	 }
-	 else {
-	    serv_info->isu_on = FALSE;
-	    sprintf(buffer, "%c OFF", PASS_CHAR);
+	 serv_info->fit_loss = loss;
+	 serv_info->fit_loss_scale = scale;
+      }
+      else if (cargc == 2 && !strcasecmp(cargv[0], "DARK")) {
+	 BOOLEAN loading;
+
+	 pthread_mutex_lock(&psf_lock);
+	 loading = dark_load.busy;
+	 if (loading == FALSE && !strcasecmp(cargv[1], "OFF")) {
+	    dark_loaded = FALSE;
+	    serv_info->dark_file[0] = '\0';
+	 }
+	 pthread_mutex_unlock(&psf_lock);
+	 if (loading == TRUE || (strcasecmp(cargv[1], "OFF") &&
+				 darkLoadStart(cargv[1]) != PASS)) {
+	    sprintf(buffer, "%c \"Unable to load dark frame %s, a dark frame "
+		  "may still be loading\"", FAIL_CHAR, cargv[1]);
+	    cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		  "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	    return;
 	 }
-#endif //HAVE_ISU
-
       }
       else {
-	 sprintf(buffer, "%c \"Invalid isu mode\"", FAIL_CHAR);
+	 char *stop_at1 = NULL, *stop_at2 = NULL;
+	 double gain = 0, rn = -1;
+
+	 if (cargc == 2) {
+	    gain = strtod(cargv[0], &stop_at1);
+	    rn = strtod(cargv[1], &stop_at2);
+	 }
+	 if (cargc != 2 || *stop_at1 != '\0' || *stop_at2 != '\0' ||
+	     gain <= 0 || rn < 0) {
+	    sprintf(buffer, "%c \"Invalid noise command. Should be %s <gain> "
+		  "<read noise>, %s LOSS <NONE|HUBER [k]|TUKEY [c]> or %s DARK "
+		  "<file|OFF>\"", FAIL_CHAR, NOISE_CMD, NOISE_CMD, NOISE_CMD);
+	    cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		  "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	    return;
+	 }
+	 serv_info->det_gain = gain;
+	 serv_info->det_read_noise = rn;
       }
+
+      sprintf(buffer, "%c %s %s", PASS_CHAR, NOISE_CMD, cargv[0]);
       cfht_logv(CFHT_MAIN, CFHT_DEBUG,
 	    "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
       return;
@@ -3718,6 +9249,315 @@ loadGuiderConfiguration(void)
 		      GUIDER_CONFIG);
 	    return FAIL;
 	 }
+      } else if (strcasecmp(line, CONFIG_PREDICT_X) == 0 ||
+		 strcasecmp(line, CONFIG_PREDICT_Y) == 0) {
+	 predict_axis_t *axis;
+	 char **argv;
+	 int argc = 0;
+
+	 axis = &serv_info->predict[strcasecmp(line, CONFIG_PREDICT_X) == 0 ?
+				    PREDICT_X : PREDICT_Y];
+	 argv = cli_argv_quoted(&argc, trim(++p));
+	 if (predictConfigure(axis, argc, argv) != PASS) {
+	    cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		      "(%s:%d) invalid predictor specification for %s in %s"
+		      " config file.  Should be OFF, ALPHABETA <alpha> <beta>"
+		      " or KALMAN <q> <r>", __FILE__, __LINE__, line,
+		      GUIDER_CONFIG);
+	    cli_argv_free(argv);
+	    return FAIL;
+	 }
+	 cli_argv_free(argv);
+      } else if (strcasecmp(line, CONFIG_PSF_MODEL) == 0) {
+	 if (psfModelParse(trim(++p), &serv_info->psf_model) != PASS) {
+	    cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		      "(%s:%d) invalid PSF model for %s in %s config file."
+		      "  Should be GAUSSIAN, MOFFAT or ELLIPTICAL",
+		      __FILE__, __LINE__, CONFIG_PSF_MODEL, GUIDER_CONFIG);
+	    return FAIL;
+	 }
+	 psfShapeReset(serv_info->psf_model, serv_info->psf_shape);
+      } else if (strcasecmp(line, CONFIG_DET_GAIN) == 0 ||
+		 strcasecmp(line, CONFIG_DET_READ_NOISE) == 0) {
+	 char *stop_at = NULL;
+	 double value = strtod(trim(++p), &stop_at);
+
+	 if (*stop_at != '\0' || value < 0 ||
+	     (value == 0 && strcasecmp(line, CONFIG_DET_GAIN) == 0)) {
+	    cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		      "(%s:%d) invalid numeric argument for %s in %s config"
+		      " file", __FILE__, __LINE__, line, GUIDER_CONFIG);
+	    return FAIL;
+	 }
+	 if (strcasecmp(line, CONFIG_DET_GAIN) == 0) {
+	    serv_info->det_gain = value;
+	 }
+	 else {
+	    serv_info->det_read_noise = value;
+	 }
+      } else if (strcasecmp(line, CONFIG_FIT_LOSS) == 0) {
+	 char **argv;
+	 int argc = 0;
+
+	 argv = cli_argv_quoted(&argc, trim(++p));
+	 if (fitLossParse(argc, argv, &serv_info->fit_loss,
+		  &serv_info->fit_loss_scale) != PASS) {
+	    cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		      "(%s:%d) invalid fit loss for %s in %s config file."
+		      "  Should be NONE, HUBER [<k>] or TUKEY [<c>]",
+		      __FILE__, __LINE__, CONFIG_FIT_LOSS, GUIDER_CONFIG);
+	    cli_argv_free(argv);
+	    return FAIL;
+	 }
+	 cli_argv_free(argv);
+      } else if (strcasecmp(line, CONFIG_FITS_QUEUE) == 0) {
+	 char **argv;
+	 int argc = 0;
+
+	 argv = cli_argv_quoted(&argc, trim(++p));
+	 if (fitsQueueParse(argc, argv, &serv_info->fits_queue_depth,
+		  &serv_info->fits_queue_policy) != PASS) {
+	    cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		      "(%s:%d) invalid FITS queue for %s in %s config file."
+		      "  Should be <1-%d> [DROPOLDEST|DROPNEWEST|BLOCKSAVE]",
+		      __FILE__, __LINE__, CONFIG_FITS_QUEUE, GUIDER_CONFIG,
+		      FITS_QUEUE_MAX);
+	    cli_argv_free(argv);
+	    return FAIL;
+	 }
+	 cli_argv_free(argv);
+      } else if (strcasecmp(line, CONFIG_VIDEO_RATE) == 0) {
+	 char **argv;
+	 int argc = 0;
+
+	 argv = cli_argv_quoted(&argc, trim(++p));
+	 if (videoRateParse(argc, argv, &video_rate.decimate,
+		  &video_rate.max_rate) != PASS) {
+	    cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		      "(%s:%d) invalid video rate for %s in %s config file."
+		      "  Should be <1-%d> [<max Hz>]", __FILE__, __LINE__,
+		      CONFIG_VIDEO_RATE, GUIDER_CONFIG, VIDEO_DECIMATE_MAX);
+	    cli_argv_free(argv);
+	    return FAIL;
+	 }
+	 cli_argv_free(argv);
+      } else if (strcasecmp(line, CONFIG_RECORD_DIR) == 0) {
+	 char *value = trim(++p);
+	 struct stat st;
+
+	 if (strlen(value) >= sizeof(recorder.dir) ||
+	     stat(value, &st) != 0 || !S_ISDIR(st.st_mode) ||
+	     access(value, W_OK) != 0) {
+	    cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		      "(%s:%d) invalid directory %s for %s in %s config file."
+		      "  Should be a writable directory",
+		      __FILE__, __LINE__, value, CONFIG_RECORD_DIR,
+		      GUIDER_CONFIG);
+	    return FAIL;
+	 }
+	 strcpy(recorder.dir, value);
+      } else if (strcasecmp(line, CONFIG_CALIB_FILE) == 0) {
+	 char *value = trim(++p);
+
+	 if (strlen(value) >= sizeof(calib_file)) {
+	    cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		      "(%s:%d) path %s for %s in %s config file is too long",
+		      __FILE__, __LINE__, value, CONFIG_CALIB_FILE,
+		      GUIDER_CONFIG);
+	    return FAIL;
+	 }
+	 strcpy(calib_file, value);
+      } else if (strcasecmp(line, CONFIG_CAMERA_INIT) == 0) {
+	 char *value = trim(++p);
+
+	 if (strcasecmp(value, "FAST") == 0) {
+	    serv_info->cam_init_mode = CAM_INIT_FAST;
+	 }
+	 else if (strcasecmp(value, "FULL") == 0) {
+	    serv_info->cam_init_mode = CAM_INIT_FULL;
+	 }
+	 else {
+	    cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		      "(%s:%d) invalid mode %s for %s in %s config file."
+		      "  Should be FAST or FULL", __FILE__, __LINE__, value,
+		      CONFIG_CAMERA_INIT, GUIDER_CONFIG);
+	    return FAIL;
+	 }
+      } else if (strcasecmp(line, CONFIG_CAMERA_READOUT) == 0) {
+	 char **argv;
+	 int argc = 0;
+	 double v[4];
+	 char *stop_at;
+	 int i;
+
+	 argv = cli_argv_quoted(&argc, trim(++p));
+	 v[2] = DEFAULT_READOUT_LINE_CLOCKS;
+	 v[3] = DEFAULT_READOUT_FRAME_US;
+	 for (i = 0; i < argc && i < 4; i++) {
+	    v[i] = strtod(argv[i], &stop_at);
+	    if (*stop_at != '\0' || v[i] < 0) break;
+	 }
+	 if (argc < 2 || argc > 4 || i < argc ||
+	     v[0] < 1 || v[0] > SIZE_X || v[1] < 1 || v[1] > SIZE_Y) {
+	    cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		      "(%s:%d) invalid readout for %s in %s config file."
+		      "  Should be <width> <height> [<line clocks>"
+		      " [<frame us>]]", __FILE__, __LINE__,
+		      CONFIG_CAMERA_READOUT, GUIDER_CONFIG);
+	    cli_argv_free(argv);
+	    return FAIL;
+	 }
+	 serv_info->readout_width = (int)v[0];
+	 serv_info->readout_height = (int)v[1];
+	 serv_info->readout_line_clocks = v[2];
+	 serv_info->readout_frame_us = v[3];
+	 cli_argv_free(argv);
+      } else if (strcasecmp(line, CONFIG_CAMERA_POLL) == 0) {
+	 char **argv;
+	 int argc = 0;
+
+	 argv = cli_argv_quoted(&argc, trim(++p));
+	 if (camPollParse(argc, argv, &serv_info->poll_temp,
+		  &serv_info->poll_settings) != PASS) {
+	    cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		      "(%s:%d) invalid intervals for %s in %s config file."
+		      "  Should be <temperature s> [<settings s>]",
+		      __FILE__, __LINE__, CONFIG_CAMERA_POLL, GUIDER_CONFIG);
+	    cli_argv_free(argv);
+	    return FAIL;
+	 }
+	 cli_argv_free(argv);
+#ifdef SIM_CAMERA
+      } else if (strcasecmp(line, CONFIG_SIM_CAMERA) == 0) {
+	 char **argv;
+	 int argc = 0;
+	 char *stop_at = NULL;
+
+	 argv = cli_argv_quoted(&argc, trim(++p));
+	 if (argc >= 1) owl_sim.latency = strtod(argv[0], &stop_at);
+	 if (argc == 2 && *stop_at == '\0') {
+	    owl_sim.baud = strtol(argv[1], &stop_at, 10);
+	 }
+	 if (argc < 1 || argc > 2 || *stop_at != '\0' ||
+	     owl_sim.latency < 0 || owl_sim.baud <= 0) {
+	    cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		      "(%s:%d) invalid emulator timing for %s in %s config "
+		      "file.  Should be <latency ms> [<baud>]", __FILE__,
+		      __LINE__, CONFIG_SIM_CAMERA, GUIDER_CONFIG);
+	    cli_argv_free(argv);
+	    return FAIL;
+	 }
+	 cli_argv_free(argv);
+#endif //SIM_CAMERA
+      } else if (strcasecmp(line, CONFIG_TELEMETRY_PORT) == 0) {
+	 char *value = trim(++p);
+	 char *end;
+	 long port = strtol(value, &end, 10);
+
+	 if (strcasecmp(value, "OFF") != 0 &&
+	     (*value == '\0' || *end != '\0' || port <= 0 || port > 65535)) {
+	    cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		      "(%s:%d) invalid port %s for %s in %s config file."
+		      "  Should be <1-65535|OFF>", __FILE__, __LINE__, value,
+		      CONFIG_TELEMETRY_PORT, GUIDER_CONFIG);
+	    return FAIL;
+	 }
+	 strcpy(telemetry.port, value);
+      } else if (strcasecmp(line, CONFIG_TELEMETRY_HOST) == 0) {
+	 char *value = trim(++p);
+
+	 if (*value == '\0' || strlen(value) >= sizeof(telemetry.host)) {
+	    cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		      "(%s:%d) invalid address %s for %s in %s config file."
+		      "  Should be <address|ALL>", __FILE__, __LINE__, value,
+		      CONFIG_TELEMETRY_HOST, GUIDER_CONFIG);
+	    return FAIL;
+	 }
+	 strcpy(telemetry.host, value);
+      } else if (strcasecmp(line, CONFIG_TELEMETRY_SOCKET) == 0) {
+	 char *value = trim(++p);
+
+	 if (strlen(value) >= sizeof(telemetry.socket_path)) {
+	    cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		      "(%s:%d) socket path %s for %s in %s config file is "
+		      "too long", __FILE__, __LINE__, value,
+		      CONFIG_TELEMETRY_SOCKET, GUIDER_CONFIG);
+	    return FAIL;
+	 }
+	 strcpy(telemetry.socket_path, value);
+      } else if (strcasecmp(line, CONFIG_FITS_COMPRESS) == 0) {
+	 char **argv;
+	 int argc = 0;
+
+	 argv = cli_argv_quoted(&argc, trim(++p));
+	 if (fitsCompressParse(argc, argv, &serv_info->fits_compress,
+		  &serv_info->compress_workers) != PASS) {
+	    cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		      "(%s:%d) invalid compression for %s in %s config file."
+		      "  Should be <OFF|VIDEO|SAVE|BOTH> [<1-%d>]", __FILE__,
+		      __LINE__, CONFIG_FITS_COMPRESS, GUIDER_CONFIG,
+		      COMPRESS_MAX_WORKERS);
+	    cli_argv_free(argv);
+	    return FAIL;
+	 }
+	 cli_argv_free(argv);
+      } else if (strcasecmp(line, CONFIG_SAVE_CUBE) == 0) {
+	 char **argv;
+	 int argc = 0;
+
+	 argv = cli_argv_quoted(&argc, trim(++p));
+	 if (cubeParse(argc, argv, &serv_info->cube_frames,
+		  &serv_info->cube_flush) != PASS) {
+	    cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		      "(%s:%d) invalid cube for %s in %s config file."
+		      "  Should be OFF or <2-%d> [<flush s>]", __FILE__,
+		      __LINE__, CONFIG_SAVE_CUBE, GUIDER_CONFIG,
+		      CUBE_MAX_FRAMES);
+	    cli_argv_free(argv);
+	    return FAIL;
+	 }
+	 cli_argv_free(argv);
+      } else if (strcasecmp(line, CONFIG_SHM_RING) == 0) {
+	 char *value = trim(++p);
+
+	 if (strcasecmp(value, "ON") && strcasecmp(value, "OFF")) {
+	    cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		      "(%s:%d) invalid argument for %s in %s config file."
+		      "  Should be ON or OFF", __FILE__, __LINE__,
+		      CONFIG_SHM_RING, GUIDER_CONFIG);
+	    return FAIL;
+	 }
+	 shm_ring_enabled = !strcasecmp(value, "ON");
+      } else if (strcasecmp(line, CONFIG_FITS_VMSPLICE) == 0) {
+	 char *value = trim(++p);
+
+	 if (strcasecmp(value, "ON") && strcasecmp(value, "OFF")) {
+	    cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		      "(%s:%d) invalid argument for %s in %s config file."
+		      "  Should be ON or OFF", __FILE__, __LINE__,
+		      CONFIG_FITS_VMSPLICE, GUIDER_CONFIG);
+	    return FAIL;
+	 }
+	 fits_output.vmsplice = !strcasecmp(value, "ON");
+      } else if (strcasecmp(line, CONFIG_COADD_FRAMES) == 0) {
+	 char *stop_at = NULL;
+	 long depth = strtol(trim(++p), &stop_at, 10);
+
+	 if (*stop_at != '\0' || coaddConfigure(&coadd, (int)depth) != PASS) {
+	    cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		      "(%s:%d) invalid argument for %s in %s config file."
+		      "  Should be 0 to %d", __FILE__, __LINE__,
+		      CONFIG_COADD_FRAMES, GUIDER_CONFIG, COADD_MAX_FRAMES);
+	    return FAIL;
+	 }
+      } else if (strcasecmp(line, CONFIG_DARK_FRAME) == 0) {
+	 strncpy(serv_info->dark_file, trim(++p),
+		 sizeof(serv_info->dark_file) - 1);
+	 serv_info->dark_file[sizeof(serv_info->dark_file) - 1] = '\0';
+	 /* A missing dark is not fatal, the fit is done without it */
+	 if (loadDarkFrame(serv_info->dark_file) != PASS) {
+	    serv_info->dark_file[0] = '\0';
+	 }
       }
       else {
 	 cfht_logv(CFHT_MAIN, CFHT_WARN,
@@ -3751,12 +9591,26 @@ int main(int argc, char* argv[])
    char *edt_unitstr = "0";
    Edtinfo edtinfo;
    char bitdir[256];
-   char *camera_response;
-   int gain_mode=1;
-   int digital_gain;
+   cam_init_t cam_init;
+   pthread_t init_thread;
+   BOOLEAN init_thread_started = TRUE;
+   struct timeval init_start;
    BOOLEAN last_video_on_state = FALSE;
    BOOLEAN last_guide_on_state = FALSE;
+   BOOLEAN last_isu_on_state = FALSE;
    unsigned char *image_p;
+   struct timeval capture_tv, last_capture_tv = { 0, 0 };
+   struct timeval frame_done_tv;
+   double frame_dt = 0;
+   double frame_busy;
+   BOOLEAN fwhm_request = FALSE;
+   BOOLEAN save_active;
+   BOOLEAN last_save = FALSE;
+   frame_info_t skipped_info;
+   frame_info_t *frame_info;
+   fits_job_t *fits_job;
+   raptor_telemetry_t telemetry_rec;
+   int centroid_status;
    int last_timeouts = 0;
    int timeouts;
 
@@ -3770,7 +9624,6 @@ int main(int argc, char* argv[])
    double xangle = 0;
    double yangle = 0;
    double next_x_angle=0, next_y_angle=0;
-   BOOLEAN x_fault, y_fault;
    double last_x_angle=0, last_y_angle=0;
 #endif //HAVE_ISU
 
@@ -3814,6 +9667,23 @@ int main(int argc, char* argv[])
    serv_info = (server_info_t *)cli_malloc(sizeof(server_info_t));
    memset(serv_info, 0, sizeof(server_info_t));
    serv_info->fits_comment[0] = '\0';
+   serv_info->psf_model = PSF_GAUSSIAN;
+   psfShapeReset(serv_info->psf_model, serv_info->psf_shape);
+   serv_info->det_gain = DEFAULT_DET_GAIN;
+   serv_info->det_read_noise = DEFAULT_DET_READ_NOISE;
+   serv_info->fit_loss = FIT_LOSS_NONE;
+   serv_info->fits_queue_depth = DEFAULT_FITS_QUEUE;
+   serv_info->fits_queue_policy = FITS_DROP_OLDEST;
+   serv_info->fits_compress = FITS_COMPRESS_OFF;
+   serv_info->compress_workers = DEFAULT_COMPRESS_WORKERS;
+   serv_info->poll_temp = DEFAULT_POLL_TEMP;
+   serv_info->poll_settings = DEFAULT_POLL_SETTINGS;
+   serv_info->cam_init_mode = CAM_INIT_FAST;
+   serv_info->pclock_mhz = DEFAULT_PCLOCK_MHZ;
+   serv_info->readout_width = SIZE_X;
+   serv_info->readout_height = SIZE_Y;
+   serv_info->readout_line_clocks = DEFAULT_READOUT_LINE_CLOCKS;
+   serv_info->readout_frame_us = DEFAULT_READOUT_FRAME_US;
 
    /*
     * Initialize the CFHT logging stuff.
@@ -3907,212 +9777,134 @@ int main(int argc, char* argv[])
    }
 
    /*
-    * Initialize the framegrabber board and camera
-    */
-   if (pdv_initcam(serv_info->edt_p, serv_info->dd_p, edt_unit, 
-	    &edtinfo, RAPTOR_CONFIG, bitdir, 0) != 0){
-      cfht_logv(CFHT_MAIN, CFHT_ERROR,
-	    "(%s:%d) pdv_initcam() failed - exiting",
-	    __FILE__, __LINE__);
-      edt_close(serv_info->edt_p);
-      exit(EXIT_FAILURE);
-   }
-
-   /*
-    * Set the clock frequency in MHz on the board
-    */
-   pdv_cls_set_clock(serv_info->edt_p, 40.0);
-
-   /*
-    * Set a reasonable image timeout value based on the image size,
-    * exposure time (if set) and pixel clock speed (if set)
-    */
-   if (pdv_auto_set_timeout(serv_info->edt_p) != 0){
-      edt_close(serv_info->edt_p);
-      cfht_logv(CFHT_MAIN, CFHT_ERROR,
-	    "(%s:%d) can not set the camera time out - exiting",
-	    __FILE__, __LINE__);
-      exit(EXIT_FAILURE);
-   }
-
-   /*
-    * TODO: The following statement is part of the guiderinit.c program.
-    * I'm not sure it makes sense for the interface to be closed, but I'll
-    * leave it here until the testing phase.
-    */
-   edt_close(serv_info->edt_p);
-   cfht_logv(CFHT_MAIN, CFHT_ERROR,
-	 "(%s:%d) edt_close() performed", __FILE__, __LINE__);
-
-   /*
-    * Check the system status from the camera
-    */
-   if (checkCameraStatus(&camera_response) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_ERROR,
-	    "(%s:%d) there is no response from the camera when checking"
-	    " the camera status - exiting", __FILE__, __LINE__);
-      exit(EXIT_FAILURE);
-   }
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	 "(%s:%d) camera status OK", __FILE__, __LINE__);
-
-   /* 
-    * Turn off non-uniform correction
-    */
-   if (setGuiderNUC(0) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_ERROR,
-	    "(%s:%d) not able to set NUC status - exiting", 
-	    __FILE__, __LINE__);
-      exit(EXIT_FAILURE);
-
-   }
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	 "(%s:%d) camera NUC turned off", __FILE__, __LINE__);
-
-   /* 
-    * Turn off Auto Level 
-    */
-   if (setGuiderAutoLevel(0) != 0) {
-      cfht_logv(CFHT_MAIN, CFHT_ERROR,
-	    "(%s:%d) not able to set camera auto level - exiting", 
-	    __FILE__, __LINE__);
-      exit(EXIT_FAILURE);
-
-   }
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	 "(%s:%d) camera auto level turned off", __FILE__, __LINE__);
-
-   /*
-    * Enable TEC cooler
+    * Initialize the framegrabber board and camera.  The bitfile is only
+    * loaded when the board does not run it already, the way initcam -B
+    * skips it.
     */
-   if (enableGuiderTEC() != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	    "(%s:%d) enable TEC control failed - exiting", 
-	    __FILE__, __LINE__);
-      exit(EXIT_FAILURE);
+   gettimeofday(&init_start, NULL);
+   memset(&cam_init, 0, sizeof(cam_init));
+   cam_init.mode = serv_info->cam_init_mode;
+   cam_init.bitload = (cam_init.mode == CAM_INIT_FULL ||
+	 camInitBoardReady(serv_info->edt_p, serv_info->dd_p) == FALSE);
+   if (cam_init.bitload == FALSE) {
+      strcpy(serv_info->dd_p->rbtfile, "_SKIPPED_");
    }
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	 "(%s:%d) camera TEC enabled", 
-	 __FILE__, __LINE__);
-
-   if (checkCameraStatus(&camera_response) != PASS) {
+   if (pdv_initcam(serv_info->edt_p, serv_info->dd_p, edt_unit, 
+	    &edtinfo, RAPTOR_CONFIG, bitdir, 0) != 0){
       cfht_logv(CFHT_MAIN, CFHT_ERROR,
-	    "(%s:%d) there is no response from the camera when checking"
-	    " the camera status - exiting", __FILE__, __LINE__);
+	    "(%s:%d) pdv_initcam() failed - exiting",
+	    __FILE__, __LINE__);
+      edt_close(serv_info->edt_p);
       exit(EXIT_FAILURE);
    }
 
    /*
-    * Set the camera to the high gain mode
+    * Set the clock frequency in MHz on the board
     */
-   if (setGuiderGainMode(HIGHGAIN) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	    "(%s:%d) unable to set camera to high-gain mode - exiting",
-	    __FILE__, __LINE__);
-      //exit(EXIT_FAILURE);
+   pdv_cls_set_clock(serv_info->edt_p, 40.0);
+
+   /* Pixel clock of the frame rate ceiling, pclock_speed of the camera */
+   if (serv_info->dd_p->pclock_speed > 0) {
+      serv_info->pclock_mhz = serv_info->dd_p->pclock_speed;
    }
 
    /*
-    * Read back the gain mode to verify that the guider is in the high
-    * gain mode
+    * Set a reasonable image timeout value based on the image size,
+    * exposure time (if set) and pixel clock speed (if set)
     */
-   if (getGuiderGainMode(&gain_mode) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	    "(%s:%d) unable to retrieve gain mode from the"
-	    " camera - exiting", __FILE__, __LINE__);
-      exit(EXIT_FAILURE);
-   }
-   if (gain_mode != HIGHGAIN) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	    "(%s:%d) gain read back from the camera=%d which is not"
-	    " the expected high-gain mode - exiting",
-	    __FILE__, __LINE__, gain_mode);
+   if (pdv_auto_set_timeout(serv_info->edt_p) != 0){
+      edt_close(serv_info->edt_p);
+      cfht_logv(CFHT_MAIN, CFHT_ERROR,
+	    "(%s:%d) can not set the camera time out - exiting",
+	    __FILE__, __LINE__);
       exit(EXIT_FAILURE);
    }
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	 "(%s:%d) camera is set to HIGH gain mode",
-	 __FILE__, __LINE__);
 
    /*
-    * Set a temperature set point
+    * TODO: The following statement is part of the guiderinit.c program.
+    * I'm not sure it makes sense for the interface to be closed, but I'll
+    * leave it here until the testing phase.
     */
-   if (setGuiderTECPoint(DEFAULT_TEC_SETPOINT) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	    "(%s:%d) unable to set the TEC setpoint to %.2f"
-	    " degrees - exiting", __FILE__, __LINE__, 
-	    DEFAULT_TEC_SETPOINT);
-      exit(EXIT_FAILURE);
-   }
-   serv_info->tec_setpoint = DEFAULT_TEC_SETPOINT;
-
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	 "(%s:%d) TEC setpoint set to %.2f degrees",
-	 __FILE__, __LINE__, DEFAULT_TEC_SETPOINT);
-
+   edt_close(serv_info->edt_p);
+   cfht_logv(CFHT_MAIN, CFHT_ERROR,
+	 "(%s:%d) edt_close() performed", __FILE__, __LINE__);
+   cam_init.board_ms = camInitMs(&init_start);
 
    /*
-    * Set the digital gain value to be 1
+    * Set up the camera over the serial line while the rest of the server
+    * starts
     */
-   if (setDigitalGain(DEFAULT_DIGITAL_GAIN) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	    "(%s:%d) unable to set default digital gain of %d - exiting",
-	    __FILE__, __LINE__, DEFAULT_DIGITAL_GAIN);
-      exit(EXIT_FAILURE);
+   if (pthread_create(&init_thread, NULL, camInitThread, &cam_init)) {
+      cfht_logv(CFHT_MAIN, CFHT_WARN,
+	    "(%s:%d) failed creating the camera initialization thread",
+	    __FILE__, __LINE__);
+      camInitThread(&cam_init);
+      init_thread_started = FALSE;
    }
 
    /*
-    * Read back the digital gain value and make sure it matches what is 
-    * expected
+    * Start the frame processing pipeline stages
     */
-   if (getDigitalGain(&digital_gain) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	    "(%s:%d) unable to retrieve digital gain from the"
-	    " camera - exiting", __FILE__, __LINE__);
+   fitsConvertSelect();
+   if (fitsQueueCreate(&fits_queue, serv_info->fits_queue_depth,
+	    serv_info->fits_queue_policy, serv_info->fits_compress,
+	    serv_info->compress_workers) != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_ERROR,
+	    "(%s:%d) unable to start the FITS writer - exiting",
+	    __FILE__, __LINE__);
       exit(EXIT_FAILURE);
    }
-   if (digital_gain != DEFAULT_DIGITAL_GAIN) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	    "(%s:%d) digital gain retrieved from the camera does not"
-	    " match what is expected (%d != %d) - exiting", 
-	    __FILE__, __LINE__, digital_gain, DEFAULT_DIGITAL_GAIN);
+   if (recordCreate(&recorder) != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_ERROR,
+	    "(%s:%d) unable to start the SAVE recorder - exiting",
+	    __FILE__, __LINE__);
       exit(EXIT_FAILURE);
    }
-
-   /*
-    * Set the default exposure time to be 10 milliseconds
-    */
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	 "(%s:%d) attempting to set the exposure time to %.3f ms",
-	 __FILE__, __LINE__, DEFAULT_EXPOSURE_TIME);
-   if (setGuiderExptime(DEFAULT_EXPOSURE_TIME * 40e3) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	    "(%s:%d) unable to set exposure time to %.3f ms - exiting",
-	    __FILE__, __LINE__, DEFAULT_EXPOSURE_TIME);
+   if (shm_ring_enabled == TRUE && shmRingCreate(RAPTOR_SHM_NAME) != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_WARN,
+	    "(%s:%d) frames will not be published in shared memory",
+	    __FILE__, __LINE__);
+   }
+   if ((strcasecmp(telemetry.port, "OFF") != 0 ||
+	telemetry.socket_path[0] != '\0') &&
+       telemetryCreate(&telemetry) != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_WARN,
+	    "(%s:%d) guide results will not be published in the telemetry "
+	    "stream", __FILE__, __LINE__);
+   }
+#ifdef HAVE_ISU
+   if (stageCreate(&isu_stage, isuStageJob, &isu_job) != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_ERROR,
+	    "(%s:%d) unable to start the ISU readback stage - exiting",
+	    __FILE__, __LINE__);
       exit(EXIT_FAILURE);
    }
-   serv_info->exposure_time = DEFAULT_EXPOSURE_TIME;
-
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	 "(%s:%d) exposure time in camera set to %.3f ms",
-	 __FILE__, __LINE__, serv_info->exposure_time);
+#endif //HAVE_ISU
 
    /*
-    * Set the default frame rate to be 50 Hz
+    * The camera must be set up before the main loop.  From then on its
+    * settings are changed by the camera control thread, which first reads
+    * the sensor temperature.
     */
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	 "(%s:%d) attempting to set the frame rate to %5.2f Hz",
-	 __FILE__, __LINE__, DEFAULT_FRAME_RATE);
-   if (setGuiderFrameRate(DEFAULT_FRAME_RATE) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	    "(%s:%d) unable to set frame rate to %5.2f Hz - exiting",
-	    __FILE__, __LINE__, DEFAULT_FRAME_RATE);
+   if (init_thread_started == TRUE) pthread_join(init_thread, NULL);
+   if (cam_init.status != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_ERROR,
+	    "(%s:%d) unable to initialize the camera - exiting",
+	    __FILE__, __LINE__);
       exit(EXIT_FAILURE);
    }
-   serv_info->frame_rate = DEFAULT_FRAME_RATE;
-
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	 "(%s:%d) frame rate in camera set to %5.2f Hz",
-	 __FILE__, __LINE__, DEFAULT_FRAME_RATE);
+   if (camWorkerCreate(&cam_worker, serv_info->poll_temp,
+	    serv_info->poll_settings) != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_ERROR,
+	    "(%s:%d) unable to start the camera control thread - exiting",
+	    __FILE__, __LINE__);
+      exit(EXIT_FAILURE);
+   }
+   camSnapshotSet(&cam_worker, CAM_EXPTIME, serv_info->exposure_time);
+   camSnapshotSet(&cam_worker, CAM_FRAMERATE, serv_info->frame_rate);
+   camSnapshotSet(&cam_worker, CAM_TEC, serv_info->tec_setpoint);
+   camSnapshotSet(&cam_worker, CAM_GAINMODE, cam_init.gain_mode);
+   camSnapshotSet(&cam_worker, CAM_DGAIN, cam_init.digital_gain);
 
    /*
     * Create a linked list to hold client entries
@@ -4167,6 +9959,17 @@ int main(int argc, char* argv[])
       cli_signal_unblock(SIGTERM);
       cli_signal_unblock(SIGINT);
 
+      /*
+       * Apply the results of the camera commands completed meanwhile.
+       * Without video there is no frame to wait for to send the staged
+       * exposure and frame rate.
+       */
+      camWorkerPoll(&cam_worker);
+      darkLoadPoll();
+      if (serv_info->video_on == FALSE) {
+	 camStageSend(&cam_stage, &cam_worker);
+      }
+
       /*
        * Determine if a request has been made to turn on video mode when it
        * was off
@@ -4176,16 +9979,18 @@ int main(int argc, char* argv[])
 	 /* 
 	  * Try to open a handle to the device     
 	  */
+	 pthread_mutex_lock(&serial_session.line);
 	 if (serv_info->pdv_p == NULL) {
-	    if ((serv_info->pdv_p = pdv_open_channel(edt_devname, edt_unit, 
-			edt_channel)) == NULL) {
-	       cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-		     "(%s:%d) pdv_open_channel request failed",
-		     __FILE__, __LINE__);
-	       serv_info->video_on = FALSE;
-	       serv_info->pdv_p = NULL;
-	       continue;
-	    }
+	    serv_info->pdv_p = pdv_open_channel(edt_devname, edt_unit, 
+		  edt_channel);
+	 }
+	 pthread_mutex_unlock(&serial_session.line);
+	 if (serv_info->pdv_p == NULL) {
+	    cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		  "(%s:%d) pdv_open_channel request failed",
+		  __FILE__, __LINE__);
+	    serv_info->video_on = FALSE;
+	    continue;
 	 }
 
 	 /*
@@ -4203,8 +10008,7 @@ int main(int argc, char* argv[])
 		  __FILE__, __LINE__, serv_info->image_width,
 		  serv_info->image_height);
 	    serv_info->video_on = FALSE;
-	    pdv_close(serv_info->pdv_p);
-	    serv_info->pdv_p = NULL;
+	    serialChannelClose(&serial_session);
 	    continue;
 	 }
 
@@ -4227,8 +10031,7 @@ int main(int argc, char* argv[])
 		  "(%s:%d) pdv_multibuf() call failed",
 		  __FILE__, __LINE__);
 	    serv_info->video_on = FALSE;
-	    pdv_close(serv_info->pdv_p);
-	    serv_info->pdv_p = NULL;
+	    serialChannelClose(&serial_session);
 	    continue;
 	 }
 
@@ -4240,8 +10043,7 @@ int main(int argc, char* argv[])
 		  "(%s:%d) pdv_set_timeout() call failed",
 		  __FILE__, __LINE__);
 	    serv_info->video_on = FALSE;
-	    pdv_close(serv_info->pdv_p);
-	    serv_info->pdv_p = NULL;
+	    serialChannelClose(&serial_session);
 	    continue;
 	 }
 
@@ -4272,17 +10074,51 @@ int main(int argc, char* argv[])
 	  */
 	 image_p = pdv_wait_image(serv_info->pdv_p);
 
+	 /*
+	  * Keep track of the time elapsed between consecutive frames for
+	  * the centroid predictor
+	  */
+	 gettimeofday(&capture_tv, NULL);
+	 centroid_status = RAPTOR_TELEMETRY_NOT_GUIDING;
+	 if (last_capture_tv.tv_sec != 0) {
+	    frame_dt = (capture_tv.tv_sec - last_capture_tv.tv_sec) +
+	       (capture_tv.tv_usec - last_capture_tv.tv_usec) * 1e-6;
+	 }
+	 last_capture_tv = capture_tv;
+
+	 /*
+	  * Between two frames: switch to the exposure time and frame rate
+	  * the camera took, and send the ones staged since
+	  */
+	 camStageFrame(&cam_stage, &capture_tv);
+	 camStageSend(&cam_stage, &cam_worker);
+
 #ifdef DEBUG
          /* Take "EnGetImage" time */
          gettimeofday(&t3,&tz);
 #endif //DEBUG
 
+	 /*
+	  * The corrections accumulated by the predictors are meaningless
+	  * once the ISU is switched on or off
+	  */
+	 if (serv_info->isu_on != last_isu_on_state) {
+	    predictReset(&serv_info->predict[PREDICT_X]);
+	    predictReset(&serv_info->predict[PREDICT_Y]);
+	    last_isu_on_state = serv_info->isu_on;
+	 }
+
 	 /*
 	  *  Starting the centroid calculation
 	  */
 	 if (serv_info->guide_on == TRUE)
 	 {
 	    if (last_guide_on_state == FALSE) {
+	       predictReset(&serv_info->predict[PREDICT_X]);
+	       predictReset(&serv_info->predict[PREDICT_Y]);
+	       coaddReset(&coadd);
+	       serv_info->coadd_count = 0;
+	       frame_dt = 0;
 #ifdef DEBUG
                index = 0;
 	       /* 
@@ -4328,49 +10164,30 @@ int main(int argc, char* argv[])
 #endif //DEBUG
 
             }
-	    if (serv_info->first_done_flag == 0)
-	    {
-	       calculatePointFWHM((unsigned short *)image_p,
-		     GUIDE_SIZE_X, GUIDE_SIZE_Y);
+	    /*
+	     * The FWHM of the star is measured on the first guide frame, by
+	     * the FITS stage, off the critical path of the guide loop.  It is
+	     * measured again when the PSF model is changed.
+	     */
+	    if (serv_info->first_done_flag == 0 || serv_info->psf_refit) {
+	       fwhm_request = TRUE;
+	       serv_info->psf_refit = FALSE;
+	    }
 
 #ifdef HAVE_ISU
-	       /* checking isu error status first of all */
-	       if (check_isu(&x_fault, &y_fault) == FAIL) {
-		  cfht_logv(CFHT_MAIN, CFHT_WARN, "(%s:%d) failed checking isu",
-			__FILE__, __LINE__);
-	       }
-	       else {
-		  if (x_fault) {
-		     cfht_logv(CFHT_MAIN, CFHT_ERROR, "(%s:%d) fatal error on "
-			   "the fast guiding loop: isu x axis is in error."
-			   " Relaunch the fast guiding loop. an evolution of "
-			   "libisu to avoid "
-			   "this fatal error should be considered", 
-			   __FILE__, __LINE__);
-		     if (xangle != 0) {
-			cfht_logv(CFHT_MAIN, CFHT_ERROR, "(%s:%d) \"true\" "
-			      "setup requested was from %lf to %lf mrad in x",
-			      __FILE__, __LINE__, last_x_angle, next_x_angle);
-		     }
-		     exit(EXIT_FAILURE);
-		  }
-		  if (y_fault) {
-		     cfht_logv(CFHT_MAIN, CFHT_ERROR, "(%s:%d) fatal error on "
-			   "the fast guiding loop: isu y axis is in error.  "
-			   "Relaunch the fast guiding loop. An evolution of "
-			   "libisu to avoid this fatal error should be "
-			   "considered", 
-			   __FILE__, __LINE__);
-		     if (yangle != 0) {
-			cfht_logv(CFHT_MAIN, CFHT_ERROR, "(%s:%d) \"true\" "
-			      "setup requested was from %lf to %lf mrad in y",
-			      __FILE__, __LINE__, last_y_angle, next_y_angle);
-		     }
-		     exit(EXIT_FAILURE);
-		  }
-	       } /* end of isu check */
+	    /*
+	     * Read the ISU angles back while the centroid is calculated.
+	     * The error status of the axes is checked first of all on the
+	     * first frame.
+	     */
+	    isu_job.check = (serv_info->first_done_flag == 0);
+#ifdef SIM_STAR
+	    isu_job.readback = FALSE;
+#else
+	    isu_job.readback = TRUE;
+#endif //SIM_STAR
+	    stageStart(&isu_stage);
 #endif //HAVE_ISU
-	    }
 
 	    /*
 	     *  Calculate the centroid
@@ -4411,7 +10228,10 @@ int main(int argc, char* argv[])
 	    serv_info->isu_mrad_y_delta_setup = yangle;
 #else
 	    //calculateCentroid((unsigned short *)image, GUIDE_SIZE_X, GUIDE_SIZE_Y,&xc, &yc);
-	    calculateCentroidMPFIT((unsigned short *)image_p, GUIDE_SIZE_X, GUIDE_SIZE_Y,&xc, &yc);
+	    calculateCentroidMPFIT((unsigned short *)image_p, GUIDE_SIZE_X, GUIDE_SIZE_Y,
+		  serv_info->win_x0, serv_info->win_y0, &xc, &yc);
+	    centroid_status = serv_info->psf_niter >= 0 ?
+	       serv_info->psf_niter : RAPTOR_TELEMETRY_FIT_FAILED;
 
             /* In order to be compliant with the SExtractor convention: +0.5 */
             xc = xc + 0.5;
@@ -4427,14 +10247,39 @@ int main(int argc, char* argv[])
 	    serv_info->guide_yoff 
 	       = (serv_info->guide_y0 + yc - serv_info->null_y) * PIXSCALE;
 
+	    /*
+	     * Register the frame on the null position and add it to the
+	     * co-add of the faint star mode
+	     */
+	    if (coadd.depth > 0) {
+	       coaddAdd(&coadd, (unsigned short *)image_p,
+		     (int)lround(serv_info->guide_xoff / PIXSCALE),
+		     (int)lround(serv_info->guide_yoff / PIXSCALE));
+	    }
+
 	    // fprintf(stderr, "guide_xoff : %.2f - "
 	    //                 "guide_yoff : %.2f (pixels)\n",
 	    // serv_info->guide_xoff, serv_info->guide_yoff);
 
 #ifdef HAVE_ISU
-	    /* Converting pixel values to angle in arcsec */
-	    xangle = serv_info->guide_xoff;
-	    yangle = serv_info->guide_yoff;
+	    /*
+	     * Until a latency has been measured, assume the correction is
+	     * applied one frame period after the middle of the exposure
+	     */
+	    if (serv_info->loop_latency <= 0) {
+	       serv_info->loop_latency = serv_info->exposure_time / 2e3 +
+		  1.0 / (serv_info->frame_rate != 0 ?
+			 serv_info->frame_rate : DEFAULT_FRAME_RATE);
+	    }
+
+	    /*
+	     * Converting pixel values to angle in arcsec, predicted at the
+	     * time the ISU will actually apply the correction
+	     */
+	    xangle = predictUpdate(&serv_info->predict[PREDICT_X],
+		  serv_info->guide_xoff, frame_dt, serv_info->loop_latency);
+	    yangle = predictUpdate(&serv_info->predict[PREDICT_Y],
+		  serv_info->guide_yoff, frame_dt, serv_info->loop_latency);
 
 	    // fprintf(stderr, "xangle : %.3f - yangle : %.3f (mrad) ; %.3f\n", xangle, yangle, PIXSCALE);
 
@@ -4452,21 +10297,6 @@ int main(int argc, char* argv[])
 	    serv_info->isu_mrad_x_delta_setup = next_x_angle;
 	    serv_info->isu_mrad_y_delta_setup = next_y_angle;
 
-	    /* 
-	     * retreiving current isu position in mrad on the mechanism
-	     * ("true" position)
-	     */
-	    if (get_angles(&last_x_angle, &last_y_angle) != PASS) {
-	       cfht_logv(CFHT_MAIN, CFHT_ERROR, "(%s:%d) fatal error on "
-		     "the fast guiding loop: failed getting isu angles",
-		     __FILE__, __LINE__);
-	       exit(EXIT_FAILURE);
-	    }
-
-	    /* The serv_info structure is updated to fill in the header */
-	    serv_info->isu_mrad_x_status = last_x_angle;
-	    serv_info->isu_mrad_y_status = last_y_angle;
-
 #else
 	    /* The serv_info structure is updated to fill in the header */
 	    serv_info->isu_mrad_x_delta_setup = fh_fits_real_null;
@@ -4474,6 +10304,70 @@ int main(int argc, char* argv[])
 #endif //HAVE_ISU
 
 #endif //SIM_STAR
+
+#ifdef HAVE_ISU
+	    /*
+	     * Collect the result of the ISU readback stage
+	     */
+	    stageWait(&isu_stage);
+
+	    /* checking isu error status first of all */
+	    if (isu_job.check == TRUE) {
+	       if (isu_job.check_status == FAIL) {
+		  cfht_logv(CFHT_MAIN, CFHT_WARN, "(%s:%d) failed checking isu",
+			__FILE__, __LINE__);
+	       }
+	       else {
+		  if (isu_job.x_fault) {
+		     cfht_logv(CFHT_MAIN, CFHT_ERROR, "(%s:%d) fatal error on "
+			   "the fast guiding loop: isu x axis is in error."
+			   " Relaunch the fast guiding loop. an evolution of "
+			   "libisu to avoid "
+			   "this fatal error should be considered", 
+			   __FILE__, __LINE__);
+		     if (xangle != 0) {
+			cfht_logv(CFHT_MAIN, CFHT_ERROR, "(%s:%d) \"true\" "
+			      "setup requested was from %lf to %lf mrad in x",
+			      __FILE__, __LINE__, last_x_angle, next_x_angle);
+		     }
+		     exit(EXIT_FAILURE);
+		  }
+		  if (isu_job.y_fault) {
+		     cfht_logv(CFHT_MAIN, CFHT_ERROR, "(%s:%d) fatal error on "
+			   "the fast guiding loop: isu y axis is in error.  "
+			   "Relaunch the fast guiding loop. An evolution of "
+			   "libisu to avoid this fatal error should be "
+			   "considered", 
+			   __FILE__, __LINE__);
+		     if (yangle != 0) {
+			cfht_logv(CFHT_MAIN, CFHT_ERROR, "(%s:%d) \"true\" "
+			      "setup requested was from %lf to %lf mrad in y",
+			      __FILE__, __LINE__, last_y_angle, next_y_angle);
+		     }
+		     exit(EXIT_FAILURE);
+		  }
+	       } /* end of isu check */
+	    }
+
+	    /* 
+	     * retreiving current isu position in mrad on the mechanism
+	     * ("true" position)
+	     */
+	    if (isu_job.readback == TRUE) {
+	       if (isu_job.readback_status != PASS) {
+		  cfht_logv(CFHT_MAIN, CFHT_ERROR, "(%s:%d) fatal error on "
+			"the fast guiding loop: failed getting isu angles",
+			__FILE__, __LINE__);
+		  exit(EXIT_FAILURE);
+	       }
+	       last_x_angle = isu_job.x_angle;
+	       last_y_angle = isu_job.y_angle;
+
+	       /* The serv_info structure is updated to fill in the header */
+	       serv_info->isu_mrad_x_status = last_x_angle;
+	       serv_info->isu_mrad_y_status = last_y_angle;
+	    }
+#endif //HAVE_ISU
 #ifdef DEBUG
          /* Take "EnCentroid" time */
          gettimeofday(&t5,&tz);
@@ -4534,6 +10428,29 @@ int main(int argc, char* argv[])
 			__FILE__, __LINE__, __FUNCTION__);
 	       }
 #endif //SLOPES
+#ifndef SIM_STAR
+	       {
+		  struct timeval actuate_tv;
+		  double latency;
+
+		  predictCommit(&serv_info->predict[PREDICT_X], xangle);
+		  predictCommit(&serv_info->predict[PREDICT_Y], yangle);
+
+		  /*
+		   * Measure the latency between the middle of the exposure
+		   * and the middle of the slope sent to the ISU, which lasts
+		   * one frame period
+		   */
+		  gettimeofday(&actuate_tv, NULL);
+		  latency = (actuate_tv.tv_sec - capture_tv.tv_sec) +
+		     (actuate_tv.tv_usec - capture_tv.tv_usec) * 1e-6 +
+		     serv_info->exposure_time / 2e3 +
+		     0.5 / (serv_info->frame_rate != 0 ?
+			    serv_info->frame_rate : DEFAULT_FRAME_RATE);
+		  serv_info->loop_latency += LATENCY_SMOOTHING *
+		     (latency - serv_info->loop_latency);
+	       }
+#endif //SIM_STAR
 #endif  //HAVE_ISU
 	    } /* End of isu correction loop */
 
@@ -4657,13 +10574,74 @@ int main(int argc, char* argv[])
 	    }
 
 	    /*
-	     * Create a FITS image from the pixel data and send it to stdout
+	     * Hand the frame over to the FITS writer, which creates a FITS
+	     * image from the pixel data and sends it to stdout while the next
+	     * frames are acquired and centroided.  Outside of SAVE sequences
+	     * only the frames selected by the video rate are written.  If the
+	     * writer is behind
+	     * and its queue is full, a frame is dropped instead of stalling
+	     * the guide loop.  The header values are taken in any case to
+	     * keep the sequence numbering, and every frame is published in
+	     * the shared memory ring for the local readers and in the
+	     * telemetry stream.  The frames of SAVE sequences also go to the
+	     * recorder when it is enabled.
 	     */
-	    if (writeFITSImage(image_p) != PASS) {
-	       cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-		     "(%s:%d) unable to create FITS file and write it to"
-		     " STDOUT", __FILE__, __LINE__);
+	    save_active = (serv_info->frame_save_count > 0);
+	    fits_job = NULL;
+	    if (videoRateEmit(&video_rate, &capture_tv, save_active) == TRUE) {
+	       fits_job = fitsQueueReserve(&fits_queue, save_active);
+	    }
+	    frame_info = fits_job != NULL ? &fits_job->info : &skipped_info;
+	    frameInfoSnapshot(frame_info, &capture_tv);
+	    shmRingPublish(frame_info, image_p);
+	    recordFrame(&recorder, frame_info, (unsigned short *)image_p);
+#ifdef SIM_STAR
+	    telemetryRecord(&telemetry_rec, frame_info, centroid_status, 0, 0);
+#else
+	    telemetryRecord(&telemetry_rec, frame_info, centroid_status, xc, yc);
+#endif //SIM_STAR
+	    telemetryPublish(&telemetry, &telemetry_rec);
+	    if (fits_job != NULL) {
+	       memcpy(fits_job->pixels, image_p, serv_info->image_width *
+		     serv_info->image_height * sizeof(uint16_t));
+	       fits_job->fwhm_request = fwhm_request;
+	       fwhm_request = FALSE;
+
+	       /*
+		* The co-add is measured each time a quarter of it was
+		* renewed
+		*/
+	       fits_job->coadd_request = FALSE;
+	       if (serv_info->guide_on == TRUE && coadd.count > 0 &&
+		   coadd.added - coadd.measured >=
+		   (coadd.depth / 4 > 0 ? coadd.depth / 4 : 1)) {
+		  coadd.measured = coadd.added;
+		  coaddMean(&coadd, fits_job->coadd_pixels,
+			&fits_job->coadd_shift_x, &fits_job->coadd_shift_y);
+		  serv_info->coadd_count = coadd.count;
+		  fits_job->coadd_request = TRUE;
+	       }
+	       fitsQueueCommit(&fits_queue, fits_job);
+	    }
+
+	    /* The last frame of a SAVE sequence may have been dropped */
+	    if (frame_info->save_last == TRUE ||
+		(last_save == TRUE && frame_info->save == FALSE)) {
+	       fitsQueueCubeEnd(&fits_queue);
 	    }
+	    last_save = frame_info->save;
+
+	    /*
+	     * The loop cannot run faster than the time it spends on a
+	     * frame, a ceiling of the frame rate.  Only the work on the
+	     * frame counts, from its capture to here, not the poll of the
+	     * sockets.
+	     */
+	    gettimeofday(&frame_done_tv, NULL);
+	    frame_busy = camElapsed(&capture_tv, &frame_done_tv);
+	    if (serv_info->proc_time <= 0) serv_info->proc_time = frame_busy;
+	    serv_info->proc_time += LATENCY_SMOOTHING *
+	       (frame_busy - serv_info->proc_time);
 #ifdef DEBUG
          /* Take "End" time */
          gettimeofday(&t8,&tz);
@@ -4679,7 +10657,15 @@ int main(int argc, char* argv[])
 	  */
 	 if (serv_info->video_on == FALSE)
 	 {
-	    if (last_video_on_state == TRUE) { last_video_on_state = FALSE; }
+	    if (last_video_on_state == TRUE) {
+	       last_video_on_state = FALSE;
+	       fitsQueueCubeEnd(&fits_queue);
+	       last_save = FALSE;
+	    }
+
+	    /* The first frame after a restart has no previous frame */
+	    last_capture_tv.tv_sec = 0;
+	    last_capture_tv.tv_usec = 0;
 	 }
 
       } // End of Infinte loop for
@@ -0,0 +1,201 @@
+/* -*- c-file-style: "Ellemtel" -*- */
+/* Copyright (C) 2015   Canada-France-Hawaii Telescope Corp.          */
+/* This program is distributed WITHOUT any warranty, and is under the */
+/* terms of the GNU General Public License, see the file COPYING      */
+/*!**********************************************************************
+ *
+ * DESCRIPTION
+ *
+ *    Layout of the shared memory frame ring published by raptorServ and
+ *    client functions to read it.  Each frame acquired by the server is
+ *    written, with its header values, in the next slot of the ring.  Any
+ *    number of local processes can attach read-only and follow the frames
+ *    without slowing the server down: a reader that is too slow just finds
+ *    that the slot was overwritten and skips to the latest frame.
+ *
+ *    Each slot is protected by a sequence number, odd while the server
+ *    writes the slot and 2 * (frame + 1) once frame is complete.  A reader
+ *    checks the sequence before and after it uses the slot.
+ *
+ *    Typical use:
+ *
+ *       const raptor_shm_t *shm = raptorShmAttach(RAPTOR_SHM_NAME);
+ *       uint64_t frame = raptorShmLatest(shm);
+ *       for (;;) {
+ *          if (raptorShmRead(shm, frame, &meta, pixels, npixels) == 0) {
+ *             ... use meta and pixels ...
+ *             frame++;
+ *          }
+ *          else if (frame < raptorShmLatest(shm)) {
+ *             frame = raptorShmLatest(shm);   overwritten, skip ahead
+ *          }
+ *          else usleep(1000);                 not acquired yet
+ *       }
+ *       raptorShmDetach(shm);
+ *
+ *    Link with -lrt on older C libraries.
+ *
+ *********************************************************************!*/
+#ifndef RAPTOR_SHM_H
+#define RAPTOR_SHM_H
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define RAPTOR_SHM_NAME "/raptorServ"
+#define RAPTOR_SHM_MAGIC 0x52505452     /* "RPTR" */
+#define RAPTOR_SHM_VERSION 1
+#define RAPTOR_SHM_SLOTS 8
+#define RAPTOR_SHM_MAX_PIXELS (640 * 512)
+
+/*
+ * Header values of a frame
+ */
+typedef struct {
+   uint64_t frame;              /* frame number since the server started */
+   int64_t capture_sec;         /* capture time */
+   int64_t capture_usec;
+   int32_t width;
+   int32_t height;
+   int32_t win_x0;              /* window position on the detector */
+   int32_t win_y0;
+   int32_t seqnum;              /* SEQNUM of the FITS header */
+   int32_t guide_on;
+   int32_t isu_on;
+   int32_t save;                /* frame of a SAVE sequence */
+   float exposure_time;         /* ms */
+   float frame_rate;            /* Hz */
+   float guide_xoff;            /* arcsec */
+   float guide_yoff;
+   double isu_mrad_x_delta_setup;
+   double isu_mrad_y_delta_setup;
+   double isu_mrad_x_status;
+   double isu_mrad_y_status;
+} raptor_shm_meta_t;
+
+/*
+ * A slot of the ring.  The pixels are the raw unsigned 16 bits values,
+ * width * height of them, row by row.
+ */
+typedef struct {
+   uint64_t seq;                /* odd while written, 2 * (frame + 1) after */
+   raptor_shm_meta_t meta;
+   uint16_t pixels[RAPTOR_SHM_MAX_PIXELS] __attribute__((aligned(64)));
+} raptor_shm_slot_t;
+
+typedef struct {
+   uint32_t magic;
+   uint32_t version;
+   uint32_t nslots;
+   uint32_t slot_size;
+   uint64_t published;          /* frames published so far */
+   raptor_shm_slot_t slots[RAPTOR_SHM_SLOTS];
+} raptor_shm_t;
+
+/*
+ * Map the ring read-only.  NULL is returned if the server did not create
+ * it or if its layout is not the one of this header.
+ */
+static inline const raptor_shm_t *
+raptorShmAttach(const char *name)
+{
+   const raptor_shm_t *shm;
+   struct stat st;
+   void *p;
+   int fd;
+
+   if ((fd = shm_open(name, O_RDONLY, 0)) < 0) return NULL;
+   if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(raptor_shm_t)) {
+      close(fd);
+      return NULL;
+   }
+   p = mmap(NULL, sizeof(raptor_shm_t), PROT_READ, MAP_SHARED, fd, 0);
+   close(fd);
+   if (p == MAP_FAILED) return NULL;
+
+   shm = (const raptor_shm_t *)p;
+   if (shm->magic != RAPTOR_SHM_MAGIC || shm->version != RAPTOR_SHM_VERSION ||
+       shm->nslots != RAPTOR_SHM_SLOTS ||
+       shm->slot_size != sizeof(raptor_shm_slot_t)) {
+      munmap(p, sizeof(raptor_shm_t));
+      return NULL;
+   }
+   return shm;
+}
+
+/*
+ * Unmap the ring
+ */
+static inline void
+raptorShmDetach(const raptor_shm_t *shm)
+{
+   if (shm != NULL) munmap((void *)shm, sizeof(raptor_shm_t));
+}
+
+/*
+ * Number of the latest complete frame, which is only meaningful once
+ * raptorShmPublished is not 0
+ */
+static inline uint64_t
+raptorShmPublished(const raptor_shm_t *shm)
+{
+   return __atomic_load_n(&shm->published, __ATOMIC_ACQUIRE);
+}
+
+static inline uint64_t
+raptorShmLatest(const raptor_shm_t *shm)
+{
+   uint64_t published = raptorShmPublished(shm);
+
+   return published > 0 ? published - 1 : 0;
+}
+
+/*
+ * Slot of a frame, to use the pixels in place.  raptorShmValid must be
+ * called after using them to know whether the server overwrote the slot
+ * meanwhile.
+ */
+static inline const raptor_shm_slot_t *
+raptorShmSlot(const raptor_shm_t *shm, uint64_t frame)
+{
+   return &shm->slots[frame % RAPTOR_SHM_SLOTS];
+}
+
+static inline int
+raptorShmValid(const raptor_shm_slot_t *slot, uint64_t frame)
+{
+   __atomic_thread_fence(__ATOMIC_ACQUIRE);
+   return __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == 2 * (frame + 1);
+}
+
+/*
+ * Copy a frame out of the ring.  At most max_pixels pixels are copied,
+ * pixels may be NULL to only get the header values.  Returns 0 on success
+ * and -1 if the frame is not in the ring, because it is not acquired yet
+ * or because it was already overwritten.
+ */
+static inline int
+raptorShmRead(const raptor_shm_t *shm, uint64_t frame,
+      raptor_shm_meta_t *meta, uint16_t *pixels, size_t max_pixels)
+{
+   const raptor_shm_slot_t *slot = raptorShmSlot(shm, frame);
+   size_t npixels;
+
+   if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != 2 * (frame + 1)) {
+      return -1;
+   }
+   memcpy(meta, &slot->meta, sizeof(*meta));
+   if (pixels != NULL) {
+      npixels = (size_t)meta->width * meta->height;
+      if (npixels > RAPTOR_SHM_MAX_PIXELS) npixels = RAPTOR_SHM_MAX_PIXELS;
+      if (npixels > max_pixels) npixels = max_pixels;
+      memcpy(pixels, slot->pixels, npixels * sizeof(uint16_t));
+   }
+   return raptorShmValid(slot, frame) ? 0 : -1;
+}
+
+#endif /* RAPTOR_SHM_H */
@@ -0,0 +1,184 @@
+/* -*- c-file-style: "Ellemtel" -*- */
+/* Copyright (C) 2015   Canada-France-Hawaii Telescope Corp.          */
+/* This program is distributed WITHOUT any warranty, and is under the */
+/* terms of the GNU General Public License, see the file COPYING      */
+/*!**********************************************************************
+ *
+ * DESCRIPTION
+ *
+ *    Checks of the typed camera functions of raptorServ.c against the
+ *    emulator of the OWL 640 serial interface.  The server is built with
+ *    SIM_CAMERA and its main renamed, so that the functions run unchanged
+ *    on top of the emulator.  Each check prints PASS or FAIL, and the
+ *    exit status is the number of failed checks.  Run with make simtest.
+ *
+ *********************************************************************!*/
+#define SIM_CAMERA
+#define main raptorServMain
+#include "raptorServ.c"
+#undef main
+
+static int failures = 0;
+
+static void
+check(BOOLEAN ok, const char *what)
+{
+   printf("%s %s\n", ok == TRUE ? "PASS" : "FAIL", what);
+   if (ok == FALSE) failures++;
+}
+
+/*
+ * Value of n registers of the emulator, most significant first
+ */
+static unsigned long
+simRegs(u_char addr, int n)
+{
+   unsigned long value = 0;
+   int i;
+
+   for (i = 0; i < n; i++) value = (value << 8) | owl_sim.regs[addr + i];
+   return value;
+}
+
+/*
+ * A framed command with a wrong checksum is answered with the checksum
+ * error code and the checksum received, and the session resynchronizes
+ */
+static void
+checkChecksumError(void)
+{
+   static const u_char frame[5] = { 0x53, 0xe1, 0x01, OWL_ETX, 0x00 };
+   u_char reply[SERBUFSIZE];
+   long errors = owl_sim.errors;
+   int nreply;
+
+   pthread_mutex_lock(&serial_session.line);
+   pdvSerialWriteRead(&serial_session, frame, sizeof(frame), reply, 2,
+	 &nreply);
+   serial_session.desync = TRUE;
+   pthread_mutex_unlock(&serial_session.line);
+   check(nreply == 2 && reply[0] == OWL_ERR_CHECKSUM && reply[1] == 0x00 &&
+	 owl_sim.errors == errors + 1,
+	 "bad checksum answered with the checksum error code");
+   check(checkCameraStatus() == PASS, "session usable after the error");
+}
+
+/*
+ * Whether the serial statistics have an entry for op on addr
+ */
+static BOOLEAN
+checkSerialStats(serial_op_t op, int addr)
+{
+   int i;
+
+   for (i = 0; i < serial_session.nstats; i++) {
+      if (serial_session.stats[i].op == op &&
+	  serial_session.stats[i].addr == addr) return TRUE;
+   }
+   return FALSE;
+}
+
+int
+main(int argc, char *argv[])
+{
+   unsigned long count;
+   double rate;
+   float temp;
+   int gain;
+   long errors;
+   owl_calib_t calib;
+   u_char mfg[OWL_MFG_SIZE];
+   static const u_char unknown[2] = { 0x53, 0x99 };
+
+   serv_info = (server_info_t *)calloc(1, sizeof(*serv_info));
+   owl_sim.latency = 0.1;
+
+   /*
+    * Status command: checksum and ACK modes
+    */
+   check(checkCameraStatus() == PASS, "status command acknowledged");
+   check((owl_sim.status & (OWL_STATUS_CHECKSUM | OWL_STATUS_ACK)) ==
+	 (OWL_STATUS_CHECKSUM | OWL_STATUS_ACK),
+	 "checksum and ACK modes enabled");
+
+   /*
+    * Register round trips, most significant byte first
+    */
+   check(setGuiderExptime(0x01234567) == PASS &&
+	 getGuiderExptime(&count) == PASS && count == 0x01234567,
+	 "exposure round trip");
+   check(simRegs(OWL_REG_EXPOSURE, 4) == 0x01234567,
+	 "exposure registers most significant first");
+   check(setGuiderExptime(0x01234500) == PASS &&
+	 getGuiderExptime(&count) == PASS && count == 0x01234500,
+	 "exposure changed in its last byte");
+
+   check(setGuiderFrameRate(50) == PASS &&
+	 simRegs(OWL_REG_FRAME_RATE, 4) == 800000,
+	 "frame rate written as a period of 40 MHz counts");
+   check(getGuiderFrameRate(&rate) == PASS && fabs(rate - 50) < 1e-6,
+	 "frame rate round trip");
+   check(setGuiderFrameRate(12.5) == PASS &&
+	 getGuiderFrameRate(&rate) == PASS && fabs(rate - 12.5) < 1e-6,
+	 "lower frame rate round trip");
+
+   check(setDigitalGain(3) == PASS && getDigitalGain(&gain) == PASS &&
+	 gain == 3 && simRegs(OWL_REG_DIGITAL_GAIN, 2) == 0x0300,
+	 "digital gain round trip");
+
+   /*
+    * Calibration decoded from the little endian manufacturing data
+    */
+   memset(&calib, 0, sizeof(calib));
+   check(owlReadCalibration(&calib) == PASS && calib.valid == TRUE &&
+	 calib.adc0 == 1520 && calib.adc40 == 2790 && calib.dac0 == 1000 &&
+	 calib.dac40 == 3000, "calibration decode");
+   memcpy(mfg, owl_sim.mfg, sizeof(mfg));
+   owl_sim.mfg[OWL_MFG_ADC_40C] = owl_sim.mfg[OWL_MFG_ADC_0C];
+   owl_sim.mfg[OWL_MFG_ADC_40C + 1] = owl_sim.mfg[OWL_MFG_ADC_0C + 1];
+   check(owlReadCalibration(&calib) == FAIL && calib.valid == FALSE,
+	 "calibration with equal counts rejected");
+   memcpy(owl_sim.mfg, mfg, sizeof(mfg));
+
+   /*
+    * Sensor temperature, at ambient while the TEC is off
+    */
+   check(checkGuiderTemp(&temp) == PASS && fabs(temp - 20) < 0.1,
+	 "sensor temperature at ambient");
+
+   /*
+    * TEC set point, with its registers in reverse order
+    */
+   check(setGuiderTECPoint(10) == PASS &&
+	 owl_sim.regs[OWL_REG_TEC_SETPOINT_MSB] == 0x05 &&
+	 owl_sim.regs[OWL_REG_TEC_SETPOINT_LSB] == 0xdc,
+	 "TEC set point byte order");
+   check(getGuiderTECPoint(&temp) == PASS && fabs(temp - 10) < 0.1,
+	 "TEC set point round trip");
+   check(enableGuiderTEC() == PASS &&
+	 owl_sim.regs[OWL_REG_FPGA_CTRL] == OWL_FPGA_TEC_ON, "TEC enabled");
+
+   /*
+    * Error codes: an unknown command is not acknowledged, a bad checksum
+    * is reported
+    */
+   errors = serial_session.errors;
+   check(owlCommand(unknown, sizeof(unknown), NULL, 0) == FAIL &&
+	 serial_session.errors == errors + 1,
+	 "unknown command rejected");
+   check(getGuiderExptime(&count) == PASS && count == 0x01234500,
+	 "register read after a rejected command");
+   checkChecksumError();
+
+   /*
+    * Latency statistics kept per operation and register
+    */
+   check(checkSerialStats(SERIAL_OP_READ, OWL_REG_EXPOSURE) &&
+	 checkSerialStats(SERIAL_OP_WRITE, OWL_REG_EXPOSURE + 3) &&
+	 checkSerialStats(SERIAL_OP_STATUS, -1) &&
+	 !checkSerialStats(SERIAL_OP_READ, -1),
+	 "serial statistics per operation and register");
+
+   printf("%d failed\n", failures);
+   return failures;
+}
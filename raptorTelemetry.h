@@ -0,0 +1,110 @@
+/* -*- c-file-style: "Ellemtel" -*- */
+/* Copyright (C) 2015   Canada-France-Hawaii Telescope Corp.          */
+/* This program is distributed WITHOUT any warranty, and is under the */
+/* terms of the GNU General Public License, see the file COPYING      */
+/*!**********************************************************************
+ *
+ * DESCRIPTION
+ *
+ *    Binary telemetry stream of raptorServ: one fixed size record per
+ *    acquired frame with the guide results, published on a TCP port and
+ *    optionally on a Unix socket.  Both are off unless configured, and the
+ *    port is on the loopback interface unless telemetryHost is set.
+ *    RAPTOR_TELEMETRY_PORT is the port usually configured.  A subscriber
+ *    just connects and reads records.  It can send "DECIMATE <n>\n" at any
+ *    time to only receive the frames whose number is a multiple of n.
+ *
+ *    The records are in the byte order of the server host (little endian
+ *    on the guider PC).  Values that are not available are NaN.  The
+ *    server never waits for a subscriber: records are skipped for a
+ *    subscriber that does not read fast enough, which shows as a gap in
+ *    the frame numbers.
+ *
+ *********************************************************************!*/
+#ifndef RAPTOR_TELEMETRY_H
+#define RAPTOR_TELEMETRY_H
+
+#include <stdint.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define RAPTOR_TELEMETRY_PORT "916"
+#define RAPTOR_TELEMETRY_MAGIC 0x54545052   /* "RPTT" */
+#define RAPTOR_TELEMETRY_VERSION 1
+
+/* Fit status when the centroid was not computed on the frame */
+#define RAPTOR_TELEMETRY_NOT_GUIDING (-2)
+/* Fit status when the centroid fit failed */
+#define RAPTOR_TELEMETRY_FIT_FAILED (-1)
+
+typedef struct {
+   uint32_t magic;
+   uint16_t version;
+   uint16_t size;               /* bytes of the record */
+   uint64_t frame;              /* frame number since the server started */
+   int32_t seqnum;              /* SEQNUM of the FITS header */
+   int32_t status;              /* iterations of the centroid fit, < 0 */
+                                /* when not computed */
+   double timestamp;            /* capture time (UNIX, s) */
+   float xc;                    /* star on the detector (pixels) */
+   float yc;
+   float xerr;                  /* 1 sigma errors of the centroid */
+   float yerr;
+   float flux;                  /* integrated flux of the fitted PSF (ADU) */
+   float fwhm_x;                /* last measured FWHM (pixels) */
+   float fwhm_y;
+   float background;            /* ADU */
+   float chi2;                  /* reduced chi2 of the centroid fit */
+   float guide_xoff;            /* offset from the null position (arcsec) */
+   float guide_yoff;
+   float reserved;
+   double isu_cmd_x;            /* correction sent to the ISU (mrad) */
+   double isu_cmd_y;
+   double isu_meas_x;           /* position read from the ISU (mrad) */
+   double isu_meas_y;
+} raptor_telemetry_t;
+
+typedef char raptor_telemetry_size_check
+   [sizeof(raptor_telemetry_t) == 112 ? 1 : -1];
+
+/*
+ * Ask the server for one frame out of n on a connected socket
+ */
+static inline int
+raptorTelemetryDecimate(int fd, int n)
+{
+   char line[32];
+   int len = snprintf(line, sizeof(line), "DECIMATE %d\n", n);
+
+   return write(fd, line, len) == len ? 0 : -1;
+}
+
+/*
+ * Read the next record from a connected socket.  Returns 0 on success and
+ * -1 on error, end of stream or unknown record format.
+ */
+static inline int
+raptorTelemetryRead(int fd, raptor_telemetry_t *rec)
+{
+   char *p = (char *)rec;
+   size_t left = sizeof(*rec);
+   ssize_t n;
+
+   while (left > 0) {
+      n = read(fd, p, left);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) return -1;
+      p += n;
+      left -= n;
+   }
+   if (rec->magic != RAPTOR_TELEMETRY_MAGIC ||
+       rec->version != RAPTOR_TELEMETRY_VERSION ||
+       rec->size != sizeof(*rec)) {
+      return -1;
+   }
+   return 0;
+}
+
+#endif /* RAPTOR_TELEMETRY_H */